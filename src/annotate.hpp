@@ -0,0 +1,521 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./generation.hpp"
+
+/**
+ * Per-instruction costs of one microarchitecture: latency and reciprocal
+ * throughput in cycles for the register form, plus the latency a memory
+ * source operand adds. Figures are rounded from published measurements and
+ * only meant to show where the cycles go, not to predict them exactly.
+ */
+struct CostModel {
+    struct Cost {
+        double latency;
+        double throughput;   // cycles per instruction when independent ones queue up
+        double load;         // part of the latency spent loading a memory operand
+    };
+
+    std::string name;
+    size_t column;           // index into k_costs
+    double load_latency;
+
+    static std::optional<CostModel> from_name(const std::string& name) {
+        if (name == "skylake") return CostModel {.name = "Skylake", .column = 0, .load_latency = 5};
+        if (name == "zen3") return CostModel {.name = "Zen 3", .column = 1, .load_latency = 4};
+        return {};
+    }
+
+    /**
+     * Cost of an instruction, or nothing if the table does not know it.
+     * `operands` are the instruction's operands as written.
+     */
+    std::optional<Cost> cost(const std::string& mnemonic, const std::vector<std::string>& operands) const {
+        std::string key = mnemonic;
+        if (key.starts_with("j") && key != "jmp") key = "jcc";
+        else if (key.starts_with("set")) key = "setcc";
+        else if (key.starts_with("cmov")) key = "cmovcc";
+        else if (key == "div" || key == "idiv") key += is_32bit(operands) ? "32" : "64";
+        else if ((key == "shl" || key == "shr" || key == "sar") && operands.size() == 2 && operands[1] == "cl") key += "_cl";
+        auto it = k_costs.find(key);
+        if (it == k_costs.end() && key.starts_with("v")) {
+            // VEX forms of SSE instructions cost the same
+            it = k_costs.find(key.substr(1));
+        }
+        if (it == k_costs.end()) {
+            return {};
+        }
+        Cost cost = it->second[column];
+        if (loads(mnemonic, operands)) {
+            // A plain load costs just the load
+            cost.latency = mnemonic.starts_with("mov") ? load_latency : cost.latency + load_latency;
+            cost.load = load_latency;
+            cost.throughput = std::max(cost.throughput, 0.5);
+        }
+        return cost;
+    }
+
+private:
+    // True if the instruction reads memory: a memory source operand, or a
+    // memory destination that is also read (add [m], r; cmp [m], r). lea
+    // only computes the address.
+    static bool loads(const std::string& mnemonic, const std::vector<std::string>& operands) {
+        for (size_t i = 0; i < operands.size(); i++) {
+            if (operands[i].find('[') == std::string::npos || mnemonic == "lea") {
+                continue;
+            }
+            const bool store_only = i == 0 && operands.size() > 1 && (mnemonic.starts_with("mov") || mnemonic.starts_with("vmov"));
+            if (!store_only) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool is_32bit(const std::vector<std::string>& operands) {
+        if (operands.empty()) return false;
+        const std::string& operand = operands.back();
+        return operand.starts_with("DWORD") || operand.starts_with("e") || operand.ends_with("d");
+    }
+
+    // {Skylake, Zen 3}
+    static inline const std::unordered_map<std::string, std::array<Cost, 2>> k_costs {
+        {"mov", {{{1, 0.25}, {1, 0.25}}}},
+        {"movzx", {{{1, 0.25}, {1, 0.25}}}},
+        {"movsx", {{{1, 0.25}, {1, 0.25}}}},
+        {"movsxd", {{{1, 0.25}, {1, 0.25}}}},
+        {"lea", {{{1, 0.5}, {1, 0.25}}}},
+        {"add", {{{1, 0.25}, {1, 0.25}}}},
+        {"sub", {{{1, 0.25}, {1, 0.25}}}},
+        {"and", {{{1, 0.25}, {1, 0.25}}}},
+        {"or", {{{1, 0.25}, {1, 0.25}}}},
+        {"xor", {{{1, 0.25}, {1, 0.25}}}},
+        {"cmp", {{{1, 0.25}, {1, 0.25}}}},
+        {"test", {{{1, 0.25}, {1, 0.25}}}},
+        {"inc", {{{1, 0.25}, {1, 0.25}}}},
+        {"dec", {{{1, 0.25}, {1, 0.25}}}},
+        {"neg", {{{1, 0.25}, {1, 0.25}}}},
+        {"not", {{{1, 0.25}, {1, 0.25}}}},
+        {"imul", {{{3, 1}, {3, 1}}}},
+        {"mul", {{{3, 1}, {3, 1}}}},
+        {"div32", {{{26, 6}, {10, 6}}}},
+        {"div64", {{{42, 24}, {14, 7}}}},
+        {"idiv32", {{{26, 6}, {10, 6}}}},
+        {"idiv64", {{{42, 24}, {14, 7}}}},
+        {"cqo", {{{1, 0.5}, {1, 0.25}}}},
+        {"shl", {{{1, 0.5}, {1, 0.5}}}},
+        {"shr", {{{1, 0.5}, {1, 0.5}}}},
+        {"sar", {{{1, 0.5}, {1, 0.5}}}},
+        {"shl_cl", {{{2, 1}, {1, 0.5}}}},
+        {"shr_cl", {{{2, 1}, {1, 0.5}}}},
+        {"sar_cl", {{{2, 1}, {1, 0.5}}}},
+        {"shlx", {{{1, 0.5}, {1, 0.5}}}},
+        {"shrx", {{{1, 0.5}, {1, 0.5}}}},
+        {"sarx", {{{1, 0.5}, {1, 0.5}}}},
+        {"bts", {{{1, 0.5}, {1, 0.5}}}},
+        {"btr", {{{1, 0.5}, {1, 0.5}}}},
+        {"setcc", {{{1, 0.5}, {1, 0.5}}}},
+        {"cmovcc", {{{1, 0.5}, {1, 0.5}}}},
+        {"jcc", {{{0, 0.5}, {0, 0.5}}}},
+        {"jmp", {{{0, 1}, {0, 0.5}}}},
+        {"call", {{{0, 1}, {0, 1}}}},
+        {"ret", {{{0, 1}, {0, 1}}}},
+        {"push", {{{1, 1}, {1, 0.5}}}},
+        {"pop", {{{5, 0.5}, {4, 0.5}}}},
+        {"popcnt", {{{3, 1}, {1, 0.25}}}},
+        {"lzcnt", {{{3, 1}, {1, 0.25}}}},
+        {"tzcnt", {{{3, 1}, {2, 0.5}}}},
+        {"bsr", {{{3, 1}, {4, 3}}}},
+        {"bsf", {{{3, 1}, {3, 3}}}},
+        {"bswap", {{{2, 0.5}, {1, 0.25}}}},
+        {"movbe", {{{1, 0.5}, {1, 0.5}}}},
+        {"syscall", {{{100, 100}, {100, 100}}}},
+        {"rdtsc", {{{25, 25}, {40, 36}}}},
+        {"rdtscp", {{{32, 32}, {44, 44}}}},
+        {"lfence", {{{4, 4}, {1, 1}}}},
+        {"lock", {{{18, 18}, {8, 8}}}},
+        {"movq", {{{2, 1}, {3, 1}}}},
+        {"movsd", {{{1, 0.33}, {1, 0.25}}}},
+        {"movapd", {{{1, 0.33}, {1, 0.25}}}},
+        {"xorpd", {{{1, 0.33}, {1, 0.25}}}},
+        {"addsd", {{{4, 0.5}, {3, 0.5}}}},
+        {"subsd", {{{4, 0.5}, {3, 0.5}}}},
+        {"mulsd", {{{4, 0.5}, {3, 0.5}}}},
+        {"divsd", {{{14, 4}, {13, 4.5}}}},
+        {"sqrtsd", {{{18, 6}, {20, 9}}}},
+        {"ucomisd", {{{3, 1}, {3, 1}}}},
+        {"cvtsi2sd", {{{4, 1}, {4, 1}}}},
+        {"cvttsd2si", {{{6, 1}, {6, 1}}}},
+        {"vmovdqa", {{{1, 0.33}, {1, 0.25}}}},
+        {"vpaddq", {{{1, 0.33}, {1, 0.25}}}},
+        {"vpsubq", {{{1, 0.33}, {1, 0.25}}}},
+        {"vpand", {{{1, 0.33}, {1, 0.25}}}},
+        {"vpor", {{{1, 0.33}, {1, 0.25}}}},
+        {"vpxor", {{{1, 0.33}, {1, 0.25}}}},
+        {"vpmuludq", {{{5, 0.5}, {3, 0.5}}}},
+        {"vpcmpeqq", {{{1, 0.5}, {1, 0.25}}}},
+        {"vpcmpgtq", {{{3, 1}, {1, 0.5}}}},
+        {"vpsllq", {{{1, 0.5}, {1, 0.5}}}},
+        {"vpsrlq", {{{1, 0.5}, {1, 0.5}}}},
+        {"vpshufd", {{{1, 1}, {1, 0.5}}}},
+        {"vpbroadcastq", {{{3, 1}, {1, 0.5}}}},
+        {"vextracti128", {{{3, 1}, {3, 1}}}},
+    };
+};
+
+/**
+ * Turns the Generator's assembly, produced with GenOptions::line_markers,
+ * into a listing that interleaves the source lines with the instructions
+ * generated for them. Every instruction gets its latency and reciprocal
+ * throughput from a CostModel, and every run of code belonging to one line
+ * and every basic block gets an estimate: the longest chain of register
+ * dependencies through it and the sum of the throughputs, the larger of the
+ * two bounding its cycles. Memory dependencies and port conflicts are
+ * ignored. The listing is still valid NASM input.
+ */
+class AsmAnnotator {
+public:
+    AsmAnnotator(CostModel model, const std::string& source)
+        : m_model(std::move(model))
+    {
+        std::istringstream stream(source);
+        for (std::string line; std::getline(stream, line);) {
+            m_source.push_back(line.substr(std::min(line.size(), line.find_first_not_of(" \t"))));
+        }
+    }
+
+    /**
+     * Annotates `assembly`. With `keep_markers` the line marker labels stay
+     * in, for --size-report.
+     */
+    std::string annotate(const std::string& assembly, bool keep_markers) {
+        // Split into runs of code for one source line
+        std::vector<Run> runs;
+        std::istringstream stream(assembly);
+        for (std::string text; std::getline(stream, text);) {
+            if (const std::optional<int> line = marker_line(text)) {
+                if (runs.empty() || runs.back().line != line.value()) {
+                    runs.push_back({.line = line.value()});
+                }
+                if (keep_markers) {
+                    runs.back().lines.push_back({.text = text});
+                }
+                continue;
+            }
+            if (runs.empty()) {
+                runs.push_back({.line = -1});
+            }
+            runs.back().lines.push_back(parse(text));
+        }
+
+        std::stringstream out;
+        out << "; Annotated by hauss. Costs for " << m_model.name << ": latency and reciprocal throughput in\n";
+        out << "; cycles per instruction; estimates are the longest register dependency chain and\n";
+        out << "; the summed throughputs, whichever is larger bounding the cycles.\n";
+        std::map<int, Estimate> totals;
+        Block block;
+        for (const Run& run : runs) {
+            const Estimate estimate = estimate_of(run.lines);
+            if (run.line >= 0 && estimate.instructions != 0) {
+                Estimate& total = totals[run.line];
+                total.instructions += estimate.instructions;
+                total.latency += estimate.latency;
+                total.throughput += estimate.throughput;
+                out << "\n    ;; " << describe(run.line) << "  [" << format(estimate) << "]\n";
+            }
+            for (const Line& line : run.lines) {
+                if (line.label && !block.lines.empty()) {
+                    end_block(out, block);
+                }
+                out << line.text;
+                if (line.cost.has_value()) {
+                    out << std::string(std::max<size_t>(line.text.size() + 1, 44) - line.text.size(), ' ') << "; "
+                        << number(line.cost->latency) << "  " << number(line.cost->throughput);
+                } else if (line.instruction) {
+                    out << std::string(std::max<size_t>(line.text.size() + 1, 44) - line.text.size(), ' ') << "; ?";
+                }
+                out << "\n";
+                if (line.instruction) {
+                    block.lines.push_back(line);
+                    if (line.ends_block) {
+                        end_block(out, block);
+                    }
+                }
+            }
+        }
+
+        // The lines costing the most, with the code of all their runs summed
+        std::vector<std::pair<int, Estimate>> ranked(totals.begin(), totals.end());
+        std::stable_sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.second.cycles() > b.second.cycles(); });
+        out << "\n; Per source line, most expensive first:\n";
+        for (const auto& [line, estimate] : ranked) {
+            out << ";   " << describe(line) << "  [" << format(estimate) << "]\n";
+        }
+        return out.str();
+    }
+
+private:
+    struct Line {
+        std::string text;
+        bool label = false;
+        bool instruction = false;
+        bool ends_block = false;
+        std::optional<CostModel::Cost> cost;
+        std::vector<std::string> reads;    // registers, plus "flags"
+        std::vector<std::string> address_reads;   // registers in memory operands
+        std::vector<std::string> writes;
+    };
+
+    struct Run {
+        int line;                          // source line; 0 for the entry, exit and runtime code
+        std::vector<Line> lines;
+    };
+
+    struct Block {
+        std::vector<Line> lines;
+    };
+
+    struct Estimate {
+        size_t instructions = 0;
+        double latency = 0;
+        double throughput = 0;
+        double cycles() const { return std::max(latency, throughput); }
+    };
+
+    static std::optional<int> marker_line(const std::string& text) {
+        const std::string prefix = Generator::k_line_marker;
+        if (!text.starts_with(prefix) || !text.ends_with(":") || text == std::string(Generator::k_line_marker_end) + ":") {
+            return {};
+        }
+        const size_t separator = text.find('_', prefix.size());
+        if (separator == std::string::npos) {
+            return {};
+        }
+        return std::stoi(text.substr(prefix.size(), separator - prefix.size()));
+    }
+
+    // 64-bit name of a general purpose register, "v<n>" for xmm<n>/ymm<n>,
+    // or nothing for other operands. rsp is left out: it only changes by
+    // constants and would chain every push to the next.
+    static std::optional<std::string> register_of(const std::string& operand) {
+        static const std::unordered_map<std::string, std::string> k_legacy {
+            {"rax", "rax"}, {"eax", "rax"}, {"ax", "rax"}, {"al", "rax"}, {"ah", "rax"},
+            {"rbx", "rbx"}, {"ebx", "rbx"}, {"bx", "rbx"}, {"bl", "rbx"}, {"bh", "rbx"},
+            {"rcx", "rcx"}, {"ecx", "rcx"}, {"cx", "rcx"}, {"cl", "rcx"}, {"ch", "rcx"},
+            {"rdx", "rdx"}, {"edx", "rdx"}, {"dx", "rdx"}, {"dl", "rdx"}, {"dh", "rdx"},
+            {"rsi", "rsi"}, {"esi", "rsi"}, {"si", "rsi"}, {"sil", "rsi"},
+            {"rdi", "rdi"}, {"edi", "rdi"}, {"di", "rdi"}, {"dil", "rdi"},
+            {"rbp", "rbp"}, {"ebp", "rbp"}, {"bp", "rbp"}, {"bpl", "rbp"},
+        };
+        if (auto it = k_legacy.find(operand); it != k_legacy.end()) {
+            return it->second;
+        }
+        if (operand.size() >= 2 && operand[0] == 'r' && std::isdigit(static_cast<unsigned char>(operand[1]))) {
+            return operand.substr(0, operand.find_first_not_of("r0123456789"));
+        }
+        if (operand.starts_with("xmm") || operand.starts_with("ymm")) {
+            return "v" + operand.substr(3);
+        }
+        return {};
+    }
+
+    // Registers an operand reads when it addresses memory
+    static std::vector<std::string> address_registers(const std::string& operand) {
+        std::vector<std::string> registers;
+        const size_t open = operand.find('[');
+        if (open == std::string::npos) {
+            return registers;
+        }
+        std::string word;
+        for (size_t i = open + 1; i <= operand.size(); i++) {
+            if (i < operand.size() && std::isalnum(static_cast<unsigned char>(operand[i]))) {
+                word += operand[i];
+                continue;
+            }
+            if (const std::optional<std::string> reg = register_of(word)) {
+                registers.push_back(reg.value());
+            }
+            word.clear();
+        }
+        return registers;
+    }
+
+    Line parse(const std::string& text) const {
+        Line line {.text = text};
+        const size_t start = text.find_first_not_of(" \t");
+        if (start == std::string::npos || text[start] == ';') {
+            return line;
+        }
+        if (start == 0) {
+            // Labels, and directives such as section and global
+            line.label = text.ends_with(":");
+            return line;
+        }
+        std::istringstream words(text.substr(start, text.find(';', start) - start));
+        std::string mnemonic;
+        words >> mnemonic;
+        if (mnemonic == "align" || mnemonic == "dq" || mnemonic == "dd" || mnemonic == "dw" || mnemonic == "db"
+            || mnemonic == "resq" || mnemonic == "resb" || mnemonic == "times") {
+            return line;
+        }
+        if (mnemonic == "rep" || mnemonic == "lock") {
+            std::string instruction;
+            words >> instruction;
+        }
+        std::string rest;
+        std::getline(words, rest);
+        std::vector<std::string> operands;
+        int depth = 0;
+        std::string operand;
+        for (const char c : rest + ",") {
+            if (c == ',' && depth == 0) {
+                const size_t first = operand.find_first_not_of(' ');
+                if (first != std::string::npos) {
+                    operands.push_back(operand.substr(first, operand.find_last_not_of(' ') - first + 1));
+                }
+                operand.clear();
+                continue;
+            }
+            depth += c == '[' ? 1 : c == ']' ? -1 : 0;
+            operand += c;
+        }
+
+        line.instruction = true;
+        line.cost = m_model.cost(mnemonic, operands);
+        line.ends_block = mnemonic.starts_with("j") || mnemonic == "ret" || mnemonic == "syscall";
+        dependencies(mnemonic, operands, line);
+        return line;
+    }
+
+    // Registers the instruction reads and writes, for the dependency chains
+    static void dependencies(const std::string& mnemonic, const std::vector<std::string>& operands, Line& line) {
+        for (const std::string& operand : operands) {
+            for (const std::string& reg : address_registers(operand)) {
+                line.address_reads.push_back(reg);
+            }
+        }
+        const std::optional<std::string> dst = operands.empty() ? std::nullopt : register_of(operands[0]);
+        const bool flags_only = mnemonic == "cmp" || mnemonic == "test" || mnemonic == "ucomisd" || mnemonic == "vucomisd";
+        const bool write_only = mnemonic.starts_with("mov") || mnemonic.starts_with("vmov") || mnemonic == "lea"
+            || mnemonic.starts_with("set") || mnemonic == "pop" || mnemonic.starts_with("cvt") || mnemonic.starts_with("vcvt")
+            || mnemonic == "popcnt" || mnemonic == "lzcnt" || mnemonic == "tzcnt" || mnemonic == "vpbroadcastq"
+            || (mnemonic.starts_with("v") && operands.size() >= 3);
+        const bool zero_idiom = operands.size() == 2 && operands[0] == operands[1]
+            && (mnemonic == "xor" || mnemonic == "sub" || mnemonic == "xorpd" || mnemonic == "vxorpd" || mnemonic == "vpxor");
+
+        if (mnemonic.starts_with("j") || mnemonic.starts_with("set") || mnemonic.starts_with("cmov")) {
+            line.reads.push_back("flags");
+        }
+        if (mnemonic == "mul" || mnemonic == "div" || mnemonic == "idiv" || (mnemonic == "imul" && operands.size() == 1)) {
+            line.reads.push_back("rax");
+            if (mnemonic != "mul" && mnemonic != "imul") line.reads.push_back("rdx");
+            line.writes.insert(line.writes.end(), {"rax", "rdx"});
+        } else if (mnemonic == "cqo") {
+            line.reads.push_back("rax");
+            line.writes.push_back("rdx");
+        } else if (mnemonic == "rdtsc" || mnemonic == "rdtscp") {
+            line.writes.insert(line.writes.end(), {"rax", "rdx"});
+        } else if (mnemonic == "syscall" || mnemonic == "call") {
+            line.reads.insert(line.reads.end(), {"rax", "rdi", "rsi", "rdx"});
+            line.writes.insert(line.writes.end(), {"rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11"});
+        }
+        // Shifts by cl read rcx through their count operand below
+        for (size_t i = 0; i < operands.size(); i++) {
+            const std::optional<std::string> reg = register_of(operands[i]);
+            if (!reg.has_value() || zero_idiom) {
+                continue;
+            }
+            if (i == 0 && operands.size() > 1) {
+                if (!write_only) line.reads.push_back(reg.value());
+                if (!flags_only) line.writes.push_back(reg.value());
+            } else if (i == 0 && (mnemonic == "pop" || mnemonic.starts_with("set"))) {
+                line.writes.push_back(reg.value());
+            } else {
+                line.reads.push_back(reg.value());
+                if (i == 0 && (mnemonic == "neg" || mnemonic == "not" || mnemonic == "inc" || mnemonic == "dec" || mnemonic == "bswap")) {
+                    line.writes.push_back(reg.value());
+                }
+            }
+        }
+        if (zero_idiom && dst.has_value()) {
+            line.writes.push_back(dst.value());
+        }
+        static const std::vector<std::string> k_flag_setters {
+            "add", "sub", "and", "or", "xor", "cmp", "test", "inc", "dec", "neg", "imul", "mul", "div", "idiv", "shl", "shr",
+            "sar", "bts", "btr", "popcnt", "lzcnt", "tzcnt", "bsr", "bsf", "ucomisd", "vucomisd", "lock",
+        };
+        const bool sets_flags = std::find(k_flag_setters.begin(), k_flag_setters.end(), mnemonic) != k_flag_setters.end();
+        if (sets_flags) {
+            line.writes.push_back("flags");
+        }
+    }
+
+    // Longest register dependency chain and summed throughput of the
+    // instructions among `lines`, starting with every register ready. A
+    // memory operand is loaded as soon as its address registers are ready,
+    // in parallel with the other operands.
+    static Estimate estimate_of(const std::vector<Line>& lines) {
+        Estimate estimate;
+        std::unordered_map<std::string, double> ready;
+        for (const Line& line : lines) {
+            if (!line.instruction) {
+                continue;
+            }
+            estimate.instructions++;
+            const CostModel::Cost cost = line.cost.value_or(CostModel::Cost {1, 1});
+            double address = 0;
+            for (const std::string& reg : line.address_reads) {
+                address = std::max(address, ready[reg]);
+            }
+            double start = address + cost.load;
+            for (const std::string& reg : line.reads) {
+                start = std::max(start, ready[reg]);
+            }
+            start -= cost.load;
+            for (const std::string& reg : line.writes) {
+                ready[reg] = start + cost.latency;
+            }
+            estimate.latency = std::max(estimate.latency, start + cost.latency);
+            estimate.throughput += cost.throughput;
+        }
+        return estimate;
+    }
+
+    void end_block(std::stringstream& out, Block& block) const {
+        out << "    ;; block: " << format(estimate_of(block.lines)) << "\n";
+        block.lines.clear();
+    }
+
+    std::string describe(int line) const {
+        if (line == 0) {
+            return "entry, exit and runtime";
+        }
+        return "line " + std::to_string(line) + ": "
+            + (static_cast<size_t>(line) <= m_source.size() ? m_source[line - 1] : std::string());
+    }
+
+    static std::string number(double value) {
+        char buffer[32];
+        snprintf(buffer, sizeof buffer, value == static_cast<int64_t>(value) ? "%.0f" : "%.2f", value);
+        return buffer;
+    }
+
+    static std::string format(const Estimate& estimate) {
+        return std::to_string(estimate.instructions) + (estimate.instructions == 1 ? " instruction" : " instructions") + ", latency " + number(estimate.latency)
+            + ", throughput " + number(estimate.throughput) + ", ~" + number(estimate.cycles()) + " cycles";
+    }
+
+    CostModel m_model;
+    std::vector<std::string> m_source;
+};
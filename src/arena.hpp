@@ -1,32 +1,39 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdlib>
 #include <memory>
 #include <utility>
+#include <vector>
 
+// Hands out memory from blocks of block_num_bytes. When a block is full a new
+// one is chained on, so the size of the program is not limited by the first
+// block; earlier blocks stay put and pointers into them remain valid.
 class ArenaAllocator {
 public:
-    explicit ArenaAllocator(const size_t max_num_bytes)
-        : m_size { max_num_bytes }
-        , m_buffer { new std::byte[max_num_bytes] }
-        , m_offset { m_buffer }
+    explicit ArenaAllocator(const size_t block_num_bytes)
+        : m_block_size { block_num_bytes }
     {
+        add_block(block_num_bytes);
     }
 
     ArenaAllocator(const ArenaAllocator&) = delete;
     ArenaAllocator& operator=(const ArenaAllocator&) = delete;
 
     ArenaAllocator(ArenaAllocator&& other) noexcept
-        : m_size { std::exchange(other.m_size, 0) }
-        , m_buffer { std::exchange(other.m_buffer, nullptr) }
+        : m_block_size { std::exchange(other.m_block_size, 0) }
+        , m_blocks { std::move(other.m_blocks) }
+        , m_size { std::exchange(other.m_size, 0) }
         , m_offset { std::exchange(other.m_offset, nullptr) }
     {
     }
 
     ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
     {
+        std::swap(m_block_size, other.m_block_size);
+        std::swap(m_blocks, other.m_blocks);
         std::swap(m_size, other.m_size);
-        std::swap(m_buffer, other.m_buffer);
         std::swap(m_offset, other.m_offset);
         return *this;
     }
@@ -34,11 +41,10 @@ public:
     template <typename T>
     [[nodiscard]] T* alloc()
     {
-        size_t remaining_num_bytes = m_size - static_cast<size_t>(m_offset - m_buffer);
-        auto pointer = static_cast<void*>(m_offset);
-        const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
+        void* aligned_address = align<T>();
         if (aligned_address == nullptr) {
-            throw std::bad_alloc {};
+            add_block(std::max(m_block_size, sizeof(T) + alignof(T)));
+            aligned_address = align<T>();
         }
         m_offset = static_cast<std::byte*>(aligned_address) + sizeof(T);
         return static_cast<T*>(aligned_address);
@@ -51,13 +57,37 @@ public:
         return new (allocated_memory) T { std::forward<Args>(args)... };
     }
 
-    ~ArenaAllocator()
+private:
+    // Room for a T in the current block, or nullptr if it is full
+    template <typename T>
+    void* align()
     {
-        delete[] m_buffer;
+        size_t remaining_num_bytes = m_size - static_cast<size_t>(m_offset - m_blocks.back().get());
+        auto pointer = static_cast<void*>(m_offset);
+        return std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
     }
 
-private:
-    size_t m_size;
-    std::byte* m_buffer;
-    std::byte* m_offset;
-};
\ No newline at end of file
+    // Blocks are zero-filled: the parser assigns into nodes from alloc()
+    // rather than constructing them, which needs empty strings and optionals
+    // to read as zero. calloc gets fresh pages from the kernel without
+    // touching them, so unused parts of a block take no memory.
+    void add_block(const size_t num_bytes)
+    {
+        auto* block = static_cast<std::byte*>(std::calloc(num_bytes, 1));
+        if (block == nullptr) {
+            throw std::bad_alloc {};
+        }
+        m_blocks.emplace_back(block);
+        m_size = num_bytes;
+        m_offset = m_blocks.back().get();
+    }
+
+    struct FreeBlock {
+        void operator()(std::byte* block) const { std::free(block); }
+    };
+
+    size_t m_block_size;
+    std::vector<std::unique_ptr<std::byte, FreeBlock>> m_blocks;
+    size_t m_size = 0;         // of the current block
+    std::byte* m_offset = nullptr;
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * `hauss bench`: runs the freshly linked ./out many times and reports the
+ * distribution of its wall time instead of a single noisy measurement. Every
+ * run is pinned to one CPU, or to all the CPUs we may use for programs whose
+ * parallel fors size their thread pool from the affinity mask. The first runs
+ * only warm up caches and the page cache and are discarded, and the peak
+ * resident set of each run is read from wait4's rusage. The program's output
+ * is discarded.
+ */
+class Bench {
+public:
+    struct Options {
+        int runs = 30;
+        int warmup = 3;
+        std::optional<int> cpu;                  // default: the last CPU we may run on, or all of them when threaded
+        bool threaded = false;                   // ./out starts a thread pool, set by the caller
+        std::optional<std::string> stdin_path;   // default: /dev/null
+        std::vector<std::string> args;           // for arg(i), given after `--`
+    };
+
+    // Parses one of the bench flags into `options`; false if `arg` is not one
+    static bool parse_flag(const std::string& arg, Options& options) {
+        if (arg.rfind("--runs=", 0) == 0) {
+            options.runs = parse_int(arg, 7);
+        } else if (arg.rfind("--warmup=", 0) == 0) {
+            options.warmup = parse_int(arg, 9);
+        } else if (arg.rfind("--cpu=", 0) == 0) {
+            options.cpu = parse_int(arg, 6);
+        } else if (arg.rfind("--stdin=", 0) == 0) {
+            options.stdin_path = arg.substr(8);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    explicit Bench(Options options)
+        : m_options(std::move(options))
+    {
+        if (m_options.runs < 1 || m_options.warmup < 0) {
+            std::cerr << "bench needs --runs of at least 1 and a --warmup that is not negative" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (m_options.cpu.has_value() && (m_options.cpu.value() < 0 || m_options.cpu.value() >= CPU_SETSIZE)) {
+            std::cerr << "bench needs a --cpu from 0 to " << CPU_SETSIZE - 1 << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /**
+     * Runs ./out and prints the report, after the compile and the assemble
+     * and link times measured by the caller.
+     */
+    void run(std::ostream& out, double compile_seconds, double link_seconds) const {
+        // nullopt runs on every CPU in our affinity mask
+        std::optional<int> cpu = m_options.cpu;
+        if (!cpu.has_value() && !m_options.threaded) {
+            cpu = default_cpu();
+        }
+        const long inherited_rss_kb = inherited_rss();
+        for (int i = 0; i < m_options.warmup; i++) {
+            run_once(cpu);
+        }
+        std::vector<Sample> samples;
+        for (int i = 0; i < m_options.runs; i++) {
+            samples.push_back(run_once(cpu));
+        }
+
+        std::vector<double> times;
+        long max_rss_kb = 0;
+        for (const Sample& sample : samples) {
+            times.push_back(sample.seconds);
+            max_rss_kb = std::max(max_rss_kb, sample.max_rss_kb);
+        }
+        std::sort(times.begin(), times.end());
+        const size_t n = times.size();
+        const double median = n % 2 == 1 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+        // Nearest rank: the smallest time at least 99% of the runs do not exceed
+        const double p99 = times[static_cast<size_t>(std::ceil(0.99 * static_cast<double>(n))) - 1];
+        double mean = 0;
+        for (const double time : times) {
+            mean += time / static_cast<double>(n);
+        }
+        double variance = 0;
+        for (const double time : times) {
+            variance += (time - mean) * (time - mean) / static_cast<double>(std::max<size_t>(n - 1, 1));
+        }
+        const double stddev = std::sqrt(variance);
+
+        const auto ms = [&](const std::string& label, double seconds) {
+            out << "  " << std::left << std::setw(15) << label << std::right << std::setw(10) << std::fixed
+                << std::setprecision(3) << seconds * 1000 << " ms";
+        };
+        ms("compile", compile_seconds);
+        out << "\n";
+        ms("assemble+link", link_seconds);
+        out << "\n";
+        if (cpu.has_value()) {
+            out << "  " << n << " runs on cpu " << cpu.value();
+        } else {
+            out << "  " << n << " runs on all allowed cpus (" << allowed_cpus() << ")";
+        }
+        out << " after " << m_options.warmup << " warmup runs\n";
+        if (cpu.has_value() && m_options.threaded) {
+            out << "  warning: parallel fors run on a single thread when pinned to one cpu\n";
+        }
+        ms("median", median);
+        out << "\n";
+        ms("p99", p99);
+        out << "\n";
+        ms("stddev", stddev);
+        out << "  (" << std::setprecision(1) << 100 * stddev / std::max(mean, 1e-12) << "% of mean)\n";
+        ms("min", times.front());
+        out << "\n";
+        out << "  " << std::left << std::setw(15) << "max RSS" << std::right << std::setw(10) << max_rss_kb << " KB";
+        if (max_rss_kb <= inherited_rss_kb) {
+            out << "  (at most: a forked child starts with " << inherited_rss_kb << " KB)";
+        }
+        out << "\n";
+        out << "  " << std::left << std::setw(15) << "exit code" << std::right << std::setw(10) << samples.front().exit_code << "\n";
+        if (std::any_of(samples.begin(), samples.end(), [&](const Sample& s) { return s.exit_code != samples.front().exit_code; })) {
+            out << "  warning: the exit code differs between runs\n";
+        }
+    }
+
+private:
+    struct Sample {
+        double seconds;
+        long max_rss_kb;
+        int exit_code;
+    };
+
+    // The integer after the `--flag=` prefix of `arg`
+    static int parse_int(const std::string& arg, const size_t prefix) {
+        const char* first = arg.data() + prefix;
+        const char* last = arg.data() + arg.size();
+        int value = 0;
+        const auto [end, error] = std::from_chars(first, last, value);
+        if (first == last || error != std::errc {} || end != last) {
+            std::cerr << "Incorrect usage: " << arg.substr(0, prefix - 1) << " needs an integer, got '" << arg.substr(prefix) << "'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return value;
+    }
+
+    // One run of ./out, timed from fork to reaping it
+    Sample run_once(const std::optional<int> cpu) const {
+        std::vector<std::string> args = {"./out"};
+        args.insert(args.end(), m_options.args.begin(), m_options.args.end());
+        std::vector<char*> argv;
+        for (std::string& arg : args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+        const std::string stdin_path = m_options.stdin_path.value_or("/dev/null");
+
+        // The child reports a failed setup through a pipe that a successful
+        // exec closes, so every exit code of the program stays its own
+        int setup[2];
+        if (pipe2(setup, O_CLOEXEC) != 0) {
+            std::cerr << "bench: pipe failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "bench: fork failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (cpu.has_value()) {
+                CPU_SET(cpu.value(), &set);
+            }
+            const int in = open(stdin_path.c_str(), O_RDONLY);
+            const int null = open("/dev/null", O_WRONLY);
+            if ((cpu.has_value() && sched_setaffinity(0, sizeof set, &set) != 0) || in < 0 || null < 0
+                || dup2(in, STDIN_FILENO) < 0 || dup2(null, STDOUT_FILENO) < 0) {
+                setup_failed(setup[1]);
+            }
+            execv(argv[0], argv.data());
+            setup_failed(setup[1]);
+        }
+        close(setup[1]);
+        char failed;
+        const bool started = read(setup[0], &failed, 1) == 0;
+        close(setup[0]);
+        int status;
+        rusage usage {};
+        if (wait4(pid, &status, 0, &usage) != pid) {
+            std::cerr << "bench: wait4 failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (WIFSIGNALED(status)) {
+            std::cerr << "bench: ./out was killed by signal " << WTERMSIG(status) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!started) {
+            std::cerr << "bench: cannot run ./out" << (cpu.has_value() ? " on cpu " + std::to_string(cpu.value()) : "")
+                      << " with stdin " << stdin_path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return {.seconds = elapsed.count(), .max_rss_kb = usage.ru_maxrss, .exit_code = WEXITSTATUS(status)};
+    }
+
+    // Linux counts the pages a child shares with us between fork and exec in
+    // its max RSS, so a run that stays below this reports this instead
+    static long inherited_rss() {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            _exit(EXIT_SUCCESS);
+        }
+        int status;
+        rusage usage {};
+        if (pid < 0 || wait4(pid, &status, 0, &usage) != pid) {
+            return 0;
+        }
+        return usage.ru_maxrss;
+    }
+
+    // The last CPU in our affinity mask: CPU 0 usually takes most interrupts
+    static int default_cpu() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof set, &set) == 0) {
+            for (int cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--) {
+                if (CPU_ISSET(cpu, &set)) {
+                    return cpu;
+                }
+            }
+        }
+        return 0;
+    }
+
+    // The number of CPUs in our affinity mask
+    static int allowed_cpus() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        return sched_getaffinity(0, sizeof set, &set) == 0 ? CPU_COUNT(&set) : 1;
+    }
+
+    [[noreturn]] static void setup_failed(const int pipe) {
+        const char failed = 1;
+        (void)!write(pipe, &failed, 1);
+        _exit(EXIT_FAILURE);
+    }
+
+    const Options m_options;
+};
@@ -1,418 +1,3874 @@
 #pragma once
 
+#include <array>
+#include <bit>
+#include <cstdlib>
 #include <sstream>
 #include <unordered_map>   
 #include <cassert>
 #include <map>
 #include <algorithm>
+#include <type_traits>
 
+#include "./interpreter.hpp"
 #include "./parser.hpp"
+#include "./range.hpp"
+#include "./runtime.hpp"
+#include "./superopt.hpp"
+#include "./target.hpp"
+#include "./var_stack.hpp"
 
 // The Generator class is responsible for generating x86-64 assembly code
 // from the AST (Abstract Syntax Tree) nodes produced by the parser.
+
+// Code generation choices beyond the target CPU
+struct GenOptions {
+    bool optimize_size = false;   // -Os: shorter encodings and sequences over speed
+    bool line_markers = false;    // label the code of every statement with its source line
+};
+
 class Generator {
 public:
-    // Constructor: stores the root program node
-    inline Generator(NodeProg prog)
+    // Ranges of live variables by position in m_vars. Snapshots only hold the
+    // variables changed since the innermost range frame was opened.
+    using RangeEnv = std::unordered_map<size_t, Range>;
+
+    // Instruction selection tiles. Every expression node is covered by the
+    // cheapest tile matching at it; each tile leaves the value in a register.
+    enum class Tile {
+        constant,   // mov dst, imm
+        load,       // mov dst, [var]
+        term,       // unary terms: -x, read(), arg(i), alloc(n), a[i], popcount(x), ...
+        superopt,   // sequence found by the superoptimizer
+        op,         // op dst, reg/imm/[var] (add, sub, imul, div, and, shl, ...)
+        div_const,  // x / c or x % c: shift, mask or multiply-high by a reciprocal
+        imul_imm,   // imul dst, [var], imm
+        lea,        // lea dst, [base + index*scale + disp]
+        compare,    // cmp/test (ucomisd for f64) followed by setcc, or a conditional jump
+    };
+
+    // How the second operand of a tile is supplied
+    enum class Operand { reg, imm, mem, zero };
+
+    struct Label {
+        Tile tile;
+        size_t cost;                      // estimated cycles, from the tile cost table
+        size_t need;                      // registers needed without spilling (Sethi-Ullman number)
+        const NodeExpr* lhs = nullptr;    // operand computed into dst (lea: base)
+        const NodeExpr* rhs = nullptr;    // second operand (lea: index)
+        Operand rhs_kind = Operand::reg;
+        const NodeBinExpr* bin = nullptr; // operation of an op tile
+        int64_t imm = 0;                  // constant (bit pattern for f64), immediate, lea displacement or divisor
+        int64_t scale = 1;                // lea index scale
+        std::string cc;                   // condition code of a compare tile
+    };
+
+    // Line markers are labels k_line_marker<line>_<n>. The code from one
+    // marker up to the next one belongs to that source line; line 0 is the
+    // program's entry and exit and the runtime. k_line_marker_end ends .text.
+    static constexpr const char* k_line_marker = "hauss_line";
+    static constexpr const char* k_line_marker_end = "hauss_line_end";
+
+    // Constructor: stores the root program node, the CPU to generate code for,
+    // the optional superoptimizer consulted for small arithmetic trees and
+    // the code generation options
+    inline Generator(NodeProg prog, Target target = {}, Superoptimizer* superopt = nullptr, GenOptions options = {})
         : m_prog(std::move(prog))
+        , m_target(std::move(target))
+        , m_superopt(superopt)
+        , m_options(options)
     {
     }
 
-    // Generate assembly for a terminal expression
-    void gen_term(const NodeTerm* term){
+    // Generate assembly for a terminal expression into k_expr_regs[reg]
+    void gen_term(const NodeTerm* term, size_t reg){
         struct TermVisitor {
             Generator& gen;
+            size_t reg;
+            const std::string dst;
+
+            // Integer literal (e.g. 42)
+            void operator()(const NodeTermIntLit* term_int_lit) const {
+                gen.gen_mov_imm(dst, std::stoll(term_int_lit->int_lit.value.value()));
+            }
+
+            // Identifier (e.g. variable x)
+            void operator()(const NodeTermIdent* term_ident) const {
+                gen.m_output << "    mov " << dst << ", " << gen.var_slot(term_ident->ident.value.value()) << "\n";
+            }
+
+            // Unary negation (e.g. -x)
+            void operator()(const NodeTermNeg* term_neg) const {
+                gen.gen_term(term_neg->term, reg);
+                gen.m_output << "    neg " << dst << "\n";
+            }
+
+            // Bitwise complement (e.g. ~x)
+            void operator()(const NodeTermBitNot* term_bit_not) const {
+                gen.gen_term(term_bit_not->term, reg);
+                gen.m_output << "    not " << dst << "\n";
+            }
+
+            // Parenthesized expression (e.g. (x + 1))
+            void operator()(const NodeTermParen* term_paren) const {
+                gen.gen_expr_to(term_paren->expr, reg);
+            }
+
+            // Next integer from stdin
+            void operator()(const NodeTermRead*) const {
+                gen.check_not_parallel("read()");
+                gen.require(rt_read_int);
+                gen.m_output << "    call read_int\n";
+                gen.m_output << "    mov " << dst << ", rax\n";
+            }
+
+            // Fresh array from the runtime bump allocator
+            void operator()(const NodeTermAlloc* term_alloc) const {
+                gen.check_not_parallel("alloc()");
+                gen.require(rt_alloc);
+                gen.gen_expr_to(term_alloc->count, reg);
+                gen.m_output << "    mov rdi, " << dst << "\n";
+                gen.m_output << "    call alloc\n";
+                gen.m_output << "    mov " << dst << ", rax\n";
+            }
+
+            // Array element (e.g. a[i])
+            void operator()(const NodeTermIndex* term_index) const {
+                gen.gen_expr_to(term_index->index, reg);
+                gen.m_output << "    mov rax, " << gen.var_slot(term_index->ident.value.value()) << "\n";
+                gen.m_output << "    mov " << dst << ", [rax + " << dst << "*8]\n";
+            }
+
+            // Struct field (e.g. a[i].x), sign-extended from its width
+            void operator()(const NodeTermField* term_field) const {
+                gen.gen_expr_to(term_field->index, reg);
+                const std::string address = gen.field_address(term_field, dst);
+                switch (field_of(term_field).size) {
+                case 8: gen.m_output << "    mov " << dst << ", QWORD " << address << "\n"; break;
+                case 4: gen.m_output << "    movsxd " << dst << ", DWORD " << address << "\n"; break;
+                case 2: gen.m_output << "    movsx " << dst << ", WORD " << address << "\n"; break;
+                default: gen.m_output << "    movsx " << dst << ", BYTE " << address << "\n"; break;
+                }
+            }
+
+            // Command line argument parsed as an integer
+            void operator()(const NodeTermArg* term_arg) const {
+                gen.require(rt_arg_int);
+                gen.gen_expr_to(term_arg->index, reg);
+                gen.m_output << "    mov rdi, " << dst << "\n";
+                gen.m_output << "    call arg_int\n";
+                gen.m_output << "    mov " << dst << ", rax\n";
+            }
+
+            // popcount(x), clz(x), ctz(x), bswap(x) and the clocks
+            void operator()(const NodeTermIntrinsic* term_intrinsic) const {
+                gen.gen_intrinsic(term_intrinsic, reg);
+            }
+
+            // sum(range(a, b) |> ...) and count(...), fused into one loop
+            void operator()(const NodeTermPipeline* pipeline) const {
+                gen.gen_pipeline(pipeline, reg);
+            }
+
+            // Call of an extern fn returning i64
+            void operator()(const NodeTermCall* term_call) const {
+                gen.gen_call(term_call, reg);
+            }
+
+            // i64(x): f64 values are truncated toward zero
+            void operator()(const NodeTermConvert* term_convert) const {
+                gen.gen_expr_to(term_convert->expr, reg);
+                if (term_convert->expr->type == Type::f64) {
+                    gen.gen_sse("cvttsd2si", dst, k_float_regs[reg]);
+                }
+            }
+
+            // f64 terms are generated by gen_float_term
+            void operator()(const NodeTermFloatLit*) const { assert(false); }
+        };
+
+        TermVisitor visitor({.gen = *this, .reg = reg, .dst = k_expr_regs[reg]});
+        std::visit(visitor, term->var);
+    }
+
+    // Evaluate two operands into registers, one of them k_expr_regs[reg] (or
+    // k_float_regs[reg] for f64 operands), and return the registers holding
+    // them. The operand needing more registers is evaluated first so the other
+    // one fits in the registers left over; only when both need all of them is
+    // the first result spilled to the stack. Operands that both have side
+    // effects, or a call and an array or field read, keep the source order
+    // given by `a_first` (left to right): the call may store to the memory
+    // being read.
+    std::pair<std::string, std::string> gen_operands(const NodeExpr* a, const NodeExpr* b, size_t reg, bool a_first){
+        const size_t a_need = label(a).need;
+        const size_t b_need = label(b).need;
+        const bool ordered = (has_side_effects(a) && has_side_effects(b))
+            || (has_call(a) && reads_memory(b)) || (has_call(b) && reads_memory(a));
+        if (!ordered) {
+            a_first = a_need >= b_need;
+        }
+        const bool is_float = a->type == Type::f64;
+        const std::string dst = is_float ? k_float_regs[reg] : k_expr_regs[reg];
+        std::string first_reg = dst;
+        std::string second_reg;
+        gen_expr_to(a_first ? a : b, reg);
+        if (std::min(a_need, b_need) >= k_expr_regs.size() - reg) {
+            if (is_float) {
+                gen_sse("movq", "rax", dst);
+                push("rax");
+            } else {
+                push(dst);
+            }
+            gen_expr_to(a_first ? b : a, reg);
+            if (is_float) {
+                pop("rax");
+                gen_sse("movq", k_float_scratch, "rax");
+                first_reg = k_float_scratch;
+            } else {
+                pop("rcx");
+                first_reg = "rcx";
+            }
+            second_reg = dst;
+        } else {
+            gen_expr_to(a_first ? b : a, reg + 1);
+            second_reg = is_float ? k_float_regs[reg + 1] : k_expr_regs[reg + 1];
+        }
+        if (a_first) {
+            return {first_reg, second_reg};
+        }
+        return {second_reg, first_reg};
+    }
+
+    // Emit dst = lhs op rhs, where dst is one of the operands and the other
+    // one is a register, an immediate or a memory operand
+    void gen_bin_op(const NodeBinExpr* bin_expr, const std::string& lhs, const std::string& rhs, const std::string& dst){
+        struct BinOpVisitor {
+            Generator& gen;
+            const std::string& lhs;
+            const std::string& rhs;
+            const std::string& dst;
+
+            // The operand that is not dst
+            const std::string& src() const {
+                return dst == lhs ? rhs : lhs;
+            }
+
+            void operator()(const NodeBinExprSub*) const {
+                if (dst == lhs) {
+                    gen.m_output << "    sub " << lhs << ", " << rhs << "\n";
+                } else {
+                    gen.m_output << "    neg " << rhs << "\n";
+                    gen.m_output << "    add " << rhs << ", " << lhs << "\n";
+                }
+            }
+
+            void operator()(const NodeBinExprAdd*) const {
+                gen.m_output << "    add " << dst << ", " << src() << "\n";
+            }
+
+            void operator()(const NodeBinExprMulti*) const {
+                gen.m_output << "    imul " << dst << ", " << src() << "\n";
+            }
+
+            void operator()(const NodeBinExprDiv* div) const {
+                gen.gen_div(div->lhs, div->rhs, lhs, rhs);
+                gen.m_output << "    mov " << dst << ", rax\n";
+            }
+
+            void operator()(const NodeBinExprMod* mod) const {
+                gen.gen_div(mod->lhs, mod->rhs, lhs, rhs);
+                gen.m_output << "    mov " << dst << ", rdx\n";
+            }
+
+            void operator()(const NodeBinExprBitAnd*) const {
+                gen.m_output << "    and " << dst << ", " << src() << "\n";
+            }
+
+            void operator()(const NodeBinExprBitOr*) const {
+                gen.m_output << "    or " << dst << ", " << src() << "\n";
+            }
+
+            void operator()(const NodeBinExprBitXor*) const {
+                gen.m_output << "    xor " << dst << ", " << src() << "\n";
+            }
+
+            void operator()(const NodeBinExprShl* shl) const { shift("shl", "shlx", shl->rhs); }
+            void operator()(const NodeBinExprShr* shr) const { shift("sar", "sarx", shr->rhs); }
+
+            // Immediate counts are reduced mod 64 like the hardware does with
+            // register counts. BMI2 shifts take the count from any register and
+            // write a separate destination; the legacy forms need it in cl.
+            void shift(const char* op, const char* bmi2_op, const NodeExpr* count_expr) const {
+                const std::optional<int64_t> count = gen.constant_of(count_expr);
+                if (count.has_value() && rhs == std::to_string(count.value())) {
+                    gen.m_output << "    " << op << " " << dst << ", " << (count.value() & 63) << "\n";
+                } else if (gen.m_target.features.bmi2) {
+                    gen.m_output << "    " << bmi2_op << " " << dst << ", " << lhs << ", " << rhs << "\n";
+                } else if (dst == lhs && lhs != "rcx") {
+                    if (rhs != "rcx") {
+                        gen.m_output << "    mov rcx, " << rhs << "\n";
+                    }
+                    gen.m_output << "    " << op << " " << dst << ", cl\n";
+                } else {
+                    gen.m_output << "    mov rax, " << lhs << "\n";
+                    if (rhs != "rcx") {
+                        gen.m_output << "    mov rcx, " << rhs << "\n";
+                    }
+                    gen.m_output << "    " << op << " rax, cl\n";
+                    gen.m_output << "    mov " << dst << ", rax\n";
+                }
+            }
+
+            // Comparisons are covered by compare tiles
+            void operator()(const NodeBinExprGt*) const { assert(false); }
+            void operator()(const NodeBinExprGe*) const { assert(false); }
+            void operator()(const NodeBinExprLt*) const { assert(false); }
+            void operator()(const NodeBinExprLe*) const { assert(false); }
+            void operator()(const NodeBinExprEqEq*) const { assert(false); }
+        };
+
+        BinOpVisitor visitor {.gen = *this, .lhs = lhs, .rhs = rhs, .dst = dst};
+        std::visit(visitor, bin_expr->var);
+    }
+
+    // Emit rax = lhs / rhs and rdx = lhs % rhs (unsigned), where rhs is a
+    // register or memory operand
+    void gen_div(const NodeExpr* lhs_expr, const NodeExpr* rhs_expr, const std::string& lhs, const std::string& rhs){
+        if (range_of(lhs_expr).fits_u32() && range_of(rhs_expr).fits_u32()) {
+            // 32-bit div is much cheaper and zero-extends into rax and rdx
+            m_output << "    mov eax, " << operand32(lhs) << "\n";
+            m_output << "    xor edx, edx\n";
+            m_output << "    div " << operand32(rhs) << "\n";
+        } else {
+            m_output << "    mov rax, " << lhs << "\n";
+            m_output << "    xor edx, edx\n";
+            m_output << "    div " << rhs << "\n";
+        }
+    }
+
+    // Emit quot = x / d and rem = x % d (unsigned) for a divisor accepted by
+    // is_fast_divisor. Either output may be empty, and one of them may be x
+    // itself. Powers of two become a shift and a mask; other divisors multiply
+    // by a fixed-point reciprocal and keep the high half, and the remainder is
+    // recovered as x - q * d.
+    void gen_div_const(const std::string& x, int64_t d, const std::string& quot, const std::string& rem){
+        if (std::has_single_bit(static_cast<uint64_t>(d))) {
+            const auto gen_quot = [&]() {
+                if (quot.empty()) {
+                    return;
+                }
+                if (quot != x) {
+                    m_output << "    mov " << quot << ", " << x << "\n";
+                }
+                if (d != 1) {
+                    m_output << "    shr " << quot << ", " << std::countr_zero(static_cast<uint64_t>(d)) << "\n";
+                }
+            };
+            if (quot != x) {
+                gen_quot();
+            }
+            if (!rem.empty()) {
+                if (rem != x) {
+                    m_output << "    mov " << rem << ", " << x << "\n";
+                }
+                if (fits_imm32(d - 1)) {
+                    m_output << "    and " << rem << ", " << d - 1 << "\n";
+                } else {
+                    m_output << "    mov rax, " << d - 1 << "\n";
+                    m_output << "    and " << rem << ", rax\n";
+                }
+            }
+            if (quot == x) {
+                gen_quot();
+            }
+            return;
+        }
+        const Magic magic = unsigned_magic(d);
+        m_output << "    mov rax, " << static_cast<int64_t>(magic.multiplier) << "\n";
+        m_output << "    mul " << x << "\n";
+        std::string q = "rdx";
+        if (magic.add) {
+            // q = (((x - hi) >> 1) + hi) >> shift, without overflowing 64 bits
+            m_output << "    mov rax, " << x << "\n";
+            m_output << "    sub rax, rdx\n";
+            m_output << "    shr rax, 1\n";
+            m_output << "    add rax, rdx\n";
+            q = "rax";
+        }
+        if (magic.shift != 0) {
+            m_output << "    shr " << q << ", " << magic.shift << "\n";
+        }
+        if (!rem.empty()) {
+            if (fits_imm32(d)) {
+                m_output << "    imul rcx, " << q << ", " << d << "\n";
+            } else {
+                m_output << "    mov rcx, " << d << "\n";
+                m_output << "    imul rcx, " << q << "\n";
+            }
+            if (rem != x) {
+                m_output << "    mov " << rem << ", " << x << "\n";
+            }
+            m_output << "    sub " << rem << ", rcx\n";
+        }
+        if (!quot.empty()) {
+            m_output << "    mov " << quot << ", " << q << "\n";
+        }
+    }
+
+    // Emit a builtin into k_expr_regs[reg]. The bit counts use popcnt, lzcnt
+    // and tzcnt when the target has them. Otherwise clz and ctz use bsr/bsf,
+    // whose result is undefined for 0, so a cmov supplies the 64 for 0, and
+    // popcount adds up bits in parallel within the register (SWAR).
+    void gen_intrinsic(const NodeTermIntrinsic* term_intrinsic, size_t reg){
+        const std::string dst = k_expr_regs[reg];
+        const TargetFeatures& features = m_target.features;
+        if (term_intrinsic->op == Intrinsic::clock_ns) {
+            require(rt_clock_ns);
+            m_output << "    call clock_ns\n";
+            m_output << "    mov " << dst << ", rax\n";
+            return;
+        }
+        if (!intrinsic_takes_arg(term_intrinsic->op)) {
+            if (term_intrinsic->op == Intrinsic::rdtsc) {
+                m_output << "    rdtsc\n";
+            } else if (features.rdtscp) {
+                // rdtscp waits for the code before it; the lfence holds back the code after it
+                m_output << "    rdtscp\n";
+                m_output << "    lfence\n";
+            } else {
+                m_output << "    lfence\n";
+                m_output << "    rdtsc\n";
+                m_output << "    lfence\n";
+            }
+            m_output << "    shl rdx, 32\n";
+            m_output << "    or rax, rdx\n";
+            m_output << "    mov " << dst << ", rax\n";
+            return;
+        }
+        // movbe swaps the bytes while loading
+        const NodeExpr* arg = strip_parens(term_intrinsic->arg);
+        const auto* term = std::get_if<NodeTerm*>(&arg->var);
+        const auto* ident = term != nullptr ? std::get_if<NodeTermIdent*>(&(*term)->var) : nullptr;
+        if (term_intrinsic->op == Intrinsic::bswap && features.movbe && ident != nullptr) {
+            m_output << "    movbe " << dst << ", " << var_slot((*ident)->ident.value.value()) << "\n";
+            return;
+        }
+
+        gen_expr_to(arg, reg);
+        switch (term_intrinsic->op) {
+        case Intrinsic::popcount:
+            if (features.popcnt) {
+                m_output << "    popcnt " << dst << ", " << dst << "\n";
+                break;
+            }
+            // Bit pairs, then nibbles, then bytes; the multiply sums the
+            // bytes into the top one
+            m_output << "    mov rax, " << dst << "\n";
+            m_output << "    shr rax, 1\n";
+            m_output << "    mov rcx, 0x5555555555555555\n";
+            m_output << "    and rax, rcx\n";
+            m_output << "    sub " << dst << ", rax\n";
+            m_output << "    mov rcx, 0x3333333333333333\n";
+            m_output << "    mov rax, " << dst << "\n";
+            m_output << "    shr " << dst << ", 2\n";
+            m_output << "    and rax, rcx\n";
+            m_output << "    and " << dst << ", rcx\n";
+            m_output << "    add " << dst << ", rax\n";
+            m_output << "    mov rax, " << dst << "\n";
+            m_output << "    shr rax, 4\n";
+            m_output << "    add " << dst << ", rax\n";
+            m_output << "    mov rcx, 0x0f0f0f0f0f0f0f0f\n";
+            m_output << "    and " << dst << ", rcx\n";
+            m_output << "    mov rcx, 0x0101010101010101\n";
+            m_output << "    imul " << dst << ", rcx\n";
+            m_output << "    shr " << dst << ", 56\n";
+            break;
+        case Intrinsic::clz:
+            if (features.lzcnt) {
+                m_output << "    lzcnt " << dst << ", " << dst << "\n";
+                break;
+            }
+            // 63 - index of the highest set bit, or 127 ^ 63 = 64 for 0
+            m_output << "    bsr " << dst << ", " << dst << "\n";
+            m_output << "    mov ecx, 127\n";
+            m_output << "    cmovz " << dst << ", rcx\n";
+            m_output << "    xor " << dst << ", 63\n";
+            break;
+        case Intrinsic::ctz:
+            if (features.bmi1) {
+                m_output << "    tzcnt " << dst << ", " << dst << "\n";
+                break;
+            }
+            m_output << "    bsf " << dst << ", " << dst << "\n";
+            m_output << "    mov ecx, 64\n";
+            m_output << "    cmovz " << dst << ", rcx\n";
+            break;
+        case Intrinsic::bswap:
+            m_output << "    bswap " << dst << "\n";
+            break;
+        case Intrinsic::rdtsc:
+        case Intrinsic::clock_ns:
+        case Intrinsic::cycles:
+            break;
+        }
+    }
+
+    // Call an extern fn with the System V calling convention, leaving the
+    // result in k_expr_regs[reg] or k_float_regs[reg]. The arguments are
+    // evaluated left to right onto the stack, then popped into rdi, rsi, rdx,
+    // rcx, r8, r9 and xmm0-xmm7. Registers below `reg` may hold operands of
+    // the enclosing expression; k_expr_regs are callee-saved, but
+    // k_float_regs are not, so those are spilled around the call.
+    void gen_call(const NodeTermCall* call, size_t reg){
+        static constexpr std::array<const char*, 6> k_int_args {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+        if (call->fn != nullptr) {
+            gen_fn_call(call, reg);
+            return;
+        }
+        // Pool threads are cloned without a TLS area of their own, so C code
+        // that touches errno, stdio or malloc state would share the main
+        // thread's
+        check_not_parallel("extern fn " + call->ident.value.value());
+        const NodeStmtExtern* callee = m_externs.at(call->ident.value.value());
+        for (size_t i = 0; i < reg; i++) {
+            gen_sse("movq", "rax", k_float_regs[i]);
+            push("rax");
+        }
+        for (const NodeExpr* arg : call->args) {
+            gen_expr(arg, reg);
+        }
+        std::vector<std::string> arg_regs;
+        size_t float_args = 0;
+        for (const Type type : callee->params) {
+            arg_regs.push_back(type == Type::f64 ? "xmm" + std::to_string(float_args++) : k_int_args[arg_regs.size() - float_args]);
+        }
+        for (size_t i = arg_regs.size(); i-- > 0;) {
+            if (callee->params[i] == Type::f64) {
+                pop("rax");
+                gen_sse("movq", arg_regs[i], "rax");
+            } else {
+                pop(arg_regs[i]);
+            }
+        }
+        const bool pad = !stack_aligned();
+        if (pad) {
+            m_output << "    sub rsp, 8\n";
+        }
+        // Variadic functions such as printf take the number of vector
+        // registers used in al
+        m_output << "    mov eax, " << float_args << "\n";
+        m_output << "    call " << call->ident.value.value() << "\n";
+        if (pad) {
+            m_output << "    add rsp, 8\n";
+        }
+        if (callee->ret == Type::f64) {
+            if (reg != 0) {
+                gen_sse("movapd", k_float_regs[reg], "xmm0");
+            }
+        } else {
+            m_output << "    mov " << k_expr_regs[reg] << ", rax\n";
+        }
+        for (size_t i = reg; i-- > 0;) {
+            pop("rax");
+            gen_sse("movq", k_float_regs[i], "rax");
+        }
+    }
+
+    // Call of an fn. The registers below `reg` hold live values and the fn
+    // may use all of them, so they are saved around the call, the SSE ones
+    // only if the fn evaluates f64 values. A call of a @memo fn may instead
+    // read a table computed at compile time (try_gen_memo_table).
+    void gen_fn_call(const NodeTermCall* call, size_t reg){
+        const NodeStmtFn* fn = call->fn;
+        const std::string& name = fn->ident.value.value();
+        if (fn->memo) {
+            if (try_gen_memo_table(call, reg)) {
+                return;
+            }
+            check_not_parallel("@memo fn " + name);
+        }
+        for (size_t i = 0; i < reg; i++) {
+            push(k_expr_regs[i]);
+            if (fn->clobbers_xmm) {
+                gen_sse("movq", "rax", k_float_regs[i]);
+                push("rax");
+            }
+        }
+        for (const NodeExpr* arg : call->args) {
+            gen_expr(arg, reg);
+        }
+        m_output << "    call fn_" << name << "\n";
+        if (!call->args.empty()) {
+            m_output << "    add rsp, " << call->args.size() * 8 << "\n";
+            m_stack_size -= call->args.size();
+        }
+        if (fn->ret == Type::f64) {
+            gen_sse("movq", k_float_regs[reg], "rax");
+        } else {
+            m_output << "    mov " << k_expr_regs[reg] << ", rax\n";
+        }
+        for (size_t i = reg; i-- > 0;) {
+            if (fn->clobbers_xmm) {
+                pop("rax");
+                gen_sse("movq", k_float_regs[i], "rax");
+            }
+            pop(k_expr_regs[i]);
+        }
+    }
+
+    // A call of a @memo fn whose arguments have known ranges spanning at
+    // most k_memo_table_max_entries combinations becomes a load from a table
+    // of every result, evaluated at compile time by the Interpreter and
+    // indexed row-major by the arguments' offsets from their lower bounds.
+    // Calls with the same fn and ranges share the table. Arguments with a
+    // single possible value add nothing to the index and are not evaluated,
+    // so a call whose arguments all have one becomes the result itself.
+    bool try_gen_memo_table(const NodeTermCall* call, size_t reg){
+        const NodeStmtFn* fn = call->fn;
+        if (fn->ret != Type::i64) {
+            return false;
+        }
+        std::vector<std::pair<int64_t, int64_t>> bounds;
+        std::vector<uint64_t> sizes;
+        uint64_t count = 1;
+        for (const NodeExpr* arg : call->args) {
+            const Range range = range_of(arg);
+            // Full ranges wrap the size around to 0
+            const uint64_t size = static_cast<uint64_t>(range.hi) - static_cast<uint64_t>(range.lo) + 1;
+            if (arg->type != Type::i64 || range.lo > range.hi || size == 0 || size > k_memo_table_max_entries / count) {
+                return false;
+            }
+            bounds.emplace_back(range.lo, range.hi);
+            sizes.push_back(size);
+            count *= size;
+        }
+        auto it = m_memo_tables.find({fn, bounds});
+        if (it == m_memo_tables.end()) {
+            if (!m_memo_interpreter.has_value()) {
+                m_memo_interpreter.emplace(m_prog, k_memo_table_steps);
+            }
+            std::vector<int64_t> values;
+            std::vector<int64_t> args(bounds.size());
+            for (uint64_t index = 0; index < count && values.size() == index; index++) {
+                uint64_t rest = index;
+                for (size_t i = bounds.size(); i-- > 0;) {
+                    args[i] = static_cast<int64_t>(static_cast<uint64_t>(bounds[i].first) + rest % sizes[i]);
+                    rest /= sizes[i];
+                }
+                if (const std::optional<int64_t> value = m_memo_interpreter->call(fn, args)) {
+                    values.push_back(value.value());
+                }
+            }
+            // No values remember that the fn could not be evaluated
+            if (values.size() != count) {
+                values.clear();
+            }
+            it = m_memo_tables.emplace(std::make_pair(fn, bounds), MemoTable {.values = std::move(values)}).first;
+        }
+        MemoTable& table = it->second;
+        if (table.values.empty()) {
+            return false;
+        }
+        std::vector<size_t> indexed;
+        for (size_t i = 0; i < call->args.size(); i++) {
+            if (sizes[i] != 1 || !is_speculatable(call->args[i])) {
+                indexed.push_back(i);
+            }
+        }
+        const std::string dst = k_expr_regs[reg];
+        if (indexed.empty()) {
+            m_output << "    ;; " << fn->ident.value.value() << "() precomputed\n";
+            m_output << "    mov " << dst << ", " << table.values[0] << "\n";
+            return true;
+        }
+        if (table.label.empty()) {
+            table.label = "memo_table" + std::to_string(m_memo_table_count++);
+            m_rodata << "    align 8\n";
+            m_rodata << table.label << ":\n";
+            for (size_t i = 0; i < table.values.size(); i += 8) {
+                m_rodata << "    dq ";
+                for (size_t j = i; j < std::min(table.values.size(), i + 8); j++) {
+                    m_rodata << (j > i ? ", " : "") << table.values[j];
+                }
+                m_rodata << "\n";
+            }
+        }
+
+        const auto sub_lower_bound = [&](int64_t lo) {
+            if (lo == 0) {
+                return;
+            }
+            if (fits_imm32(lo)) {
+                m_output << "    sub " << dst << ", " << lo << "\n";
+            } else {
+                m_output << "    mov rax, " << lo << "\n";
+                m_output << "    sub " << dst << ", rax\n";
+            }
+        };
+        m_output << "    ;; " << fn->ident.value.value() << "() from a precomputed table\n";
+        gen_expr_to(call->args[indexed[0]], reg);
+        sub_lower_bound(bounds[indexed[0]].first);
+        for (size_t k = 1; k < indexed.size(); k++) {
+            const size_t i = indexed[k];
+            push(dst);
+            gen_expr_to(call->args[i], reg);
+            sub_lower_bound(bounds[i].first);
+            pop("rax");
+            if (sizes[i] != 1) {
+                m_output << "    imul rax, rax, " << sizes[i] << "\n";
+            }
+            m_output << "    add " << dst << ", rax\n";
+        }
+        m_output << "    mov " << dst << ", QWORD [" << table.label << " + " << dst << "*8]\n";
+        return true;
+    }
+
+    // Generate an fn into m_functions as fn_<name>. Its frame starts with
+    // the arguments the caller pushed, in order, then the return address
+    // and, for @memo fns, the address of the table entry the result goes
+    // to. No register is live on entry, and the result is returned in rax
+    // (its bits, for f64).
+    void gen_fn(const NodeStmtFn* fn){
+        std::stringstream body;
+        std::swap(body, m_output);
+        VarStack<Var> outer_vars;
+        std::swap(outer_vars, m_vars);
+        std::vector<size_t> outer_scopes;
+        std::swap(outer_scopes, m_scopes);
+        const size_t outer_stack_size = m_stack_size;
+        const std::optional<size_t> outer_par_base = m_par_base;
+        m_par_base.reset();
+        m_range_cache.clear();
+        m_label_cache.clear();
+
+        m_stack_size = 0;
+        for (size_t i = 0; i < fn->params.size(); i++) {
+            m_vars.push_back({.name = fn->params[i].value.value(), .stack_loc = m_stack_size++, .type = fn->param_types[i]});
+        }
+        m_stack_size++;   // the return address
+        m_fn_return_label = create_label();
+        m_output << "\nfn_" << fn->ident.value.value() << ":\n";
+        mark_line();
+        if (fn->memo) {
+            gen_memo_lookup(fn);
+        }
+        m_fn_frame = m_stack_size;
+        gen_scope(fn->scope);
+        // Falling off the end returns 0
+        m_output << "    xor eax, eax\n";
+        m_output << m_fn_return_label << ":\n";
+        if (fn->memo) {
+            gen_memo_store(fn);
+        }
+        m_output << "    ret\n";
+
+        m_stack_size = outer_stack_size;
+        m_par_base = outer_par_base;
+        std::swap(outer_scopes, m_scopes);
+        std::swap(outer_vars, m_vars);
+        m_range_cache.clear();
+        m_label_cache.clear();
+        std::swap(body, m_output);
+        m_functions << body.str();
+    }
+
+    // return expr: the value goes to rax, the locals are dropped and the fn's
+    // exit path runs
+    void gen_return(const NodeStmtReturn* stmt_return){
+        gen_expr_to(stmt_return->expr, 0);
+        if (stmt_return->expr->type == Type::f64) {
+            gen_sse("movq", "rax", k_float_regs[0]);
+        } else {
+            m_output << "    mov rax, " << k_expr_regs[0] << "\n";
+        }
+        if (m_stack_size > m_fn_frame) {
+            m_output << "    add rsp, " << (m_stack_size - m_fn_frame) * 8 << "\n";
+        }
+        m_output << "    jmp " << m_fn_return_label << "\n";
+    }
+
+    // Look the arguments of a @memo fn up in its .bss table on entry.
+    // Entries are [used, arguments..., result], found by Fibonacci hashing
+    // of the arguments and linear probing. A hit returns the stored result;
+    // otherwise the first free entry, or the last one probed when
+    // k_memo_probes are taken, is kept on the stack for gen_memo_store.
+    void gen_memo_lookup(const NodeStmtFn* fn){
+        const std::string table = "memo_" + fn->ident.value.value();
+        const size_t param_count = fn->params.size();
+        const uint64_t entries = std::bit_ceil(static_cast<uint64_t>(fn->memo_entries > 0 ? fn->memo_entries : k_memo_default_entries));
+        const size_t entry_size = (param_count + 2) * 8;
+        m_bss << table << " resq " << entries * (param_count + 2) << "\n";
+
+        const std::string probe_label = create_label();
+        const std::string next_label = create_label();
+        const std::string claim_label = create_label();
+        m_output << "    ;; memo lookup\n";
+        m_output << "    mov rcx, 0x9e3779b97f4a7c15\n";
+        m_output << "    xor eax, eax\n";
+        for (const Token& param : fn->params) {
+            m_output << "    xor rax, " << var_slot(param.value.value()) << "\n";
+            m_output << "    imul rax, rcx\n";
+        }
+        if (entries == 1) {
+            m_output << "    xor eax, eax\n";
+        } else {
+            m_output << "    shr rax, " << 64 - std::countr_zero(entries) << "\n";
+        }
+        m_output << "    mov edx, " << k_memo_probes << "\n";
+        m_output << probe_label << ":\n";
+        m_output << "    imul rcx, rax, " << entry_size << "\n";
+        m_output << "    lea rcx, [rcx + " << table << "]\n";
+        m_output << "    cmp QWORD [rcx], 0\n";
+        m_output << "    je " << claim_label << "\n";
+        for (size_t i = 0; i < param_count; i++) {
+            m_output << "    mov rsi, QWORD [rcx + " << (i + 1) * 8 << "]\n";
+            m_output << "    cmp rsi, " << var_slot(fn->params[i].value.value()) << "\n";
+            m_output << "    jne " << next_label << "\n";
+        }
+        m_output << "    mov rax, QWORD [rcx + " << (param_count + 1) * 8 << "]\n";
+        m_output << "    ret\n";
+        m_output << next_label << ":\n";
+        m_output << "    add rax, 1\n";
+        m_output << "    and rax, " << entries - 1 << "\n";
+        m_output << "    sub edx, 1\n";
+        m_output << "    jnz " << probe_label << "\n";
+        m_output << claim_label << ":\n";
+        push("rcx");
+    }
+
+    // Fill the entry gen_memo_lookup claimed with the arguments and the
+    // result in rax, then drop its address
+    void gen_memo_store(const NodeStmtFn* fn){
+        const size_t param_count = fn->params.size();
+        m_output << "    mov rcx, QWORD [rsp]\n";
+        m_output << "    mov QWORD [rcx], 1\n";
+        for (size_t i = 0; i < param_count; i++) {
+            m_output << "    mov rdx, " << var_slot(fn->params[i].value.value()) << "\n";
+            m_output << "    mov QWORD [rcx + " << (i + 1) * 8 << "], rdx\n";
+        }
+        m_output << "    mov QWORD [rcx + " << (param_count + 1) * 8 << "], rax\n";
+        m_output << "    add rsp, 8\n";
+    }
+
+    // Fold a range pipeline in a single loop, so no stage materializes its
+    // values. The position, the end, the running total and the value passed
+    // between the stages live in hidden stack slots, and while a stage body
+    // is generated its parameter names the value slot. On AVX2 targets the
+    // loop is preceded by a vectorized one (gen_pipeline_vector) and only
+    // finishes the last few values.
+    void gen_pipeline(const NodeTermPipeline* pipeline, size_t reg){
+        const std::string dst = k_expr_regs[reg];
+        const std::string loop_label = create_label();
+        const std::string next_label = create_label();
+        const std::string end_label = create_label();
+        const size_t vars_start = m_vars.size();
+        // Named after the loop so that nested pipelines do not collide, and
+        // with a '.' so that they cannot collide with the program's names
+        const std::string position = loop_label + ".i";
+        const std::string end = loop_label + ".end";
+        const std::string total = loop_label + ".total";
+        const std::string value = loop_label + ".value";
+        m_output << "    ;; pipeline\n";
+        m_vars.push_back({.name = position, .stack_loc = m_stack_size});
+        gen_expr(pipeline->begin, reg);
+        m_vars.push_back({.name = end, .stack_loc = m_stack_size});
+        gen_expr(pipeline->end, reg);
+        m_vars.push_back({.name = total, .stack_loc = m_stack_size});
+        push("0");
+        m_vars.push_back({.name = value, .stack_loc = m_stack_size});
+        push("0");
+        const size_t value_loc = m_vars.back().stack_loc;
+        if (m_target.features.avx2 && !m_options.optimize_size) {
+            gen_pipeline_vector(pipeline, position, end, total);
+        }
+
+        m_output << loop_label << ":\n";
+        m_output << "    mov rax, " << var_slot(position) << "\n";
+        m_output << "    cmp rax, " << var_slot(end) << "\n";
+        m_output << "    jge " << end_label << "\n";
+        m_output << "    mov " << var_slot(value) << ", rax\n";
+        bool in_dst = false;   // the value slot is also in dst
+        for (const NodePipeStage& stage : pipeline->stages) {
+            const std::string& param = stage.param.value.value();
+            if (m_vars.contains(param)) {
+                std::cerr << "Identifier already used: " << param << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            m_vars.push_back({.name = param, .stack_loc = value_loc});
+            if (stage.filter) {
+                gen_jump_if_false(stage.body, next_label, reg);
+                in_dst = false;
+            } else {
+                gen_expr_to(stage.body, reg);
+                if (&stage != &pipeline->stages.back()) {
+                    m_output << "    mov " << var_slot(value) << ", " << dst << "\n";
+                }
+                in_dst = true;
+            }
+            m_vars.pop_back();
+        }
+        if (pipeline->count) {
+            m_output << "    add " << var_slot(total) << ", 1\n";
+        } else if (in_dst) {
+            m_output << "    add " << var_slot(total) << ", " << dst << "\n";
+        } else {
+            m_output << "    mov rax, " << var_slot(value) << "\n";
+            m_output << "    add " << var_slot(total) << ", rax\n";
+        }
+        m_output << next_label << ":\n";
+        m_output << "    add " << var_slot(position) << ", 1\n";
+        m_output << "    jmp " << loop_label << "\n";
+        m_output << end_label << ":\n";
+        m_output << "    mov " << dst << ", " << var_slot(total) << "\n";
+        m_output << "    add rsp, 32\n";
+        m_stack_size -= 4;
+        m_vars.resize(vars_start);
+        m_output << "    ;; /pipeline\n";
+    }
+
+    // Run a pipeline on four values at a time while at least four are left.
+    // ymm4 holds the per-lane totals, ymm5 the lane positions, ymm6 the
+    // lanes every filter so far accepted and ymm7 the value after a map;
+    // the stage bodies are evaluated in ymm8-ymm14. Filtered out lanes keep
+    // computing and are masked off when the total is updated. Nothing is
+    // emitted when a stage body uses an operation AVX2 has no lane-wise
+    // form for, such as division by a non power of two.
+    void gen_pipeline_vector(const NodeTermPipeline* pipeline, const std::string& position, const std::string& end, const std::string& total){
+        VectorEmitter emitter {.gen = *this};
+        const std::string iota = emitter.constant({0, 1, 2, 3});
+        const std::string four = emitter.constant({4, 4, 4, 4});
+        std::string value = "ymm5";
+        bool filtered = false;
+        for (const NodePipeStage& stage : pipeline->stages) {
+            emitter.param = stage.param.value.value();
+            emitter.param_reg = value;
+            if (stage.filter) {
+                const std::string mask = emitter.mask(stage.body, 8);
+                if (filtered) {
+                    emitter.out << "    vpand ymm6, ymm6, " << mask << "\n";
+                } else {
+                    emitter.out << "    vmovdqa ymm6, " << mask << "\n";
+                }
+                filtered = true;
+            } else {
+                const std::string result = emitter.reg(stage.body, 8);
+                if (result != "ymm7") {
+                    emitter.out << "    vmovdqa ymm7, " << result << "\n";
+                }
+                value = "ymm7";
+            }
+        }
+        if (pipeline->count) {
+            if (filtered) {
+                // Accepted lanes are all ones, i.e. -1
+                emitter.out << "    vpsubq ymm4, ymm4, ymm6\n";
+            } else {
+                emitter.out << "    vpaddq ymm4, ymm4, " << emitter.constant({1, 1, 1, 1}) << "\n";
+            }
+        } else if (filtered) {
+            emitter.out << "    vpand ymm8, ymm6, " << value << "\n";
+            emitter.out << "    vpaddq ymm4, ymm4, ymm8\n";
+        } else {
+            emitter.out << "    vpaddq ymm4, ymm4, " << value << "\n";
+        }
+        if (!emitter.ok) {
+            return;
+        }
+
+        for (const std::array<int64_t, 4>& lanes : emitter.constants) {
+            m_rodata << "    align 32\n";
+            m_rodata << "vconst" << m_vector_constants++ << ": dq " << lanes[0] << ", " << lanes[1] << ", " << lanes[2] << ", " << lanes[3] << "\n";
+        }
+        const std::string loop_label = create_label();
+        const std::string end_label = create_label();
+        m_output << "    mov rcx, " << var_slot(position) << "\n";
+        m_output << "    mov rdx, " << var_slot(end) << "\n";
+        m_output << "    vpxor xmm4, xmm4, xmm4\n";
+        m_output << "    vmovq xmm5, rcx\n";
+        m_output << "    vpbroadcastq ymm5, xmm5\n";
+        m_output << "    vpaddq ymm5, ymm5, " << iota << "\n";
+        // Compare the count left rather than rcx + 4, which overflows when
+        // the range ends near INT64_MAX. Once rcx < rdx, rdx - rcx is exact
+        // as an unsigned number.
+        m_output << loop_label << ":\n";
+        m_output << "    cmp rcx, rdx\n";
+        m_output << "    jge " << end_label << "\n";
+        m_output << "    mov rax, rdx\n";
+        m_output << "    sub rax, rcx\n";
+        m_output << "    cmp rax, 4\n";
+        m_output << "    jb " << end_label << "\n";
+        m_output << emitter.out.str();
+        m_output << "    vpaddq ymm5, ymm5, " << four << "\n";
+        m_output << "    add rcx, 4\n";
+        m_output << "    jmp " << loop_label << "\n";
+        m_output << end_label << ":\n";
+        // Add up the four lane totals
+        m_output << "    vextracti128 xmm8, ymm4, 1\n";
+        m_output << "    vpaddq xmm4, xmm4, xmm8\n";
+        m_output << "    vpshufd xmm8, xmm4, 78\n";
+        m_output << "    vpaddq xmm4, xmm4, xmm8\n";
+        m_output << "    vmovq rax, xmm4\n";
+        m_output << "    mov " << var_slot(total) << ", rax\n";
+        m_output << "    mov " << var_slot(position) << ", rcx\n";
+        // The SSE code that follows would otherwise pay for the dirty upper halves
+        m_output << "    vzeroupper\n";
+    }
+
+    // Evaluates a pipeline stage body on the four lanes of a ymm register
+    // (see gen_pipeline_vector). Each function returns the operand holding
+    // the result: the parameter's register, a constant in memory or ymm r,
+    // with ymm r and up free to use. `ok` turns false on an operation
+    // without a lane-wise form or when the registers run out.
+    struct VectorEmitter {
+        Generator& gen;
+        std::string param;
+        std::string param_reg;
+        std::stringstream out;
+        std::vector<std::array<int64_t, 4>> constants;   // committed to m_rodata as vconst<m_vector_constants + index>
+        bool ok = true;
+
+        static constexpr int k_last_reg = 14;   // ymm15 is k_float_scratch
+
+        static std::string ymm(int r) {
+            return "ymm" + std::to_string(r);
+        }
+
+        // First register at or after r not holding the operand
+        static int after(const std::string& operand, int r) {
+            return operand == ymm(r) ? r + 1 : r;
+        }
+
+        bool claim(int r) {
+            if (r > k_last_reg) {
+                ok = false;
+            }
+            return ok;
+        }
+
+        std::string constant(const std::array<int64_t, 4>& lanes) {
+            constants.push_back(lanes);
+            return "[vconst" + std::to_string(gen.m_vector_constants + constants.size() - 1) + "]";
+        }
+
+        std::string to_reg(const std::string& operand, int r) {
+            if (operand[0] != '[' || !claim(r)) {
+                return operand;
+            }
+            out << "    vmovdqa " << ymm(r) << ", " << operand << "\n";
+            return ymm(r);
+        }
+
+        std::string reg(const NodeExpr* expr, int r) {
+            return to_reg(operand(expr, r), r);
+        }
+
+        std::string operand(const NodeExpr* expr, int r) {
+            if (!ok) {
+                return ymm(r);
+            }
+            if (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+                return term_operand(*term, r);
+            }
+            return bin_operand(std::get<NodeBinExpr*>(expr->var), r);
+        }
+
+        std::string term_operand(const NodeTerm* term, int r) {
+            if (const auto* int_lit = std::get_if<NodeTermIntLit*>(&term->var)) {
+                const int64_t value = std::stoll((*int_lit)->int_lit.value.value());
+                return constant({value, value, value, value});
+            }
+            if (const auto* ident = std::get_if<NodeTermIdent*>(&term->var)) {
+                const std::string& name = (*ident)->ident.value.value();
+                if (name == param) {
+                    return param_reg;
+                }
+                if (claim(r)) {
+                    out << "    vpbroadcastq " << ymm(r) << ", " << gen.var_slot(name) << "\n";
+                }
+                return ymm(r);
+            }
+            if (const auto* paren = std::get_if<NodeTermParen*>(&term->var)) {
+                return operand((*paren)->expr, r);
+            }
+            const auto* neg = std::get_if<NodeTermNeg*>(&term->var);
+            const auto* bit_not = std::get_if<NodeTermBitNot*>(&term->var);
+            if (neg == nullptr && bit_not == nullptr) {
+                ok = false;
+                return ymm(r);
+            }
+            const std::string x = to_reg(term_operand(neg != nullptr ? (*neg)->term : (*bit_not)->term, r), r);
+            const int scratch = after(x, r);
+            if (!claim(scratch)) {
+                return ymm(r);
+            }
+            if (neg != nullptr) {
+                out << "    vpxor " << ymm(scratch) << ", " << ymm(scratch) << ", " << ymm(scratch) << "\n";
+                out << "    vpsubq " << ymm(r) << ", " << ymm(scratch) << ", " << x << "\n";
+            } else {
+                out << "    vpcmpeqq " << ymm(scratch) << ", " << ymm(scratch) << ", " << ymm(scratch) << "\n";
+                out << "    vpxor " << ymm(r) << ", " << x << ", " << ymm(scratch) << "\n";
+            }
+            return ymm(r);
+        }
+
+        std::string binary(const char* op, const NodeExpr* lhs, const NodeExpr* rhs, int r) {
+            const std::string a = reg(lhs, r);
+            const std::string b = operand(rhs, after(a, r));
+            if (claim(r)) {
+                out << "    " << op << " " << ymm(r) << ", " << a << ", " << b << "\n";
+            }
+            return ymm(r);
+        }
+
+        std::string bin_operand(const NodeBinExpr* bin_expr, int r) {
+            const auto& var = bin_expr->var;
+            if (const auto* add = std::get_if<NodeBinExprAdd*>(&var)) return binary("vpaddq", (*add)->lhs, (*add)->rhs, r);
+            if (const auto* sub = std::get_if<NodeBinExprSub*>(&var)) return binary("vpsubq", (*sub)->lhs, (*sub)->rhs, r);
+            if (const auto* bit_and = std::get_if<NodeBinExprBitAnd*>(&var)) return binary("vpand", (*bit_and)->lhs, (*bit_and)->rhs, r);
+            if (const auto* bit_or = std::get_if<NodeBinExprBitOr*>(&var)) return binary("vpor", (*bit_or)->lhs, (*bit_or)->rhs, r);
+            if (const auto* bit_xor = std::get_if<NodeBinExprBitXor*>(&var)) return binary("vpxor", (*bit_xor)->lhs, (*bit_xor)->rhs, r);
+            if (const auto* multi = std::get_if<NodeBinExprMulti*>(&var)) return multiply((*multi)->lhs, (*multi)->rhs, r);
+            if (is_comparison(bin_expr)) {
+                // All ones to 1
+                const std::string mask = compare(bin_expr, r);
+                if (ok) {
+                    out << "    vpsrlq " << ymm(r) << ", " << mask << ", 63\n";
+                }
+                return ymm(r);
+            }
+            // Shifts by a literal, and the unsigned / and % by a power of two
+            std::optional<int64_t> shl, div, mod;
+            const NodeExpr* x = nullptr;
+            if (const auto* shl_expr = std::get_if<NodeBinExprShl*>(&var)) {
+                x = (*shl_expr)->lhs;
+                shl = literal_value((*shl_expr)->rhs);
+            } else if (const auto* div_expr = std::get_if<NodeBinExprDiv*>(&var)) {
+                x = (*div_expr)->lhs;
+                div = literal_value((*div_expr)->rhs);
+            } else if (const auto* mod_expr = std::get_if<NodeBinExprMod*>(&var)) {
+                x = (*mod_expr)->lhs;
+                mod = literal_value((*mod_expr)->rhs);
+            }
+            const std::optional<int64_t> divisor = div.has_value() ? div : mod;
+            if (!shl.has_value() && !(divisor.has_value() && divisor.value() > 0 && std::has_single_bit(static_cast<uint64_t>(divisor.value())))) {
+                ok = false;
+                return ymm(r);
+            }
+            const std::string a = reg(x, r);
+            if (!claim(r)) {
+                return ymm(r);
+            }
+            if (shl.has_value()) {
+                out << "    vpsllq " << ymm(r) << ", " << a << ", " << (shl.value() & 63) << "\n";
+            } else if (div.has_value()) {
+                out << "    vpsrlq " << ymm(r) << ", " << a << ", " << std::countr_zero(static_cast<uint64_t>(div.value())) << "\n";
+            } else {
+                const int64_t low = mod.value() - 1;
+                out << "    vpand " << ymm(r) << ", " << a << ", " << constant({low, low, low, low}) << "\n";
+            }
+            return ymm(r);
+        }
+
+        // AVX2 only multiplies the low 32 bits of each lane, so a 64-bit
+        // product is put together from the partial products that reach the
+        // low 64 bits: lo*lo + (hi*lo + lo*hi) << 32
+        std::string multiply(const NodeExpr* lhs, const NodeExpr* rhs, int r) {
+            std::optional<int64_t> factor = literal_value(rhs);
+            if (!factor.has_value() && literal_value(lhs).has_value()) {
+                factor = literal_value(lhs);
+                std::swap(lhs, rhs);
+            }
+            const std::string a = reg(lhs, r);
+            if (factor.has_value() && factor.value() >= 0 && factor.value() <= UINT32_MAX) {
+                // The factor's high half is zero
+                const std::string b = constant({factor.value(), factor.value(), factor.value(), factor.value()});
+                const std::string t = ymm(r + 1);
+                if (!claim(r + 1)) {
+                    return ymm(r);
+                }
+                out << "    vpsrlq " << t << ", " << a << ", 32\n";
+                out << "    vpmuludq " << t << ", " << t << ", " << b << "\n";
+                out << "    vpsllq " << t << ", " << t << ", 32\n";
+                out << "    vpmuludq " << ymm(r) << ", " << a << ", " << b << "\n";
+                out << "    vpaddq " << ymm(r) << ", " << ymm(r) << ", " << t << "\n";
+                return ymm(r);
+            }
+            const std::string b = reg(rhs, after(a, r));
+            // The partial products must not land in ymm r, which the last step writes
+            const int first = std::max(r + 1, after(b, after(a, r)));
+            if (!claim(first + 1)) {
+                return ymm(r);
+            }
+            const std::string t = ymm(first), u = ymm(first + 1);
+            out << "    vpsrlq " << t << ", " << a << ", 32\n";
+            out << "    vpmuludq " << t << ", " << t << ", " << b << "\n";
+            out << "    vpsrlq " << u << ", " << b << ", 32\n";
+            out << "    vpmuludq " << u << ", " << u << ", " << a << "\n";
+            out << "    vpaddq " << t << ", " << t << ", " << u << "\n";
+            out << "    vpsllq " << t << ", " << t << ", 32\n";
+            out << "    vpmuludq " << ymm(r) << ", " << a << ", " << b << "\n";
+            out << "    vpaddq " << ymm(r) << ", " << ymm(r) << ", " << t << "\n";
+            return ymm(r);
+        }
+
+        // All ones in the lanes where a comparison holds (signed, like the
+        // scalar code)
+        std::string compare(const NodeBinExpr* bin_expr, int r) {
+            const auto greater = [&](const NodeExpr* x, const NodeExpr* y, bool invert, const char* op = "vpcmpgtq") {
+                const std::string a = reg(x, r);
+                const std::string b = operand(y, after(a, r));
+                if (!claim(r + 1)) {
+                    return ymm(r);
+                }
+                out << "    " << op << " " << ymm(r) << ", " << a << ", " << b << "\n";
+                if (invert) {
+                    out << "    vpcmpeqq " << ymm(r + 1) << ", " << ymm(r + 1) << ", " << ymm(r + 1) << "\n";
+                    out << "    vpxor " << ymm(r) << ", " << ymm(r) << ", " << ymm(r + 1) << "\n";
+                }
+                return ymm(r);
+            };
+            const auto& var = bin_expr->var;
+            if (const auto* gt = std::get_if<NodeBinExprGt*>(&var)) return greater((*gt)->lhs, (*gt)->rhs, false);
+            if (const auto* lt = std::get_if<NodeBinExprLt*>(&var)) return greater((*lt)->rhs, (*lt)->lhs, false);
+            if (const auto* ge = std::get_if<NodeBinExprGe*>(&var)) return greater((*ge)->rhs, (*ge)->lhs, true);
+            if (const auto* le = std::get_if<NodeBinExprLe*>(&var)) return greater((*le)->lhs, (*le)->rhs, true);
+            const auto* eq_eq = std::get<NodeBinExprEqEq*>(var);
+            return greater(eq_eq->lhs, eq_eq->rhs, false, "vpcmpeqq");
+        }
+
+        // A filter condition as a lane mask: comparisons directly, other
+        // values by testing for non-zero
+        std::string mask(const NodeExpr* expr, int r) {
+            expr = strip_parens(expr);
+            if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&expr->var); bin_expr != nullptr && is_comparison(*bin_expr)) {
+                return compare(*bin_expr, r);
+            }
+            const std::string x = reg(expr, r);
+            const std::string zero = ymm(r + 1);
+            if (!claim(r + 1)) {
+                return ymm(r);
+            }
+            out << "    vpxor " << zero << ", " << zero << ", " << zero << "\n";
+            out << "    vpcmpeqq " << ymm(r) << ", " << x << ", " << zero << "\n";
+            out << "    vpcmpeqq " << zero << ", " << zero << ", " << zero << "\n";
+            out << "    vpxor " << ymm(r) << ", " << ymm(r) << ", " << zero << "\n";
+            return ymm(r);
+        }
+    };
+
+    // True if rsp is a multiple of 16 here, as calls into C code require. It
+    // is at _start, and a parallel for body is called from an aligned stack,
+    // so its return address takes one slot.
+    bool stack_aligned() const {
+        if (m_par_base.has_value()) {
+            return (m_stack_size - m_par_base.value()) % 2 == 1;
+        }
+        return m_stack_size % 2 == 0;
+    }
+
+    // Cycles gen_intrinsic spends on top of evaluating the argument
+    size_t intrinsic_cost(Intrinsic op) const {
+        const TargetFeatures& features = m_target.features;
+        switch (op) {
+        case Intrinsic::popcount: return features.popcnt ? k_cost_bitcount : k_cost_imul + 12 * k_cost_alu;
+        case Intrinsic::clz: return features.lzcnt ? k_cost_bitcount : k_cost_bitcount + 3 * k_cost_alu;
+        case Intrinsic::ctz: return features.bmi1 ? k_cost_bitcount : k_cost_bitcount + 2 * k_cost_alu;
+        case Intrinsic::bswap: return k_cost_alu;
+        case Intrinsic::rdtsc: return k_cost_rdtsc;
+        case Intrinsic::clock_ns: return k_cost_call;
+        case Intrinsic::cycles: return k_cost_rdtsc + k_cost_alu;
+        }
+        return 0;
+    }
+
+    // Emit dst = lhs op rhs for f64 operands, where dst is one of the operands
+    // and rhs may be a memory operand. AVX has a separate destination; with
+    // SSE2 a subtraction or division into rhs goes through lhs.
+    void gen_float_op(const NodeBinExpr* bin_expr, const std::string& lhs, const std::string& rhs, const std::string& dst){
+        std::string op;
+        if (std::holds_alternative<NodeBinExprAdd*>(bin_expr->var)) op = "addsd";
+        else if (std::holds_alternative<NodeBinExprSub*>(bin_expr->var)) op = "subsd";
+        else if (std::holds_alternative<NodeBinExprMulti*>(bin_expr->var)) op = "mulsd";
+        else op = "divsd";
+        const bool commutative = op == "addsd" || op == "mulsd";
+        if (m_target.features.avx) {
+            m_output << "    v" << op << " " << dst << ", " << lhs << ", " << rhs << "\n";
+        } else if (dst == lhs) {
+            m_output << "    " << op << " " << dst << ", " << rhs << "\n";
+        } else if (commutative) {
+            m_output << "    " << op << " " << dst << ", " << lhs << "\n";
+        } else {
+            m_output << "    " << op << " " << lhs << ", " << rhs << "\n";
+            m_output << "    movapd " << dst << ", " << lhs << "\n";
+        }
+    }
+
+    // Emit the cmp/test of a compare tile and return the condition code
+    // (l, ge, e, ...) under which the comparison holds
+    std::string gen_compare(const Label& label, size_t reg){
+        if (label.lhs->type == Type::f64) {
+            if (label.rhs_kind == Operand::mem) {
+                gen_expr_to(label.lhs, reg);
+                gen_sse("ucomisd", k_float_regs[reg], operand(label.rhs, Operand::mem));
+            } else {
+                const auto [lhs, rhs] = gen_operands(label.lhs, label.rhs, reg, true);
+                gen_sse("ucomisd", lhs, rhs);
+            }
+            if (label.cc == "e") {
+                // Equal and ordered: ZF set and PF clear
+                m_output << "    sete al\n";
+                m_output << "    setnp cl\n";
+                m_output << "    test al, cl\n";
+                return "ne";
+            }
+            return label.cc;
+        }
+        const std::string dst = k_expr_regs[reg];
+        switch (label.rhs_kind) {
+        case Operand::zero:
+            gen_expr_to(label.lhs, reg);
+            m_output << "    test " << dst << ", " << dst << "\n";
+            break;
+        case Operand::reg: {
+            const auto [lhs, rhs] = gen_operands(label.lhs, label.rhs, reg, true);
+            m_output << "    cmp " << lhs << ", " << rhs << "\n";
+            break;
+        }
+        default:
+            gen_expr_to(label.lhs, reg);
+            m_output << "    cmp " << dst << ", " << operand(label.rhs, label.rhs_kind) << "\n";
+            break;
+        }
+        return label.cc;
+    }
+
+    // Generate assembly for any expression node and push its value, using
+    // k_expr_regs[reg] and the registers after it
+    void gen_expr(const NodeExpr* expr, size_t reg = 0) {
+        const Label label = this->label(expr);
+        if (label.tile == Tile::constant && fits_imm32(label.imm)) {
+            push(std::to_string(label.imm));
+        } else if (label.tile == Tile::load) {
+            push(operand(label.lhs, Operand::mem));
+        } else if (expr->type == Type::f64) {
+            if (label.tile == Tile::constant) {
+                m_output << "    mov rax, " << label.imm << "\n";
+            } else {
+                gen_expr_to(expr, reg);
+                gen_sse("movq", "rax", k_float_regs[reg]);
+            }
+            push("rax");
+        } else {
+            gen_expr_to(expr, reg);
+            push(k_expr_regs[reg]);
+        }
+    }
+
+    // Generate assembly for any expression node into k_expr_regs[reg], or
+    // k_float_regs[reg] for f64 values, using only that register and the ones
+    // after it. The node is covered by the tile label() selected for it.
+    void gen_expr_to(const NodeExpr* expr, size_t reg) {
+        if (expr->type == Type::f64) {
+            gen_float_to(expr, reg);
+            return;
+        }
+        const Label label = this->label(expr);
+        const std::string dst = k_expr_regs[reg];
+        switch (label.tile) {
+        case Tile::constant:
+            gen_mov_imm(dst, label.imm);
+            break;
+        case Tile::load:
+            m_output << "    mov " << dst << ", " << operand(label.lhs, Operand::mem) << "\n";
+            break;
+        case Tile::term:
+            gen_term(std::get<NodeTerm*>(label.lhs->var), reg);
+            break;
+        case Tile::superopt: {
+            const Superoptimizer::Lowering lowering = m_superopt->lower(expr).value();
+            static const char* inputs[] = {"rax", "rcx"};
+            for (size_t i = 0; i < lowering.vars.size(); i++) {
+                m_output << "    mov " << inputs[i] << ", " << var_slot(lowering.vars[i]) << "\n";
+            }
+            for (const std::string& insn : lowering.insns) {
+                m_output << "    " << insn << "\n";
+            }
+            m_output << "    mov " << dst << ", rax\n";
+            break;
+        }
+        case Tile::op:
+            if (label.rhs_kind == Operand::reg) {
+                const auto [lhs, rhs] = gen_operands(label.lhs, label.rhs, reg, true);
+                gen_bin_op(label.bin, lhs, rhs, dst);
+            } else {
+                gen_expr_to(label.lhs, reg);
+                gen_bin_op(label.bin, dst, operand(label.rhs, label.rhs_kind), dst);
+            }
+            break;
+        case Tile::div_const:
+            gen_expr_to(label.lhs, reg);
+            if (std::holds_alternative<NodeBinExprDiv*>(label.bin->var)) {
+                gen_div_const(dst, label.imm, dst, "");
+            } else {
+                gen_div_const(dst, label.imm, "", dst);
+            }
+            break;
+        case Tile::imul_imm:
+            m_output << "    imul " << dst << ", " << operand(label.lhs, Operand::mem) << ", " << label.imm << "\n";
+            break;
+        case Tile::lea: {
+            std::string base;
+            std::string index;
+            if (label.lhs != nullptr && label.rhs != nullptr && label.lhs != label.rhs) {
+                std::tie(base, index) = gen_operands(label.lhs, label.rhs, reg, true);
+            } else {
+                gen_expr_to(label.lhs != nullptr ? label.lhs : label.rhs, reg);
+                base = label.lhs != nullptr ? dst : "";
+                index = label.rhs != nullptr ? dst : "";
+            }
+            m_output << "    lea " << dst << ", [";
+            if (!base.empty()) {
+                m_output << base << (index.empty() ? "" : " + ");
+            }
+            if (!index.empty()) {
+                m_output << index << (label.scale == 1 ? "" : "*" + std::to_string(label.scale));
+            }
+            if (label.imm != 0) {
+                m_output << (label.imm < 0 ? " - " : " + ") << (label.imm < 0 ? -label.imm : label.imm);
+            }
+            m_output << "]\n";
+            break;
+        }
+        case Tile::compare: {
+            const std::string cc = gen_compare(label, reg);
+            m_output << "    set" << cc << " al\n";
+            m_output << "    movzx " << dst << ", al\n";
+            break;
+        }
+        }
+    }
+
+    // Generate an f64 expression into k_float_regs[reg]
+    void gen_float_to(const NodeExpr* expr, size_t reg) {
+        const Label label = this->label(expr);
+        const std::string dst = k_float_regs[reg];
+        switch (label.tile) {
+        case Tile::constant:
+            gen_float_constant(label.imm, dst);
+            break;
+        case Tile::load:
+            gen_sse("movsd", dst, operand(label.lhs, Operand::mem));
+            break;
+        case Tile::term:
+            gen_float_term(std::get<NodeTerm*>(label.lhs->var), reg);
+            break;
+        case Tile::op:
+            if (label.rhs_kind == Operand::reg) {
+                const auto [lhs, rhs] = gen_operands(label.lhs, label.rhs, reg, true);
+                gen_float_op(label.bin, lhs, rhs, dst);
+            } else {
+                gen_expr_to(label.lhs, reg);
+                gen_float_op(label.bin, dst, operand(label.rhs, label.rhs_kind), dst);
+            }
+            break;
+        default:
+            assert(false);
+        }
+    }
+
+    // Generate an f64 terminal expression into k_float_regs[reg]
+    void gen_float_term(const NodeTerm* term, size_t reg){
+        struct TermVisitor {
+            Generator& gen;
+            size_t reg;
+            const std::string dst;
+
+            void operator()(const NodeTermFloatLit* term_float_lit) const {
+                gen.gen_float_constant(float_bits(term_float_lit), dst);
+            }
+
+            void operator()(const NodeTermIdent* term_ident) const {
+                gen.gen_sse("movsd", dst, gen.var_slot(term_ident->ident.value.value()));
+            }
+
+            // Flip the sign bit
+            void operator()(const NodeTermNeg* term_neg) const {
+                gen.gen_float_term(term_neg->term, reg);
+                gen.m_output << "    mov rax, 0x8000000000000000\n";
+                gen.gen_sse("movq", k_float_scratch, "rax");
+                gen.gen_sse("xorpd", dst, k_float_scratch, true);
+            }
+
+            void operator()(const NodeTermParen* term_paren) const {
+                gen.gen_expr_to(term_paren->expr, reg);
+            }
+
+            // f64(x): integers are converted exactly or to the nearest double
+            void operator()(const NodeTermConvert* term_convert) const {
+                gen.gen_expr_to(term_convert->expr, reg);
+                if (term_convert->expr->type == Type::i64) {
+                    // Zeroing first breaks the dependency on the old register value
+                    gen.gen_sse("xorpd", dst, dst, true);
+                    gen.gen_sse("cvtsi2sd", dst, k_expr_regs[reg], true);
+                }
+            }
+
+            // The remaining terms are integers
+            void operator()(const NodeTermIntLit*) const { assert(false); }
+            void operator()(const NodeTermRead*) const { assert(false); }
+            void operator()(const NodeTermArg*) const { assert(false); }
+            void operator()(const NodeTermAlloc*) const { assert(false); }
+            void operator()(const NodeTermIndex*) const { assert(false); }
+            void operator()(const NodeTermField*) const { assert(false); }
+            void operator()(const NodeTermBitNot*) const { assert(false); }
+            void operator()(const NodeTermIntrinsic*) const { assert(false); }
+            void operator()(const NodeTermPipeline*) const { assert(false); }
+
+            // Call of an extern fn returning f64
+            void operator()(const NodeTermCall* term_call) const {
+                gen.gen_call(term_call, reg);
+            }
+        };
+
+        TermVisitor visitor({.gen = *this, .reg = reg, .dst = k_float_regs[reg]});
+        std::visit(visitor, term->var);
+    }
+
+    // Jump to `label` when the condition is false. Comparisons branch on
+    // their flags directly instead of materializing a 0/1 value first. The
+    // condition is evaluated from register `reg` up.
+    void gen_jump_if_false(const NodeExpr* cond, const std::string& label, size_t reg = 0){
+        const Label cond_label = this->label(cond);
+        if (cond_label.tile == Tile::compare) {
+            const std::string cc = gen_compare(cond_label, reg);
+            m_output << "    j" << negate_cc(cc) << " " << label << "\n";
+            return;
+        }
+        gen_expr_to(cond, reg);
+        m_output << "    test " << k_expr_regs[reg] << ", " << k_expr_regs[reg] << "\n";
+        m_output << "    jz " << label << "\n";
+    }
+
+    // dst = imm. Under -Os, 0 becomes a 32-bit xor, which clobbers the flags
+    // (constants are never loaded while flags are live), and values that fit
+    // in 32 bits a zero-extending 32-bit mov, dropping the REX prefix or the
+    // 64-bit immediate.
+    void gen_mov_imm(const std::string& dst, int64_t imm){
+        if (m_options.optimize_size && imm == 0) {
+            m_output << "    xor " << operand32(dst) << ", " << operand32(dst) << "\n";
+        } else if (m_options.optimize_size && imm > 0 && imm <= UINT32_MAX) {
+            m_output << "    mov " << operand32(dst) << ", " << imm << "\n";
+        } else {
+            m_output << "    mov " << dst << ", " << imm << "\n";
+        }
+    }
+
+    // Jump to `label` when the condition is true
+    void gen_jump_if_true(const NodeExpr* cond, const std::string& label, size_t reg = 0){
+        const Label cond_label = this->label(cond);
+        if (cond_label.tile == Tile::compare) {
+            const std::string cc = gen_compare(cond_label, reg);
+            m_output << "    j" << cc << " " << label << "\n";
+            return;
+        }
+        gen_expr_to(cond, reg);
+        m_output << "    test " << k_expr_regs[reg] << ", " << k_expr_regs[reg] << "\n";
+        m_output << "    jnz " << label << "\n";
+    }
+
+    // Store an expression's value into a variable. `x = x + e`, `x = x - e`
+    // and `x = x & e` (likewise | and ^) update the variable in place.
+    void gen_store(const std::string& name, const NodeExpr* expr){
+        const Label label = this->label(expr);
+        const std::string slot = var_slot(name);
+        if (label.tile == Tile::constant && fits_imm32(label.imm)) {
+            m_output << "    mov " << slot << ", " << label.imm << "\n";
+            return;
+        }
+        if (expr->type == Type::f64) {
+            if (label.tile == Tile::constant) {
+                m_output << "    mov rax, " << label.imm << "\n";
+                m_output << "    mov " << slot << ", rax\n";
+            } else {
+                gen_expr_to(expr, 0);
+                gen_sse("movsd", slot, k_float_regs[0]);
+            }
+            return;
+        }
+        if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&strip_parens(expr)->var)) {
+            const NodeExpr* other = nullptr;
+            const char* op = nullptr;
+            const auto match = [&](const NodeExpr* lhs, const NodeExpr* rhs, const char* name_op, bool commutative) {
+                op = name_op;
+                if (is_ident(as_ident(lhs), name)) other = rhs;
+                else if (commutative && is_ident(as_ident(rhs), name)) other = lhs;
+            };
+            const auto& var = (*bin_expr)->var;
+            if (const auto* add = std::get_if<NodeBinExprAdd*>(&var)) match((*add)->lhs, (*add)->rhs, "add", true);
+            else if (const auto* sub = std::get_if<NodeBinExprSub*>(&var)) match((*sub)->lhs, (*sub)->rhs, "sub", false);
+            else if (const auto* bit_and = std::get_if<NodeBinExprBitAnd*>(&var)) match((*bit_and)->lhs, (*bit_and)->rhs, "and", true);
+            else if (const auto* bit_or = std::get_if<NodeBinExprBitOr*>(&var)) match((*bit_or)->lhs, (*bit_or)->rhs, "or", true);
+            else if (const auto* bit_xor = std::get_if<NodeBinExprBitXor*>(&var)) match((*bit_xor)->lhs, (*bit_xor)->rhs, "xor", true);
+            if (other != nullptr) {
+                const Label other_label = this->label(other);
+                if (other_label.tile == Tile::constant && fits_imm32(other_label.imm)) {
+                    m_output << "    " << op << " " << slot << ", " << other_label.imm << "\n";
+                } else {
+                    gen_expr_to(other, 0);
+                    m_output << "    " << op << " " << var_slot(name) << ", " << k_expr_regs[0] << "\n";
+                }
+                return;
+            }
+        }
+        gen_expr_to(expr, 0);
+        m_output << "    mov " << var_slot(name) << ", " << k_expr_regs[0] << "\n";
+    }
+
+    // Generate assembly for a scope (block of statements)
+    void gen_scope(const NodeScope* scope){
+        begin_scope();
+        gen_stmts(scope->stmts);
+        end_scope();
+    }
+
+    // Generate a statement list, fusing adjacent statements where possible
+    void gen_stmts(const std::vector<NodeStmt*>& stmts){
+        for (size_t i = 0; i < stmts.size(); i++){
+            if (i + 1 < stmts.size() && try_gen_divmod_pair(stmts[i], stmts[i + 1])) {
+                i++;
+                continue;
+            }
+            gen_stmt(stmts[i]);
+        }
+    }
+
+    // Generate code for an if-elif-else chain. The variable ranges at the end of
+    // every arm are collected in `exits` so the caller can merge them.
+    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label, std::vector<RangeEnv>& exits){
+        struct PredVisitor {
+            Generator& gen;
+            const std::string& end_label;
+            std::vector<RangeEnv>& exits;
+
+            void operator()(const NodeIfPredElif* elif) const {
+                const std::optional<bool> truth = elif == gen.m_hoisted_elif ? false : gen.truth_of(elif->expr);
+                if (truth == false) {
+                    // Excluded by the conditions tested before it
+                    gen.m_output << "    ;; elif (never taken)\n";
+                    if (elif->pred.has_value()) {
+                        gen.gen_if_pred(elif->pred.value(), end_label, exits);
+                    } else {
+                        exits.push_back(gen.snapshot_ranges());
+                    }
+                    return;
+                }
+                if (truth == true) {
+                    // Implied by the conditions tested before it: no test, and
+                    // the remaining arms are unreachable
+                    gen.m_output << "    ;; elif (always taken)\n";
+                    gen.gen_scope(elif->scope);
+                    exits.push_back(gen.snapshot_ranges());
+                    return;
+                }
+
+                if (elif->hint != BranchHint::none) {
+                    gen.m_output << "    ;; elif (" << (elif->hint == BranchHint::likely ? "likely" : "unlikely") << ")\n";
+                    gen.gen_hinted_test(elif->expr, elif->scope, elif->hint, elif->pred, end_label, exits);
+                    return;
+                }
+                gen.m_output << "    ;; elif\n";
+                const std::string label = gen.create_label();
+                gen.gen_jump_if_false(elif->expr, label);
+                const RangeEnv entry = gen.snapshot_ranges();
+                gen.refine_ranges(elif->expr, true);
+                gen.gen_scope(elif->scope);
+                exits.push_back(gen.snapshot_ranges());
+                gen.m_output << "    jmp " << end_label << "\n";
+                gen.m_output << label << ":\n";
+                gen.restore_ranges(entry);
+                gen.refine_ranges(elif->expr, false);
+
+                if (elif->pred.has_value()) {
+                    gen.gen_if_pred(elif->pred.value(), end_label, exits);
+                } else {
+                    exits.push_back(gen.snapshot_ranges());
+                }
+            }
+
+            void operator()(const NodeIfPredElse* else_) const {
+                gen.gen_scope(else_->scope);
+                exits.push_back(gen.snapshot_ranges());
+            }
+        };
+
+        PredVisitor visitor{.gen = *this, .end_label = end_label, .exits = exits};
+        std::visit(visitor, pred->var);
+    }
+
+    // Generate an if-elif-else chain. `hoist` allows testing a likely elif
+    // first (try_gen_hoisted_elif).
+    void gen_if(const NodeStmtIf* stmt_if, bool hoist = true){
+        open_range_frame();
+        gen_if_chain(stmt_if, hoist);
+        close_range_frame();
+    }
+
+    void gen_if_chain(const NodeStmtIf* stmt_if, bool hoist){
+        const std::optional<bool> truth = truth_of(stmt_if->expr);
+        if (truth == true) {
+            m_output << "    ;; if (always taken)\n";
+            refine_ranges(stmt_if->expr, true);
+            gen_scope(stmt_if->scope);
+            return;
+        }
+        if (truth == false) {
+            m_output << "    ;; if (never taken)\n";
+            if (stmt_if->pred.has_value()) {
+                std::vector<RangeEnv> exits;
+                const std::string end_label = create_label();
+                gen_if_pred(stmt_if->pred.value(), end_label, exits);
+                m_output << end_label << ":\n";
+                restore_ranges(join_envs(exits));
+            }
+            return;
+        }
+        if (hoist && try_gen_hoisted_elif(stmt_if)) {
+            return;
+        }
+        std::vector<RangeEnv> exits;
+        if (stmt_if->hint != BranchHint::none) {
+            // A hinted branch is predictable, so it stays a branch instead of
+            // being if-converted
+            m_output << "    ;; if (" << (stmt_if->hint == BranchHint::likely ? "likely" : "unlikely") << ")\n";
+            const std::string end_label = create_label();
+            gen_hinted_test(stmt_if->expr, stmt_if->scope, stmt_if->hint, stmt_if->pred, end_label, exits);
+            m_output << end_label << ":\n";
+            restore_ranges(join_envs(exits));
+            return;
+        }
+        if (try_gen_if_converted(stmt_if)) {
+            return;
+        }
+        std::string label = create_label();
+        gen_jump_if_false(stmt_if->expr, label);
+        const RangeEnv entry = snapshot_ranges();
+        refine_ranges(stmt_if->expr, true);
+        gen_scope(stmt_if->scope);
+        exits.push_back(snapshot_ranges());
+        restore_ranges(entry);
+        refine_ranges(stmt_if->expr, false);
+
+        if (stmt_if->pred.has_value()) {
+            const std::string end_label = create_label();
+            m_output << "    jmp " << end_label << "\n";
+            m_output << label << ":\n";
+            gen_if_pred(stmt_if->pred.value(), end_label, exits);
+            m_output << end_label << ":\n";
+        } else {
+            m_output << label << ":\n";
+            exits.push_back(snapshot_ranges());
+        }
+        restore_ranges(join_envs(exits));
+    }
+
+    // Test of an if or elif with a hint, followed by the rest of its chain.
+    // The expected path falls straight through to `end_label`, which the
+    // caller places right after: a likely arm is inline and the tests after
+    // it move to the cold section, while an unlikely arm moves there itself
+    // and the chain continues inline.
+    void gen_hinted_test(const NodeExpr* cond, const NodeScope* scope, BranchHint hint, std::optional<NodeIfPred*> rest,
+                         const std::string& end_label, std::vector<RangeEnv>& exits){
+        const RangeEnv entry = snapshot_ranges();
+        const auto gen_rest = [&]() {
+            restore_ranges(entry);
+            refine_ranges(cond, false);
+            if (rest.has_value()) {
+                gen_if_pred(rest.value(), end_label, exits);
+            } else {
+                exits.push_back(snapshot_ranges());
+            }
+        };
+        const std::string label = rest.has_value() || hint == BranchHint::unlikely ? create_label() : end_label;
+        if (hint == BranchHint::unlikely) {
+            gen_jump_if_true(cond, label);
+            gen_cold([&]() {
+                m_output << label << ":\n";
+                refine_ranges(cond, true);
+                gen_scope(scope);
+                exits.push_back(snapshot_ranges());
+                m_output << "    jmp " << end_label << "\n";
+            });
+            gen_rest();
+            return;
+        }
+        gen_jump_if_false(cond, label);
+        refine_ranges(cond, true);
+        gen_scope(scope);
+        exits.push_back(snapshot_ranges());
+        if (!rest.has_value()) {
+            gen_rest();
+            return;
+        }
+        gen_cold([&]() {
+            m_output << label << ":\n";
+            gen_rest();
+            m_output << "    jmp " << end_label << "\n";
+        });
+    }
+
+    // Test a likely elif before the conditions preceding it when the range
+    // analysis shows that none of them can hold together with it, so the
+    // expected arm is reached by a single test. The chain as written, minus
+    // that elif, follows in the cold section. All the conditions must be free
+    // of side effects, since the fast path skips the earlier ones.
+    bool try_gen_hoisted_elif(const NodeStmtIf* stmt_if){
+        std::vector<const NodeExpr*> earlier {stmt_if->expr};
+        const NodeIfPredElif* likely = nullptr;
+        std::optional<NodeIfPred*> pred = stmt_if->pred;
+        while (pred.has_value() && likely == nullptr) {
+            const auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var);
+            if (elif == nullptr) {
+                return false;
+            }
+            if ((*elif)->hint == BranchHint::likely) {
+                likely = *elif;
+            } else {
+                earlier.push_back((*elif)->expr);
+                pred = (*elif)->pred;
+            }
+        }
+        if (likely == nullptr || has_side_effects(likely->expr)
+            || std::any_of(earlier.begin(), earlier.end(), [](const NodeExpr* cond) { return has_side_effects(cond); })) {
+            return false;
+        }
+        const RangeEnv entry = snapshot_ranges();
+        refine_ranges(likely->expr, true);
+        const bool disjoint = std::all_of(earlier.begin(), earlier.end(), [&](const NodeExpr* cond) { return truth_of(cond) == false; });
+        restore_ranges(entry);
+        if (!disjoint) {
+            return false;
+        }
+
+        m_output << "    ;; elif (likely, tested first)\n";
+        const std::string end_label = create_label();
+        const std::string label = create_label();
+        std::vector<RangeEnv> exits;
+        gen_jump_if_false(likely->expr, label);
+        refine_ranges(likely->expr, true);
+        gen_scope(likely->scope);
+        exits.push_back(snapshot_ranges());
+        gen_cold([&]() {
+            m_output << label << ":\n";
+            restore_ranges(entry);
+            refine_ranges(likely->expr, false);
+            const NodeIfPredElif* outer_hoisted = m_hoisted_elif;
+            m_hoisted_elif = likely;
+            gen_if(stmt_if, false);
+            m_hoisted_elif = outer_hoisted;
+            exits.push_back(snapshot_ranges());
+            m_output << "    jmp " << end_label << "\n";
+        });
+        m_output << end_label << ":\n";
+        restore_ranges(join_envs(exits));
+        return true;
+    }
+
+    // Generate code into the cold section placed after all other code, so
+    // rarely run paths do not take up room in the hot code's cache lines
+    template <typename Body>
+    void gen_cold(const Body& body){
+        std::stringstream code;
+        std::swap(code, m_output);
+        mark_line();
+        body();
+        std::swap(code, m_output);
+        m_cold << code.str();
+    }
+
+    // Generate assembly for a statement node
+    void gen_stmt(const NodeStmt* stmt) {
+        struct StmtVisitor {
+            Generator& gen;
+
+            // Exit program with value
+            void operator()(const NodeStmtExit* stmt_exit) const {
+                gen.gen_expr_to(stmt_exit->expr, 0);
+                if (gen.m_options.optimize_size) {
+                    gen.require(rt_exit_rbx);
+                    gen.m_output << "    jmp exit_rbx\n";
+                    return;
+                }
+                gen.m_output << "    mov rax, 231\n";
+                gen.m_output << "    mov rdi, " << k_expr_regs[0] << "\n";
+                gen.m_output << "    syscall\n";
+            }
+
+            // Variable declaration (let)
+            void operator()(const NodeStmtLet* stmt_let) const {
+                if (stmt_let->record_type != nullptr) {
+                    gen.gen_record_array(stmt_let);
+                    return;
+                }
+                const Range range = gen.range_of(stmt_let->expr);
+                gen.declare_var(stmt_let);
+                gen.gen_expr(stmt_let->expr); 
+                gen.set_range(gen.m_vars.back(), range);
+            }
+
+            // Assignment (x = ...)
+            void operator()(const NodeStmtAssign* stmt_assign) const {
+                Var& var = gen.find_var(stmt_assign->ident.value.value());
+                if (gen.is_shared(var)) {
+                    std::cerr << "Cannot assign shared variable " << var.name
+                              << " inside a parallel for; use a reduce clause" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+
+                // Generating the value may declare hidden variables (pipelines),
+                // which can move m_vars, so look the variable up again
+                const std::string& name = stmt_assign->ident.value.value();
+                const Range range = gen.range_of(stmt_assign->expr);
+                gen.gen_store(name, stmt_assign->expr);
+                gen.set_range(gen.find_var(name), range);
+            }
+
+            // Array element store (a[i] = ...)
+            void operator()(const NodeStmtIndexAssign* stmt_assign) const {
+                const auto [value, index] = gen.gen_operands(stmt_assign->expr, stmt_assign->index, 0, true);
+                gen.m_output << "    mov rax, " << gen.var_slot(stmt_assign->ident.value.value()) << "\n";
+                gen.m_output << "    mov [rax + " << index << "*8], " << value << "\n";
+            }
+
+            // Struct field store (a[i].x = ...), truncated to the field width
+            void operator()(const NodeStmtFieldAssign* stmt_assign) const {
+                const auto [value, index] = gen.gen_operands(stmt_assign->expr, stmt_assign->target->index, 0, true);
+                const std::string address = gen.field_address(stmt_assign->target, index);
+                gen.m_output << "    mov " << address << ", " << operand_of_size(value, field_of(stmt_assign->target).size) << "\n";
+            }
+
+            // Struct declaration: the layout was computed by the TypeChecker
+            void operator()(const NodeStmtStruct*) const {}
+
+            // Sequential loop
+            void operator()(const NodeStmtFor* stmt_for) const {
+                gen.gen_for(stmt_for);
+            }
+
+            // Loop whose iterations are spread over the runtime thread pool
+            void operator()(const NodeStmtParallelFor* stmt_parallel) const {
+                if (gen.m_par_base.has_value()) {
+                    // Nested parallelism runs on the worker that reached it
+                    gen.gen_for(stmt_parallel->loop);
+                    return;
+                }
+                gen.gen_parallel_for(stmt_parallel);
+            }
+
+            // Nested scope
+            void operator()(const NodeScope* scope) const {
+                gen.m_output << "    ;; scope\n";
+                gen.gen_scope(scope);
+                gen.m_output << "    ;; /scope\n";
+            }
+
+            // If statement
+            void operator()(const NodeStmtIf* stmt_if) const {
+                gen.gen_if(stmt_if);
+            }
+
+            // Inline assembly
+            void operator()(const NodeStmtAsm* stmt_asm) const {
+                gen.gen_asm(stmt_asm);
+            }
+
+            // C function declaration: only makes the symbol known
+            void operator()(const NodeStmtExtern* stmt_extern) const {
+                gen.m_externs.emplace(stmt_extern->ident.value.value(), stmt_extern);
+            }
+
+            // Call whose result is unused
+            void operator()(const NodeStmtCall* stmt_call) const {
+                gen.gen_call(stmt_call->call, 0);
+            }
+
+            // Function definition, generated out of line
+            void operator()(const NodeStmtFn* stmt_fn) const {
+                gen.gen_fn(stmt_fn);
+            }
+
+            void operator()(const NodeStmtReturn* stmt_return) const {
+                gen.gen_return(stmt_return);
+            }
+
+            // Print value
+            void operator()(const NodeStmtPrint* stmt_print) const {
+                gen.gen_expr_to(stmt_print->expr, 0);
+                if (stmt_print->expr->type == Type::f64) {
+                    // k_float_regs[0] is xmm0, the argument register
+                    gen.require(rt_print_f64);
+                    gen.m_output << "    call print_f64\n";
+                    return;
+                }
+                if (gen.m_options.optimize_size) {
+                    gen.require(rt_print_rbx);
+                    gen.require(rt_print_int);
+                    gen.m_output << "    call print_rbx\n";
+                    return;
+                }
+                gen.require(rt_print_int);
+                gen.m_output << "    mov rdi, " << k_expr_regs[0] << "\n";
+                gen.m_output << "    call print_int\n";
+            }
+        };
+
+        const bool marked = m_options.line_markers && stmt->line != 0;
+        if (marked) {
+            m_lines.push_back(stmt->line);
+            mark_line();
+        }
+        StmtVisitor visitor {.gen = *this};
+        std::visit(visitor, stmt->var);
+        if (marked) {
+            // The rest of the enclosing statement, such as a loop's step
+            m_lines.pop_back();
+            mark_line();
+        }
+    }
+
+    // Label the code that follows with the line of the innermost statement
+    // being generated, when line markers are on
+    void mark_line(){
+        if (m_options.line_markers) {
+            m_output << k_line_marker << (m_lines.empty() ? 0 : m_lines.back()) << "_" << m_line_marks++ << ":\n";
+        }
+    }
+
+    // Whether the program starts the thread pool of parallel fors
+    bool uses_threads() const {
+        return is_required(rt_parallel);
+    }
+
+    // Generate the full program's assembly
+    std::string gen_prog() {
+        gen_stmts(m_prog.stmts);
+
+        // Default exit if not explicitly exited. exit_group also ends the
+        // parallel for worker threads.
+        mark_line();
+        if (m_options.optimize_size) {
+            m_output << "    xor edi, edi\n";
+            m_output << "    mov eax, 231\n";
+        } else {
+            m_output << "    mov rax, 231\n";
+            m_output << "    mov rdi, 0\n";
+        }
+        m_output << "    syscall\n";
+
+        std::stringstream prog;
+        prog << "; target: " << m_target.name << " (" << m_target.describe().substr(1) << ")\n";
+        for (const auto& [name, stmt_extern] : m_externs) {
+            prog << "extern " << name << "\n";
+        }
+        prog << "global _start\n_start:\n";
+        if (m_options.line_markers) {
+            // Numbered 0, so it sorts before a marker at the same address
+            prog << k_line_marker << "0_0:\n";
+        }
+        if (is_required(rt_arg_int)) {
+            // argc and argv sit at the initial stack pointer
+            prog << "    mov [argv_base], rsp\n";
+        }
+        if (is_required(rt_clock_ns)) {
+            // So is the auxiliary vector, after argv and envp
+            prog << "    mov [clock_stack], rsp\n";
+        }
+        prog << m_output.str();
+        prog << m_functions.str();
+        if (m_cold.tellp() > 0) {
+            prog << "\n    ;; cold code\n";
+            prog << m_cold.str();
+        }
+
+        // Runtime routines used by the program
+        if (m_options.line_markers) {
+            prog << k_line_marker << "0_" << m_line_marks++ << ":\n";
+        }
+        for (const RuntimeRoutine* routine : m_runtime) {
+            prog << routine->text;
+        }
+        if (m_options.line_markers) {
+            prog << k_line_marker_end << ":\n";
+        }
+        if (m_rodata.tellp() > 0) {
+            prog << "\nsection .rodata\n";
+            prog << m_rodata.str();
+        }
+        prog << "\nsection .bss\n";
+        for (const RuntimeRoutine* routine : m_runtime) {
+            prog << routine->bss;
+        }
+        prog << m_bss.str();
+        if (!m_externs.empty()) {
+            // Linked with C objects, which mark their stack non-executable
+            prog << "\nsection .note.GNU-stack noalloc noexec nowrite progbits\n";
+        }
+
+        return prog.str();
+    }
+
+    // Generate a program that only replays output computed at compile time:
+    // a single write of the whole output followed by the known exit status
+    std::string gen_precomputed(const std::string& output, int exit_code) const {
+        std::stringstream prog;
+        prog << "; target: " << m_target.name << " (" << m_target.describe().substr(1) << ")\n";
+        prog << "; output precomputed at compile time\n";
+        prog << "global _start\n_start:\n";
+        if (!output.empty()) {
+            prog << "    mov rsi, precomputed_output\n";
+            prog << "    mov rdx, " << output.size() << "\n";
+            // write(2) normally takes everything at once; retry on short writes
+            prog << ".write:\n";
+            prog << "    mov eax, 1\n";
+            prog << "    mov edi, 1\n";
+            prog << "    syscall\n";
+            prog << "    test rax, rax\n";
+            prog << "    jle .exit\n";
+            prog << "    add rsi, rax\n";
+            prog << "    sub rdx, rax\n";
+            prog << "    jnz .write\n";
+        }
+        prog << ".exit:\n";
+        prog << "    mov eax, 231\n";
+        prog << "    mov edi, " << exit_code << "\n";
+        prog << "    syscall\n";
+        if (!output.empty()) {
+            prog << "\nsection .rodata\nprecomputed_output:";
+            for (size_t i = 0; i < output.size(); i++) {
+                prog << (i % 32 == 0 ? "\n    db " : ", ") << static_cast<int>(static_cast<unsigned char>(output[i]));
+            }
+            prog << "\n";
+        }
+        return prog.str();
+    }
+
+private:
+    // Utility: push register or value onto stack
+    void push(const std::string& reg){
+        m_output << "    push " << reg << "\n";
+        m_stack_size++;
+    }
+
+    // Utility: pop into a register
+    void pop(const std::string& reg){
+        m_output << "    pop " << reg << "\n";
+        m_stack_size--;
+    }
+
+    // Emit an SSE2 instruction, or its VEX-encoded form when the target has
+    // AVX. Instructions that also read dst take it twice in the VEX form.
+    void gen_sse(const std::string& op, const std::string& dst, const std::string& src, bool reads_dst = false){
+        if (!m_target.features.avx) {
+            m_output << "    " << op << " " << dst << ", " << src << "\n";
+        } else if (reads_dst) {
+            m_output << "    v" << op << " " << dst << ", " << dst << ", " << src << "\n";
+        } else {
+            m_output << "    v" << op << " " << dst << ", " << src << "\n";
+        }
+    }
+
+    // Load the f64 with the given bit pattern into an xmm register
+    void gen_float_constant(int64_t bits, const std::string& dst){
+        if (bits == 0) {
+            gen_sse("xorpd", dst, dst, true);
+            return;
+        }
+        m_output << "    mov rax, " << bits << "\n";
+        gen_sse("movq", dst, "rax");
+    }
+
+    // Bit pattern of a float literal, correctly rounded
+    static int64_t float_bits(const NodeTermFloatLit* term_float_lit){
+        return std::bit_cast<int64_t>(std::strtod(term_float_lit->float_lit.value.value().c_str(), nullptr));
+    }
+
+    // Mark a runtime routine as used so gen_prog appends it
+    void require(const RuntimeRoutine& routine){
+        if (!is_required(routine)) {
+            m_runtime.push_back(&routine);
+        }
+    }
+
+    bool is_required(const RuntimeRoutine& routine) const {
+        return std::find(m_runtime.begin(), m_runtime.end(), &routine) != m_runtime.end();
+    }
+
+    // Declare the variable of a let statement in the stack slot its value is
+    // pushed to next
+    void declare_var(const NodeStmtLet* stmt_let){
+        if (m_vars.contains(stmt_let->ident.value.value())) {
+            std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = m_stack_size, .type = stmt_let->expr->type});
+    }
+
+    // Allocate an array of structs for `let a: Name[] = alloc(n);`. A struct
+    // of arrays also keeps the start of every field array but the first in a
+    // hidden variable `a.field`, so each field access is a single load.
+    void gen_record_array(const NodeStmtLet* stmt_let){
+        check_not_parallel("alloc()");
+        require(rt_alloc);
+        const NodeStmtStruct* record = stmt_let->record_type;
+        const auto* term_alloc = std::get<NodeTermAlloc*>(std::get<NodeTerm*>(stmt_let->expr->var)->var);
+        const std::string count = k_expr_regs[0];
+        gen_expr_to(term_alloc->count, 0);
+        // The allocator counts 8-byte words
+        m_output << "    imul rdi, " << count << ", " << (stmt_let->soa ? record->packed_size : record->size) << "\n";
+        m_output << "    add rdi, 7\n";
+        m_output << "    shr rdi, 3\n";
+        m_output << "    call alloc\n";
+        declare_var(stmt_let);
+        push("rax");
+        if (!stmt_let->soa) {
+            return;
+        }
+        for (const NodeStructField& field : record->fields) {
+            if (field.soa_offset != 0) {
+                m_output << "    imul rcx, " << count << ", " << field.soa_offset << "\n";
+                m_output << "    add rcx, rax\n";
+                m_vars.push_back({.name = stmt_let->ident.value.value() + "." + field.ident.value.value(), .stack_loc = m_stack_size});
+                push("rcx");
+            }
+        }
+    }
+
+    static const NodeStructField& field_of(const NodeTermField* term_field){
+        return term_field->array->record_type->fields[term_field->field_index];
+    }
+
+    // Memory operand of a[i].f, with i in the register `index`. An element
+    // of an array of structs is addressed as [a + i*scale + offset], with the
+    // element size split into a power-of-two scale and a multiplier applied
+    // to `index` beforehand.
+    std::string field_address(const NodeTermField* term_field, const std::string& index){
+        const NodeStmtLet* array = term_field->array;
+        const NodeStructField& field = field_of(term_field);
+        const std::string& name = term_field->ident.value.value();
+        std::stringstream address;
+        if (array->soa) {
+            const std::string base = field.soa_offset == 0 ? name : name + "." + field.ident.value.value();
+            m_output << "    mov rax, " << var_slot(base) << "\n";
+            address << "[rax + " << index << "*" << field.size << "]";
+            return address.str();
+        }
+        int scale = 8;
+        while (array->record_type->size % scale != 0) {
+            scale /= 2;
+        }
+        const int multiplier = array->record_type->size / scale;
+        if (multiplier == 3 || multiplier == 5 || multiplier == 9) {
+            m_output << "    lea " << index << ", [" << index << " + " << index << "*" << multiplier - 1 << "]\n";
+        } else if (std::has_single_bit(static_cast<unsigned>(multiplier))) {
+            if (multiplier > 1) {
+                m_output << "    shl " << index << ", " << std::countr_zero(static_cast<unsigned>(multiplier)) << "\n";
+            }
+        } else {
+            m_output << "    imul " << index << ", " << index << ", " << multiplier << "\n";
+        }
+        m_output << "    mov rax, " << var_slot(name) << "\n";
+        address << "[rax + " << index << "*" << scale;
+        if (field.offset != 0) {
+            address << " + " << field.offset;
+        }
+        address << "]";
+        return address.str();
+    }
+
+    // Begin a new variable scope
+    void begin_scope(){
+        m_scopes.push_back(m_vars.size());
+    }
+
+    // End current scope and deallocate local variables
+    void end_scope(){
+        size_t pop_count = m_vars.size() - m_scopes.back();
+        if (pop_count != 0) {
+            m_output << "    add rsp, " << pop_count * 8 << "\n";
+        }
+        m_stack_size -= pop_count;
+        for (int i = 0; i < pop_count; i++){
+            m_vars.pop_back();
+        }
+        m_scopes.pop_back();
+    }
+
+    // Tile cost table, roughly in cycles. Folding a load into an instruction
+    // as a memory operand is treated as free.
+    static constexpr size_t k_cost_mov = 1;
+    static constexpr size_t k_cost_alu = 1;
+    static constexpr size_t k_cost_lea = 1;
+    static constexpr size_t k_cost_lea3 = 2;   // base + index + displacement
+    static constexpr size_t k_cost_imul = 3;
+    static constexpr size_t k_cost_div = 25;
+    static constexpr size_t k_cost_setcc = 2;
+    static constexpr size_t k_cost_call = 20;
+    static constexpr size_t k_cost_fadd = 4;    // addsd, subsd
+    static constexpr size_t k_cost_fmul = 4;
+    static constexpr size_t k_cost_fdiv = 14;
+    static constexpr size_t k_cost_fcmp = 3;    // ucomisd
+    static constexpr size_t k_cost_cvt = 4;     // cvtsi2sd, cvttsd2si
+    static constexpr size_t k_cost_bitcount = 3;  // popcnt, lzcnt, tzcnt, bsr, bsf
+    static constexpr size_t k_cost_rdtsc = 25;
+
+    // Label an expression with its cheapest tile (memoized until ranges change).
+    // A superoptimized sequence replaces the tiling only when it is cheaper.
+    Label label(const NodeExpr* expr){
+        if (auto it = m_label_cache.find(expr); it != m_label_cache.end()) {
+            return it->second;
+        }
+        Label label = select_tile(expr);
+        if (m_superopt != nullptr && expr->type != Type::f64 && label.tile != Tile::constant) {
+            if (std::optional<Superoptimizer::Lowering> lowering = m_superopt->lower(expr)) {
+                if (const size_t cost = lowering_cost(lowering.value()); cost < label.cost) {
+                    label = {.tile = Tile::superopt, .cost = cost, .need = 1};
+                }
+            }
+        }
+        m_label_cache.emplace(expr, label);
+        return label;
+    }
+
+    // Cost of a superoptimized sequence as gen_expr_to emits it: a load per
+    // variable, the instructions and the move of rax to the destination
+    static size_t lowering_cost(const Superoptimizer::Lowering& lowering){
+        size_t cost = (lowering.vars.size() + 1) * k_cost_mov;
+        for (const std::string& insn : lowering.insns) {
+            const std::string mnemonic = insn.substr(0, insn.find(' '));
+            if (mnemonic == "imul") {
+                cost += k_cost_imul;
+            } else if (mnemonic == "lea") {
+                cost += k_cost_lea;
+            } else if (mnemonic == "mov") {
+                cost += k_cost_mov;
+            } else {
+                cost += k_cost_alu;
+            }
+        }
+        return cost;
+    }
+
+    // Minimum-cost tiling: try every tile rooted at the node on top of the
+    // already labelled children. Ties keep the tile tried first.
+    Label select_tile(const NodeExpr* expr){
+        if (expr->type == Type::f64 || is_float_compare(expr)) {
+            return select_float_tile(expr);
+        }
+        if (const std::optional<int64_t> value = constant_of(expr)) {
+            return {.tile = Tile::constant, .cost = k_cost_mov, .need = 1, .imm = value.value()};
+        }
+        expr = strip_parens(expr);
+        if (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (std::holds_alternative<NodeTermIdent*>((*term)->var)) {
+                return {.tile = Tile::load, .cost = k_cost_mov, .need = 1, .lhs = expr};
+            }
+            const auto [cost, need] = term_cost(*term);
+            return {.tile = Tile::term, .cost = cost, .need = need, .lhs = expr};
+        }
+
+        const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+        const auto [a, b] = std::visit([](const auto* bin) { return std::pair<const NodeExpr*, const NodeExpr*>(bin->lhs, bin->rhs); }, bin_expr->var);
+        const Label la = label(a);
+        const Label lb = label(b);
+        const bool a_imm = la.tile == Tile::constant && fits_imm32(la.imm);
+        const bool b_imm = lb.tile == Tile::constant && fits_imm32(lb.imm);
+        const bool a_mem = la.tile == Tile::load;
+        const bool b_mem = lb.tile == Tile::load;
+
+        std::optional<Label> best;
+        const auto consider = [&](Label candidate) {
+            if (!best.has_value() || candidate.cost < best->cost || (candidate.cost == best->cost && candidate.need < best->need)) {
+                best = candidate;
+            }
+        };
+
+        if (is_comparison(bin_expr)) {
+            const std::string cc = condition_code(bin_expr);
+            const size_t cost = k_cost_alu + k_cost_setcc;
+            if (lb.tile == Tile::constant && lb.imm == 0) {
+                consider({.tile = Tile::compare, .cost = cost + la.cost, .need = la.need, .lhs = a, .rhs = b, .rhs_kind = Operand::zero, .cc = cc});
+            }
+            if (la.tile == Tile::constant && la.imm == 0) {
+                consider({.tile = Tile::compare, .cost = cost + lb.cost, .need = lb.need, .lhs = b, .rhs = a, .rhs_kind = Operand::zero, .cc = swap_cc(cc)});
+            }
+            if (b_imm || b_mem) {
+                consider({.tile = Tile::compare, .cost = cost + la.cost, .need = la.need, .lhs = a, .rhs = b, .rhs_kind = b_imm ? Operand::imm : Operand::mem, .cc = cc});
+            }
+            if (a_imm || a_mem) {
+                consider({.tile = Tile::compare, .cost = cost + lb.cost, .need = lb.need, .lhs = b, .rhs = a, .rhs_kind = a_imm ? Operand::imm : Operand::mem, .cc = swap_cc(cc)});
+            }
+            consider({.tile = Tile::compare, .cost = cost + la.cost + lb.cost, .need = pair_need(la.need, lb.need), .lhs = a, .rhs = b, .cc = cc});
+            return best.value();
+        }
+
+        const bool is_div = std::holds_alternative<NodeBinExprDiv*>(bin_expr->var) || std::holds_alternative<NodeBinExprMod*>(bin_expr->var);
+        const bool is_mul = std::holds_alternative<NodeBinExprMulti*>(bin_expr->var);
+        const bool is_shift = std::holds_alternative<NodeBinExprShl*>(bin_expr->var) || std::holds_alternative<NodeBinExprShr*>(bin_expr->var);
+        const bool commutative = is_mul || std::holds_alternative<NodeBinExprAdd*>(bin_expr->var)
+            || std::holds_alternative<NodeBinExprBitAnd*>(bin_expr->var) || std::holds_alternative<NodeBinExprBitOr*>(bin_expr->var)
+            || std::holds_alternative<NodeBinExprBitXor*>(bin_expr->var);
+        const size_t cost = is_div ? k_cost_div : is_mul ? k_cost_imul : k_cost_alu;
+        if (is_div && lb.tile == Tile::constant && is_fast_divisor(lb.imm)) {
+            const bool remainder = std::holds_alternative<NodeBinExprMod*>(bin_expr->var);
+            consider({.tile = Tile::div_const, .cost = div_const_cost(lb.imm, remainder) + la.cost, .need = la.need, .lhs = a, .bin = bin_expr, .imm = lb.imm});
+        }
+        if (is_shift) {
+            // Shift counts are never memory operands, and without BMI2 a
+            // register count is first moved into cl
+            if (b_imm) {
+                consider({.tile = Tile::op, .cost = cost + la.cost, .need = la.need, .lhs = a, .rhs = b, .rhs_kind = Operand::imm, .bin = bin_expr});
+            }
+            const size_t count_cost = m_target.features.bmi2 ? 0 : k_cost_mov;
+            consider({.tile = Tile::op, .cost = cost + count_cost + la.cost + lb.cost, .need = pair_need(la.need, lb.need), .lhs = a, .rhs = b, .bin = bin_expr});
+            return best.value();
+        }
+        if (b_imm && !is_div) {
+            consider({.tile = Tile::op, .cost = cost + la.cost, .need = la.need, .lhs = a, .rhs = b, .rhs_kind = Operand::imm, .bin = bin_expr});
+        }
+        if (commutative && a_imm) {
+            consider({.tile = Tile::op, .cost = cost + lb.cost, .need = lb.need, .lhs = b, .rhs = a, .rhs_kind = Operand::imm, .bin = bin_expr});
+        }
+        if (is_mul && a_mem && b_imm) {
+            consider({.tile = Tile::imul_imm, .cost = cost, .need = 1, .lhs = a, .bin = bin_expr, .imm = lb.imm});
+        }
+        if (is_mul && b_mem && a_imm) {
+            consider({.tile = Tile::imul_imm, .cost = cost, .need = 1, .lhs = b, .bin = bin_expr, .imm = la.imm});
+        }
+        if (b_mem) {
+            consider({.tile = Tile::op, .cost = cost + la.cost, .need = la.need, .lhs = a, .rhs = b, .rhs_kind = Operand::mem, .bin = bin_expr});
+        }
+        if (commutative && a_mem) {
+            consider({.tile = Tile::op, .cost = cost + lb.cost, .need = lb.need, .lhs = b, .rhs = a, .rhs_kind = Operand::mem, .bin = bin_expr});
+        }
+        consider({.tile = Tile::op, .cost = cost + la.cost + lb.cost, .need = pair_need(la.need, lb.need), .lhs = a, .rhs = b, .bin = bin_expr});
+        if (std::optional<Label> lea = match_lea(bin_expr)) {
+            consider(lea.value());
+        }
+        return best.value();
+    }
+
+    // Tiles for f64 arithmetic and comparisons. There are no float immediates,
+    // so only variables are folded in as memory operands. Comparisons are
+    // arranged as `x > y` or `x >= y` (seta/setae), which are false when
+    // either operand is NaN; equality also checks the parity flag.
+    Label select_float_tile(const NodeExpr* expr){
+        expr = strip_parens(expr);
+        if (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (const auto* lit = std::get_if<NodeTermFloatLit*>(&(*term)->var)) {
+                const int64_t bits = float_bits(*lit);
+                return {.tile = Tile::constant, .cost = bits == 0 ? k_cost_alu : 2 * k_cost_mov, .need = 1, .imm = bits};
+            }
+            if (std::holds_alternative<NodeTermIdent*>((*term)->var)) {
+                return {.tile = Tile::load, .cost = k_cost_mov, .need = 1, .lhs = expr};
+            }
+            const auto [cost, need] = term_cost(*term);
+            return {.tile = Tile::term, .cost = cost, .need = need, .lhs = expr};
+        }
+
+        const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+        auto [a, b] = std::visit([](const auto* bin) { return std::pair<const NodeExpr*, const NodeExpr*>(bin->lhs, bin->rhs); }, bin_expr->var);
+        std::optional<Label> best;
+        const auto consider = [&](Label candidate) {
+            if (!best.has_value() || candidate.cost < best->cost || (candidate.cost == best->cost && candidate.need < best->need)) {
+                best = candidate;
+            }
+        };
+
+        if (is_comparison(bin_expr)) {
+            std::string cc = condition_code(bin_expr);
+            if (cc == "l" || cc == "le") {
+                std::swap(a, b);
+            }
+            cc = cc == "e" ? "e" : cc == "g" || cc == "l" ? "a" : "ae";
+            const Label la = label(a);
+            const Label lb = label(b);
+            const size_t cost = k_cost_fcmp + k_cost_setcc + (cc == "e" ? 2 * k_cost_alu : 0);
+            if (lb.tile == Tile::load) {
+                consider({.tile = Tile::compare, .cost = cost + la.cost, .need = la.need, .lhs = a, .rhs = b, .rhs_kind = Operand::mem, .cc = cc});
+            }
+            if (cc == "e" && la.tile == Tile::load) {
+                consider({.tile = Tile::compare, .cost = cost + lb.cost, .need = lb.need, .lhs = b, .rhs = a, .rhs_kind = Operand::mem, .cc = cc});
+            }
+            consider({.tile = Tile::compare, .cost = cost + la.cost + lb.cost, .need = pair_need(la.need, lb.need), .lhs = a, .rhs = b, .cc = cc});
+            return best.value();
+        }
+
+        const Label la = label(a);
+        const Label lb = label(b);
+        const bool is_div = std::holds_alternative<NodeBinExprDiv*>(bin_expr->var);
+        const bool is_mul = std::holds_alternative<NodeBinExprMulti*>(bin_expr->var);
+        const bool commutative = is_mul || std::holds_alternative<NodeBinExprAdd*>(bin_expr->var);
+        const size_t cost = is_div ? k_cost_fdiv : is_mul ? k_cost_fmul : k_cost_fadd;
+        if (lb.tile == Tile::load) {
+            consider({.tile = Tile::op, .cost = cost + la.cost, .need = la.need, .lhs = a, .rhs = b, .rhs_kind = Operand::mem, .bin = bin_expr});
+        }
+        if (commutative && la.tile == Tile::load) {
+            consider({.tile = Tile::op, .cost = cost + lb.cost, .need = lb.need, .lhs = b, .rhs = a, .rhs_kind = Operand::mem, .bin = bin_expr});
+        }
+        consider({.tile = Tile::op, .cost = cost + la.cost + lb.cost, .need = pair_need(la.need, lb.need), .lhs = a, .rhs = b, .bin = bin_expr});
+        return best.value();
+    }
+
+    // Comparison between f64 operands (the result itself is an i64)
+    static bool is_float_compare(const NodeExpr* expr){
+        const auto* bin_expr = std::get_if<NodeBinExpr*>(&strip_parens(expr)->var);
+        if (bin_expr == nullptr || !is_comparison(*bin_expr)) {
+            return false;
+        }
+        return std::visit([](const auto* bin) { return bin->lhs->type == Type::f64; }, (*bin_expr)->var);
+    }
+
+    // Cost and register need of the unary terms, which are not tiled further
+    std::pair<size_t, size_t> term_cost(const NodeTerm* term){
+        struct CostVisitor {
+            Generator& gen;
+            using Result = std::pair<size_t, size_t>;
+            Result operator()(const NodeTermIntLit*) const { return {k_cost_mov, 1}; }
+            Result operator()(const NodeTermIdent*) const { return {k_cost_mov, 1}; }
+            Result operator()(const NodeTermNeg* term_neg) const {
+                const Result inner = gen.term_cost(term_neg->term);
+                return {inner.first + k_cost_alu, inner.second};
+            }
+            Result operator()(const NodeTermBitNot* term_bit_not) const {
+                const Result inner = gen.term_cost(term_bit_not->term);
+                return {inner.first + k_cost_alu, inner.second};
+            }
+            Result operator()(const NodeTermParen* term_paren) const { return of(term_paren->expr, 0); }
+            Result operator()(const NodeTermRead*) const { return {k_cost_call, 1}; }
+            Result operator()(const NodeTermArg* term_arg) const { return of(term_arg->index, k_cost_call); }
+            Result operator()(const NodeTermAlloc* term_alloc) const { return of(term_alloc->count, k_cost_call); }
+            Result operator()(const NodeTermIndex* term_index) const { return of(term_index->index, 2 * k_cost_mov); }
+            Result operator()(const NodeTermField* term_field) const { return of(term_field->index, 2 * k_cost_mov); }
+            Result operator()(const NodeTermFloatLit*) const { return {2 * k_cost_mov, 1}; }
+            Result operator()(const NodeTermConvert* term_convert) const {
+                return of(term_convert->expr, term_convert->type == term_convert->expr->type ? 0 : k_cost_cvt);
+            }
+            Result operator()(const NodeTermCall* term_call) const {
+                Result result {k_cost_call, 1};
+                for (const NodeExpr* arg : term_call->args) {
+                    const Label label = gen.label(arg);
+                    result = {result.first + label.cost + k_cost_mov, std::max(result.second, label.need)};
+                }
+                return result;
+            }
+            Result operator()(const NodeTermIntrinsic* term_intrinsic) const {
+                if (term_intrinsic->arg == nullptr) {
+                    return {gen.intrinsic_cost(term_intrinsic->op), 1};
+                }
+                return of(term_intrinsic->arg, gen.intrinsic_cost(term_intrinsic->op));
+            }
+            // A loop: the stage bodies cannot be labeled before their
+            // parameter exists, so assume it needs every register
+            Result operator()(const NodeTermPipeline*) const { return {k_cost_call, k_expr_regs.size()}; }
+            Result of(const NodeExpr* expr, size_t extra) const {
+                const Label label = gen.label(expr);
+                return {label.cost + extra, label.need};
+            }
+        };
+        return std::visit(CostVisitor {.gen = *this}, term->var);
+    }
+
+    // lea tile for sums of up to two registers, a scaled index and a constant
+    // (e.g. a + b*4 + 8), and for multiplications by 2, 3, 4, 5, 8 and 9
+    std::optional<Label> match_lea(const NodeBinExpr* bin_expr){
+        Label lea {.tile = Tile::lea};
+        if (const auto* multi = std::get_if<NodeBinExprMulti*>(&bin_expr->var)) {
+            std::optional<int64_t> factor = small_factor((*multi)->rhs);
+            const NodeExpr* value = (*multi)->lhs;
+            if (!factor.has_value()) {
+                factor = small_factor((*multi)->lhs);
+                value = (*multi)->rhs;
+            }
+            if (factor == 2 || factor == 4 || factor == 8) {
+                lea.rhs = value;
+                lea.scale = factor.value();
+            } else if (factor == 3 || factor == 5 || factor == 9) {
+                lea.lhs = value;
+                lea.rhs = value;
+                lea.scale = factor.value() - 1;
+            } else {
+                return {};
+            }
+            const Label inner = label(value);
+            lea.cost = k_cost_lea + inner.cost;
+            lea.need = inner.need;
+            return lea;
+        }
+        if (!std::holds_alternative<NodeBinExprAdd*>(bin_expr->var)) {
+            return {};
+        }
+
+        // Flatten nested additions into at most three summands
+        std::vector<const NodeExpr*> summands;
+        std::vector<const NodeExpr*> pending {std::get<NodeBinExprAdd*>(bin_expr->var)->rhs, std::get<NodeBinExprAdd*>(bin_expr->var)->lhs};
+        while (!pending.empty()) {
+            const NodeExpr* summand = strip_parens(pending.back());
+            pending.pop_back();
+            const auto* nested = std::get_if<NodeBinExpr*>(&summand->var);
+            if (nested != nullptr && summands.size() + pending.size() < 2 && label(summand).tile != Tile::constant) {
+                if (const auto* add = std::get_if<NodeBinExprAdd*>(&(*nested)->var)) {
+                    pending.push_back((*add)->rhs);
+                    pending.push_back((*add)->lhs);
+                    continue;
+                }
+            }
+            summands.push_back(summand);
+        }
+        if (summands.size() > 3) {
+            return {};
+        }
+
+        std::vector<const NodeExpr*> regs;
+        bool has_disp = false;
+        bool has_scaled = false;
+        for (const NodeExpr* summand : summands) {
+            const Label summand_label = label(summand);
+            if (summand_label.tile == Tile::constant && !has_disp && fits_imm32(summand_label.imm)) {
+                lea.imm = summand_label.imm;
+                has_disp = true;
+                continue;
+            }
+            const auto* nested = std::get_if<NodeBinExpr*>(&summand->var);
+            const auto* multi = nested != nullptr ? std::get_if<NodeBinExprMulti*>(&(*nested)->var) : nullptr;
+            if (multi != nullptr && !has_scaled) {
+                std::optional<int64_t> factor = small_factor((*multi)->rhs);
+                const NodeExpr* value = (*multi)->lhs;
+                if (!factor.has_value()) {
+                    factor = small_factor((*multi)->lhs);
+                    value = (*multi)->rhs;
+                }
+                if (factor == 2 || factor == 4 || factor == 8) {
+                    lea.rhs = value;
+                    lea.scale = factor.value();
+                    has_scaled = true;
+                    continue;
+                }
+            }
+            regs.push_back(summand);
+        }
+        if (regs.size() + (has_scaled ? 1 : 0) > 2 || regs.size() + (has_scaled ? 1 : 0) + (has_disp ? 1 : 0) < 2) {
+            return {};
+        }
+        if (!has_scaled && regs.size() == 2) {
+            lea.rhs = regs[1];
+        }
+        if (!regs.empty()) {
+            lea.lhs = regs[0];
+        }
+        const bool three_parts = lea.lhs != nullptr && lea.rhs != nullptr && has_disp;
+        lea.cost = three_parts ? k_cost_lea3 : k_cost_lea;
+        lea.need = 1;
+        if (lea.lhs != nullptr && lea.rhs != nullptr) {
+            lea.cost += label(lea.lhs).cost + label(lea.rhs).cost;
+            lea.need = pair_need(label(lea.lhs).need, label(lea.rhs).need);
+        } else {
+            const Label inner = label(lea.lhs != nullptr ? lea.lhs : lea.rhs);
+            lea.cost += inner.cost;
+            lea.need = inner.need;
+        }
+        return lea;
+    }
+
+    // Divisors gen_div_const handles: every positive int64. Larger unsigned
+    // divisors (negative literals) and zero keep the div instruction, and so
+    // do all but powers of two under -Os, since the reciprocal sequence is
+    // several times longer.
+    bool is_fast_divisor(int64_t d) const {
+        return d >= 1 && (!m_options.optimize_size || std::has_single_bit(static_cast<uint64_t>(d)));
+    }
+
+    // Cost of gen_div_const for one of its outputs
+    static size_t div_const_cost(int64_t d, bool remainder){
+        if (std::has_single_bit(static_cast<uint64_t>(d))) {
+            return k_cost_alu;
+        }
+        const size_t quotient_cost = k_cost_mov + k_cost_imul + k_cost_alu + (unsigned_magic(d).add ? 4 * k_cost_alu : 0);
+        return quotient_cost + (remainder ? k_cost_imul + k_cost_alu : 0);
+    }
+
+    // Reciprocal for unsigned division by a d that is not a power of two:
+    // x / d == mulhi(x, multiplier) >> shift. When the exact multiplier needs
+    // 65 bits, `add` is set and its top bit is added back after the multiply
+    // (Granlund and Montgomery, "Division by invariant integers using
+    // multiplication").
+    struct Magic {
+        uint64_t multiplier;
+        int shift;
+        bool add;
+    };
+
+    static Magic unsigned_magic(uint64_t d){
+        const int log = 63 - std::countl_zero(d);
+        const unsigned __int128 numerator = static_cast<unsigned __int128>(1) << (64 + log);
+        uint64_t multiplier = static_cast<uint64_t>(numerator / d);
+        const uint64_t rem = static_cast<uint64_t>(numerator % d);
+        if (d - rem < (uint64_t {1} << log)) {
+            return {.multiplier = multiplier + 1, .shift = log, .add = false};
+        }
+        multiplier += multiplier;
+        const uint64_t twice_rem = rem + rem;
+        if (twice_rem >= d || twice_rem < rem) {
+            multiplier++;
+        }
+        return {.multiplier = multiplier + 1, .shift = log, .add = true};
+    }
+
+    // A literal multiplier lea can apply (2, 3, 4, 5, 8 or 9)
+    std::optional<int64_t> small_factor(const NodeExpr* expr){
+        const Label label = this->label(expr);
+        if (label.tile == Tile::constant && (label.imm == 2 || label.imm == 3 || label.imm == 4 || label.imm == 5 || label.imm == 8 || label.imm == 9)) {
+            return label.imm;
+        }
+        return {};
+    }
+
+    // Registers needed for two operands held at the same time
+    static size_t pair_need(size_t a, size_t b){
+        return a == b ? a + 1 : std::max(a, b);
+    }
+
+    // Value of an expression that is the same on every execution and safe to materialize
+    std::optional<int64_t> constant_of(const NodeExpr* expr){
+        if (const Range range = range_of(expr); range.is_constant() && is_speculatable(expr)) {
+            return range.lo;
+        }
+        return {};
+    }
+
+    static bool fits_imm32(int64_t value){
+        return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+    }
+
+    // Render an immediate or memory operand
+    std::string operand(const NodeExpr* expr, Operand kind){
+        if (kind == Operand::mem) {
+            return var_slot(as_ident(expr)->ident.value.value());
+        }
+        return std::to_string(constant_of(expr).value());
+    }
+
+    static const NodeExpr* strip_parens(const NodeExpr* expr){
+        while (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            const auto* paren = std::get_if<NodeTermParen*>(&(*term)->var);
+            if (paren == nullptr) {
+                break;
+            }
+            expr = (*paren)->expr;
+        }
+        return expr;
+    }
+
+    static std::string condition_code(const NodeBinExpr* bin_expr){
+        if (std::holds_alternative<NodeBinExprGt*>(bin_expr->var)) return "g";
+        if (std::holds_alternative<NodeBinExprGe*>(bin_expr->var)) return "ge";
+        if (std::holds_alternative<NodeBinExprLt*>(bin_expr->var)) return "l";
+        if (std::holds_alternative<NodeBinExprLe*>(bin_expr->var)) return "le";
+        return "e";
+    }
+
+    // Condition code after exchanging the operands of the comparison
+    static std::string swap_cc(const std::string& cc){
+        if (cc == "g") return "l";
+        if (cc == "ge") return "le";
+        if (cc == "l") return "g";
+        if (cc == "le") return "ge";
+        return cc;
+    }
+
+    // Condition code that holds exactly when `cc` does not. For the unsigned
+    // codes of f64 compares this includes the unordered (NaN) outcome.
+    static std::string negate_cc(const std::string& cc){
+        if (cc == "a") return "be";
+        if (cc == "ae") return "b";
+        if (cc == "g") return "le";
+        if (cc == "ge") return "l";
+        if (cc == "l") return "ge";
+        if (cc == "le") return "g";
+        if (cc == "e") return "ne";
+        return "e";
+    }
+
+    // True if `pred` holds for a term or binary expression anywhere in the
+    // expression. `pred` takes a `const NodeTerm*`, and binary expressions are
+    // only tested if it also takes a `const NodeBinExpr*`.
+    template <typename Pred>
+    static bool any_subexpr(const NodeExpr* expr, const Pred& pred){
+        struct Walker {
+            const Pred& pred;
+            bool operator()(const NodeExpr* expr) const { return std::visit(*this, expr->var); }
+            bool operator()(const NodeBinExpr* bin_expr) const {
+                if constexpr (std::is_invocable_v<const Pred&, const NodeBinExpr*>) {
+                    if (pred(bin_expr)) return true;
+                }
+                return std::visit([&](const auto* bin) { return (*this)(bin->lhs) || (*this)(bin->rhs); }, bin_expr->var);
+            }
+            bool operator()(const NodeTerm* term) const { return pred(term) || std::visit(*this, term->var); }
+            bool operator()(const NodeTermIntLit*) const { return false; }
+            bool operator()(const NodeTermIdent*) const { return false; }
+            bool operator()(const NodeTermNeg* term_neg) const { return (*this)(term_neg->term); }
+            bool operator()(const NodeTermBitNot* term_bit_not) const { return (*this)(term_bit_not->term); }
+            bool operator()(const NodeTermParen* term_paren) const { return (*this)(term_paren->expr); }
+            bool operator()(const NodeTermRead*) const { return false; }
+            bool operator()(const NodeTermArg* term_arg) const { return (*this)(term_arg->index); }
+            bool operator()(const NodeTermAlloc* term_alloc) const { return (*this)(term_alloc->count); }
+            bool operator()(const NodeTermIndex* term_index) const { return (*this)(term_index->index); }
+            bool operator()(const NodeTermField* term_field) const { return (*this)(term_field->index); }
+            bool operator()(const NodeTermFloatLit*) const { return false; }
+            bool operator()(const NodeTermConvert* term_convert) const { return (*this)(term_convert->expr); }
+            bool operator()(const NodeTermIntrinsic* term_intrinsic) const {
+                return term_intrinsic->arg != nullptr && (*this)(term_intrinsic->arg);
+            }
+            bool operator()(const NodeTermCall* term_call) const {
+                return std::any_of(term_call->args.begin(), term_call->args.end(), [&](const NodeExpr* arg) { return (*this)(arg); });
+            }
+            bool operator()(const NodeTermPipeline* pipeline) const {
+                return (*this)(pipeline->begin) || (*this)(pipeline->end)
+                    || std::any_of(pipeline->stages.begin(), pipeline->stages.end(), [&](const NodePipeStage& stage) { return (*this)(stage.body); });
+            }
+        };
+        return Walker {.pred = pred}(expr);
+    }
+
+    // True if evaluating the expression changes state a later evaluation can
+    // observe (consuming input, allocating, reading the cycle counter, calling
+    // C code), so it must not be reordered
+    static bool has_side_effects(const NodeExpr* expr){
+        return any_subexpr(expr, [](const NodeTerm* term) {
+            const auto* intrinsic = std::get_if<NodeTermIntrinsic*>(&term->var);
+            return std::holds_alternative<NodeTermRead*>(term->var) || std::holds_alternative<NodeTermAlloc*>(term->var)
+                || std::holds_alternative<NodeTermCall*>(term->var) || (intrinsic != nullptr && (*intrinsic)->arg == nullptr);
+        });
+    }
+
+    // Whether an expression calls an fn or extern fn. Either may store to
+    // arrays and struct fields.
+    static bool has_call(const NodeExpr* expr){
+        return any_subexpr(expr, [](const NodeTerm* term) { return std::holds_alternative<NodeTermCall*>(term->var); });
+    }
+
+    // Whether an expression reads an array element or struct field
+    static bool reads_memory(const NodeExpr* expr){
+        return any_subexpr(expr, [](const NodeTerm* term) {
+            return std::holds_alternative<NodeTermIndex*>(term->var) || std::holds_alternative<NodeTermField*>(term->var);
+        });
+    }
 
-            // Integer literal (e.g. 42)
-            void operator()(const NodeTermIntLit* term_int_lit) const {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-            }
+    static bool is_comparison(const NodeBinExpr* bin_expr){
+        return std::holds_alternative<NodeBinExprGt*>(bin_expr->var) || std::holds_alternative<NodeBinExprGe*>(bin_expr->var)
+            || std::holds_alternative<NodeBinExprLt*>(bin_expr->var) || std::holds_alternative<NodeBinExprLe*>(bin_expr->var)
+            || std::holds_alternative<NodeBinExprEqEq*>(bin_expr->var);
+    }
 
-            // Identifier (e.g. variable x)
-            void operator()(const NodeTermIdent* term_ident) const {
-                auto it = std::find_if(
-                        gen.m_vars.cbegin(),
-                        gen.m_vars.cend(),
-                        [&](const Var& var) { return var.name == term_ident->ident.value.value(); });
+    // 32-bit form of a register or memory operand (rbx -> ebx, r12 -> r12d)
+    static std::string operand32(const std::string& operand){
+        if (operand.rfind("QWORD ", 0) == 0) {
+            return "DWORD " + operand.substr(6);
+        }
+        if (operand[1] >= '0' && operand[1] <= '9') {
+            return operand + "d";
+        }
+        return "e" + operand.substr(1);
+    }
 
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
+    // Low 8, 16, 32 or 64 bits of a register (rbx -> bl, r12 -> r12w)
+    static std::string operand_of_size(const std::string& reg, int size){
+        const bool numbered = reg[1] >= '0' && reg[1] <= '9';
+        switch (size) {
+        case 8: return reg;
+        case 4: return operand32(reg);
+        case 2: return numbered ? reg + "w" : reg.substr(1);
+        default: return numbered ? reg + "b" : reg.substr(1, 1) + "l";
+        }
+    }
 
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]";
-                gen.push(offset.str()); 
+    // Estimate how many instructions an expression lowers to (used by if-conversion)
+    static size_t expr_cost(const NodeExpr* expr){
+        struct CostVisitor {
+            size_t operator()(const NodeTermIntLit*) const { return 1; }
+            size_t operator()(const NodeTermIdent*) const { return 1; }
+            size_t operator()(const NodeTermNeg* term_neg) const { return 1 + (*this)(term_neg->term); }
+            size_t operator()(const NodeTermBitNot* term_bit_not) const { return 1 + (*this)(term_bit_not->term); }
+            size_t operator()(const NodeTermParen* term_paren) const { return expr_cost(term_paren->expr); }
+            size_t operator()(const NodeTermRead*) const { return 1; }
+            size_t operator()(const NodeTermArg* term_arg) const { return 1 + expr_cost(term_arg->index); }
+            size_t operator()(const NodeTermAlloc* term_alloc) const { return 1 + expr_cost(term_alloc->count); }
+            size_t operator()(const NodeTermIndex* term_index) const { return 2 + expr_cost(term_index->index); }
+            size_t operator()(const NodeTermField* term_field) const { return 2 + expr_cost(term_field->index); }
+            size_t operator()(const NodeTermFloatLit*) const { return 2; }
+            size_t operator()(const NodeTermConvert* term_convert) const { return 1 + expr_cost(term_convert->expr); }
+            size_t operator()(const NodeTermIntrinsic* term_intrinsic) const {
+                return term_intrinsic->arg == nullptr ? 4 : 1 + expr_cost(term_intrinsic->arg);
             }
-
-            // Unary negation (e.g. -x)
-            void operator()(const NodeTermNeg* term_neg) const {
-                gen.gen_term(term_neg->term);
-                gen.pop("rax");
-                gen.m_output << "    neg rax\n";
-                gen.push("rax");
+            size_t operator()(const NodeTermCall* term_call) const {
+                size_t cost = 3;
+                for (const NodeExpr* arg : term_call->args) cost += 2 + expr_cost(arg);
+                return cost;
             }
+            // A loop is never cheap enough to if-convert
+            size_t operator()(const NodeTermPipeline*) const { return k_if_convert_max_cost + 1; }
+            size_t operator()(const NodeTerm* term) const { return std::visit(*this, term->var); }
+            size_t operator()(const NodeBinExpr* bin_expr) const {
+                return std::visit([](const auto* bin) { return 1 + expr_cost(bin->lhs) + expr_cost(bin->rhs); }, bin_expr->var);
+            }
+        };
+        return std::visit(CostVisitor {}, expr->var);
+    }
 
-            // Parenthesized expression (e.g. (x + 1))
-            void operator()(const NodeTermParen* term_paren) const {
-                gen.gen_expr(term_paren->expr);
+    // True if evaluating the expression can neither trap nor have side effects,
+    // so it is safe to evaluate it even when the source would not have.
+    static bool is_speculatable(const NodeExpr* expr){
+        struct Unsafe {
+            bool operator()(const NodeTerm* term) const {
+                const auto* intrinsic = std::get_if<NodeTermIntrinsic*>(&term->var);
+                return std::holds_alternative<NodeTermRead*>(term->var) || std::holds_alternative<NodeTermAlloc*>(term->var)
+                    || std::holds_alternative<NodeTermIndex*>(term->var) || std::holds_alternative<NodeTermField*>(term->var)
+                    || std::holds_alternative<NodeTermCall*>(term->var) || std::holds_alternative<NodeTermPipeline*>(term->var)
+                    || (intrinsic != nullptr && (*intrinsic)->arg == nullptr);
+            }
+            // Division may fault unless the divisor is a non-zero literal
+            bool operator()(const NodeBinExpr* bin_expr) const {
+                const NodeExpr* divisor = nullptr;
+                if (const auto* div = std::get_if<NodeBinExprDiv*>(&bin_expr->var)) divisor = (*div)->rhs;
+                else if (const auto* mod = std::get_if<NodeBinExprMod*>(&bin_expr->var)) divisor = (*mod)->rhs;
+                if (divisor == nullptr) return false;
+                const std::optional<int64_t> value = literal_value(divisor);
+                return !value.has_value() || value.value() == 0;
             }
         };
+        return !any_subexpr(expr, Unsafe {});
+    }
 
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
+    // True if the expression reads the named variable
+    static bool expr_reads(const NodeExpr* expr, const std::string& name){
+        return any_subexpr(expr, [&](const NodeTerm* term) {
+            if (const auto* ident = std::get_if<NodeTermIdent*>(&term->var)) return (*ident)->ident.value.value() == name;
+            if (const auto* index = std::get_if<NodeTermIndex*>(&term->var)) return (*index)->ident.value.value() == name;
+            if (const auto* field = std::get_if<NodeTermField*>(&term->var)) return (*field)->ident.value.value() == name;
+            return false;
+        });
     }
 
-    // Generate assembly for a binary expression
-    void gen_bin_expr(const NodeBinExpr* bin_expr){
-        struct BinExprVisitor {
-            Generator& gen;
+    // Collect the assignments of an if/else arm, if the arm consists only of
+    // speculatable assignments that can be evaluated up front.
+    static std::optional<std::vector<const NodeStmtAssign*>> collect_cmov_arm(const NodeScope* scope){
+        std::vector<const NodeStmtAssign*> assigns;
+        for (const NodeStmt* stmt : scope->stmts) {
+            const auto* assign = std::get_if<NodeStmtAssign*>(&stmt->var);
+            if (assign == nullptr || !is_speculatable((*assign)->expr)) {
+                return {};
+            }
+            // Every value is computed before any store, so a right-hand side must
+            // not observe a variable written earlier in the same arm.
+            for (const NodeStmtAssign* prev : assigns) {
+                if (prev->ident.value.value() == (*assign)->ident.value.value()
+                    || expr_reads((*assign)->expr, prev->ident.value.value())) {
+                    return {};
+                }
+            }
+            assigns.push_back(*assign);
+        }
+        return assigns;
+    }
 
-            // Binary operations: all follow the pattern
-            // 1. evaluate RHS and LHS
-            // 2. pop values
-            // 3. perform operation
-            // 4. push result
+    // Lower `if (c) { x = a; } else { x = b; }` to cmov when both arms only assign
+    // cheap side-effect-free values, trading a possible mispredict for evaluating both arms.
+    // The values of both arms are computed into registers first (a variable
+    // can stay in memory as the cmov source), then the condition sets the
+    // flags with one cmp and every target takes its value with a cmovcc.
+    bool try_gen_if_converted(const NodeStmtIf* stmt_if){
+        std::optional<std::vector<const NodeStmtAssign*>> then_arm = collect_cmov_arm(stmt_if->scope);
+        std::optional<std::vector<const NodeStmtAssign*>> else_arm = std::vector<const NodeStmtAssign*> {};
+        if (stmt_if->pred.has_value()) {
+            const auto* else_ = std::get_if<NodeIfPredElse*>(&stmt_if->pred.value()->var);
+            if (else_ == nullptr) {
+                return false;
+            }
+            else_arm = collect_cmov_arm((*else_)->scope);
+        }
+        if (!then_arm.has_value() || !else_arm.has_value()) {
+            return false;
+        }
 
-            void operator()(const NodeBinExprSub* sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
+        std::vector<std::string> targets;
+        size_t cost = 0;
+        for (const auto* arm : {&then_arm.value(), &else_arm.value()}) {
+            for (const NodeStmtAssign* assign : *arm) {
+                cost += expr_cost(assign->expr);
+                if (std::find(targets.begin(), targets.end(), assign->ident.value.value()) == targets.end()) {
+                    targets.push_back(assign->ident.value.value());
+                }
             }
+        }
+        if (targets.empty() || targets.size() > k_if_convert_max_vars || cost > k_if_convert_max_cost) {
+            return false;
+        }
 
-            void operator()(const NodeBinExprAdd* add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
+        const auto find_value = [](const std::vector<const NodeStmtAssign*>& arm, const std::string& name) -> const NodeExpr* {
+            for (const NodeStmtAssign* assign : arm) {
+                if (assign->ident.value.value() == name) return assign->expr;
             }
+            return nullptr;
+        };
+
+        std::vector<Range> target_ranges;
+        for (const std::string& name : targets) {
+            const NodeExpr* then_value = find_value(then_arm.value(), name);
+            const NodeExpr* else_value = find_value(else_arm.value(), name);
+            const Range current = find_var(name).range;
+            target_ranges.push_back(range_join(
+                then_value != nullptr ? range_of(then_value) : current,
+                else_value != nullptr ? range_of(else_value) : current));
+        }
 
-            void operator()(const NodeBinExprMulti* multi) const {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
+        // Per target, the value kept in a register when the condition is
+        // false (`kept`) and the one moved over it when it is true (`taken`),
+        // or the reverse with `negate`. A null value is the variable's
+        // current one, which the cmov can read from its slot.
+        struct Select {
+            const NodeExpr* kept;
+            const NodeExpr* taken;
+            bool negate;
+            size_t kept_reg;
+            std::optional<size_t> taken_reg;   // none when read from memory
+        };
+        const auto in_memory = [&](const NodeExpr* value) { return value == nullptr || label(value).tile == Tile::load; };
+        std::vector<Select> selects;
+        size_t regs = 0;
+        for (const std::string& name : targets) {
+            const NodeExpr* then_value = find_value(then_arm.value(), name);
+            const NodeExpr* else_value = find_value(else_arm.value(), name);
+            Select select {.kept = else_value, .taken = then_value, .negate = false};
+            if (else_value == nullptr || (in_memory(else_value) && !in_memory(then_value))) {
+                select = {.kept = then_value, .taken = else_value, .negate = true};
             }
+            select.kept_reg = regs++;
+            if (!in_memory(select.taken)) {
+                select.taken_reg = regs++;
+            }
+            selects.push_back(select);
+        }
+        // One register must be left for the condition
+        if (regs >= k_expr_regs.size()) {
+            return false;
+        }
 
-            void operator()(const NodeBinExprDiv* div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
-            }
-
-            // Comparison operators
-            void operator()(const NodeBinExprGt* gt) const {
-                gen.gen_expr(gt->lhs);
-                gen.gen_expr(gt->rhs);
-                gen.pop("rbx");
-                gen.pop("rax");
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    setg al\n";
-                gen.m_output << "    movzx rax, al\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprGe* ge) const {
-                gen.gen_expr(ge->lhs);
-                gen.gen_expr(ge->rhs);
-                gen.pop("rbx");
-                gen.pop("rax");
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    setge al\n";
-                gen.m_output << "    movzx rax, al\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprLt* lt) const {
-                gen.gen_expr(lt->lhs);
-                gen.gen_expr(lt->rhs);
-                gen.pop("rbx");
-                gen.pop("rax");
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    setl al\n";
-                gen.m_output << "    movzx rax, al\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprLe* le) const {
-                gen.gen_expr(le->lhs);
-                gen.gen_expr(le->rhs);
-                gen.pop("rbx");
-                gen.pop("rax");
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    setle al\n";
-                gen.m_output << "    movzx rax, al\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprEqEq* eq_eq) const {
-                gen.gen_expr(eq_eq->lhs);
-                gen.gen_expr(eq_eq->rhs);
-                gen.pop("rbx");
-                gen.pop("rax");
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    sete al\n";
-                gen.m_output << "    movzx rax, al\n";
-                gen.push("rax");
+        m_output << "    ;; if-converted\n";
+        const auto value_to = [&](const NodeExpr* value, size_t reg) {
+            const Label value_label = label(value);
+            if (value->type == Type::f64 && value_label.tile == Tile::constant) {
+                gen_mov_imm(k_expr_regs[reg], value_label.imm);
+            } else if (value->type == Type::f64) {
+                gen_float_to(value, reg);
+                gen_sse("movq", k_expr_regs[reg], k_float_regs[reg]);
+            } else {
+                gen_expr_to(value, reg);
             }
         };
+        for (const Select& select : selects) {
+            value_to(select.kept, select.kept_reg);
+            if (select.taken_reg.has_value()) {
+                value_to(select.taken, select.taken_reg.value());
+            }
+        }
+        // Nothing may clobber the flags from here on
+        std::string cc = "nz";
+        if (const Label cond_label = label(stmt_if->expr); cond_label.tile == Tile::compare) {
+            cc = gen_compare(cond_label, regs);
+        } else {
+            gen_expr_to(stmt_if->expr, regs);
+            m_output << "    test " << k_expr_regs[regs] << ", " << k_expr_regs[regs] << "\n";
+        }
+        for (size_t i = 0; i < targets.size(); i++) {
+            const Select& select = selects[i];
+            std::string source = select.taken_reg.has_value() ? k_expr_regs[select.taken_reg.value()]
+                : select.taken == nullptr ? var_slot(targets[i])
+                : operand(label(select.taken).lhs, Operand::mem);
+            m_output << "    cmov" << (select.negate ? negate_cc(cc) : cc) << " " << k_expr_regs[select.kept_reg] << ", " << source << "\n";
+        }
+        for (size_t i = 0; i < targets.size(); i++) {
+            m_output << "    mov " << var_slot(targets[i]) << ", " << k_expr_regs[selects[i].kept_reg] << "\n";
+        }
+        for (size_t i = 0; i < targets.size(); i++) {
+            set_range(find_var(targets[i]), target_ranges[i]);
+        }
+        return true;
+    }
 
-        BinExprVisitor visitor {.gen = *this};
-        std::visit(visitor, bin_expr->var);
+    // A statement storing a value into a variable: `let x = e;` or `x = e;`
+    struct Def {
+        const NodeStmtLet* let;   // null for an assignment
+        const std::string& name;
+        const NodeExpr* expr;
+    };
+
+    static std::optional<Def> as_def(const NodeStmt* stmt){
+        if (const auto* let = std::get_if<NodeStmtLet*>(&stmt->var)) {
+            return Def {.let = *let, .name = (*let)->ident.value.value(), .expr = (*let)->expr};
+        }
+        if (const auto* assign = std::get_if<NodeStmtAssign*>(&stmt->var)) {
+            return Def {.let = nullptr, .name = (*assign)->ident.value.value(), .expr = (*assign)->expr};
+        }
+        return {};
     }
 
-    // Generate assembly for any expression node
-    void gen_expr(const NodeExpr* expr) {
-        struct ExprVisitor {
-            Generator& gen;
+    // The x / y or x % y an expression consists of
+    static const NodeBinExpr* as_div_or_mod(const NodeExpr* expr){
+        const auto* bin_expr = std::get_if<NodeBinExpr*>(&strip_parens(expr)->var);
+        if (bin_expr == nullptr || expr->type != Type::i64) {
+            return nullptr;
+        }
+        if (std::holds_alternative<NodeBinExprDiv*>((*bin_expr)->var) || std::holds_alternative<NodeBinExprMod*>((*bin_expr)->var)) {
+            return *bin_expr;
+        }
+        return nullptr;
+    }
 
-            void operator()(const NodeTerm* term) const {
-                gen.gen_term(term);
-            }
+    // True if both expressions are the same variable or the same literal
+    static bool is_same_leaf(const NodeExpr* a, const NodeExpr* b){
+        const NodeTermIdent* a_ident = as_ident(a);
+        const NodeTermIdent* b_ident = as_ident(b);
+        if (a_ident != nullptr || b_ident != nullptr) {
+            return a_ident != nullptr && b_ident != nullptr && a_ident->ident.value.value() == b_ident->ident.value.value();
+        }
+        const std::optional<int64_t> a_value = literal_value(a);
+        return a_value.has_value() && a_value == literal_value(b);
+    }
 
-            void operator()(const NodeBinExpr* bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
-            }
+    // Compute `q = x / y;` and `r = x % y;` on adjacent statements (in either
+    // order, each a let or an assignment) with a single division, which
+    // yields both. x and y must be variables or literals the first statement
+    // leaves unchanged.
+    bool try_gen_divmod_pair(const NodeStmt* first_stmt, const NodeStmt* second_stmt){
+        const std::optional<Def> first = as_def(first_stmt);
+        const std::optional<Def> second = as_def(second_stmt);
+        if (!first.has_value() || !second.has_value()) {
+            return false;
+        }
+        const NodeBinExpr* first_op = as_div_or_mod(first->expr);
+        const NodeBinExpr* second_op = as_div_or_mod(second->expr);
+        if (first_op == nullptr || second_op == nullptr || first_op->var.index() == second_op->var.index()) {
+            return false;
+        }
+        const auto operands = [](const NodeBinExpr* bin_expr) {
+            return std::visit([](const auto* bin) { return std::pair<const NodeExpr*, const NodeExpr*>(bin->lhs, bin->rhs); }, bin_expr->var);
         };
+        const auto [x, y] = operands(first_op);
+        const auto [second_x, second_y] = operands(second_op);
+        if (!is_same_leaf(x, second_x) || !is_same_leaf(y, second_y) || is_ident(as_ident(x), first->name) || is_ident(as_ident(y), first->name)
+            || (as_ident(x) == nullptr && !literal_value(x).has_value()) || (as_ident(y) == nullptr && !literal_value(y).has_value())) {
+            return false;
+        }
+        for (const Def* def : {&first.value(), &second.value()}) {
+            if (def->let == nullptr && is_shared(find_var(def->name))) {
+                // Rejected with an error by the assignment itself
+                return false;
+            }
+        }
 
-        ExprVisitor visitor {.gen = *this};
-        std::visit(visitor, expr->var);
+        const Range first_range = range_of(first->expr);
+        const Range second_range = range_of(second->expr);
+        m_output << "    ;; fused / and %\n";
+        gen_divmod(x, y);
+        const bool first_is_div = std::holds_alternative<NodeBinExprDiv*>(first_op->var);
+        store_def(first.value(), k_expr_regs[first_is_div ? 0 : 1], first_range);
+        store_def(second.value(), k_expr_regs[first_is_div ? 1 : 0], second_range);
+        return true;
     }
 
-    // Generate assembly for a scope (block of statements)
-    void gen_scope(const NodeScope* scope){
-        begin_scope();
-        for (const NodeStmt* stmt : scope->stmts){
-            gen_stmt(stmt);
+    // Quotient and remainder of x / y into k_expr_regs[0] and k_expr_regs[1]
+    void gen_divmod(const NodeExpr* x, const NodeExpr* y){
+        const Label divisor = label(y);
+        if (divisor.tile == Tile::constant && is_fast_divisor(divisor.imm)) {
+            gen_expr_to(x, 1);
+            gen_div_const(k_expr_regs[1], divisor.imm, k_expr_regs[0], k_expr_regs[1]);
+            return;
         }
-        end_scope();
+        gen_expr_to(x, 0);
+        std::string rhs;
+        if (divisor.tile == Tile::load) {
+            rhs = operand(y, Operand::mem);
+        } else {
+            gen_expr_to(y, 1);
+            rhs = k_expr_regs[1];
+        }
+        gen_div(x, y, k_expr_regs[0], rhs);
+        m_output << "    mov " << k_expr_regs[0] << ", rax\n";
+        m_output << "    mov " << k_expr_regs[1] << ", rdx\n";
     }
 
-    // Generate code for an if-elif-else chain
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label){
-        struct PredVisitor {
-            Generator& gen;
-            const std::string& end_label;
+    // Store a register into the variable a let or assignment defines
+    void store_def(const Def& def, const std::string& reg, Range range){
+        if (def.let != nullptr) {
+            declare_var(def.let);
+            push(reg);
+            set_range(m_vars.back(), range);
+        } else {
+            Var& var = find_var(def.name);
+            m_output << "    mov " << var_slot(def.name) << ", " << reg << "\n";
+            set_range(var, range);
+        }
+    }
 
-            void operator()(const NodeIfPredElif* elif) const {
-                gen.m_output << "    ;; elif\n";
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
+    // Stack slot operand of a declared variable
+    std::string var_slot(const std::string& name) {
+        const Var& var = find_var(name);
+        std::stringstream offset;
+        if (is_shared(var)) {
+            // Inside a parallel for body, variables of the enclosing code live
+            // in its frame, which r15 points to
+            offset << "QWORD [r15 + " << (m_par_base.value() - var.stack_loc - 1) * 8 << "]";
+        } else {
+            offset << "QWORD [rsp + " << (m_stack_size - var.stack_loc - 1) * 8 << "]";
+        }
+        return offset.str();
+    }
 
-                if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
+    // Look up a declared variable, failing on unknown names. The search runs
+    // from the innermost declaration so reduction copies shadow the shared variable.
+    struct Var;
+    Var& find_var(const std::string& name) {
+        Var* var = m_vars.find(name);
+        if (var == nullptr) {
+            std::cerr << "Undeclared identifier: " << name << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return *var;
+    }
+
+    // Value range analysis. Ranges of live variables are tracked alongside
+    // code generation; the tree is structured, so a single forward pass that
+    // joins at the end of each if-chain is enough.
+
+    // Range of values an expression can take at this program point
+    Range range_of(const NodeExpr* expr) {
+        if (auto it = m_range_cache.find(expr); it != m_range_cache.end()) {
+            return it->second;
+        }
+        // Only integers are tracked
+        if (expr->type == Type::f64) {
+            return Range::full();
+        }
+        if (is_float_compare(expr)) {
+            return {0, 1};
+        }
+        struct RangeVisitor {
+            Generator& gen;
+            Range operator()(const NodeTermIntLit* term_int_lit) const {
+                return Range::constant(std::stoll(term_int_lit->int_lit.value.value()));
+            }
+            Range operator()(const NodeTermIdent* term_ident) const { return gen.find_var(term_ident->ident.value.value()).range; }
+            Range operator()(const NodeTermNeg* term_neg) const { return range_neg((*this)(term_neg->term)); }
+            Range operator()(const NodeTermBitNot* term_bit_not) const { return range_bit_not((*this)(term_bit_not->term)); }
+            Range operator()(const NodeTermParen* term_paren) const { return gen.range_of(term_paren->expr); }
+            Range operator()(const NodeTermRead*) const { return Range::full(); }
+            Range operator()(const NodeTermArg*) const { return Range::full(); }
+            Range operator()(const NodeTermAlloc*) const { return Range::full(); }
+            Range operator()(const NodeTermIndex*) const { return Range::full(); }
+            Range operator()(const NodeTermField* term_field) const {
+                const int bits = field_of(term_field).size * 8;
+                if (bits == 64) {
+                    return Range::full();
                 }
+                return {-(int64_t {1} << (bits - 1)), (int64_t {1} << (bits - 1)) - 1};
             }
+            Range operator()(const NodeTermFloatLit*) const { return Range::full(); }
+            Range operator()(const NodeTermConvert*) const { return Range::full(); }
+            Range operator()(const NodeTermCall*) const { return Range::full(); }
+            Range operator()(const NodeTermPipeline* pipeline) const {
+                return pipeline->count ? Range {0, INT64_MAX} : Range::full();
+            }
+            Range operator()(const NodeTermIntrinsic* term_intrinsic) const {
+                if (!intrinsic_takes_arg(term_intrinsic->op)) {
+                    return Range::full();
+                }
+                const Range arg = gen.range_of(term_intrinsic->arg);
+                if (arg.is_constant()) {
+                    return Range::constant(eval_intrinsic(term_intrinsic->op, arg.lo));
+                }
+                return term_intrinsic->op == Intrinsic::bswap ? Range::full() : Range {0, 64};
+            }
+            Range operator()(const NodeTerm* term) const { return std::visit(*this, term->var); }
+            Range operator()(const NodeBinExprAdd* add) const { return range_add(gen.range_of(add->lhs), gen.range_of(add->rhs)); }
+            Range operator()(const NodeBinExprSub* sub) const { return range_sub(gen.range_of(sub->lhs), gen.range_of(sub->rhs)); }
+            Range operator()(const NodeBinExprMulti* multi) const { return range_mul(gen.range_of(multi->lhs), gen.range_of(multi->rhs)); }
+            Range operator()(const NodeBinExprDiv* div) const { return range_div(gen.range_of(div->lhs), gen.range_of(div->rhs)); }
+            Range operator()(const NodeBinExprMod* mod) const { return range_mod(gen.range_of(mod->lhs), gen.range_of(mod->rhs)); }
+            Range operator()(const NodeBinExprBitAnd* bit_and) const { return range_bit_and(gen.range_of(bit_and->lhs), gen.range_of(bit_and->rhs)); }
+            Range operator()(const NodeBinExprBitOr* bit_or) const { return range_bit_or(gen.range_of(bit_or->lhs), gen.range_of(bit_or->rhs)); }
+            Range operator()(const NodeBinExprBitXor* bit_xor) const { return range_bit_or(gen.range_of(bit_xor->lhs), gen.range_of(bit_xor->rhs)); }
+            Range operator()(const NodeBinExprShl* shl) const { return range_shl(gen.range_of(shl->lhs), gen.range_of(shl->rhs)); }
+            Range operator()(const NodeBinExprShr* shr) const { return range_shr(gen.range_of(shr->lhs), gen.range_of(shr->rhs)); }
+            Range operator()(const NodeBinExprGt* gt) const { return range_of_truth(range_less(gen.range_of(gt->rhs), gen.range_of(gt->lhs))); }
+            Range operator()(const NodeBinExprLt* lt) const { return range_of_truth(range_less(gen.range_of(lt->lhs), gen.range_of(lt->rhs))); }
+            Range operator()(const NodeBinExprGe* ge) const { return range_of_truth(negate(range_less(gen.range_of(ge->lhs), gen.range_of(ge->rhs)))); }
+            Range operator()(const NodeBinExprLe* le) const { return range_of_truth(negate(range_less(gen.range_of(le->rhs), gen.range_of(le->lhs)))); }
+            Range operator()(const NodeBinExprEqEq* eq_eq) const { return range_of_truth(range_equal(gen.range_of(eq_eq->lhs), gen.range_of(eq_eq->rhs))); }
+            Range operator()(const NodeBinExpr* bin_expr) const { return std::visit(*this, bin_expr->var); }
+            static std::optional<bool> negate(std::optional<bool> truth) {
+                if (truth.has_value()) return !truth.value();
+                return {};
+            }
+        };
+        const Range range = std::visit(RangeVisitor {.gen = *this}, expr->var);
+        m_range_cache.emplace(expr, range);
+        return range;
+    }
 
-            void operator()(const NodeIfPredElse* else_) const {
-                gen.gen_scope(else_->scope);
+    // Whether a condition is known to be always true or always false
+    std::optional<bool> truth_of(const NodeExpr* expr) {
+        if (!is_speculatable(expr)) {
+            return {};
+        }
+        const Range range = range_of(expr);
+        if (!range.contains(0)) return true;
+        if (range.is_constant()) return false;
+        return {};
+    }
+
+    // Narrow variable ranges knowing that `cond` evaluated to `taken`
+    void refine_ranges(const NodeExpr* cond, bool taken) {
+        while (const auto* term = std::get_if<NodeTerm*>(&cond->var)) {
+            if (const auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                cond = (*paren)->expr;
+                continue;
+            }
+            if (const auto* ident = std::get_if<NodeTermIdent*>(&(*term)->var)) {
+                Var& var = find_var((*ident)->ident.value.value());
+                set_range(var, taken ? exclude(var.range, 0) : range_meet(var.range, Range::constant(0)));
+            }
+            return;
+        }
+
+        enum class Cmp { lt, le, gt, ge, eq, ne };
+        const auto& bin_expr = std::get<NodeBinExpr*>(cond->var)->var;
+        Cmp cmp;
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+        if (const auto* lt = std::get_if<NodeBinExprLt*>(&bin_expr)) { cmp = taken ? Cmp::lt : Cmp::ge; lhs = (*lt)->lhs; rhs = (*lt)->rhs; }
+        else if (const auto* le = std::get_if<NodeBinExprLe*>(&bin_expr)) { cmp = taken ? Cmp::le : Cmp::gt; lhs = (*le)->lhs; rhs = (*le)->rhs; }
+        else if (const auto* gt = std::get_if<NodeBinExprGt*>(&bin_expr)) { cmp = taken ? Cmp::gt : Cmp::le; lhs = (*gt)->lhs; rhs = (*gt)->rhs; }
+        else if (const auto* ge = std::get_if<NodeBinExprGe*>(&bin_expr)) { cmp = taken ? Cmp::ge : Cmp::lt; lhs = (*ge)->lhs; rhs = (*ge)->rhs; }
+        else if (const auto* eq_eq = std::get_if<NodeBinExprEqEq*>(&bin_expr)) { cmp = taken ? Cmp::eq : Cmp::ne; lhs = (*eq_eq)->lhs; rhs = (*eq_eq)->rhs; }
+        else return;
+        if (lhs->type == Type::f64) {
+            return;
+        }
+
+        const auto constrain = [](Range var, Cmp cmp, Range other) {
+            switch (cmp) {
+            case Cmp::lt: return other.hi == other.lo && other.hi == INT64_MIN ? Range {1, 0} : range_meet(var, {INT64_MIN, other.hi - 1});
+            case Cmp::le: return range_meet(var, {INT64_MIN, other.hi});
+            case Cmp::gt: return other.lo == INT64_MAX ? Range {1, 0} : range_meet(var, {other.lo + 1, INT64_MAX});
+            case Cmp::ge: return range_meet(var, {other.lo, INT64_MAX});
+            case Cmp::eq: return range_meet(var, other);
+            case Cmp::ne: return other.is_constant() ? exclude(var, other.lo) : var;
+            }
+            return var;
+        };
+        const auto flip = [](Cmp cmp) {
+            switch (cmp) {
+            case Cmp::lt: return Cmp::gt;
+            case Cmp::le: return Cmp::ge;
+            case Cmp::gt: return Cmp::lt;
+            case Cmp::ge: return Cmp::le;
+            default: return cmp;
             }
         };
 
-        PredVisitor visitor{.gen = *this, .end_label = end_label};
-        std::visit(visitor, pred->var);
+        const Range lhs_range = range_of(lhs);
+        const Range rhs_range = range_of(rhs);
+        if (const NodeTermIdent* ident = as_ident(lhs)) {
+            Var& var = find_var(ident->ident.value.value());
+            set_range(var, constrain(var.range, cmp, rhs_range));
+        }
+        if (const NodeTermIdent* ident = as_ident(rhs)) {
+            Var& var = find_var(ident->ident.value.value());
+            set_range(var, constrain(var.range, flip(cmp), lhs_range));
+        }
     }
 
-    // Generate assembly for a statement node
-    void gen_stmt(const NodeStmt* stmt) {
-        struct StmtVisitor {
-            Generator& gen;
+    // Remove a value from a range when it sits on one of its ends
+    static Range exclude(Range range, int64_t value) {
+        if (range.is_constant() && range.lo == value) return {1, 0};
+        if (range.lo == value) range.lo++;
+        else if (range.hi == value) range.hi--;
+        return range;
+    }
 
-            // Exit program with value
-            void operator()(const NodeStmtExit* stmt_exit) const {
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
+    // The identifier an expression consists of, looking through parentheses
+    static const NodeTermIdent* as_ident(const NodeExpr* expr) {
+        while (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (const auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                expr = (*paren)->expr;
+                continue;
+            }
+            if (const auto* ident = std::get_if<NodeTermIdent*>(&(*term)->var)) {
+                return *ident;
             }
+            return nullptr;
+        }
+        return nullptr;
+    }
 
-            // Variable declaration (let)
-            void operator()(const NodeStmtLet* stmt_let) const {
-                auto it = std::find_if(
-                    gen.m_vars.cbegin(), gen.m_vars.cend(),
-                    [&](const Var& var) { return var.name == stmt_let->ident.value.value(); });
+    void set_range(Var& var, Range range) {
+        if (!m_range_frames.empty()) {
+            m_range_frames.back().try_emplace(m_vars.index_of(var), var.range);
+        }
+        var.range = range;
+        m_range_cache.clear();
+        m_label_cache.clear();
+    }
 
-                if (it != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
+    // A range frame covers one if-chain or parallel loop body and records the
+    // range every variable it changes had when it was opened, so snapshots,
+    // restores and joins inside it only visit those variables instead of all
+    // that are live. Snapshots are taken between arms, where the same
+    // variables are live as when the frame was opened; positions past them
+    // belong to locals of arms that have ended.
+    void open_range_frame() {
+        m_range_frames.emplace_back();
+    }
 
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size});
-                gen.gen_expr(stmt_let->expr); 
+    void close_range_frame() {
+        RangeEnv frame = std::move(m_range_frames.back());
+        m_range_frames.pop_back();
+        if (!m_range_frames.empty()) {
+            for (const auto& [index, original] : frame) {
+                m_range_frames.back().try_emplace(index, original);
             }
+        }
+    }
 
-            // Assignment (x = ...)
-            void operator()(const NodeStmtAssign* stmt_assign) const {
-                auto it = std::find_if(gen.m_vars.begin(), gen.m_vars.end(),
-                    [&](const Var& var) { return var.name == stmt_assign->ident.value.value(); });
+    RangeEnv snapshot_ranges() const {
+        RangeEnv env;
+        for (const auto& [index, original] : m_range_frames.back()) {
+            if (index < m_vars.size()) {
+                env.emplace(index, m_vars[index].range);
+            }
+        }
+        return env;
+    }
 
-                if (it == gen.m_vars.end()){
-                    std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << "\n";
-                    exit(EXIT_FAILURE);
-                }
+    // Return to a snapshot of the current frame; variables it does not hold
+    // get back the range they had when the frame was opened
+    void restore_ranges(const RangeEnv& env) {
+        for (const auto& [index, original] : m_range_frames.back()) {
+            if (index < m_vars.size()) {
+                const auto it = env.find(index);
+                m_vars[index].range = it != env.end() ? it->second : original;
+            }
+        }
+        m_range_cache.clear();
+        m_label_cache.clear();
+    }
 
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
+    // Merge the variable ranges flowing out of several arms
+    RangeEnv join_envs(const std::vector<RangeEnv>& envs) const {
+        RangeEnv joined;
+        for (const auto& [index, original] : m_range_frames.back()) {
+            if (index >= m_vars.size()) {
+                continue;
             }
+            const auto range_in = [&](const RangeEnv& env) {
+                const auto it = env.find(index);
+                return it != env.end() ? it->second : original;
+            };
+            Range range = range_in(envs.front());
+            for (const RangeEnv& env : envs) {
+                range = range_join(range, range_in(env));
+            }
+            joined.emplace(index, range);
+        }
+        return joined;
+    }
 
-            // Nested scope
+    // Names of the variables a statement may assign
+    static void collect_assigned(const NodeStmt* stmt, std::vector<std::string>& names){
+        struct AssignedVisitor {
+            std::vector<std::string>& names;
+            void operator()(const NodeStmtAssign* assign) const { names.push_back(assign->ident.value.value()); }
             void operator()(const NodeScope* scope) const {
-                gen.m_output << "    ;; scope\n";
-                gen.gen_scope(scope);
-                gen.m_output << "    ;; /scope\n";
+                for (const NodeStmt* stmt : scope->stmts) collect_assigned(stmt, names);
             }
-
-            // If statement
-            void operator()(const NodeStmtIf* stmt_if) {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-
-                if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
-                } else {
-                    gen.m_output << label << ":\n";
+            void operator()(const NodeStmtIf* stmt_if) const {
+                (*this)(stmt_if->scope);
+                for (auto pred = stmt_if->pred; pred.has_value();) {
+                    if (const auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        (*this)((*elif)->scope);
+                        pred = (*elif)->pred;
+                    } else {
+                        (*this)(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        pred.reset();
+                    }
                 }
             }
+            void operator()(const NodeStmtFor* stmt_for) const {
+                collect_assigned(stmt_for->step, names);
+                (*this)(stmt_for->scope);
+            }
+            void operator()(const NodeStmtParallelFor* stmt_parallel) const {
+                for (const NodeReduction& reduction : stmt_parallel->reductions) names.push_back(reduction.ident.value.value());
+                (*this)(stmt_parallel->loop);
+            }
+            void operator()(const NodeStmtExit*) const {}
+            void operator()(const NodeStmtLet*) const {}
+            void operator()(const NodeStmtPrint*) const {}
+            void operator()(const NodeStmtIndexAssign*) const {}
+            void operator()(const NodeStmtFieldAssign*) const {}
+            void operator()(const NodeStmtStruct*) const {}
+            void operator()(const NodeStmtAsm* stmt_asm) const {
+                for (const NodeAsmBinding& binding : stmt_asm->outputs) names.push_back(binding.ident.value.value());
+            }
+            void operator()(const NodeStmtExtern*) const {}
+            void operator()(const NodeStmtCall*) const {}
+            void operator()(const NodeStmtFn*) const {}
+            void operator()(const NodeStmtReturn*) const {}
+        };
+        std::visit(AssignedVisitor {.names = names}, stmt->var);
+    }
 
-            // Print integer value
-            void operator()(const NodeStmtPrint* stmt_print) const {
-                gen.gen_expr(stmt_print->expr);
-                gen.pop("rdi");
-                gen.m_output << "    call print_int\n";
+    // Forget what is known about variables a loop body may change, since the
+    // body is generated once but runs with the values of every iteration
+    void widen_ranges(const std::vector<std::string>& assigned){
+        for (const std::string& name : assigned) {
+            m_vars.for_each_named(name, [&](Var& var) { set_range(var, Range::full()); });
+        }
+    }
+
+    // Generate a sequential for loop
+    void gen_for(const NodeStmtFor* stmt_for){
+        std::vector<std::string> assigned;
+        collect_assigned(stmt_for->step, assigned);
+        for (const NodeStmt* stmt : stmt_for->scope->stmts) {
+            collect_assigned(stmt, assigned);
+        }
+
+        m_output << "    ;; for\n";
+        begin_scope();
+        gen_stmt(stmt_for->init);
+        widen_ranges(assigned);
+        const std::string loop_label = create_label();
+        const std::string end_label = create_label();
+        m_output << loop_label << ":\n";
+        gen_jump_if_false(stmt_for->cond, end_label);
+        refine_ranges(stmt_for->cond, true);
+        gen_scope(stmt_for->scope);
+        gen_stmt(stmt_for->step);
+        m_output << "    jmp " << loop_label << "\n";
+        m_output << end_label << ":\n";
+        widen_ranges(assigned);
+        refine_ranges(stmt_for->cond, false);
+        end_scope();
+        m_output << "    ;; /for\n";
+    }
+
+    // Generate a parallel for. The body becomes an out-of-line function
+    // par_bodyN(rdi = first iteration, rsi = end iteration) that the runtime
+    // (par_for) calls from every pool thread on chunks of the iteration space.
+    // Variables of the enclosing code are reached through r15, which holds
+    // the enclosing rsp; each reduction gets a private copy that is combined
+    // into the shared variable with an atomic operation when the chunk ends.
+    void gen_parallel_for(const NodeStmtParallelFor* stmt_parallel){
+        const NodeStmtFor* loop = stmt_parallel->loop;
+        const auto* init = std::get<NodeStmtLet*>(loop->init->var);
+        const std::string& index_name = init->ident.value.value();
+
+        // Only `i < end` / `i <= end` with `i = i + step` can be split up front
+        const auto fail = [&](const std::string& msg) {
+            std::cerr << "parallel for on line " << init->ident.line << ": " << msg << std::endl;
+            exit(EXIT_FAILURE);
+        };
+        const NodeExpr* bound = nullptr;
+        bool inclusive = false;
+        if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&loop->cond->var)) {
+            if (const auto* lt = std::get_if<NodeBinExprLt*>(&(*bin_expr)->var); lt && is_ident(as_ident((*lt)->lhs), index_name)) {
+                bound = (*lt)->rhs;
+            } else if (const auto* le = std::get_if<NodeBinExprLe*>(&(*bin_expr)->var); le && is_ident(as_ident((*le)->lhs), index_name)) {
+                bound = (*le)->rhs;
+                inclusive = true;
+            }
+        }
+        if (bound == nullptr || expr_reads(bound, index_name)) {
+            fail("condition must be `" + index_name + " < bound` or `" + index_name + " <= bound`");
+        }
+        const auto* step = std::get<NodeStmtAssign*>(loop->step->var);
+        int64_t stride = 0;
+        if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&step->expr->var);
+            bin_expr && step->ident.value.value() == index_name) {
+            if (const auto* add = std::get_if<NodeBinExprAdd*>(&(*bin_expr)->var)) {
+                if (is_ident(as_ident((*add)->lhs), index_name)) stride = literal_value((*add)->rhs).value_or(0);
+                else if (is_ident(as_ident((*add)->rhs), index_name)) stride = literal_value((*add)->lhs).value_or(0);
+            }
+        }
+        if (stride <= 0 || stride > INT32_MAX) {
+            fail("step must be `" + index_name + " = " + index_name + " + <positive literal>`");
+        }
+        std::vector<std::string> assigned;
+        for (const NodeStmt* stmt : loop->scope->stmts) {
+            collect_assigned(stmt, assigned);
+        }
+        if (std::find(assigned.begin(), assigned.end(), index_name) != assigned.end()) {
+            fail("the loop variable cannot be assigned in the body");
+        }
+        for (const NodeReduction& reduction : stmt_parallel->reductions) {
+            find_var(reduction.ident.value.value());
+        }
+
+        // Evaluate the bounds once and hand the iteration count to the runtime
+        require(rt_parallel);
+        m_output << "    ;; parallel for\n";
+        gen_expr(init->expr);
+        const size_t start_loc = m_stack_size - 1;
+        gen_expr_to(bound, 0);
+        m_output << "    mov rsi, " << k_expr_regs[0] << "\n";
+        m_output << "    sub rsi, QWORD [rsp]\n";
+        if (const int64_t round_up = inclusive ? stride : stride - 1; round_up != 0) {
+            m_output << "    add rsi, " << round_up << "\n";
+        }
+        if (stride != 1) {
+            m_output << "    mov rax, rsi\n";
+            m_output << "    cqo\n";
+            m_output << "    mov rcx, " << stride << "\n";
+            m_output << "    idiv rcx\n";
+            m_output << "    mov rsi, rax\n";
+        }
+        std::stringstream body_name;
+        body_name << "par_body" << m_par_body_count++;
+        m_output << "    mov rdi, " << body_name.str() << "\n";
+        m_output << "    mov rdx, rsp\n";
+        m_output << "    mov ecx, " << (stmt_parallel->static_schedule ? 1 : 0) << "\n";
+        // par_for follows the System V ABI, which expects an aligned stack
+        const bool pad = !stack_aligned();
+        if (pad) {
+            m_output << "    sub rsp, 8\n";
+        }
+        m_output << "    call par_for\n";
+        if (pad) {
+            m_output << "    add rsp, 8\n";
+        }
+
+        // The body function, generated into its own stream
+        std::stringstream body;
+        std::swap(body, m_output);
+        const size_t outer_stack_size = m_stack_size;
+        open_range_frame();
+        const RangeEnv entry = snapshot_ranges();
+        m_par_base = m_stack_size;
+        m_output << "\n" << body_name.str() << ":\n";
+        mark_line();
+        m_output << "    mov rax, QWORD [r15 + " << (outer_stack_size - start_loc - 1) * 8 << "]\n";
+        if (stride != 1) {
+            m_output << "    imul rdi, rdi, " << stride << "\n";
+            m_output << "    imul rsi, rsi, " << stride << "\n";
+        }
+        m_output << "    add rdi, rax\n";
+        m_output << "    add rsi, rax\n";
+        begin_scope();
+        push("rsi");
+        const size_t end_loc = m_stack_size - 1;
+        push("rdi");
+        m_vars.push_back({.name = index_name, .stack_loc = m_stack_size - 1});
+        for (const NodeReduction& reduction : stmt_parallel->reductions) {
+            // The identity of the operation: 0 or 1 (0.0 or 1.0 for f64)
+            const Type type = find_var(reduction.ident.value.value()).type;
+            const int64_t one = type == Type::f64 ? std::bit_cast<int64_t>(1.0) : 1;
+            m_output << "    mov rax, " << (reduction.op == TokenType::plus ? 0 : one) << "\n";
+            push("rax");
+            m_vars.push_back({.name = reduction.ident.value.value(), .stack_loc = m_stack_size - 1, .type = type});
+        }
+        widen_ranges(assigned);
+        const std::string loop_label = create_label();
+        const std::string end_label = create_label();
+        m_output << loop_label << ":\n";
+        m_output << "    mov rax, " << var_slot(index_name) << "\n";
+        m_output << "    cmp rax, QWORD [rsp + " << (m_stack_size - end_loc - 1) * 8 << "]\n";
+        m_output << "    jge " << end_label << "\n";
+        gen_scope(loop->scope);
+        m_output << "    add " << var_slot(index_name) << ", " << stride << "\n";
+        m_output << "    jmp " << loop_label << "\n";
+        m_output << end_label << ":\n";
+        for (const NodeReduction& reduction : stmt_parallel->reductions) {
+            const std::string& name = reduction.ident.value.value();
+            const size_t shared_loc = m_vars.find_outermost(name)->stack_loc;
+            const std::string shared = "QWORD [r15 + " + std::to_string((outer_stack_size - shared_loc - 1) * 8) + "]";
+            m_output << "    mov rcx, " << var_slot(name) << "\n";
+            if (find_var(name).type == Type::f64) {
+                // No atomic float arithmetic: retry until no other thread changed it
+                const std::string retry_label = create_label();
+                m_output << "    mov rax, " << shared << "\n";
+                m_output << retry_label << ":\n";
+                gen_sse("movq", k_float_scratch, "rax");
+                gen_sse("movq", "xmm0", "rcx");
+                gen_sse(reduction.op == TokenType::plus ? "addsd" : "mulsd", k_float_scratch, "xmm0", true);
+                gen_sse("movq", "rdx", k_float_scratch);
+                m_output << "    lock cmpxchg " << shared << ", rdx\n";
+                m_output << "    jne " << retry_label << "\n";
+            } else if (reduction.op == TokenType::plus) {
+                m_output << "    lock add " << shared << ", rcx\n";
+            } else {
+                const std::string retry_label = create_label();
+                m_output << "    mov rax, " << shared << "\n";
+                m_output << retry_label << ":\n";
+                m_output << "    mov rdx, rax\n";
+                m_output << "    imul rdx, rcx\n";
+                m_output << "    lock cmpxchg " << shared << ", rdx\n";
+                m_output << "    jne " << retry_label << "\n";
+            }
+        }
+        end_scope();
+        m_output << "    add rsp, 8\n";
+        m_output << "    ret\n";
+        m_par_base.reset();
+        m_stack_size = outer_stack_size;
+        std::swap(body, m_output);
+        m_functions << body.str();
+
+        restore_ranges(entry);
+        close_range_frame();
+        for (const NodeReduction& reduction : stmt_parallel->reductions) {
+            set_range(find_var(reduction.ident.value.value()), Range::full());
+        }
+        m_output << "    add rsp, 8\n";
+        m_stack_size--;
+        m_output << "    ;; /parallel for\n";
+    }
+
+    // Inline assembly. Between statements every variable lives in its stack
+    // slot and no register holds anything, so the inputs are loaded into
+    // their registers, the instructions are pasted as written and the outputs
+    // are stored back. Clobbers need no saving except r15, which holds the
+    // enclosing frame inside a parallel for body. The instructions must
+    // leave rsp as they found it.
+    void gen_asm(const NodeStmtAsm* stmt_asm){
+        const auto fail = [&](const std::string& msg) {
+            std::cerr << "asm on line " << stmt_asm->text.line << ": " << msg << std::endl;
+            exit(EXIT_FAILURE);
+        };
+        const auto check_reg = [&](const std::string& reg) {
+            if (reg == "rsp") {
+                fail("rsp addresses the variables and cannot be bound or clobbered");
+            }
+            if (!is_asm_gp_reg(reg) && !is_asm_xmm_reg(reg)) {
+                fail("unknown register " + reg);
+            }
+        };
+        const auto check_bindings = [&](const std::vector<NodeAsmBinding>& bindings) {
+            for (size_t i = 0; i < bindings.size(); i++) {
+                const std::string& reg = bindings[i].reg.value.value();
+                const Var& var = find_var(bindings[i].ident.value.value());
+                check_reg(reg);
+                if (reg == "r15" && m_par_base.has_value()) {
+                    fail("r15 holds the enclosing frame inside a parallel for and cannot be bound");
+                }
+                if ((var.type == Type::f64) != is_asm_xmm_reg(reg)) {
+                    fail(to_string(var.type) + " variable " + var.name + " cannot be bound to " + reg);
+                }
+                for (size_t j = 0; j < i; j++) {
+                    if (bindings[j].reg.value.value() == reg) fail("register " + reg + " is bound twice");
+                }
             }
         };
+        check_bindings(stmt_asm->inputs);
+        check_bindings(stmt_asm->outputs);
+        bool save_r15 = false;
+        for (const Token& clobber : stmt_asm->clobbers) {
+            check_reg(clobber.value.value());
+            save_r15 = save_r15 || (clobber.value.value() == "r15" && m_par_base.has_value());
+        }
+        for (const NodeAsmBinding& binding : stmt_asm->outputs) {
+            const Var& var = find_var(binding.ident.value.value());
+            if (is_shared(var)) {
+                fail("cannot write shared variable " + var.name + " inside a parallel for; use a reduce clause");
+            }
+        }
 
-        StmtVisitor visitor {.gen = *this};
-        std::visit(visitor, stmt->var);
+        m_output << "    ;; asm\n";
+        for (const NodeAsmBinding& binding : stmt_asm->inputs) {
+            const std::string slot = var_slot(binding.ident.value.value());
+            if (is_asm_xmm_reg(binding.reg.value.value())) {
+                gen_sse("movsd", binding.reg.value.value(), slot);
+            } else {
+                m_output << "    mov " << binding.reg.value.value() << ", " << slot << "\n";
+            }
+        }
+        if (save_r15) {
+            m_output << "    push r15\n";
+        }
+        std::stringstream text(stmt_asm->text.value.value());
+        for (std::string line; std::getline(text, line);) {
+            const size_t first = line.find_first_not_of(" \t\r");
+            if (first != std::string::npos) {
+                m_output << "    " << line.substr(first, line.find_last_not_of(" \t\r") - first + 1) << "\n";
+            }
+        }
+        if (save_r15) {
+            m_output << "    pop r15\n";
+        }
+        for (const NodeAsmBinding& binding : stmt_asm->outputs) {
+            const std::string slot = var_slot(binding.ident.value.value());
+            if (is_asm_xmm_reg(binding.reg.value.value())) {
+                gen_sse("movsd", slot, binding.reg.value.value());
+            } else {
+                m_output << "    mov " << slot << ", " << binding.reg.value.value() << "\n";
+            }
+            set_range(find_var(binding.ident.value.value()), Range::full());
+        }
+        m_output << "    ;; /asm\n";
     }
 
-    // Generate the full program's assembly
-    std::string gen_prog() {
-        m_output << "global _start\n_start:\n";
-        for (const NodeStmt* stmt : m_prog.stmts){
-            gen_stmt(stmt);
-        }
-
-        // Default exit if not explicitly exited
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall";
-
-        // Print integer routine
-        m_output << R"(
-            print_int:
-                push rbp
-                mov rbp, rsp
-                sub rsp, 32
-                ; Check if number is negative
-                test rdi, rdi
-                jns .positive
-                ; Handle negative number
-                mov byte [rsp], '-'
-                mov rax, 1
-                mov rsi, rsp
-                mov rdx, 1
-                push rdi
-                mov rdi, 1
-                syscall
-                pop rdi
-                neg rdi
-            .positive:
-                test rdi, rdi
-                jnz .non_zero
-                mov byte [rsp], '0'
-                mov rsi, rsp
-                mov rdx, 1
-                jmp .print
-            .non_zero:
-                mov rax, rdi
-                lea rsi, [rsp+31]
-                mov rcx, 0
-            .convert_loop:
-                xor rdx, rdx
-                mov r10, 10
-                div r10
-                add dl, '0'
-                dec rsi
-                mov [rsi], dl
-                inc rcx
-                test rax, rax
-                jnz .convert_loop
-            .print:
-                mov rax, 1
-                mov rdi, 1
-                mov rdx, rcx
-                syscall
-
-                ; Print newline
-                mov byte [rsp], 10
-                mov rax, 1
-                mov rdi, 1
-                mov rsi, rsp
-                mov rdx, 1
-                syscall
-
-                mov rsp, rbp
-                pop rbp
-                ret
-            )";
-
-        return m_output.str();
+    static bool is_asm_gp_reg(const std::string& reg) {
+        static constexpr std::array<const char*, 16> regs {"rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+                                                          "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+        return std::find(regs.begin(), regs.end(), reg) != regs.end();
     }
 
-private:
-    // Utility: push register or value onto stack
-    void push(const std::string& reg){
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
+    static bool is_asm_xmm_reg(const std::string& reg) {
+        for (int i = 0; i < 16; i++) {
+            if (reg == "xmm" + std::to_string(i)) return true;
+        }
+        return false;
     }
 
-    // Utility: pop into a register
-    void pop(const std::string& reg){
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+    // True for variables that belong to the code enclosing the parallel for
+    // body being generated
+    bool is_shared(const Var& var) const {
+        return m_par_base.has_value() && var.stack_loc < m_par_base.value();
     }
 
-    // Begin a new variable scope
-    void begin_scope(){
-        m_scopes.push_back(m_vars.size());
+    // Reject constructs whose runtime support is not thread-safe
+    void check_not_parallel(const std::string& what) const {
+        if (m_par_base.has_value()) {
+            std::cerr << what << " cannot be used inside a parallel for" << std::endl;
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // End current scope and deallocate local variables
-    void end_scope(){
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-        m_stack_size -= pop_count;
-        for (int i = 0; i < pop_count; i++){
-            m_vars.pop_back();
+    static bool is_ident(const NodeTermIdent* ident, const std::string& name) {
+        return ident != nullptr && ident->ident.value.value() == name;
+    }
+
+    // Value of an integer literal expression, looking through parentheses
+    static std::optional<int64_t> literal_value(const NodeExpr* expr) {
+        while (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (const auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                expr = (*paren)->expr;
+                continue;
+            }
+            if (const auto* lit = std::get_if<NodeTermIntLit*>(&(*term)->var)) {
+                return std::stoll((*lit)->int_lit.value.value());
+            }
+            return {};
         }
-        m_scopes.pop_back();
+        return {};
     }
 
     // Generate a unique label for control flow
@@ -426,13 +3882,66 @@ private:
     struct Var {
         std::string name;
         size_t stack_loc;
+        Range range;
+        Type type = Type::i64;
     };
 
+    // If-conversion limits: at most this many assigned variables and this
+    // many estimated instructions across both arms
+    static constexpr size_t k_if_convert_max_vars = 4;
+    static constexpr size_t k_if_convert_max_cost = 12;
+
+    // @memo tables: entries without an explicit size, entries probed before
+    // one is overwritten, the largest table computed at compile time and the
+    // Interpreter steps all such tables may take
+    static constexpr int64_t k_memo_default_entries = 4096;
+    static constexpr int k_memo_probes = 8;
+    static constexpr uint64_t k_memo_table_max_entries = 4096;
+    static constexpr uint64_t k_memo_table_steps = 10'000'000;
+
+    // Registers expressions are evaluated in. They are callee-saved, so the
+    // runtime routines called inside an expression leave them intact.
+    static constexpr std::array<const char*, 4> k_expr_regs {"rbx", "r12", "r13", "r14"};
+
+    // Registers f64 expressions are evaluated in, paired index by index with
+    // k_expr_regs. The runtime routines called inside expressions leave the
+    // SSE registers alone. The scratch register holds spilled operands and
+    // constants.
+    static constexpr std::array<const char*, 4> k_float_regs {"xmm0", "xmm1", "xmm2", "xmm3"};
+    static constexpr const char* k_float_scratch = "xmm15";
+
     // Internal state
     const NodeProg m_prog;
+    const Target m_target;
+    Superoptimizer* const m_superopt;
     std::stringstream m_output;
     size_t m_stack_size = 0;
-    std::vector<Var> m_vars;
+    VarStack<Var> m_vars;
     std::vector<size_t> m_scopes;
     int m_label_count = 0;
+    std::vector<RangeEnv> m_range_frames;
+    std::unordered_map<const NodeExpr*, Range> m_range_cache;
+    std::unordered_map<const NodeExpr*, Label> m_label_cache;
+    std::vector<const RuntimeRoutine*> m_runtime;
+    std::stringstream m_functions;            // out-of-line code such as parallel for bodies
+    std::stringstream m_rodata;               // constants read by vectorized loops and @memo tables
+    int m_vector_constants = 0;
+    std::stringstream m_bss;                  // @memo hash tables
+    std::stringstream m_cold;                 // unlikely paths, after all other code
+    GenOptions m_options;
+    std::vector<int> m_lines;                 // lines of the statements being generated, innermost last
+    size_t m_line_marks = 1;                  // marker 0 is the entry point's
+    const NodeIfPredElif* m_hoisted_elif = nullptr;   // elif already tested by try_gen_hoisted_elif
+    size_t m_fn_frame = 0;                    // stack size below the locals of the fn being generated
+    std::string m_fn_return_label;            // its exit path
+    struct MemoTable {
+        std::string label;             // empty until a lookup is generated
+        std::vector<int64_t> values;   // row-major, empty if the fn could not be evaluated
+    };
+    std::map<std::pair<const NodeStmtFn*, std::vector<std::pair<int64_t, int64_t>>>, MemoTable> m_memo_tables;   // by argument ranges
+    int m_memo_table_count = 0;
+    std::optional<Interpreter> m_memo_interpreter;   // evaluates the precomputed tables
+    std::map<std::string, const NodeStmtExtern*> m_externs;   // declared C functions
+    std::optional<size_t> m_par_base;         // stack size of the code enclosing the parallel for body being generated
+    int m_par_body_count = 0;
 };
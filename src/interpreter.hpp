@@ -0,0 +1,547 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "./parser.hpp"
+
+/**
+ * Evaluates a whole program at compile time, mirroring the semantics of the
+ * generated code (64-bit wraparound arithmetic, unsigned division and
+ * remainder, shift counts taken mod 64, signed comparisons). Used to precompute the output of programs that do not depend
+ * on runtime input.
+ */
+class Interpreter {
+public:
+    /**
+     * What a program that ran to completion printed and its exit status.
+     */
+    struct Result {
+        std::string output;
+        int exit_code = 0;
+    };
+
+    inline Interpreter(const NodeProg& prog, uint64_t step_budget)
+        : m_prog(prog)
+        , m_steps_left(step_budget)
+    {
+    }
+
+    /**
+     * Runs the program. Returns nothing if it reads input, exceeds the step
+     * budget or would fault at runtime; the program must then be compiled normally.
+     */
+    std::optional<Result> run() {
+        try {
+            for (const NodeStmt* stmt : m_prog.stmts) {
+                exec_stmt(stmt);
+            }
+        } catch (const Exit& exit) {
+            m_result.exit_code = exit.code;
+        } catch (const Unsupported&) {
+            return {};
+        }
+        return m_result;
+    }
+
+    /**
+     * Evaluates a call of a pure fn, for the lookup tables the Generator
+     * builds for @memo fns. Returns nothing if the call would fault or
+     * exceeds what is left of the step budget, which all calls share.
+     */
+    std::optional<int64_t> call(const NodeStmtFn* fn, const std::vector<int64_t>& args) {
+        std::vector<Value> values;
+        for (const int64_t arg : args) {
+            values.push_back({.value = arg});
+        }
+        try {
+            return observe(call_fn(fn, values));
+        } catch (const Unsupported&) {
+            return {};
+        }
+    }
+
+private:
+    // A runtime value. Addresses returned by alloc() differ between this
+    // interpreter and the real process, so values derived from them are
+    // tracked and must never become observable.
+    struct Value {
+        int64_t value = 0;
+        bool address = false;
+    };
+
+    struct Exit {
+        int code;
+    };
+
+    // Unwinds an fn body to its call
+    struct Return {
+        Value value;
+    };
+
+    // Thrown when the program cannot be evaluated ahead of time
+    struct Unsupported {
+    };
+
+    // Charge one step against the budget
+    void step() {
+        if (m_steps_left == 0) {
+            throw Unsupported {};
+        }
+        m_steps_left--;
+    }
+
+    static Value combine(const Value& lhs, const Value& rhs, uint64_t result) {
+        return {.value = static_cast<int64_t>(result), .address = lhs.address || rhs.address};
+    }
+
+    // A value the program output or control flow depends on
+    static int64_t observe(const Value& value) {
+        if (value.address) {
+            throw Unsupported {};
+        }
+        return value.value;
+    }
+
+    // Comparisons branch on their operands, so both must be observable
+    template <typename Cmp>
+    static Value compare(const Value& lhs, const Value& rhs, Cmp cmp) {
+        return {.value = cmp(observe(lhs), observe(rhs)) ? 1 : 0};
+    }
+
+    Value eval_term(const NodeTerm* term) {
+        struct TermVisitor {
+            Interpreter& interp;
+
+            Value operator()(const NodeTermIntLit* term_int_lit) const {
+                return {.value = std::stoll(term_int_lit->int_lit.value.value())};
+            }
+            Value operator()(const NodeTermIdent* term_ident) const {
+                return interp.lookup(term_ident->ident.value.value());
+            }
+            Value operator()(const NodeTermNeg* term_neg) const {
+                const Value value = interp.eval_term(term_neg->term);
+                return combine(value, value, -static_cast<uint64_t>(value.value));
+            }
+            Value operator()(const NodeTermBitNot* term_bit_not) const {
+                const Value value = interp.eval_term(term_bit_not->term);
+                return combine(value, value, ~static_cast<uint64_t>(value.value));
+            }
+            Value operator()(const NodeTermParen* term_paren) const {
+                return interp.eval_expr(term_paren->expr);
+            }
+            Value operator()(const NodeTermRead*) const {
+                throw Unsupported {};
+            }
+            Value operator()(const NodeTermArg*) const {
+                throw Unsupported {};
+            }
+            Value operator()(const NodeTermAlloc* term_alloc) const {
+                const int64_t count = observe(interp.eval_expr(term_alloc->count));
+                return interp.alloc(count);
+            }
+            Value operator()(const NodeTermIndex* term_index) const {
+                const Value base = interp.lookup(term_index->ident.value.value());
+                const Value index = interp.eval_expr(term_index->index);
+                return interp.element(base, index);
+            }
+            Value operator()(const NodeTermCall* term_call) const {
+                return interp.eval_call(term_call);
+            }
+            // Arrays of structs are rejected where they are declared
+            Value operator()(const NodeTermField*) const {
+                throw Unsupported {};
+            }
+            Value operator()(const NodeTermPipeline* pipeline) const {
+                return interp.eval_pipeline(pipeline);
+            }
+            Value operator()(const NodeTermIntrinsic* term_intrinsic) const {
+                // The clocks differ from run to run
+                if (!intrinsic_takes_arg(term_intrinsic->op)) {
+                    throw Unsupported {};
+                }
+                const Value value = interp.eval_expr(term_intrinsic->arg);
+                return combine(value, value, eval_intrinsic(term_intrinsic->op, value.value));
+            }
+            // Values are integers only; programs using f64 run at runtime
+            Value operator()(const NodeTermFloatLit*) const {
+                throw Unsupported {};
+            }
+            Value operator()(const NodeTermConvert*) const {
+                throw Unsupported {};
+            }
+        };
+        step();
+        return std::visit(TermVisitor {.interp = *this}, term->var);
+    }
+
+    Value eval_bin_expr(const NodeBinExpr* bin_expr) {
+        struct BinExprVisitor {
+            Interpreter& interp;
+
+            Value operator()(const NodeBinExprAdd* add) const {
+                const Value lhs = interp.eval_expr(add->lhs), rhs = interp.eval_expr(add->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) + static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprSub* sub) const {
+                const Value lhs = interp.eval_expr(sub->lhs), rhs = interp.eval_expr(sub->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) - static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprMulti* multi) const {
+                const Value lhs = interp.eval_expr(multi->lhs), rhs = interp.eval_expr(multi->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) * static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprDiv* div) const {
+                const Value lhs = interp.eval_expr(div->lhs), rhs = interp.eval_expr(div->rhs);
+                if (rhs.value == 0) {
+                    // The real program dies with SIGFPE; leave that to it
+                    throw Unsupported {};
+                }
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) / static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprMod* mod) const {
+                const Value lhs = interp.eval_expr(mod->lhs), rhs = interp.eval_expr(mod->rhs);
+                if (rhs.value == 0) {
+                    throw Unsupported {};
+                }
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) % static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprBitAnd* bit_and) const {
+                const Value lhs = interp.eval_expr(bit_and->lhs), rhs = interp.eval_expr(bit_and->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) & static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprBitOr* bit_or) const {
+                const Value lhs = interp.eval_expr(bit_or->lhs), rhs = interp.eval_expr(bit_or->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) | static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprBitXor* bit_xor) const {
+                const Value lhs = interp.eval_expr(bit_xor->lhs), rhs = interp.eval_expr(bit_xor->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) ^ static_cast<uint64_t>(rhs.value));
+            }
+            Value operator()(const NodeBinExprShl* shl) const {
+                const Value lhs = interp.eval_expr(shl->lhs), rhs = interp.eval_expr(shl->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value) << (rhs.value & 63));
+            }
+            Value operator()(const NodeBinExprShr* shr) const {
+                const Value lhs = interp.eval_expr(shr->lhs), rhs = interp.eval_expr(shr->rhs);
+                return combine(lhs, rhs, static_cast<uint64_t>(lhs.value >> (rhs.value & 63)));
+            }
+            Value operator()(const NodeBinExprGt* gt) const {
+                return compare(interp.eval_expr(gt->lhs), interp.eval_expr(gt->rhs), [](int64_t a, int64_t b) { return a > b; });
+            }
+            Value operator()(const NodeBinExprGe* ge) const {
+                return compare(interp.eval_expr(ge->lhs), interp.eval_expr(ge->rhs), [](int64_t a, int64_t b) { return a >= b; });
+            }
+            Value operator()(const NodeBinExprLt* lt) const {
+                return compare(interp.eval_expr(lt->lhs), interp.eval_expr(lt->rhs), [](int64_t a, int64_t b) { return a < b; });
+            }
+            Value operator()(const NodeBinExprLe* le) const {
+                return compare(interp.eval_expr(le->lhs), interp.eval_expr(le->rhs), [](int64_t a, int64_t b) { return a <= b; });
+            }
+            Value operator()(const NodeBinExprEqEq* eq_eq) const {
+                return compare(interp.eval_expr(eq_eq->lhs), interp.eval_expr(eq_eq->rhs), [](int64_t a, int64_t b) { return a == b; });
+            }
+        };
+        step();
+        return std::visit(BinExprVisitor {.interp = *this}, bin_expr->var);
+    }
+
+    Value eval_expr(const NodeExpr* expr) {
+        if (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            return eval_term(*term);
+        }
+        return eval_bin_expr(std::get<NodeBinExpr*>(expr->var));
+    }
+
+    void exec_scope(const NodeScope* scope) {
+        const size_t scope_start = m_vars.size();
+        for (const NodeStmt* stmt : scope->stmts) {
+            exec_stmt(stmt);
+        }
+        m_vars.resize(scope_start);
+    }
+
+    void exec_if_pred(const NodeIfPred* pred) {
+        if (const auto* elif = std::get_if<NodeIfPredElif*>(&pred->var)) {
+            if (observe(eval_expr((*elif)->expr)) != 0) {
+                exec_scope((*elif)->scope);
+            } else if ((*elif)->pred.has_value()) {
+                exec_if_pred((*elif)->pred.value());
+            }
+            return;
+        }
+        exec_scope(std::get<NodeIfPredElse*>(pred->var)->scope);
+    }
+
+    void exec_for(const NodeStmtFor* stmt_for) {
+        const size_t scope_start = m_vars.size();
+        exec_stmt(stmt_for->init);
+        while (observe(eval_expr(stmt_for->cond)) != 0) {
+            exec_scope(stmt_for->scope);
+            exec_stmt(stmt_for->step);
+        }
+        m_vars.resize(scope_start);
+    }
+
+    // Behaves like the generated code on a single thread: the bounds are
+    // evaluated once, the whole range is one chunk, and the private reduction
+    // copies are folded into the shared variables at the end. The loop shape
+    // has already been validated by the Generator.
+    void exec_parallel_for(const NodeStmtParallelFor* stmt_parallel) {
+        const NodeStmtFor* loop = stmt_parallel->loop;
+        const auto* init = std::get<NodeStmtLet*>(loop->init->var);
+        const auto& cond = std::get<NodeBinExpr*>(loop->cond->var)->var;
+        const bool inclusive = std::holds_alternative<NodeBinExprLe*>(cond);
+        const NodeExpr* bound = inclusive ? std::get<NodeBinExprLe*>(cond)->rhs : std::get<NodeBinExprLt*>(cond)->rhs;
+        const auto* add = std::get<NodeBinExprAdd*>(std::get<NodeBinExpr*>(std::get<NodeStmtAssign*>(loop->step->var)->expr->var)->var);
+        const uint64_t stride = literal_operand(add->lhs).value_or(literal_operand(add->rhs).value_or(0));
+
+        const uint64_t start = observe(eval_expr(init->expr));
+        const uint64_t end = observe(eval_expr(bound));
+        const int64_t count = static_cast<int64_t>(end - start + (inclusive ? stride : stride - 1)) / static_cast<int64_t>(stride);
+        if (count <= 0) {
+            return;
+        }
+
+        const size_t scope_start = m_vars.size();
+        for (const NodeReduction& reduction : stmt_parallel->reductions) {
+            m_vars.push_back({reduction.ident.value.value(), {.value = reduction.op == TokenType::plus ? 0 : 1}});
+        }
+        m_vars.push_back({init->ident.value.value(), {.value = static_cast<int64_t>(start)}});
+        const int64_t last = static_cast<int64_t>(start + count * stride);
+        while (m_vars[scope_start + stmt_parallel->reductions.size()].second.value < last) {
+            exec_scope(loop->scope);
+            Value& index = m_vars[scope_start + stmt_parallel->reductions.size()].second;
+            index.value = static_cast<int64_t>(static_cast<uint64_t>(index.value) + stride);
+            step();
+        }
+
+        std::vector<Value> partials;
+        for (size_t i = 0; i < stmt_parallel->reductions.size(); i++) {
+            partials.push_back(m_vars[scope_start + i].second);
+        }
+        m_vars.resize(scope_start);
+        for (size_t i = 0; i < partials.size(); i++) {
+            const NodeReduction& reduction = stmt_parallel->reductions[i];
+            Value& shared = lookup(reduction.ident.value.value());
+            const uint64_t a = shared.value, b = partials[i].value;
+            shared = combine(shared, partials[i], reduction.op == TokenType::plus ? a + b : a * b);
+        }
+    }
+
+    // The value of a literal operand (the parallel for stride)
+    static std::optional<uint64_t> literal_operand(const NodeExpr* expr) {
+        while (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (const auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                expr = (*paren)->expr;
+            } else if (const auto* lit = std::get_if<NodeTermIntLit*>(&(*term)->var)) {
+                return std::stoll((*lit)->int_lit.value.value());
+            } else {
+                return {};
+            }
+        }
+        return {};
+    }
+
+    void exec_stmt(const NodeStmt* stmt) {
+        struct StmtVisitor {
+            Interpreter& interp;
+
+            void operator()(const NodeStmtExit* stmt_exit) const {
+                throw Exit {.code = static_cast<int>(observe(interp.eval_expr(stmt_exit->expr)) & 0xff)};
+            }
+            void operator()(const NodeStmtLet* stmt_let) const {
+                // The simulated heap holds whole integers, not packed fields
+                if (stmt_let->record_type != nullptr) {
+                    throw Unsupported {};
+                }
+                const Value value = interp.eval_expr(stmt_let->expr);
+                interp.m_vars.push_back({stmt_let->ident.value.value(), value});
+            }
+            void operator()(const NodeStmtAssign* stmt_assign) const {
+                const Value value = interp.eval_expr(stmt_assign->expr);
+                interp.lookup(stmt_assign->ident.value.value()) = value;
+            }
+            void operator()(const NodeStmtIndexAssign* stmt_assign) const {
+                const Value value = interp.eval_expr(stmt_assign->expr);
+                const Value index = interp.eval_expr(stmt_assign->index);
+                interp.element(interp.lookup(stmt_assign->ident.value.value()), index) = value;
+            }
+            void operator()(const NodeScope* scope) const {
+                interp.exec_scope(scope);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const {
+                if (observe(interp.eval_expr(stmt_if->expr)) != 0) {
+                    interp.exec_scope(stmt_if->scope);
+                } else if (stmt_if->pred.has_value()) {
+                    interp.exec_if_pred(stmt_if->pred.value());
+                }
+            }
+            void operator()(const NodeStmtFor* stmt_for) const {
+                interp.exec_for(stmt_for);
+            }
+            void operator()(const NodeStmtParallelFor* stmt_parallel) const {
+                interp.exec_parallel_for(stmt_parallel);
+            }
+            void operator()(const NodeStmtPrint* stmt_print) const {
+                interp.m_result.output += std::to_string(observe(interp.eval_expr(stmt_print->expr)));
+                interp.m_result.output += '\n';
+                if (interp.m_result.output.size() > k_max_output) {
+                    throw Unsupported {};
+                }
+            }
+            // Hand-written instructions and C code only run on the machine
+            void operator()(const NodeStmtAsm*) const {
+                throw Unsupported {};
+            }
+            void operator()(const NodeStmtExtern*) const {}
+            void operator()(const NodeStmtStruct*) const {}
+            void operator()(const NodeStmtFieldAssign*) const {
+                throw Unsupported {};
+            }
+            void operator()(const NodeStmtCall* stmt_call) const {
+                interp.eval_call(stmt_call->call);
+            }
+            void operator()(const NodeStmtFn*) const {}
+            void operator()(const NodeStmtReturn* stmt_return) const {
+                throw Return {.value = interp.eval_expr(stmt_return->expr)};
+            }
+        };
+        step();
+        std::visit(StmtVisitor {.interp = *this}, stmt->var);
+    }
+
+    // Calls of fns; C code only runs on the machine
+    Value eval_call(const NodeTermCall* call) {
+        if (call->fn == nullptr) {
+            throw Unsupported {};
+        }
+        std::vector<Value> args;
+        for (const NodeExpr* arg : call->args) {
+            args.push_back(eval_expr(arg));
+        }
+        return call_fn(call->fn, args);
+    }
+
+    // Run an fn body with only its parameters in scope. Results of @memo
+    // fns are kept, as the generated code keeps them, so that recursions
+    // over overlapping subproblems stay within the budget.
+    Value call_fn(const NodeStmtFn* fn, const std::vector<Value>& args) {
+        std::pair<const NodeStmtFn*, std::vector<int64_t>> key {fn, {}};
+        if (fn->memo) {
+            for (const Value& arg : args) {
+                key.second.push_back(arg.value);
+            }
+            if (const auto it = m_memo.find(key); it != m_memo.end()) {
+                return it->second;
+            }
+        }
+        if (m_call_depth == k_max_call_depth) {
+            throw Unsupported {};
+        }
+        std::vector<std::pair<std::string, Value>> frame;
+        for (size_t i = 0; i < args.size(); i++) {
+            frame.emplace_back(fn->params[i].value.value(), args[i]);
+        }
+        std::swap(frame, m_vars);
+        m_call_depth++;
+        Value result;
+        try {
+            exec_scope(fn->scope);
+        } catch (const Return& ret) {
+            result = ret.value;
+        } catch (...) {
+            std::swap(frame, m_vars);
+            m_call_depth--;
+            throw;
+        }
+        std::swap(frame, m_vars);
+        m_call_depth--;
+        if (fn->memo) {
+            m_memo.emplace(std::move(key), result);
+        }
+        return result;
+    }
+
+    // Fold a range pipeline one value at a time, each lambda parameter bound
+    // to the value flowing through its stage
+    Value eval_pipeline(const NodeTermPipeline* pipeline) {
+        const int64_t begin = observe(eval_expr(pipeline->begin));
+        const int64_t end = observe(eval_expr(pipeline->end));
+        Value total;
+        for (int64_t i = begin; i < end; i++) {
+            step();
+            Value value {.value = i};
+            bool passed = true;
+            for (const NodePipeStage& stage : pipeline->stages) {
+                m_vars.push_back({stage.param.value.value(), value});
+                const Value result = eval_expr(stage.body);
+                m_vars.pop_back();
+                if (!stage.filter) {
+                    value = result;
+                } else if (observe(result) == 0) {
+                    passed = false;
+                    break;
+                }
+            }
+            if (passed) {
+                total = pipeline->count ? combine(total, total, static_cast<uint64_t>(total.value) + 1)
+                                        : combine(total, value, static_cast<uint64_t>(total.value) + static_cast<uint64_t>(value.value));
+            }
+        }
+        return total;
+    }
+
+    Value& lookup(const std::string& name) {
+        for (auto it = m_vars.rbegin(); it != m_vars.rend(); ++it) {
+            if (it->first == name) {
+                return it->second;
+            }
+        }
+        // Undeclared: let the generator report it
+        throw Unsupported {};
+    }
+
+    // Simulated heap: each allocation is a block at a made-up address
+    Value alloc(int64_t count) {
+        if (count < 0 || static_cast<uint64_t>(count) > k_max_heap_words - m_heap_words) {
+            throw Unsupported {};
+        }
+        m_heap_words += count;
+        const uint64_t address = m_next_address;
+        m_heap.emplace(address, std::vector<Value>(count));
+        m_next_address += (count + 1) * 8;
+        return {.value = static_cast<int64_t>(address), .address = true};
+    }
+
+    Value& element(const Value& base, const Value& index) {
+        const uint64_t address = static_cast<uint64_t>(base.value) + static_cast<uint64_t>(observe(index)) * 8;
+        auto block = m_heap.upper_bound(address);
+        if (!base.address || block == m_heap.begin()) {
+            throw Unsupported {};
+        }
+        --block;
+        const uint64_t offset = (address - block->first) / 8;
+        if ((address - block->first) % 8 != 0 || offset >= block->second.size()) {
+            throw Unsupported {};
+        }
+        return block->second[offset];
+    }
+
+    static constexpr size_t k_max_output = 64 * 1024 * 1024;
+    static constexpr uint64_t k_max_heap_words = 16 * 1024 * 1024;
+    static constexpr size_t k_max_call_depth = 1000;   // keeps the recursion within the compiler's own stack
+
+    const NodeProg& m_prog;
+    uint64_t m_steps_left;
+    Result m_result;
+    std::vector<std::pair<std::string, Value>> m_vars;
+    std::map<uint64_t, std::vector<Value>> m_heap;
+    uint64_t m_heap_words = 0;
+    uint64_t m_next_address = 0x100000000;
+    size_t m_call_depth = 0;
+    std::map<std::pair<const NodeStmtFn*, std::vector<int64_t>>, Value> m_memo;
+};
@@ -1,3 +1,5 @@
+#include <charconv>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -5,21 +7,141 @@
 #include <optional>
 #include <vector>
 
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./annotate.hpp"
+#include "./bench.hpp"
 #include "./generation.hpp"
+#include "./interpreter.hpp"
+#include "./reassociate.hpp"
+#include "./size_report.hpp"
+#include "./typecheck.hpp"
+
+// Runs a program found on PATH with these arguments, without a shell, so the
+// arguments are passed as given; returns its wait status
+static int run_program(std::vector<std::string> args){
+    std::vector<char*> argv;
+    for (std::string& arg : args){
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    const pid_t pid = fork();
+    if (pid < 0){
+        return -1;
+    }
+    if (pid == 0){
+        execvp(argv[0], argv.data());
+        std::cerr << "Cannot run " << args[0] << std::endl;
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid){
+        return -1;
+    }
+    return status;
+}
 
 int main(int argc, char* argv[]){
-    if (argc != 2){
+    std::optional<std::string> input_path;
+    Target target;
+    std::optional<uint64_t> precompute_budget;
+    std::optional<std::string> superopt_db;
+    GenOptions options;
+    bool size_report = false;
+    bool annotate = false;
+    bool assemble = true;
+    CostModel cost_model = CostModel::from_name("skylake").value();
+    std::vector<std::string> link_args;   // objects and libraries for the extern fns
+    bool dynamic = false;
+    // `hauss bench ...` compiles as usual, then times runs of the binary
+    std::optional<Bench::Options> bench;
+    int first_arg = 1;
+    if (argc > 1 && std::string(argv[1]) == "bench"){
+        bench.emplace();
+        first_arg = 2;
+    }
+    for (int i = first_arg; i < argc; i++){
+        const std::string arg = argv[i];
+        if (bench.has_value() && arg == "--"){
+            bench->args.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (bench.has_value() && Bench::parse_flag(arg, bench.value())){
+            continue;
+        } else if (arg.rfind("-march=", 0) == 0){
+            std::optional<Target> march = Target::from_march(arg.substr(7));
+            if (!march.has_value()){
+                std::cerr << "Unknown -march value: " << arg.substr(7) << std::endl;
+                std::cerr << "Expected one of: native, x86-64, x86-64-v2, x86-64-v3, x86-64-v4" << std::endl;
+                return EXIT_FAILURE;
+            }
+            target = march.value();
+        } else if (arg == "-fprecompute"){
+            precompute_budget = 100'000'000;
+        } else if (arg.rfind("-fprecompute=", 0) == 0){
+            const char* first = arg.data() + 13;
+            const char* last = arg.data() + arg.size();
+            uint64_t steps = 0;
+            const auto [end, error] = std::from_chars(first, last, steps);
+            if (first == last || error != std::errc {} || end != last){
+                std::cerr << "Incorrect usage: -fprecompute needs a number of steps, got '" << arg.substr(13) << "'" << std::endl;
+                return EXIT_FAILURE;
+            }
+            precompute_budget = steps;
+        } else if (arg == "-Os"){
+            options.optimize_size = true;
+        } else if (arg == "--size-report"){
+            size_report = true;
+            options.line_markers = true;
+        } else if (arg == "-S"){
+            assemble = false;
+        } else if (arg == "--emit=annotated-asm"){
+            annotate = true;
+            options.line_markers = true;
+        } else if (arg.rfind("-mtune=", 0) == 0){
+            std::optional<CostModel> model = CostModel::from_name(arg.substr(7));
+            if (!model.has_value()){
+                std::cerr << "Unknown -mtune value: " << arg.substr(7) << std::endl;
+                std::cerr << "Expected one of: skylake, zen3" << std::endl;
+                return EXIT_FAILURE;
+            }
+            cost_model = model.value();
+        } else if (arg == "-fsuperopt"){
+            superopt_db = "hauss-superopt.db";
+        } else if (arg.rfind("-fsuperopt=", 0) == 0){
+            superopt_db = arg.substr(11);
+        } else if (arg.rfind("-l", 0) == 0 || arg.rfind("-L", 0) == 0){
+            link_args.push_back(arg);
+            dynamic = dynamic || arg.rfind("-l", 0) == 0;
+        } else if (arg.ends_with(".o") || arg.ends_with(".a") || arg.ends_with(".so")){
+            link_args.push_back(arg);
+            dynamic = dynamic || arg.ends_with(".so");
+        } else if (arg.rfind("-", 0) == 0 || input_path.has_value()){
+            input_path.reset();
+            break;
+        } else{
+            input_path = arg;
+        }
+    }
+    if (!input_path.has_value()){
         std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cerr << "gauss <input.hs>" << std::endl;
+        std::cerr << "hauss [-march=<cpu>] [-S] [-Os] [--size-report] [--emit=annotated-asm] [-mtune=<cpu>] [-fprecompute[=<steps>]] [-fsuperopt[=<db>]] <input.gs> [<obj.o|lib.a|lib.so>...] [-L<dir>] [-l<lib>]" << std::endl;
+        std::cerr << "hauss bench [--runs=<n>] [--warmup=<n>] [--cpu=<n>] [--stdin=<file>] <options and input as above> [-- <args>...]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (bench.has_value() && !assemble){
+        std::cerr << "hauss bench needs a binary to run and cannot be combined with -S" << std::endl;
         return EXIT_FAILURE;
     }
+    const auto compile_start = std::chrono::steady_clock::now();
     std::string contents;
     {
         std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
+        std::fstream input(input_path.value(), std::ios::in);
         contents_stream << input.rdbuf();
         contents = contents_stream.str();
     }
+    const std::string source = size_report || annotate ? contents : "";
     Tokenizer tokenizer(std::move(contents));
     std::vector<Token> tokens = tokenizer.tokenize();
     Parser parser(std::move(tokens));
@@ -30,13 +152,68 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
 
-    Generator generator(prog.value());
+    TypeChecker type_checker;
+    type_checker.check(prog.value());
+
+    Reassociator reassociator;
+    reassociator.run(prog.value());
+
+    std::optional<Superoptimizer> superopt;
+    if (superopt_db.has_value()){
+        superopt.emplace(superopt_db.value());
+    }
+    Generator generator(prog.value(), target, superopt.has_value() ? &superopt.value() : nullptr, options);
     
+    std::string assembly = generator.gen_prog();
+    bool threaded = generator.uses_threads();
+    if (precompute_budget.has_value()){
+        // Programs that read no input are run here; if they finish within the
+        // budget the binary only has to replay their output
+        Interpreter interpreter(prog.value(), precompute_budget.value());
+        if (std::optional<Interpreter::Result> result = interpreter.run()){
+            assembly = generator.gen_precomputed(result->output, result->exit_code);
+            threaded = false;
+        }
+    }
+    if (annotate){
+        // Only comments are added, so the listing still assembles
+        assembly = AsmAnnotator(cost_model, source).annotate(assembly, size_report);
+    }
     {
         std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+        file << assembly;
+    }
+    const auto compile_end = std::chrono::steady_clock::now();
+    if (!assemble){
+        return EXIT_SUCCESS;
+    }
+    if (run_program({"nasm", "-felf64", "out.asm"}) != 0){
+        std::cerr << "Assembling out.asm with nasm failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (size_report){
+        if (std::optional<SizeReport> report = SizeReport::measure("out.o")){
+            report->print(std::cout, source);
+        } else{
+            std::cerr << "No size report: cannot read the line markers of out.o" << std::endl;
+        }
+    }
+    // Shared libraries are loaded by the dynamic linker, which also runs
+    // their initializers (libc's included) before _start
+    std::vector<std::string> link = {"ld", "-o", "out", "out.o"};
+    if (dynamic){
+        link.insert(link.end(), {"-dynamic-linker", "/lib64/ld-linux-x86-64.so.2"});
+    }
+    link.insert(link.end(), link_args.begin(), link_args.end());
+    if (run_program(link) != 0){
+        std::cerr << "Linking out.o with ld failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (bench.has_value()){
+        const std::chrono::duration<double> compile_time = compile_end - compile_start;
+        const std::chrono::duration<double> link_time = std::chrono::steady_clock::now() - compile_end;
+        bench->threaded = threaded;
+        Bench(bench.value()).run(std::cout, compile_time.count(), link_time.count());
     }
-    system("nasm -felf64 out.asm");
-    system("ld -o out out.o");
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -1,30 +1,147 @@
 #pragma once
 
+#include <bit>
+#include <cstdint>
 #include <variant>
 
 #include "./arena.hpp"
 #include "./tokenization.hpp"
 
+// Value types. Integers are the default; f64 values come from float literals
+// and explicit conversions.
+enum class Type { i64, f64 };
+
+inline std::string to_string(const Type type)
+{
+    return type == Type::f64 ? "f64" : "i64";
+}
+
+// How often the programmer expects an if or elif condition to hold
+enum class BranchHint { none, likely, unlikely };
+
+// Builtins mapping to x86-64 instructions where the target has them, and
+// the clocks for timing code from inside a program
+enum class Intrinsic { popcount, clz, ctz, bswap, rdtsc, clock_ns, cycles };
+
+// The clocks take no argument
+inline bool intrinsic_takes_arg(Intrinsic op)
+{
+    return op != Intrinsic::rdtsc && op != Intrinsic::clock_ns && op != Intrinsic::cycles;
+}
+
+// Value of a builtin taking an argument, for a known argument. clz and ctz
+// of 0 are 64, as with lzcnt and tzcnt.
+inline uint64_t eval_intrinsic(Intrinsic op, uint64_t value)
+{
+    switch (op) {
+    case Intrinsic::popcount: return std::popcount(value);
+    case Intrinsic::clz: return std::countl_zero(value);
+    case Intrinsic::ctz: return std::countr_zero(value);
+    case Intrinsic::bswap: return __builtin_bswap64(value);
+    case Intrinsic::rdtsc:
+    case Intrinsic::clock_ns:
+    case Intrinsic::cycles: break;
+    }
+    return 0;
+}
+
 struct NodeTerm;
 
 struct NodeTermNeg{
     NodeTerm* term;
 };
 
+// ~x: bitwise complement
+struct NodeTermBitNot{
+    NodeTerm* term;
+};
+
 struct NodeTermIntLit{
     Token int_lit;
 };
 
+struct NodeTermFloatLit{
+    Token float_lit;
+};
+
 struct NodeTermIdent{
     Token ident;
 };
 
 struct NodeExpr;
 
+// f64(x) / i64(x): explicit conversion; i64() truncates toward zero
+struct NodeTermConvert {
+    Type type;
+    NodeExpr* expr;
+};
+
+// read(): next integer from stdin
+struct NodeTermRead {
+};
+
+// arg(i): argv[i] parsed as an integer
+struct NodeTermArg {
+    NodeExpr* index;
+};
+
+// alloc(n): a fresh zero-initialized array of n integers
+struct NodeTermAlloc {
+    NodeExpr* count;
+};
+
+// a[i]: element i of the array a
+struct NodeTermIndex {
+    Token ident;
+    NodeExpr* index;
+};
+
 struct NodeTermParen {
     NodeExpr* expr;
 };
 
+struct NodeStmtLet;
+
+// a[i].f: field f of element i of the struct array a
+struct NodeTermField {
+    Token ident;
+    NodeExpr* index;
+    Token field;
+    const NodeStmtLet* array = nullptr;   // declaration of a, set by the TypeChecker
+    size_t field_index = 0;               // set by the TypeChecker
+};
+
+struct NodeStmtFn;
+
+// f(a, b, ...) calling an fn or an extern fn
+struct NodeTermCall {
+    Token ident;
+    std::vector<NodeExpr*> args;
+    const NodeStmtFn* fn = nullptr;   // callee if it is an fn, set by the TypeChecker
+};
+
+// popcount(x), clz(x), ctz(x), bswap(x), rdtsc(), clock_ns() or cycles()
+struct NodeTermIntrinsic {
+    Intrinsic op;
+    NodeExpr* arg;  // null for the clocks
+};
+
+// `map(x => e)` or `filter(x => e)` stage of a range pipeline
+struct NodePipeStage {
+    bool filter = false;
+    Token param;
+    NodeExpr* body = nullptr;
+};
+
+// sum(range(a, b) |> stage |> ...) or count(...): folds the values a..b-1
+// that pass the filters, after the maps before each point are applied
+struct NodeTermPipeline {
+    bool count = false;
+    NodeExpr* begin = nullptr;
+    NodeExpr* end = nullptr;
+    std::vector<NodePipeStage> stages;
+};
+
 struct NodeBinExprAdd{
     NodeExpr* lhs;
     NodeExpr* rhs;
@@ -45,6 +162,38 @@ struct NodeBinExprSub{
     NodeExpr* rhs;
 };
 
+// x % y: remainder of the unsigned division, like `/`
+struct NodeBinExprMod{
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprBitAnd{
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprBitOr{
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprBitXor{
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+// x << y and x >> y (arithmetic) shift by y mod 64
+struct NodeBinExprShl{
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprShr{
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
 struct NodeBinExprGt {
     NodeExpr* lhs;
     NodeExpr* rhs;
@@ -80,15 +229,23 @@ struct NodeBinExpr{
         NodeBinExprGe*,
         NodeBinExprLt*,
         NodeBinExprLe*,
-        NodeBinExprEqEq*> var;
+        NodeBinExprEqEq*,
+        NodeBinExprMod*,
+        NodeBinExprBitAnd*,
+        NodeBinExprBitOr*,
+        NodeBinExprBitXor*,
+        NodeBinExprShl*,
+        NodeBinExprShr*> var;
 };
 
 struct NodeTerm{
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*, NodeTermNeg*> var;
+    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*, NodeTermNeg*, NodeTermRead*, NodeTermArg*, NodeTermAlloc*, NodeTermIndex*,
+        NodeTermFloatLit*, NodeTermConvert*, NodeTermBitNot*, NodeTermIntrinsic*, NodeTermCall*, NodeTermField*, NodeTermPipeline*> var;
 };
 
 struct NodeExpr {
     std::variant<NodeTerm*, NodeBinExpr*> var;
+    Type type = Type::i64;  // filled in by the TypeChecker
 };
 
 struct NodeStmtPrint {
@@ -99,9 +256,33 @@ struct NodeStmtExit{
     NodeExpr* expr;
 };
 
+// One field of a struct: a signed integer of 1, 2, 4 or 8 bytes
+struct NodeStructField {
+    Token ident;
+    int size = 8;
+    int offset = 0;       // within an element of an array of structs
+    int soa_offset = 0;   // its array starts at count * soa_offset in a struct of arrays
+};
+
+// struct Name { field[: i64|i32|i16|i8], ... }. The layout is computed by
+// the TypeChecker.
+struct NodeStmtStruct {
+    Token ident;
+    std::vector<NodeStructField> fields;
+    int size = 0;         // bytes per element, padded to the alignment
+    int align = 1;
+    int packed_size = 0;  // bytes per element in a struct of arrays
+};
+
 struct NodeStmtLet{
     Token ident;
     NodeExpr* expr;
+    std::optional<Type> type;   // from `let x: f64 = ...`
+    // `let a: Name[] [layout(soa)] = alloc(n);` declares an array of structs,
+    // stored as one array per field with layout(soa)
+    std::optional<Token> record;
+    bool soa = false;
+    const NodeStmtStruct* record_type = nullptr;   // set by the TypeChecker
 };
 
 struct NodeStmt;
@@ -116,6 +297,7 @@ struct NodeIfPredElif {
     NodeExpr* expr;
     NodeScope* scope;
     std::optional<NodeIfPred*> pred;
+    BranchHint hint = BranchHint::none;
 };
 
 struct NodeIfPredElse {
@@ -130,6 +312,7 @@ struct NodeStmtIf{
     NodeExpr* expr;
     NodeScope* scope;
     std::optional<NodeIfPred*> pred;
+    BranchHint hint = BranchHint::none;
 };
 
 struct NodeStmtAssign{
@@ -137,8 +320,93 @@ struct NodeStmtAssign{
     NodeExpr* expr;
 };
 
+// a[i] = expr;
+struct NodeStmtIndexAssign {
+    Token ident;
+    NodeExpr* index;
+    NodeExpr* expr;
+};
+
+// a[i].f = expr;
+struct NodeStmtFieldAssign {
+    NodeTermField* target;
+    NodeExpr* expr;
+};
+
+// for (let i = a; cond; i = step) { ... }
+struct NodeStmtFor {
+    NodeStmt* init;   // always a NodeStmtLet
+    NodeExpr* cond;
+    NodeStmt* step;   // always a NodeStmtAssign
+    NodeScope* scope;
+};
+
+// One `op: var` entry of a reduce(...) clause
+struct NodeReduction {
+    TokenType op;     // plus or star
+    Token ident;
+};
+
+// parallel[(static|dynamic)] for (...) [reduce(op: var, ...)] { ... }
+struct NodeStmtParallelFor {
+    NodeStmtFor* loop;
+    bool static_schedule;
+    std::vector<NodeReduction> reductions;
+};
+
+// `reg = var` in an in(...) clause, `var = reg` in an out(...) clause
+struct NodeAsmBinding {
+    Token reg;
+    Token ident;
+};
+
+// asm [in(reg = var, ...)] [out(var = reg, ...)] [clobber(reg, ...)] { instructions }
+struct NodeStmtAsm {
+    std::vector<NodeAsmBinding> inputs;
+    std::vector<NodeAsmBinding> outputs;
+    std::vector<Token> clobbers;
+    Token text;   // asm_text token holding the instructions
+};
+
+// extern fn name(param[: type], ...)[: type]; declares a C function called
+// with the System V calling convention. Types default to i64.
+struct NodeStmtExtern {
+    Token ident;
+    std::vector<Type> params;
+    Type ret;
+};
+
+// f(a, b, ...); calling an fn or an extern fn for its effect
+struct NodeStmtCall {
+    NodeTermCall* call;
+};
+
+// [@memo[(entries)]] fn name(param[: type], ...)[: type] { ... } defines a
+// function. The body only sees the parameters and its own variables, and
+// returns 0 when it ends without a return statement.
+struct NodeStmtFn {
+    Token ident;
+    std::vector<Token> params;
+    std::vector<Type> param_types;
+    Type ret = Type::i64;
+    NodeScope* scope = nullptr;
+    bool memo = false;
+    int64_t memo_entries = 0;    // hash table size from @memo(entries), 0 for the default
+    bool pure = false;           // set by the TypeChecker
+    bool clobbers_xmm = false;   // evaluates f64 values, set by the TypeChecker
+    const NodeStmtFn* memo_callee = nullptr;   // a @memo fn it calls, directly or not, set by the TypeChecker
+};
+
+// return expr; inside an fn
+struct NodeStmtReturn {
+    NodeExpr* expr = nullptr;
+    int line = 0;
+};
+
 struct NodeStmt{
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtAssign*, NodeStmtPrint*> var;
+    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtAssign*, NodeStmtPrint*, NodeStmtIndexAssign*, NodeStmtFor*, NodeStmtParallelFor*, NodeStmtAsm*,
+        NodeStmtExtern*, NodeStmtCall*, NodeStmtStruct*, NodeStmtFieldAssign*, NodeStmtFn*, NodeStmtReturn*> var;
+    int line = 0;   // where the statement starts; 0 for statements the compiler made up
 };
 
 struct NodeProg{
@@ -153,7 +421,7 @@ class Parser{
 public:
     inline explicit Parser(std::vector<Token> tokens)
         : m_tokens(std::move(tokens)),
-        m_allocator(1024 * 1024 * 4) // 4 MB
+        m_allocator(1024 * 1024 * 4) // 4 MB blocks
     {
     }
 
@@ -193,6 +461,59 @@ public:
             term->var = node_term_int_lit;
             return term;
         } 
+        if (auto float_lit = try_consume(TokenType::float_lit)){
+            auto term_float_lit = m_allocator.alloc<NodeTermFloatLit>();
+            term_float_lit->float_lit = float_lit.value();
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_float_lit;
+            return term;
+        }
+        if (peek().has_value() && (peek().value().type == TokenType::f64 || peek().value().type == TokenType::i64)){
+            auto term_convert = m_allocator.alloc<NodeTermConvert>();
+            term_convert->type = consume().type == TokenType::f64 ? Type::f64 : Type::i64;
+            try_consume_err(TokenType::open_paren);
+            if (auto expr = parse_expr()){
+                term_convert->expr = expr.value();
+            } else{
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_paren);
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_convert;
+            return term;
+        }
+        if (peek().has_value() && peek().value().type == TokenType::ident
+            && peek(1).has_value() && peek(1).value().type == TokenType::open_bracket){
+            auto term_index = m_allocator.alloc<NodeTermIndex>();
+            term_index->ident = consume();
+            consume();
+            if (auto index = parse_expr()){
+                term_index->index = index.value();
+            } else{
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_bracket);
+            if (try_consume(TokenType::dot)){
+                auto term_field = m_allocator.emplace<NodeTermField>();
+                term_field->ident = term_index->ident;
+                term_field->index = term_index->index;
+                term_field->field = try_consume_err(TokenType::ident);
+                return m_allocator.emplace<NodeTerm>(term_field);
+            }
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_index;
+            return term;
+        }
+        if (peek().has_value() && peek().value().type == TokenType::ident
+            && (peek().value().value == "sum" || peek().value().value == "count")
+            && peek(1).has_value() && peek(1).value().type == TokenType::open_paren
+            && peek(2).has_value() && peek(2).value().type == TokenType::ident && peek(2).value().value == "range"){
+            return m_allocator.emplace<NodeTerm>(parse_pipeline());
+        }
+        if (peek().has_value() && peek().value().type == TokenType::ident
+            && peek(1).has_value() && peek(1).value().type == TokenType::open_paren){
+            return m_allocator.emplace<NodeTerm>(parse_call());
+        }
         if (auto ident = try_consume(TokenType::ident)){
             auto term_ident = m_allocator.alloc<NodeTermIdent>();
             term_ident->ident = ident.value();
@@ -214,6 +535,59 @@ public:
             }
         } 
 
+        if (auto read = try_consume(TokenType::read)) {
+            try_consume_err(TokenType::open_paren);
+            try_consume_err(TokenType::close_paren);
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = m_allocator.emplace<NodeTermRead>();
+            return term;
+        }
+        if (auto alloc = try_consume(TokenType::alloc)) {
+            try_consume_err(TokenType::open_paren);
+            auto term_alloc = m_allocator.alloc<NodeTermAlloc>();
+            if (auto count = parse_expr()) {
+                term_alloc->count = count.value();
+            } else {
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_paren);
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_alloc;
+            return term;
+        }
+        if (auto arg = try_consume(TokenType::arg)) {
+            try_consume_err(TokenType::open_paren);
+            auto term_arg = m_allocator.alloc<NodeTermArg>();
+            if (auto index = parse_expr()) {
+                term_arg->index = index.value();
+            } else {
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_paren);
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_arg;
+            return term;
+        }
+
+        if (std::optional<Intrinsic> intrinsic = peek().has_value() ? as_intrinsic(peek().value().type) : std::nullopt) {
+            consume();
+            auto term_intrinsic = m_allocator.alloc<NodeTermIntrinsic>();
+            term_intrinsic->op = intrinsic.value();
+            term_intrinsic->arg = nullptr;
+            try_consume_err(TokenType::open_paren);
+            if (intrinsic_takes_arg(intrinsic.value())) {
+                if (auto arg = parse_expr()) {
+                    term_intrinsic->arg = arg.value();
+                } else {
+                    error_expected("expression");
+                }
+            }
+            try_consume_err(TokenType::close_paren);
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_intrinsic;
+            return term;
+        }
+
         if (auto sub_token = try_consume(TokenType::sub)) {
             auto term_neg = m_allocator.alloc<NodeTermNeg>();
             auto term = parse_term();
@@ -225,6 +599,18 @@ public:
             node_term->var = term_neg;
             return node_term;
         }
+
+        if (auto tilde_token = try_consume(TokenType::tilde)) {
+            auto term_bit_not = m_allocator.alloc<NodeTermBitNot>();
+            auto term = parse_term();
+            if (!term.has_value()) {
+                error_expected("term after unary '~'");
+            }
+            term_bit_not->term = term.value();
+            auto node_term = m_allocator.alloc<NodeTerm>();
+            node_term->var = term_bit_not;
+            return node_term;
+        }
         return {};
     }
 
@@ -309,7 +695,43 @@ public:
                 div->lhs = expr_lhs2;
                 div->rhs = expr_rhs.value();
                 expr->var = div;
-            } 
+            } else if (op.type == TokenType::percent){
+                auto mod = m_allocator.alloc<NodeBinExprMod>();
+                expr_lhs2->var = expr_lhs->var;
+                mod->lhs = expr_lhs2;
+                mod->rhs = expr_rhs.value();
+                expr->var = mod;
+            } else if (op.type == TokenType::amp){
+                auto bit_and = m_allocator.alloc<NodeBinExprBitAnd>();
+                expr_lhs2->var = expr_lhs->var;
+                bit_and->lhs = expr_lhs2;
+                bit_and->rhs = expr_rhs.value();
+                expr->var = bit_and;
+            } else if (op.type == TokenType::pipe){
+                auto bit_or = m_allocator.alloc<NodeBinExprBitOr>();
+                expr_lhs2->var = expr_lhs->var;
+                bit_or->lhs = expr_lhs2;
+                bit_or->rhs = expr_rhs.value();
+                expr->var = bit_or;
+            } else if (op.type == TokenType::caret){
+                auto bit_xor = m_allocator.alloc<NodeBinExprBitXor>();
+                expr_lhs2->var = expr_lhs->var;
+                bit_xor->lhs = expr_lhs2;
+                bit_xor->rhs = expr_rhs.value();
+                expr->var = bit_xor;
+            } else if (op.type == TokenType::shl){
+                auto shl = m_allocator.alloc<NodeBinExprShl>();
+                expr_lhs2->var = expr_lhs->var;
+                shl->lhs = expr_lhs2;
+                shl->rhs = expr_rhs.value();
+                expr->var = shl;
+            } else if (op.type == TokenType::shr){
+                auto shr = m_allocator.alloc<NodeBinExprShr>();
+                expr_lhs2->var = expr_lhs->var;
+                shr->lhs = expr_lhs2;
+                shr->rhs = expr_rhs.value();
+                expr->var = shr;
+            }
 
             expr_lhs->var = expr;
         }
@@ -328,11 +750,38 @@ public:
         return scope;
     }
 
+    // Parses `for (let i = a; cond; i = step) { ... }`, after the `for` keyword
+    NodeStmtFor* parse_for(){
+        try_consume_err(TokenType::open_paren);
+        auto stmt_for = m_allocator.alloc<NodeStmtFor>();
+        if (!peek().has_value() || peek().value().type != TokenType::let){
+            error_expected("`let` in for initializer");
+        }
+        stmt_for->init = parse_stmt().value();
+        if (auto cond = parse_expr()){
+            stmt_for->cond = cond.value();
+        } else{
+            error_expected("expression");
+        }
+        try_consume_err(TokenType::semi);
+        auto step = m_allocator.alloc<NodeStmtAssign>();
+        step->ident = try_consume_err(TokenType::ident);
+        try_consume_err(TokenType::eq);
+        if (auto expr = parse_expr()){
+            step->expr = expr.value();
+        } else{
+            error_expected("expression");
+        }
+        stmt_for->step = m_allocator.emplace<NodeStmt>(step);
+        try_consume_err(TokenType::close_paren);
+        return stmt_for;
+    }
+
     std::optional<NodeIfPred*> parse_if_pred(){
         if (try_consume(TokenType::elif)){
-            try_consume_err(TokenType::open_paren);
             auto elif = m_allocator.alloc<NodeIfPredElif>();
-            
+            elif->hint = parse_cond_open();
+
             if (auto expr = parse_expr()){
                 elif->expr = expr.value();
 
@@ -366,6 +815,15 @@ public:
     }
 
     std::optional<NodeStmt*> parse_stmt(){
+        const int line = peek().has_value() ? peek().value().line : 0;
+        std::optional<NodeStmt*> stmt = parse_stmt_kind();
+        if (stmt.has_value()){
+            stmt.value()->line = line;
+        }
+        return stmt;
+    }
+
+    std::optional<NodeStmt*> parse_stmt_kind(){
         if (peek().has_value() && peek().value().type == TokenType::exit && peek(1).has_value() && peek(1).value().type == TokenType::open_paren){
             consume();
             consume();
@@ -383,11 +841,33 @@ public:
         } 
         if (peek().has_value() && peek().value().type == TokenType::let &&
                     peek(1).has_value() && peek(1).value().type == TokenType::ident && 
-                    peek(2).has_value() && peek(2).value().type == TokenType::eq){
+                    peek(2).has_value() && (peek(2).value().type == TokenType::eq || peek(2).value().type == TokenType::colon)){
                         consume();
-                        auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+                        auto stmt_let = m_allocator.emplace<NodeStmtLet>();
                         stmt_let->ident = consume();
-                        consume();
+                        if (try_consume(TokenType::colon)){
+                            if (try_consume(TokenType::f64)){
+                                stmt_let->type = Type::f64;
+                            } else if (try_consume(TokenType::i64)){
+                                stmt_let->type = Type::i64;
+                            } else if (auto record = try_consume(TokenType::ident)){
+                                stmt_let->record = record;
+                                try_consume_err(TokenType::open_bracket);
+                                try_consume_err(TokenType::close_bracket);
+                                if (try_consume_clause("layout")){
+                                    const Token layout = try_consume_err(TokenType::ident);
+                                    if (layout.value.value() == "soa"){
+                                        stmt_let->soa = true;
+                                    } else if (layout.value.value() != "aos"){
+                                        error_expected("layout `aos` or `soa`");
+                                    }
+                                    try_consume_err(TokenType::close_paren);
+                                }
+                            } else{
+                                error_expected("type `i64`, `f64` or `Struct[]`");
+                            }
+                        }
+                        try_consume_err(TokenType::eq);
                         if (auto expr = parse_expr()){
                             stmt_let->expr = expr.value();
                         } else{
@@ -413,6 +893,95 @@ public:
             auto stmt = m_allocator.emplace<NodeStmt>(assign);
             return stmt;
         }
+        if (peek().has_value() && peek().value().type == TokenType::ident
+            && peek(1).has_value() && peek(1).value().type == TokenType::open_bracket){
+
+            auto assign = m_allocator.alloc<NodeStmtIndexAssign>();
+            assign->ident = consume();
+            consume();
+            if (auto index = parse_expr()){
+                assign->index = index.value();
+            } else{
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_bracket);
+            if (try_consume(TokenType::dot)){
+                auto target = m_allocator.emplace<NodeTermField>();
+                target->ident = assign->ident;
+                target->index = assign->index;
+                target->field = try_consume_err(TokenType::ident);
+                auto field_assign = m_allocator.emplace<NodeStmtFieldAssign>(target);
+                try_consume_err(TokenType::eq);
+                if (auto expr = parse_expr()){
+                    field_assign->expr = expr.value();
+                } else{
+                    error_expected("expression");
+                }
+                try_consume_err(TokenType::semi);
+                return m_allocator.emplace<NodeStmt>(field_assign);
+            }
+            try_consume_err(TokenType::eq);
+            if (auto expr = parse_expr()){
+                assign->expr = expr.value();
+            } else{
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::semi);
+            auto stmt = m_allocator.emplace<NodeStmt>(assign);
+            return stmt;
+        }
+
+        if (peek().has_value() && peek().value().type == TokenType::ident
+            && peek(1).has_value() && peek(1).value().type == TokenType::open_paren){
+            auto stmt_call = m_allocator.emplace<NodeStmtCall>(parse_call());
+            try_consume_err(TokenType::semi);
+            return m_allocator.emplace<NodeStmt>(stmt_call);
+        }
+        if (try_consume(TokenType::extern_)){
+            try_consume_err(TokenType::fn);
+            auto stmt_extern = m_allocator.emplace<NodeStmtExtern>();
+            stmt_extern->ident = try_consume_err(TokenType::ident);
+            try_consume_err(TokenType::open_paren);
+            if (!try_consume(TokenType::close_paren)){
+                do {
+                    try_consume_err(TokenType::ident);
+                    stmt_extern->params.push_back(parse_type_annotation());
+                } while (try_consume(TokenType::comma));
+                try_consume_err(TokenType::close_paren);
+            }
+            stmt_extern->ret = parse_type_annotation();
+            try_consume_err(TokenType::semi);
+            return m_allocator.emplace<NodeStmt>(stmt_extern);
+        }
+
+        if (peek().has_value() && (peek().value().type == TokenType::fn || peek().value().type == TokenType::at)){
+            return m_allocator.emplace<NodeStmt>(parse_fn());
+        }
+        if (peek().has_value() && peek().value().type == TokenType::return_){
+            auto stmt_return = m_allocator.emplace<NodeStmtReturn>();
+            stmt_return->line = consume().line;
+            if (auto expr = parse_expr()){
+                stmt_return->expr = expr.value();
+            } else{
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::semi);
+            return m_allocator.emplace<NodeStmt>(stmt_return);
+        }
+
+        if (try_consume(TokenType::struct_)){
+            auto stmt_struct = m_allocator.emplace<NodeStmtStruct>();
+            stmt_struct->ident = try_consume_err(TokenType::ident);
+            try_consume_err(TokenType::open_curly);
+            do {
+                NodeStructField field;
+                field.ident = try_consume_err(TokenType::ident);
+                field.size = parse_field_size();
+                stmt_struct->fields.push_back(field);
+            } while (try_consume(TokenType::comma));
+            try_consume_err(TokenType::close_curly);
+            return m_allocator.emplace<NodeStmt>(stmt_struct);
+        }
 
         if (peek().has_value() && peek().value().type == TokenType::open_curly){
             if (auto scope = parse_scope()){
@@ -423,9 +992,86 @@ public:
                 error_expected("expression");
             }
         } 
+        if (try_consume(TokenType::for_)){
+            auto stmt_for = parse_for();
+            if (auto scope = parse_scope()){
+                stmt_for->scope = scope.value();
+            } else{
+                error_expected("scope");
+            }
+            return m_allocator.emplace<NodeStmt>(stmt_for);
+        }
+        if (try_consume(TokenType::parallel)){
+            auto parallel = m_allocator.emplace<NodeStmtParallelFor>();
+            if (try_consume(TokenType::open_paren)){
+                const Token schedule = try_consume_err(TokenType::ident);
+                if (schedule.value.value() == "static"){
+                    parallel->static_schedule = true;
+                } else if (schedule.value.value() != "dynamic"){
+                    error_expected("`static` or `dynamic` schedule");
+                }
+                try_consume_err(TokenType::close_paren);
+            }
+            try_consume_err(TokenType::for_);
+            parallel->loop = parse_for();
+            if (try_consume(TokenType::reduce)){
+                try_consume_err(TokenType::open_paren);
+                do {
+                    NodeReduction reduction;
+                    if (auto op = try_consume(TokenType::plus)){
+                        reduction.op = op.value().type;
+                    } else if (auto op = try_consume(TokenType::star)){
+                        reduction.op = op.value().type;
+                    } else{
+                        error_expected("`+` or `*` reduction operator");
+                    }
+                    try_consume_err(TokenType::colon);
+                    reduction.ident = try_consume_err(TokenType::ident);
+                    parallel->reductions.push_back(reduction);
+                } while (try_consume(TokenType::comma));
+                try_consume_err(TokenType::close_paren);
+            }
+            if (auto scope = parse_scope()){
+                parallel->loop->scope = scope.value();
+            } else{
+                error_expected("scope");
+            }
+            return m_allocator.emplace<NodeStmt>(parallel);
+        }
+        if (try_consume(TokenType::asm_)){
+            auto stmt_asm = m_allocator.emplace<NodeStmtAsm>();
+            if (try_consume_clause("in")){
+                do {
+                    NodeAsmBinding binding;
+                    binding.reg = try_consume_err(TokenType::ident);
+                    try_consume_err(TokenType::eq);
+                    binding.ident = try_consume_err(TokenType::ident);
+                    stmt_asm->inputs.push_back(binding);
+                } while (try_consume(TokenType::comma));
+                try_consume_err(TokenType::close_paren);
+            }
+            if (try_consume_clause("out")){
+                do {
+                    NodeAsmBinding binding;
+                    binding.ident = try_consume_err(TokenType::ident);
+                    try_consume_err(TokenType::eq);
+                    binding.reg = try_consume_err(TokenType::ident);
+                    stmt_asm->outputs.push_back(binding);
+                } while (try_consume(TokenType::comma));
+                try_consume_err(TokenType::close_paren);
+            }
+            if (try_consume_clause("clobber")){
+                do {
+                    stmt_asm->clobbers.push_back(try_consume_err(TokenType::ident));
+                } while (try_consume(TokenType::comma));
+                try_consume_err(TokenType::close_paren);
+            }
+            stmt_asm->text = try_consume_err(TokenType::asm_text);
+            return m_allocator.emplace<NodeStmt>(stmt_asm);
+        }
         if (auto if_ = try_consume(TokenType::if_)){
-            try_consume_err(TokenType::open_paren);
             auto stmt_if = m_allocator.alloc<NodeStmtIf>();
+            stmt_if->hint = parse_cond_open();
             if (auto expr = parse_expr()){
                 stmt_if->expr = expr.value();
             } else{
@@ -500,6 +1146,173 @@ private:
         } 
         return {};
     }
+
+    // [@memo[(entries)]] fn name(param[: type], ...)[: type] { ... }, with `@`
+    // or `fn` next. `memo` is not a keyword.
+    NodeStmtFn* parse_fn(){
+        auto stmt_fn = m_allocator.emplace<NodeStmtFn>();
+        if (try_consume(TokenType::at)){
+            const Token attribute = try_consume_err(TokenType::ident);
+            if (attribute.value.value() != "memo"){
+                error_expected("`memo` attribute");
+            }
+            stmt_fn->memo = true;
+            if (try_consume(TokenType::open_paren)){
+                stmt_fn->memo_entries = std::stoll(try_consume_err(TokenType::int_lit).value.value());
+                if (stmt_fn->memo_entries <= 0){
+                    error_expected("positive number of @memo entries");
+                }
+                try_consume_err(TokenType::close_paren);
+            }
+        }
+        try_consume_err(TokenType::fn);
+        stmt_fn->ident = try_consume_err(TokenType::ident);
+        try_consume_err(TokenType::open_paren);
+        if (!try_consume(TokenType::close_paren)){
+            do {
+                stmt_fn->params.push_back(try_consume_err(TokenType::ident));
+                stmt_fn->param_types.push_back(parse_type_annotation());
+            } while (try_consume(TokenType::comma));
+            try_consume_err(TokenType::close_paren);
+        }
+        stmt_fn->ret = parse_type_annotation();
+        if (auto scope = parse_scope()){
+            stmt_fn->scope = scope.value();
+        } else{
+            error_expected("scope");
+        }
+        return stmt_fn;
+    }
+
+    // f(a, b, ...), with the identifier and `(` next
+    NodeTermCall* parse_call(){
+        auto call = m_allocator.emplace<NodeTermCall>();
+        call->ident = consume();
+        consume();
+        if (!try_consume(TokenType::close_paren)){
+            do {
+                if (auto arg = parse_expr()){
+                    call->args.push_back(arg.value());
+                } else{
+                    error_expected("expression");
+                }
+            } while (try_consume(TokenType::comma));
+            try_consume_err(TokenType::close_paren);
+        }
+        return call;
+    }
+
+    // sum(range(a, b) |> map(x => e) |> filter(x => e) ...) or count(...),
+    // with `sum` or `count` next. The names are not keywords.
+    NodeTermPipeline* parse_pipeline(){
+        auto pipeline = m_allocator.emplace<NodeTermPipeline>();
+        pipeline->count = consume().value.value() == "count";
+        consume();
+        consume();
+        try_consume_err(TokenType::open_paren);
+        if (auto begin = parse_expr()){
+            pipeline->begin = begin.value();
+        } else{
+            error_expected("expression");
+        }
+        try_consume_err(TokenType::comma);
+        if (auto end = parse_expr()){
+            pipeline->end = end.value();
+        } else{
+            error_expected("expression");
+        }
+        try_consume_err(TokenType::close_paren);
+        while (try_consume(TokenType::pipe_gt)){
+            NodePipeStage stage;
+            const Token kind = try_consume_err(TokenType::ident);
+            if (kind.value.value() == "filter"){
+                stage.filter = true;
+            } else if (kind.value.value() != "map"){
+                error_expected("`map` or `filter`");
+            }
+            try_consume_err(TokenType::open_paren);
+            stage.param = try_consume_err(TokenType::ident);
+            try_consume_err(TokenType::fat_arrow);
+            if (auto body = parse_expr()){
+                stage.body = body.value();
+            } else{
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_paren);
+            pipeline->stages.push_back(stage);
+        }
+        try_consume_err(TokenType::close_paren);
+        return pipeline;
+    }
+
+    // Optional `: i64` or `: f64` of an extern fn parameter or result
+    Type parse_type_annotation(){
+        if (!try_consume(TokenType::colon)){
+            return Type::i64;
+        }
+        if (try_consume(TokenType::f64)){
+            return Type::f64;
+        }
+        if (!try_consume(TokenType::i64)){
+            error_expected("type `i64` or `f64`");
+        }
+        return Type::i64;
+    }
+
+    // Optional `: i64`, `: i32`, `: i16` or `: i8` of a struct field, in bytes.
+    // The narrow types are not keywords.
+    int parse_field_size(){
+        if (!try_consume(TokenType::colon) || try_consume(TokenType::i64)){
+            return 8;
+        }
+        const Token type = try_consume_err(TokenType::ident);
+        if (type.value.value() == "i32") return 4;
+        if (type.value.value() == "i16") return 2;
+        if (type.value.value() != "i8"){
+            error_expected("field type `i64`, `i32`, `i16` or `i8`");
+        }
+        return 1;
+    }
+
+    // Consume `name(` opening a clause of an asm statement. The clause names
+    // are not keywords, so they stay usable as variable names.
+    inline bool try_consume_clause(const std::string& name){
+        if (peek().has_value() && peek().value().type == TokenType::ident && peek().value().value == name
+            && peek(1).has_value() && peek(1).value().type == TokenType::open_paren){
+            consume();
+            consume();
+            return true;
+        }
+        return false;
+    }
+
+    // Consume the `(` opening an if or elif condition, after an optional
+    // `likely` or `unlikely` hint
+    BranchHint parse_cond_open(){
+        if (try_consume_clause("likely")){
+            return BranchHint::likely;
+        }
+        if (try_consume_clause("unlikely")){
+            return BranchHint::unlikely;
+        }
+        try_consume_err(TokenType::open_paren);
+        return BranchHint::none;
+    }
+
+    // Builtin a keyword token names, if any
+    static std::optional<Intrinsic> as_intrinsic(TokenType type) {
+        switch (type) {
+        case TokenType::popcount: return Intrinsic::popcount;
+        case TokenType::clz: return Intrinsic::clz;
+        case TokenType::ctz: return Intrinsic::ctz;
+        case TokenType::bswap: return Intrinsic::bswap;
+        case TokenType::rdtsc: return Intrinsic::rdtsc;
+        case TokenType::clock_ns: return Intrinsic::clock_ns;
+        case TokenType::cycles: return Intrinsic::cycles;
+        default: return {};
+        }
+    }
+
     const std::vector<Token> m_tokens;
     size_t m_index = 0;
     ArenaAllocator m_allocator;
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+
+/**
+ * Closed interval [lo, hi] of signed 64-bit values a variable or expression
+ * can take at runtime. Arithmetic that may wrap around widens to the full range.
+ */
+struct Range {
+    int64_t lo = std::numeric_limits<int64_t>::min();
+    int64_t hi = std::numeric_limits<int64_t>::max();
+
+    static Range full() {
+        return {};
+    }
+
+    static Range constant(int64_t value) {
+        return {value, value};
+    }
+
+    bool is_constant() const {
+        return lo == hi;
+    }
+
+    bool is_empty() const {
+        return lo > hi;
+    }
+
+    bool is_non_negative() const {
+        return lo >= 0;
+    }
+
+    /**
+     * True if every value fits an unsigned 32-bit register, so 32-bit
+     * instructions produce the same result and zero-extend implicitly.
+     */
+    bool fits_u32() const {
+        return lo >= 0 && hi <= std::numeric_limits<uint32_t>::max();
+    }
+
+    bool contains(int64_t value) const {
+        return lo <= value && value <= hi;
+    }
+};
+
+/**
+ * Smallest range containing both operands (control-flow merge).
+ */
+inline Range range_join(Range a, Range b) {
+    if (a.is_empty()) return b;
+    if (b.is_empty()) return a;
+    return {std::min(a.lo, b.lo), std::max(a.hi, b.hi)};
+}
+
+/**
+ * Intersection of both operands (refinement by a known condition).
+ */
+inline Range range_meet(Range a, Range b) {
+    return {std::max(a.lo, b.lo), std::min(a.hi, b.hi)};
+}
+
+inline Range range_add(Range a, Range b) {
+    Range r;
+    if (__builtin_add_overflow(a.lo, b.lo, &r.lo) || __builtin_add_overflow(a.hi, b.hi, &r.hi)) {
+        return Range::full();
+    }
+    return r;
+}
+
+inline Range range_sub(Range a, Range b) {
+    Range r;
+    if (__builtin_sub_overflow(a.lo, b.hi, &r.lo) || __builtin_sub_overflow(a.hi, b.lo, &r.hi)) {
+        return Range::full();
+    }
+    return r;
+}
+
+inline Range range_neg(Range a) {
+    return range_sub(Range::constant(0), a);
+}
+
+inline Range range_mul(Range a, Range b) {
+    int64_t products[4];
+    if (__builtin_mul_overflow(a.lo, b.lo, &products[0]) || __builtin_mul_overflow(a.lo, b.hi, &products[1])
+        || __builtin_mul_overflow(a.hi, b.lo, &products[2]) || __builtin_mul_overflow(a.hi, b.hi, &products[3])) {
+        return Range::full();
+    }
+    return {*std::min_element(products, products + 4), *std::max_element(products, products + 4)};
+}
+
+/**
+ * Division is only tracked when both operands are known non-negative and
+ * the divisor cannot be zero; anything else is unknown.
+ */
+inline Range range_div(Range a, Range b) {
+    if (!a.is_non_negative() || b.lo < 1) {
+        return Range::full();
+    }
+    return {a.lo / b.hi, a.hi / b.lo};
+}
+
+/**
+ * Unsigned remainder: below a positive divisor, and never above a
+ * non-negative dividend.
+ */
+inline Range range_mod(Range a, Range b) {
+    if (b.lo < 1) {
+        return Range::full();
+    }
+    Range r {0, b.hi - 1};
+    if (a.is_non_negative()) {
+        r.hi = std::min(r.hi, a.hi);
+    }
+    return r;
+}
+
+inline Range range_bit_not(Range a) {
+    return {~a.hi, ~a.lo};
+}
+
+/**
+ * Masking with a non-negative value bounds the result by it.
+ */
+inline Range range_bit_and(Range a, Range b) {
+    if (a.is_non_negative() && b.is_non_negative()) return {0, std::min(a.hi, b.hi)};
+    if (a.is_non_negative()) return {0, a.hi};
+    if (b.is_non_negative()) return {0, b.hi};
+    return Range::full();
+}
+
+/**
+ * | and ^ of non-negative values stay below the next power of two.
+ */
+inline Range range_bit_or(Range a, Range b) {
+    if (!a.is_non_negative() || !b.is_non_negative()) {
+        return Range::full();
+    }
+    const uint64_t high = static_cast<uint64_t>(std::max(a.hi, b.hi));
+    return {0, static_cast<int64_t>(std::bit_ceil(high + 1) - 1)};
+}
+
+/**
+ * Left shift by a known count, when no bit reaches the sign bit.
+ */
+inline Range range_shl(Range a, Range b) {
+    if (!a.is_non_negative() || !b.is_constant() || b.lo < 0 || b.lo > 63 || a.hi > (INT64_MAX >> b.lo)) {
+        return Range::full();
+    }
+    return {a.lo << b.lo, a.hi << b.lo};
+}
+
+/**
+ * Arithmetic right shift by a count in [0, 63]; larger counts move every
+ * value towards 0 or -1.
+ */
+inline Range range_shr(Range a, Range b) {
+    if (b.lo < 0 || b.hi > 63) {
+        return Range::full();
+    }
+    return {std::min(a.lo >> b.lo, a.lo >> b.hi), std::max(a.hi >> b.lo, a.hi >> b.hi)};
+}
+
+/**
+ * Outcome of `a < b` if it is the same for every pair of values in the ranges.
+ */
+inline std::optional<bool> range_less(Range a, Range b) {
+    if (a.hi < b.lo) return true;
+    if (a.lo >= b.hi) return false;
+    return {};
+}
+
+/**
+ * Outcome of `a == b` if it is the same for every pair of values in the ranges.
+ */
+inline std::optional<bool> range_equal(Range a, Range b) {
+    if (a.is_constant() && b.is_constant() && a.lo == b.lo) return true;
+    if (range_meet(a, b).is_empty()) return false;
+    return {};
+}
+
+/**
+ * Range of a comparison result: a known 0/1 when decided, otherwise [0, 1].
+ */
+inline Range range_of_truth(std::optional<bool> truth) {
+    if (truth.has_value()) {
+        return Range::constant(truth.value() ? 1 : 0);
+    }
+    return {0, 1};
+}
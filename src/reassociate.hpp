@@ -0,0 +1,354 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./arena.hpp"
+#include "./parser.hpp"
+
+/**
+ * Tree-height reduction. Integer arithmetic wraps around, so chains of `+`/`-`
+ * and of `*` can be regrouped freely. The parser builds them left-deep, so each
+ * operation waits for the previous one. This pass rewrites each chain into a
+ * balanced tree, where independent operations can run in parallel, and folds
+ * all literals of a chain into one constant applied at the root:
+ *
+ *     a + b + c + d + 1 + 2   =>   ((a + b) + (c + d)) + 3
+ *     2 * x * y * z * 4       =>   ((x * y) * z) * 8
+ *     x * 1                   =>   x
+ *
+ * Chains containing read() or alloc() are left in source order, and f64
+ * chains are not touched at all: rounding makes float addition and
+ * multiplication non-associative.
+ */
+class Reassociator {
+public:
+    inline Reassociator()
+        : m_allocator(1024 * 1024 * 4) // 4 MB blocks
+    {
+    }
+
+    /**
+     * Rewrites every expression of the program in place. The new nodes live as
+     * long as the Reassociator.
+     */
+    void run(NodeProg& prog) {
+        for (NodeStmt* stmt : prog.stmts) {
+            rewrite_stmt(stmt);
+        }
+    }
+
+private:
+    struct Operand {
+        NodeExpr* expr;
+        bool negative;
+    };
+
+    void rewrite_stmt(NodeStmt* stmt) {
+        struct StmtVisitor {
+            Reassociator& pass;
+            void operator()(NodeStmtExit* stmt_exit) const { pass.rewrite(stmt_exit->expr); }
+            void operator()(NodeStmtLet* stmt_let) const { pass.rewrite(stmt_let->expr); }
+            void operator()(NodeScope* scope) const { pass.rewrite_scope(scope); }
+            void operator()(NodeStmtIf* stmt_if) const {
+                pass.rewrite(stmt_if->expr);
+                pass.rewrite_scope(stmt_if->scope);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        pass.rewrite((*elif)->expr);
+                        pass.rewrite_scope((*elif)->scope);
+                        pred = (*elif)->pred;
+                    } else {
+                        pass.rewrite_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        pred.reset();
+                    }
+                }
+            }
+            void operator()(NodeStmtAssign* stmt_assign) const { pass.rewrite(stmt_assign->expr); }
+            void operator()(NodeStmtPrint* stmt_print) const { pass.rewrite(stmt_print->expr); }
+            void operator()(NodeStmtIndexAssign* stmt_assign) const {
+                pass.rewrite(stmt_assign->index);
+                pass.rewrite(stmt_assign->expr);
+            }
+            void operator()(NodeStmtFor* stmt_for) const {
+                pass.rewrite_stmt(stmt_for->init);
+                pass.rewrite(stmt_for->cond);
+                pass.rewrite_stmt(stmt_for->step);
+                pass.rewrite_scope(stmt_for->scope);
+            }
+            void operator()(NodeStmtParallelFor* stmt_parallel) const { (*this)(stmt_parallel->loop); }
+            void operator()(NodeStmtAsm*) const {}
+            void operator()(NodeStmtExtern*) const {}
+            void operator()(NodeStmtStruct*) const {}
+            void operator()(NodeStmtFieldAssign* stmt_assign) const {
+                pass.rewrite(stmt_assign->target->index);
+                pass.rewrite(stmt_assign->expr);
+            }
+            void operator()(NodeStmtCall* stmt_call) const {
+                for (NodeExpr*& arg : stmt_call->call->args) pass.rewrite(arg);
+            }
+            void operator()(NodeStmtFn* stmt_fn) const { pass.rewrite_scope(stmt_fn->scope); }
+            void operator()(NodeStmtReturn* stmt_return) const { pass.rewrite(stmt_return->expr); }
+        };
+        std::visit(StmtVisitor {.pass = *this}, stmt->var);
+    }
+
+    void rewrite_scope(NodeScope* scope) {
+        for (NodeStmt* stmt : scope->stmts) {
+            rewrite_stmt(stmt);
+        }
+    }
+
+    // Rewrite the expression and everything below it
+    void rewrite(NodeExpr*& expr) {
+        if (auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            rewrite_term(*term);
+            return;
+        }
+        auto& bin_expr = std::get<NodeBinExpr*>(expr->var)->var;
+        const bool is_sum = std::holds_alternative<NodeBinExprAdd*>(bin_expr) || std::holds_alternative<NodeBinExprSub*>(bin_expr);
+        const bool is_product = std::holds_alternative<NodeBinExprMulti*>(bin_expr);
+        if ((is_sum || is_product) && expr->type == Type::i64) {
+            std::vector<Operand> operands;
+            uint64_t constant = is_sum ? 0 : 1;
+            size_t literals = 0;
+            if (is_sum) {
+                collect_sum(expr, false, operands, constant, literals);
+            } else {
+                collect_product(expr, operands, constant, literals);
+            }
+            bool effects = false;
+            for (const Operand& operand : operands) {
+                effects = effects || has_side_effects(operand.expr);
+            }
+            // A lone literal is dropped when it is the identity (x * 1, x + 0)
+            const bool identity = literals == 1 && constant == (is_sum ? 0 : 1);
+            if ((operands.size() >= 3 || literals >= 2 || identity) && !(effects && operands.size() >= 2)) {
+                for (Operand& operand : operands) {
+                    rewrite(operand.expr);
+                }
+                expr = is_sum ? build_sum(operands, constant) : build_product(operands, constant);
+                return;
+            }
+        }
+        std::visit([&](auto* bin) {
+            rewrite(bin->lhs);
+            rewrite(bin->rhs);
+        }, bin_expr);
+    }
+
+    void rewrite_term(NodeTerm* term) {
+        struct TermVisitor {
+            Reassociator& pass;
+            void operator()(NodeTermIntLit*) const {}
+            void operator()(NodeTermIdent*) const {}
+            void operator()(NodeTermNeg* term_neg) const { pass.rewrite_term(term_neg->term); }
+            void operator()(NodeTermBitNot* term_bit_not) const { pass.rewrite_term(term_bit_not->term); }
+            void operator()(NodeTermParen* term_paren) const { pass.rewrite(term_paren->expr); }
+            void operator()(NodeTermRead*) const {}
+            void operator()(NodeTermArg* term_arg) const { pass.rewrite(term_arg->index); }
+            void operator()(NodeTermAlloc* term_alloc) const { pass.rewrite(term_alloc->count); }
+            void operator()(NodeTermIndex* term_index) const { pass.rewrite(term_index->index); }
+            void operator()(NodeTermField* term_field) const { pass.rewrite(term_field->index); }
+            void operator()(NodeTermPipeline* pipeline) const {
+                pass.rewrite(pipeline->begin);
+                pass.rewrite(pipeline->end);
+                for (NodePipeStage& stage : pipeline->stages) pass.rewrite(stage.body);
+            }
+            void operator()(NodeTermFloatLit*) const {}
+            void operator()(NodeTermConvert* term_convert) const { pass.rewrite(term_convert->expr); }
+            void operator()(NodeTermIntrinsic* term_intrinsic) const {
+                if (term_intrinsic->arg != nullptr) {
+                    pass.rewrite(term_intrinsic->arg);
+                }
+            }
+            void operator()(NodeTermCall* term_call) const {
+                for (NodeExpr*& arg : term_call->args) pass.rewrite(arg);
+            }
+        };
+        std::visit(TermVisitor {.pass = *this}, term->var);
+    }
+
+    // Flatten a chain of +, - and unary minus (through parentheses) into signed
+    // operands plus the sum of its literals
+    void collect_sum(NodeExpr* expr, bool negative, std::vector<Operand>& operands, uint64_t& constant, size_t& literals) {
+        if (auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (auto* lit = std::get_if<NodeTermIntLit*>(&(*term)->var)) {
+                const auto value = static_cast<uint64_t>(std::stoll((*lit)->int_lit.value.value()));
+                constant = negative ? constant - value : constant + value;
+                literals++;
+                return;
+            }
+            if (auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                collect_sum((*paren)->expr, negative, operands, constant, literals);
+                return;
+            }
+            if (auto* neg = std::get_if<NodeTermNeg*>(&(*term)->var)) {
+                collect_sum(make_expr((*neg)->term), !negative, operands, constant, literals);
+                return;
+            }
+        } else {
+            auto& bin_expr = std::get<NodeBinExpr*>(expr->var)->var;
+            if (auto* add = std::get_if<NodeBinExprAdd*>(&bin_expr)) {
+                collect_sum((*add)->lhs, negative, operands, constant, literals);
+                collect_sum((*add)->rhs, negative, operands, constant, literals);
+                return;
+            }
+            if (auto* sub = std::get_if<NodeBinExprSub*>(&bin_expr)) {
+                collect_sum((*sub)->lhs, negative, operands, constant, literals);
+                collect_sum((*sub)->rhs, !negative, operands, constant, literals);
+                return;
+            }
+        }
+        operands.push_back({expr, negative});
+    }
+
+    // Flatten a chain of * (through parentheses and unary minus) into factors
+    // plus the product of its literals
+    void collect_product(NodeExpr* expr, std::vector<Operand>& operands, uint64_t& constant, size_t& literals) {
+        if (auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (auto* lit = std::get_if<NodeTermIntLit*>(&(*term)->var)) {
+                constant *= static_cast<uint64_t>(std::stoll((*lit)->int_lit.value.value()));
+                literals++;
+                return;
+            }
+            if (auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                collect_product((*paren)->expr, operands, constant, literals);
+                return;
+            }
+            if (auto* neg = std::get_if<NodeTermNeg*>(&(*term)->var)) {
+                constant = 0 - constant;
+                collect_product(make_expr((*neg)->term), operands, constant, literals);
+                return;
+            }
+        } else if (auto* multi = std::get_if<NodeBinExprMulti*>(&std::get<NodeBinExpr*>(expr->var)->var)) {
+            collect_product((*multi)->lhs, operands, constant, literals);
+            collect_product((*multi)->rhs, operands, constant, literals);
+            return;
+        }
+        operands.push_back({expr, false});
+    }
+
+    // (positives) - (negatives) + constant, each side a balanced tree
+    NodeExpr* build_sum(const std::vector<Operand>& operands, uint64_t constant) {
+        std::vector<NodeExpr*> positives;
+        std::vector<NodeExpr*> negatives;
+        for (const Operand& operand : operands) {
+            (operand.negative ? negatives : positives).push_back(operand.expr);
+        }
+        NodeExpr* result = nullptr;
+        if (!positives.empty()) {
+            result = balance<NodeBinExprAdd>(positives, 0, positives.size());
+        }
+        if (!negatives.empty()) {
+            NodeExpr* subtrahend = balance<NodeBinExprAdd>(negatives, 0, negatives.size());
+            if (result != nullptr) {
+                result = make_bin<NodeBinExprSub>(result, subtrahend);
+            } else if (constant != 0) {
+                // c - (x + y) keeps the subtraction instead of negating
+                result = make_bin<NodeBinExprSub>(make_literal(constant), subtrahend);
+                constant = 0;
+            } else {
+                auto* paren = m_allocator.emplace<NodeTermParen>(subtrahend);
+                result = make_expr(m_allocator.emplace<NodeTerm>(m_allocator.emplace<NodeTermNeg>(
+                    m_allocator.emplace<NodeTerm>(paren))));
+            }
+        }
+        if (result == nullptr) {
+            return make_literal(constant);
+        }
+        if (constant != 0) {
+            result = make_bin<NodeBinExprAdd>(result, make_literal(constant));
+        }
+        return result;
+    }
+
+    // (balanced product of the factors) * constant
+    NodeExpr* build_product(const std::vector<Operand>& operands, uint64_t constant) {
+        if (operands.empty()) {
+            return make_literal(constant);
+        }
+        std::vector<NodeExpr*> factors;
+        for (const Operand& operand : operands) {
+            factors.push_back(operand.expr);
+        }
+        NodeExpr* result = balance<NodeBinExprMulti>(factors, 0, factors.size());
+        if (constant != 1) {
+            result = make_bin<NodeBinExprMulti>(result, make_literal(constant));
+        }
+        return result;
+    }
+
+    // Combine exprs[lo, hi) into a tree of height log2(hi - lo), keeping their order
+    template <typename Op>
+    NodeExpr* balance(const std::vector<NodeExpr*>& exprs, size_t lo, size_t hi) {
+        if (hi - lo == 1) {
+            return exprs[lo];
+        }
+        const size_t mid = lo + (hi - lo) / 2;
+        return make_bin<Op>(balance<Op>(exprs, lo, mid), balance<Op>(exprs, mid, hi));
+    }
+
+    template <typename Op>
+    NodeExpr* make_bin(NodeExpr* lhs, NodeExpr* rhs) {
+        auto* op = m_allocator.emplace<Op>(lhs, rhs);
+        return m_allocator.emplace<NodeExpr>(m_allocator.emplace<NodeBinExpr>(op));
+    }
+
+    NodeExpr* make_literal(uint64_t value) {
+        const Token token {.type = TokenType::int_lit, .line = 0, .value = std::to_string(static_cast<int64_t>(value))};
+        return make_expr(m_allocator.emplace<NodeTerm>(m_allocator.emplace<NodeTermIntLit>(token)));
+    }
+
+    NodeExpr* make_expr(NodeTerm* term) {
+        return m_allocator.emplace<NodeExpr>(term);
+    }
+
+    // read() consumes input, alloc() returns a different block each time,
+    // rdtsc() reads a clock and C functions may do anything, so chains
+    // containing them are not reordered. The answer is kept for every node:
+    // rewrite() asks again at each chain it descends into, which would walk
+    // deeply nested expressions once per level.
+    bool has_side_effects(const NodeExpr* expr) {
+        if (const auto it = m_effects.find(expr); it != m_effects.end()) {
+            return it->second;
+        }
+        struct EffectVisitor {
+            Reassociator& self;
+            bool operator()(const NodeTermIntLit*) const { return false; }
+            bool operator()(const NodeTermIdent*) const { return false; }
+            bool operator()(const NodeTermNeg* term_neg) const { return (*this)(term_neg->term); }
+            bool operator()(const NodeTermBitNot* term_bit_not) const { return (*this)(term_bit_not->term); }
+            bool operator()(const NodeTermParen* term_paren) const { return self.has_side_effects(term_paren->expr); }
+            bool operator()(const NodeTermRead*) const { return true; }
+            bool operator()(const NodeTermArg* term_arg) const { return self.has_side_effects(term_arg->index); }
+            bool operator()(const NodeTermAlloc*) const { return true; }
+            bool operator()(const NodeTermIndex* term_index) const { return self.has_side_effects(term_index->index); }
+            bool operator()(const NodeTermField* term_field) const { return self.has_side_effects(term_field->index); }
+            bool operator()(const NodeTermPipeline* pipeline) const {
+                return self.has_side_effects(pipeline->begin) || self.has_side_effects(pipeline->end)
+                    || std::any_of(pipeline->stages.begin(), pipeline->stages.end(), [&](const NodePipeStage& stage) { return self.has_side_effects(stage.body); });
+            }
+            bool operator()(const NodeTermFloatLit*) const { return false; }
+            bool operator()(const NodeTermConvert* term_convert) const { return self.has_side_effects(term_convert->expr); }
+            bool operator()(const NodeTermIntrinsic* term_intrinsic) const {
+                return term_intrinsic->arg == nullptr || self.has_side_effects(term_intrinsic->arg);
+            }
+            bool operator()(const NodeTermCall*) const { return true; }
+            bool operator()(const NodeTerm* term) const { return std::visit(*this, term->var); }
+            bool operator()(const NodeBinExpr* bin_expr) const {
+                return std::visit([&](const auto* bin) { return self.has_side_effects(bin->lhs) || self.has_side_effects(bin->rhs); }, bin_expr->var);
+            }
+        };
+        const bool effects = std::visit(EffectVisitor { *this }, expr->var);
+        m_effects.emplace(expr, effects);
+        return effects;
+    }
+
+    ArenaAllocator m_allocator;
+    std::unordered_map<const NodeExpr*, bool> m_effects;
+};
@@ -0,0 +1,1040 @@
+#pragma once
+
+/**
+ * A freestanding assembly routine appended to generated programs, together
+ * with the uninitialized data it needs. Routines are only emitted when used.
+ */
+struct RuntimeRoutine {
+    const char* text;
+    const char* bss = "";
+};
+
+/**
+ * print_rbx / exit_rbx: print(...) and exit(...) of the value in rbx. Used
+ * under -Os so that call sites do not repeat the argument setup.
+ */
+inline const RuntimeRoutine rt_print_rbx {
+    .text = R"(
+print_rbx:
+    mov rdi, rbx
+    jmp print_int
+)",
+};
+
+inline const RuntimeRoutine rt_exit_rbx {
+    .text = R"(
+exit_rbx:
+    mov rdi, rbx
+    mov eax, 231
+    syscall
+)",
+};
+
+/**
+ * print_int(rdi): writes a signed integer followed by a newline to stdout.
+ */
+inline const RuntimeRoutine rt_print_int {
+    .text = R"(
+print_int:
+    push rbp
+    mov rbp, rsp
+    sub rsp, 32
+    ; Check if number is negative
+    test rdi, rdi
+    jns .positive
+    ; Handle negative number
+    mov byte [rsp], '-'
+    mov rax, 1
+    mov rsi, rsp
+    mov rdx, 1
+    push rdi
+    mov rdi, 1
+    syscall
+    pop rdi
+    neg rdi
+.positive:
+    test rdi, rdi
+    jnz .non_zero
+    mov byte [rsp], '0'
+    mov rsi, rsp
+    mov rcx, 1
+    jmp .print
+.non_zero:
+    mov rax, rdi
+    lea rsi, [rsp+31]
+    mov rcx, 0
+    mov r8, 0xCCCCCCCCCCCCCCCD
+.convert_loop:
+    ; q = n / 10 by reciprocal multiplication, digit = n - q * 10
+    mov r9, rax
+    mul r8
+    shr rdx, 3
+    lea rax, [rdx + rdx*4]
+    add rax, rax
+    sub r9, rax
+    mov rax, rdx
+    add r9b, '0'
+    dec rsi
+    mov [rsi], r9b
+    inc rcx
+    test rax, rax
+    jnz .convert_loop
+.print:
+    mov rax, 1
+    mov rdi, 1
+    mov rdx, rcx
+    syscall
+
+    ; Print newline
+    mov byte [rsp], 10
+    mov rax, 1
+    mov rdi, 1
+    mov rsi, rsp
+    mov rdx, 1
+    syscall
+
+    mov rsp, rbp
+    pop rbp
+    ret
+)",
+};
+
+/**
+ * print_f64(xmm0): writes a double followed by a newline to stdout, using a
+ * digit string that reads back as the same value (Grisu2). Grisu2 does not
+ * check that the string is the shortest one, and for about 0.1% of doubles
+ * it is not: 1e23 prints as 9.999999999999999e22.
+ *
+ * The value v lies between the boundaries m- and m+ halfway to its
+ * neighbours. All three are scaled by a cached power of ten 10^-K chosen so
+ * the products fall in [2^-60, 2^-32) * 2^64; digits of m+ are then produced
+ * from the integral and fractional parts until the remainder fits in the
+ * m+ - m- interval, and the last digit is nudged towards v. The digits are
+ * laid out like `1234.5`, `0.00012`, `100.0` or `1.5e-7`.
+ */
+inline const RuntimeRoutine rt_print_f64 {
+    .text = R"(
+print_f64:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    ; [rsp, rsp + 17): digits, [rsp + 32, rsp + 72): output text
+    sub rsp, 72
+    movq rax, xmm0
+    lea rdi, [rsp + 32]
+    btr rax, 63
+    jnc .positive
+    mov byte [rdi], '-'
+    inc rdi
+.positive:
+    mov rdx, rax
+    shr rdx, 52
+    mov rcx, 0xfffffffffffff
+    and rcx, rax
+    cmp edx, 0x7ff
+    je .special
+    test rax, rax
+    jz .zero
+    ; v = r8 * 2^r9d
+    mov r8, rcx
+    mov r9d, -1074
+    test edx, edx
+    jz .unpacked
+    bts r8, 52
+    lea r9d, [rdx - 1075]
+.unpacked:
+    ; m+ = (2v + 1) * 2^(e - 1), normalized: r10 * 2^r11d
+    lea r10, [r8 + r8 + 1]
+    lea r11d, [r9 - 1]
+    bsr rcx, r10
+    xor ecx, 63
+    shl r10, cl
+    sub r11d, ecx
+    ; m- = (2v - 1) * 2^(e - 1), or (4v - 1) * 2^(e - 2) when v is a power of
+    ; two and its lower neighbour is closer; aligned with m+
+    mov rax, 0x10000000000000
+    cmp r8, rax
+    je .narrow
+    lea r12, [r8 + r8 - 1]
+    lea ecx, [r9 - 1]
+    jmp .aligned
+.narrow:
+    lea r12, [r8*4 - 1]
+    lea ecx, [r9 - 2]
+.aligned:
+    sub ecx, r11d
+    shl r12, cl
+    ; w = v normalized, which shares the exponent of m+
+    bsr rcx, r8
+    xor ecx, 63
+    shl r8, cl
+    ; Cached power index from ceil((-61 - e) * log10(2)) + 347
+    lea eax, [r11 + 61]
+    imul eax, eax, 78913
+    sar eax, 18
+    mov ecx, 347
+    sub ecx, eax
+    sar ecx, 3
+    inc ecx
+    lea eax, [rcx*8]
+    mov r15d, 348
+    sub r15d, eax
+    mov rbp, [grisu_cached_f + rcx*8]
+    movsx ebx, word [grisu_cached_e + rcx*2]
+    ; 64x64 -> 64 bit products, rounded; m+ and m- are narrowed by one unit
+    mov rax, r8
+    mul rbp
+    shr rax, 63
+    lea r13, [rdx + rax]
+    mov rax, r10
+    mul rbp
+    shr rax, 63
+    lea r10, [rdx + rax - 1]
+    mov rax, r12
+    mul rbp
+    shr rax, 63
+    lea r12, [rdx + rax + 1]
+    ; The scaled values have the binary point r9d = -(e + e_c + 64) bits up
+    lea ecx, [r11 + rbx + 64]
+    neg ecx
+    mov r9d, ecx
+    mov r11, 1
+    shl r11, cl
+    dec r11
+    mov r14, r10
+    sub r14, r12
+    sub r13, r10
+    neg r13
+    mov r8, r10
+    shr r8, cl
+    and r10, r11
+    ; r8d: integral part, r10: fraction, r14: m+ - m-, r13: m+ - w,
+    ; esi: digits left in the integral part, ebx: digits written
+    mov esi, 1
+.count:
+    cmp esi, 9
+    je .counted
+    cmp r8d, [grisu_pow10 + rsi*4]
+    jb .counted
+    inc esi
+    jmp .count
+.counted:
+    xor ebx, ebx
+.integral:
+    mov eax, r8d
+    xor edx, edx
+    div dword [grisu_pow10 + rsi*4 - 4]
+    mov r8d, edx
+    test eax, eax
+    jnz .integral_digit
+    test ebx, ebx
+    jz .integral_skip
+.integral_digit:
+    add al, '0'
+    mov [rsp + rbx], al
+    inc ebx
+.integral_skip:
+    dec esi
+    mov rax, r8
+    mov ecx, r9d
+    shl rax, cl
+    add rax, r10
+    cmp rax, r14
+    ja .integral_next
+    ; Done: rax = rest, rdx = 10^kappa at the binary point
+    add r15d, esi
+    mov edx, [grisu_pow10 + rsi*4]
+    shl rdx, cl
+    jmp .round
+.integral_next:
+    test esi, esi
+    jnz .integral
+.fraction:
+    lea r10, [r10 + r10*4]
+    add r10, r10
+    lea r14, [r14 + r14*4]
+    add r14, r14
+    mov rax, r10
+    mov ecx, r9d
+    shr rax, cl
+    test eax, eax
+    jnz .fraction_digit
+    test ebx, ebx
+    jz .fraction_skip
+.fraction_digit:
+    add al, '0'
+    mov [rsp + rbx], al
+    inc ebx
+.fraction_skip:
+    and r10, r11
+    dec esi
+    cmp r10, r14
+    jae .fraction
+    add r15d, esi
+    ; m+ - w grows with the digits produced; past 10^9 it no longer matters
+    mov eax, esi
+    neg eax
+    xor edx, edx
+    cmp eax, 9
+    jae .scaled
+    mov edx, [grisu_pow10 + rax*4]
+.scaled:
+    imul r13, rdx
+    mov rax, r10
+    lea rdx, [r11 + 1]
+.round:
+    ; Step the last digit down while that moves closer to w and stays above m-
+    cmp rax, r13
+    jae .rounded
+    mov rcx, r14
+    sub rcx, rax
+    cmp rcx, rdx
+    jb .rounded
+    lea rcx, [rax + rdx]
+    cmp rcx, r13
+    jb .round_down
+    mov rbp, r13
+    sub rbp, rax
+    sub rcx, r13
+    cmp rbp, rcx
+    jbe .rounded
+.round_down:
+    dec byte [rsp + rbx - 1]
+    add rax, rdx
+    jmp .round
+.rounded:
+    ; value = digits * 10^K; eax = position of the decimal point
+    lea eax, [rbx + r15]
+    test r15d, r15d
+    js .point_inside
+    cmp eax, 21
+    jg .exponent
+    ; 1500.0: digits, K zeros, ".0"
+    mov rsi, rsp
+    mov ecx, ebx
+    rep movsb
+    mov al, '0'
+    mov ecx, r15d
+    rep stosb
+    mov byte [rdi], '.'
+    mov byte [rdi + 1], '0'
+    add rdi, 2
+    jmp .print
+.point_inside:
+    test eax, eax
+    jle .leading_zeros
+    ; 12.75
+    mov rsi, rsp
+    mov ecx, eax
+    rep movsb
+    mov byte [rdi], '.'
+    inc rdi
+    mov ecx, ebx
+    sub ecx, eax
+    rep movsb
+    jmp .print
+.leading_zeros:
+    cmp eax, -6
+    jle .exponent
+    ; 0.00125
+    mov byte [rdi], '0'
+    mov byte [rdi + 1], '.'
+    add rdi, 2
+    mov ecx, eax
+    neg ecx
+    mov al, '0'
+    rep stosb
+    mov rsi, rsp
+    mov ecx, ebx
+    rep movsb
+    jmp .print
+.exponent:
+    ; 1.25e-7
+    mov r8d, eax
+    mov al, [rsp]
+    mov [rdi], al
+    inc rdi
+    cmp ebx, 1
+    je .exponent_mark
+    mov byte [rdi], '.'
+    inc rdi
+    lea rsi, [rsp + 1]
+    lea ecx, [rbx - 1]
+    rep movsb
+.exponent_mark:
+    mov byte [rdi], 'e'
+    inc rdi
+    lea eax, [r8 - 1]
+    test eax, eax
+    jns .exponent_digits
+    mov byte [rdi], '-'
+    inc rdi
+    neg eax
+.exponent_digits:
+    ; At most three digits, built backwards just below the output text
+    lea rsi, [rsp + 32]
+    mov ecx, 10
+.exponent_digit:
+    xor edx, edx
+    div ecx
+    add dl, '0'
+    dec rsi
+    mov [rsi], dl
+    test eax, eax
+    jnz .exponent_digit
+    lea rcx, [rsp + 32]
+    sub rcx, rsi
+    rep movsb
+    jmp .print
+.special:
+    test rcx, rcx
+    jz .infinity
+    ; NaN is printed without a sign
+    lea rdi, [rsp + 32]
+    mov byte [rdi], 'N'
+    mov byte [rdi + 1], 'a'
+    mov byte [rdi + 2], 'N'
+    add rdi, 3
+    jmp .print
+.infinity:
+    mov byte [rdi], 'i'
+    mov byte [rdi + 1], 'n'
+    mov byte [rdi + 2], 'f'
+    add rdi, 3
+    jmp .print
+.zero:
+    mov byte [rdi], '0'
+    mov byte [rdi + 1], '.'
+    mov byte [rdi + 2], '0'
+    add rdi, 3
+.print:
+    mov byte [rdi], 10
+    lea rsi, [rsp + 32]
+    lea rdx, [rdi + 1]
+    sub rdx, rsi
+    mov eax, 1
+    mov edi, 1
+    syscall
+    add rsp, 72
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+grisu_pow10:
+    dd 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+; Normalized 10^k for k = -348, -340, ..., 340: significands and binary exponents
+grisu_cached_f:
+    dq 0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76, 0xcf42894a5dce35ea
+    dq 0x9a6bb0aa55653b2d, 0xe61acf033d1a45df, 0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f
+    dq 0xbe5691ef416bd60c, 0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5
+    dq 0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57, 0xc21094364dfb5637
+    dq 0x9096ea6f3848984f, 0xd77485cb25823ac7, 0xa086cfcd97bf97f4, 0xef340a98172aace5
+    dq 0xb23867fb2a35b28e, 0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996
+    dq 0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126, 0xb5b5ada8aaff80b8
+    dq 0x87625f056c7c4a8b, 0xc9bcff6034c13053, 0x964e858c91ba2655, 0xdff9772470297ebd
+    dq 0xa6dfbd9fb8e5b88f, 0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b
+    dq 0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06, 0xaa242499697392d3
+    dq 0xfd87b5f28300ca0e, 0xbce5086492111aeb, 0x8cbccc096f5088cc, 0xd1b71758e219652c
+    dq 0x9c40000000000000, 0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984
+    dq 0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068, 0x9f4f2726179a2245
+    dq 0xed63a231d4c4fb27, 0xb0de65388cc8ada8, 0x83c7088e1aab65db, 0xc45d1df942711d9a
+    dq 0x924d692ca61be758, 0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85
+    dq 0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d, 0x952ab45cfa97a0b3
+    dq 0xde469fbd99a05fe3, 0xa59bc234db398c25, 0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece
+    dq 0x88fcf317f22241e2, 0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a
+    dq 0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410, 0x8bab8eefb6409c1a
+    dq 0xd01fef10a657842c, 0x9b10a4e5e9913129, 0xe7109bfba19c0c9d, 0xac2820d9623bf429
+    dq 0x80444b5e7aa7cf85, 0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841
+    dq 0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b
+grisu_cached_e:
+    dw -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927
+    dw -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608
+    dw -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289
+    dw -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30
+    dw 56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348
+    dw 375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667
+    dw 694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986
+    dw 1013, 1039, 1066
+)",
+};
+
+/**
+ * read_int() -> rax: parses the next integer from stdin, skipping any
+ * non-numeric bytes before it. Returns 0 at end of input.
+ *
+ * stdin is consumed through a 1 MiB buffer. The byte after the valid data is
+ * always a NUL sentinel, so the digit loop needs no bounds check: running
+ * into the sentinel looks like the end of the number, and only then is the
+ * position compared against the end to tell the two apart.
+ */
+inline const RuntimeRoutine rt_read_int {
+    .text = R"(
+read_int:
+    mov rsi, [read_pos]
+    mov rdi, [read_end]
+    xor r8d, r8d
+.skip:
+    cmp rsi, rdi
+    jb .skip_char
+    call read_refill
+    cmp rsi, rdi
+    je .eof
+.skip_char:
+    movzx ecx, byte [rsi]
+    inc rsi
+    cmp ecx, '-'
+    je .minus
+    sub ecx, '0'
+    cmp ecx, 9
+    ja .skip
+    mov eax, ecx
+    jmp .digit
+.minus:
+    ; A sign only counts if a digit follows it
+    cmp rsi, rdi
+    jb .sign_char
+    call read_refill
+    cmp rsi, rdi
+    je .eof
+.sign_char:
+    movzx ecx, byte [rsi]
+    sub ecx, '0'
+    cmp ecx, 9
+    ja .skip
+    mov r8d, 1
+    xor eax, eax
+.digit:
+    movzx ecx, byte [rsi]
+    sub ecx, '0'
+    cmp ecx, 9
+    ja .digit_end
+    lea rax, [rax + rax*4]
+    lea rax, [rcx + rax*2]
+    inc rsi
+    jmp .digit
+.digit_end:
+    cmp rsi, rdi
+    jb .done
+    ; Stopped on the sentinel: the number may continue in the next block
+    push rax
+    call read_refill
+    pop rax
+    cmp rsi, rdi
+    jne .digit
+.done:
+    mov [read_pos], rsi
+    test r8d, r8d
+    jz .positive
+    neg rax
+.positive:
+    ret
+.eof:
+    mov [read_pos], rsi
+    xor eax, eax
+    ret
+
+; Refills the stdin buffer: returns rsi = start and rdi = end of the new data
+read_refill:
+    xor eax, eax
+    xor edi, edi
+    mov rsi, read_buf
+    mov edx, 1048576
+    syscall
+    test rax, rax
+    jg .filled
+    xor eax, eax
+.filled:
+    mov rsi, read_buf
+    lea rdi, [rsi + rax]
+    mov byte [rdi], 0
+    mov [read_end], rdi
+    ret
+)",
+    .bss = R"(
+read_pos resq 1
+read_end resq 1
+read_buf resb 1048577
+alignb 8
+)",
+};
+
+/**
+ * arg_int(rdi) -> rax: parses argv[rdi] as an integer. Returns 0 if the
+ * argument is missing. Needs `argv_base` to hold the initial stack pointer.
+ */
+inline const RuntimeRoutine rt_arg_int {
+    .text = R"(
+arg_int:
+    mov rax, [argv_base]
+    cmp rdi, [rax]
+    jae .missing
+    mov rsi, [rax + 8 + rdi*8]
+    xor eax, eax
+    xor r8d, r8d
+    cmp byte [rsi], '-'
+    jne .digit
+    mov r8d, 1
+    inc rsi
+.digit:
+    movzx ecx, byte [rsi]
+    sub ecx, '0'
+    cmp ecx, 9
+    ja .done
+    lea rax, [rax + rax*4]
+    lea rax, [rcx + rax*2]
+    inc rsi
+    jmp .digit
+.done:
+    test r8d, r8d
+    jz .positive
+    neg rax
+.positive:
+    ret
+.missing:
+    xor eax, eax
+    ret
+)",
+    .bss = R"(
+argv_base resq 1
+)",
+};
+
+/**
+ * clock_ns() -> rax: CLOCK_MONOTONIC in nanoseconds. The first call looks up
+ * __vdso_clock_gettime in the vDSO the kernel maps into every process, found
+ * through AT_SYSINFO_EHDR in the auxiliary vector; `clock_stack` must hold
+ * the initial stack pointer. Without a vDSO it falls back to the
+ * clock_gettime system call. The vDSO function is C code, so it is called on
+ * an aligned stack, and xmm0-xmm3 are saved around it like every runtime
+ * routine leaves them intact.
+ */
+inline const RuntimeRoutine rt_clock_ns {
+    .text = R"(
+clock_ns:
+    push rbp
+    mov rbp, rsp
+    and rsp, -16
+    sub rsp, 48
+    movsd [rsp + 16], xmm0
+    movsd [rsp + 24], xmm1
+    movsd [rsp + 32], xmm2
+    movsd [rsp + 40], xmm3
+    ; clock_fn: 0 before the lookup, 1 if there is no vDSO function
+    mov rax, [clock_fn]
+    test rax, rax
+    jz .lookup
+.call:
+    cmp rax, 1
+    je .syscall
+    mov edi, 1
+    mov rsi, rsp
+    call rax
+    jmp .done
+.syscall:
+    mov eax, 228
+    mov edi, 1
+    mov rsi, rsp
+    syscall
+.done:
+    imul rax, [rsp], 1000000000
+    add rax, [rsp + 8]
+    movsd xmm0, [rsp + 16]
+    movsd xmm1, [rsp + 24]
+    movsd xmm2, [rsp + 32]
+    movsd xmm3, [rsp + 40]
+    mov rsp, rbp
+    pop rbp
+    ret
+.lookup:
+    ; Skip argc, argv and envp to reach the auxiliary vector
+    mov rcx, [clock_stack]
+    mov rdx, [rcx]
+    lea rcx, [rcx + rdx*8 + 16]
+.skip_env:
+    mov rdx, [rcx]
+    add rcx, 8
+    test rdx, rdx
+    jnz .skip_env
+.auxv:
+    mov rdx, [rcx]
+    test rdx, rdx
+    jz .missing
+    add rcx, 16
+    cmp rdx, 33
+    jne .auxv
+    ; ELF header of the vDSO: r10 = load bias from the PT_LOAD segment,
+    ; r9 = address of the PT_DYNAMIC segment
+    mov r8, [rcx - 8]
+    mov rcx, [r8 + 32]
+    add rcx, r8
+    movzx edx, word [r8 + 56]
+    movzx r11d, word [r8 + 54]
+    mov r10, r8
+    xor r9d, r9d
+.phdr:
+    test edx, edx
+    jz .phdr_done
+    mov eax, [rcx]
+    cmp eax, 1
+    jne .not_load
+    mov r10, r8
+    add r10, [rcx + 8]
+    sub r10, [rcx + 16]
+.not_load:
+    cmp eax, 2
+    jne .next_phdr
+    mov r9, [rcx + 16]
+.next_phdr:
+    add rcx, r11
+    dec edx
+    jmp .phdr
+.phdr_done:
+    test r9, r9
+    jz .missing
+    add r9, r10
+    ; Dynamic entries: rdx = DT_HASH, rdi = DT_STRTAB, rsi = DT_SYMTAB
+    xor edx, edx
+    xor edi, edi
+    xor esi, esi
+.dyn:
+    mov rax, [r9]
+    test rax, rax
+    jz .dyn_done
+    cmp rax, 4
+    cmove rdx, [r9 + 8]
+    cmp rax, 5
+    cmove rdi, [r9 + 8]
+    cmp rax, 6
+    cmove rsi, [r9 + 8]
+    add r9, 16
+    jmp .dyn
+.dyn_done:
+    test rdx, rdx
+    jz .missing
+    test rdi, rdi
+    jz .missing
+    test rsi, rsi
+    jz .missing
+    add rdx, r10
+    add rdi, r10
+    add rsi, r10
+    ; The hash table's chain count is the number of symbols
+    mov edx, [rdx + 4]
+.symbol:
+    test edx, edx
+    jz .missing
+    mov eax, [rsi]
+    lea r8, [rdi + rax]
+    lea r11, [.name]
+.compare:
+    mov al, [r8]
+    cmp al, [r11]
+    jne .next_symbol
+    inc r8
+    inc r11
+    test al, al
+    jnz .compare
+    cmp word [rsi + 6], 0
+    je .next_symbol
+    mov rax, [rsi + 8]
+    add rax, r10
+    jmp .found
+.next_symbol:
+    add rsi, 24
+    dec edx
+    jmp .symbol
+.missing:
+    mov eax, 1
+.found:
+    mov [clock_fn], rax
+    jmp .call
+.name:
+    db "__vdso_clock_gettime", 0
+)",
+    .bss = R"(
+clock_stack resq 1
+clock_fn resq 1
+)",
+};
+
+/**
+ * alloc(rdi) -> rax: zero-initialized storage for rdi integers.
+ *
+ * A bump allocator over anonymous mmap chunks of at least 64 MiB. The fast
+ * path only compares the request against the space left in the current
+ * chunk. Nothing is ever freed; the memory goes away with the process.
+ */
+inline const RuntimeRoutine rt_alloc {
+    .text = R"(
+alloc:
+    mov rax, [heap_ptr]
+    mov rdx, [heap_end]
+    sub rdx, rax
+    shr rdx, 3
+    cmp rdi, rdx
+    ja .grow
+    lea rdx, [rax + rdi*8]
+    mov [heap_ptr], rdx
+    ret
+.grow:
+    ; Start a new chunk; the tail of the current one is abandoned
+    mov rax, rdi
+    shr rax, 40
+    jnz .out_of_memory
+    lea rsi, [rdi*8 + 4095]
+    and rsi, -4096
+    mov eax, 67108864
+    cmp rsi, rax
+    cmovb rsi, rax
+    push rdi
+    mov eax, 9
+    xor edi, edi
+    mov edx, 3
+    mov r10d, 0x4022
+    mov r8, -1
+    xor r9d, r9d
+    syscall
+    pop rdi
+    cmp rax, -4095
+    jae .out_of_memory
+    lea rdx, [rax + rsi]
+    mov [heap_end], rdx
+    lea rdx, [rax + rdi*8]
+    mov [heap_ptr], rdx
+    ret
+.out_of_memory:
+    mov eax, 1
+    mov edi, 2
+    lea rsi, [.message]
+    mov edx, 14
+    syscall
+    mov eax, 231
+    mov edi, 1
+    syscall
+.message:
+    db "out of memory", 10
+)",
+    .bss = R"(
+heap_ptr resq 1
+heap_end resq 1
+)",
+};
+
+/**
+ * par_for(rdi = body, rsi = iteration count, rdx = frame, ecx = 1 for static
+ * scheduling): runs body(first, end) over chunks of [0, count) on every thread
+ * of the pool and returns once all iterations are done. Bodies find the frame
+ * of the enclosing code in r15.
+ *
+ * The pool is started on first use: one thread per CPU in the affinity mask,
+ * created with clone() on mmap'd stacks. Idle workers sleep on a futex until
+ * par_gen changes. Chunks are claimed with lock xadd on par_next; static
+ * scheduling hands out one contiguous chunk per thread, dynamic scheduling
+ * smaller chunks so faster threads take more of them. The caller works as
+ * well and then sleeps on par_pending until the last worker has finished.
+ */
+inline const RuntimeRoutine rt_parallel {
+    .text = R"(
+par_for:
+    test rsi, rsi
+    jle .empty
+    push rbx
+    push r12
+    push r15
+    mov [par_fn], rdi
+    mov [par_count], rsi
+    mov [par_frame], rdx
+    mov qword [par_next], 0
+    mov ebx, ecx
+    cmp qword [par_threads], 0
+    jne .started
+    call par_start
+.started:
+    ; static: ceil(count / threads), dynamic: max(1, count / (threads * 8))
+    mov rax, [par_count]
+    mov rcx, [par_threads]
+    test ebx, ebx
+    jz .dynamic
+    lea rax, [rax + rcx - 1]
+    xor edx, edx
+    div rcx
+    jmp .chunk
+.dynamic:
+    shl rcx, 3
+    xor edx, edx
+    div rcx
+    test rax, rax
+    jnz .chunk
+    mov eax, 1
+.chunk:
+    mov [par_chunk], rax
+    mov rax, [par_threads]
+    dec eax
+    mov [par_pending], eax
+    jz .work
+    lock inc dword [par_gen]
+    mov eax, 202
+    mov rdi, par_gen
+    mov esi, 129
+    mov edx, 0x7fffffff
+    syscall
+.work:
+    call par_work
+.join:
+    mov edx, [par_pending]
+    test edx, edx
+    jz .joined
+    mov eax, 202
+    mov rdi, par_pending
+    mov esi, 128
+    xor r10d, r10d
+    syscall
+    jmp .join
+.joined:
+    pop r15
+    pop r12
+    pop rbx
+.empty:
+    ret
+
+; Claims chunks until the iteration space is exhausted. Bodies are called
+; with rsp 16-byte aligned, as the System V ABI requires.
+par_work:
+    sub rsp, 8
+    mov r15, [par_frame]
+.claim:
+    mov rdi, [par_chunk]
+    lock xadd [par_next], rdi
+    mov rax, [par_count]
+    cmp rdi, rax
+    jge .done
+    mov rsi, [par_chunk]
+    add rsi, rdi
+    cmp rsi, rax
+    cmovg rsi, rax
+    call [par_fn]
+    jmp .claim
+.done:
+    add rsp, 8
+    ret
+
+; Worker thread main loop. Generation 0 is never run, so a worker that starts
+; late still picks up the first loop.
+par_worker:
+    xor r12d, r12d
+.wait:
+    mov eax, [par_gen]
+    cmp eax, r12d
+    jne .run
+    mov eax, 202
+    mov rdi, par_gen
+    mov esi, 128
+    mov edx, r12d
+    xor r10d, r10d
+    syscall
+    jmp .wait
+.run:
+    ; Loop bodies evaluate expressions in r12, so keep the generation on the stack
+    mov r12d, eax
+    push r12
+    sub rsp, 8
+    call par_work
+    add rsp, 8
+    pop r12
+    lock dec dword [par_pending]
+    jnz .wait
+    mov eax, 202
+    mov rdi, par_pending
+    mov esi, 129
+    mov edx, 1
+    syscall
+    jmp .wait
+
+; Sizes the pool from the CPU affinity mask (1 to 64 threads) and spawns the workers
+par_start:
+    sub rsp, 128
+    mov eax, 204
+    xor edi, edi
+    mov esi, 128
+    mov rdx, rsp
+    syscall
+    xor ecx, ecx
+    test rax, rax
+    jle .counted
+    shr rax, 3
+    mov rsi, rsp
+.next_word:
+    mov rdx, [rsi]
+.next_bit:
+    test rdx, rdx
+    jz .word_done
+    lea r8, [rdx - 1]
+    and rdx, r8
+    inc ecx
+    jmp .next_bit
+.word_done:
+    add rsi, 8
+    dec rax
+    jnz .next_word
+.counted:
+    add rsp, 128
+    mov eax, 1
+    cmp ecx, eax
+    cmovl ecx, eax
+    mov eax, 64
+    cmp ecx, eax
+    cmovg ecx, eax
+    mov [par_threads], rcx
+    lea r12, [rcx - 1]
+.spawn:
+    test r12, r12
+    jz .spawned
+    ; 1 MiB stack: mmap(NULL, size, READ|WRITE, PRIVATE|ANONYMOUS|STACK)
+    mov eax, 9
+    xor edi, edi
+    mov esi, 1048576
+    mov edx, 3
+    mov r10d, 0x20022
+    mov r8, -1
+    xor r9d, r9d
+    syscall
+    cmp rax, -4095
+    jae .failed
+    ; clone(VM|FS|FILES|SIGHAND|THREAD|SYSVSEM, stack top)
+    lea rsi, [rax + 1048576]
+    mov eax, 56
+    mov edi, 0x50f00
+    xor edx, edx
+    xor r10d, r10d
+    xor r8d, r8d
+    syscall
+    test rax, rax
+    jz par_worker
+    js .failed
+    dec r12
+    jmp .spawn
+.failed:
+    ; Run with the workers that did start
+    sub [par_threads], r12
+.spawned:
+    ret
+)",
+    .bss = R"(
+par_fn resq 1
+par_frame resq 1
+par_count resq 1
+par_chunk resq 1
+par_threads resq 1
+par_gen resd 1
+par_pending resd 1
+alignb 64
+par_next resq 8
+)",
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "./generation.hpp"
+
+/**
+ * Bytes of machine code per source line of an assembled program, measured
+ * between the line markers the Generator places with GenOptions::line_markers.
+ * The marker addresses are read back from the object's symbol table with nm,
+ * so the sizes are those of the encodings the assembler actually chose.
+ */
+class SizeReport {
+public:
+    /**
+     * Measures the .text of `object`, or returns nothing if nm cannot read it
+     * or it has no line markers.
+     */
+    static std::optional<SizeReport> measure(const std::string& object) {
+        FILE* nm = popen(("nm --defined-only " + object + " 2>/dev/null").c_str(), "r");
+        if (nm == nullptr) {
+            return {};
+        }
+        // (address, marker number, line) of every code symbol; other labels
+        // get no line and do not end the code of the marker before them
+        std::vector<std::tuple<uint64_t, size_t, std::optional<int>>> symbols;
+        std::optional<uint64_t> end;
+        char buffer[512];
+        while (fgets(buffer, sizeof buffer, nm) != nullptr) {
+            std::istringstream line(buffer);
+            uint64_t address;
+            char kind;
+            std::string name;
+            if (!(line >> std::hex >> address >> kind >> name) || (kind != 't' && kind != 'T')) {
+                continue;
+            }
+            const std::string prefix = Generator::k_line_marker;
+            if (name == Generator::k_line_marker_end) {
+                end = address;
+            } else if (name.starts_with(prefix) && name.find('_', prefix.size()) != std::string::npos) {
+                const size_t separator = name.find('_', prefix.size());
+                symbols.emplace_back(address, std::stoull(name.substr(separator + 1)),
+                                     std::stoi(name.substr(prefix.size(), separator - prefix.size())));
+            } else {
+                symbols.emplace_back(address, SIZE_MAX, std::nullopt);
+            }
+        }
+        pclose(nm);
+        if (!end.has_value()) {
+            return {};
+        }
+
+        // Markers at the same address are ordered by their numbers, so the
+        // last one placed owns the code that follows
+        std::sort(symbols.begin(), symbols.end(), [](const auto& a, const auto& b) {
+            return std::tie(std::get<0>(a), std::get<1>(a)) < std::tie(std::get<0>(b), std::get<1>(b));
+        });
+        SizeReport report;
+        int owner = 0;
+        for (size_t i = 0; i < symbols.size() && std::get<0>(symbols[i]) < end.value(); i++) {
+            if (std::get<2>(symbols[i]).has_value()) {
+                owner = std::get<2>(symbols[i]).value();
+            }
+            const uint64_t next = i + 1 < symbols.size() ? std::min(std::get<0>(symbols[i + 1]), end.value()) : end.value();
+            report.m_bytes[owner] += next - std::get<0>(symbols[i]);
+            report.m_total += next - std::get<0>(symbols[i]);
+        }
+        return report;
+    }
+
+    /**
+     * Prints the bytes of every source line that produced code, next to the
+     * line, followed by the entry, exit and runtime code and the total.
+     */
+    void print(std::ostream& out, const std::string& source) const {
+        std::vector<std::string> lines;
+        std::istringstream stream(source);
+        for (std::string line; std::getline(stream, line);) {
+            lines.push_back(line.substr(std::min(line.size(), line.find_first_not_of(" \t"))));
+        }
+        const auto row = [&](uint64_t bytes, const std::string& line, const std::string& text) {
+            out << std::setw(7) << bytes << std::setw(6) << std::fixed << std::setprecision(1)
+                << 100.0 * static_cast<double>(bytes) / static_cast<double>(std::max<uint64_t>(m_total, 1)) << "%"
+                << std::setw(6) << line << "  " << text << "\n";
+        };
+        out << "  bytes      %  line\n";
+        for (const auto& [line, bytes] : m_bytes) {
+            if (line != 0 && bytes != 0) {
+                row(bytes, std::to_string(line), static_cast<size_t>(line) <= lines.size() ? lines[line - 1] : "");
+            }
+        }
+        if (m_bytes.contains(0)) {
+            row(m_bytes.at(0), "", "entry, exit and runtime");
+        }
+        row(m_total, "", "total .text");
+    }
+
+private:
+    std::map<int, uint64_t> m_bytes;   // by source line; 0 for the entry, exit and runtime code
+    uint64_t m_total = 0;
+};
@@ -0,0 +1,459 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./parser.hpp"
+
+/**
+ * Superoptimizer for small arithmetic expression trees (+, -, *, unary minus
+ * over at most two variables and literals).
+ *
+ * For a tree it exhaustively enumerates short x86-64 sequences over rax, rcx
+ * and rdx, with the first variable in rax, the second in rcx and the result
+ * in rax. A candidate is accepted only if it:
+ *   1. matches the tree on random 64-bit test vectors,
+ *   2. matches it exhaustively for every 8-bit input when evaluated at 8 bits,
+ *   3. has the same normal form as a polynomial over Z/2^64. Every supported
+ *      operation is a ring operation, so this proves equivalence without a solver.
+ * The cheapest accepted sequence (and "none" if there is none within the
+ * length limit) is cached per expression shape in a text database, so each
+ * shape is only searched once.
+ */
+class Superoptimizer {
+public:
+    /**
+     * Lowering of one expression: the variables to load into rax and rcx
+     * (in that order) and the instructions computing the result into rax.
+     */
+    struct Lowering {
+        std::vector<std::string> vars;
+        std::vector<std::string> insns;
+    };
+
+    inline explicit Superoptimizer(std::string db_path)
+        : m_db_path(std::move(db_path))
+    {
+        std::ifstream db(m_db_path);
+        std::string line;
+        if (std::getline(db, line) && line != k_db_header) {
+            // Written by an older search with fewer candidates: start over
+            db.close();
+            std::ofstream(m_db_path, std::ios::trunc);
+            return;
+        }
+        while (std::getline(db, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            const size_t tab = line.find('\t');
+            if (tab == std::string::npos) {
+                continue;
+            }
+            std::optional<std::vector<std::string>> insns;
+            if (line.substr(tab + 1) != "none") {
+                insns.emplace();
+                std::stringstream seq(line.substr(tab + 1));
+                std::string insn;
+                while (std::getline(seq, insn, ';')) {
+                    insns->push_back(insn);
+                }
+            }
+            m_db[line.substr(0, tab)] = insns;
+        }
+    }
+
+    Superoptimizer(const Superoptimizer&) = delete;
+    Superoptimizer& operator=(const Superoptimizer&) = delete;
+
+    /**
+     * Optimal lowering of the expression, or nothing if it is not a small
+     * arithmetic tree or no sequence within the search limits exists.
+     */
+    std::optional<Lowering> lower(const NodeExpr* expr) {
+        Shape shape;
+        Lowering lowering;
+        if (!build_shape(expr, shape, lowering.vars) || shape.ops == 0) {
+            return {};
+        }
+        const std::string key = shape.key(shape.nodes.size() - 1);
+        auto it = m_db.find(key);
+        if (it == m_db.end()) {
+            it = m_db.emplace(key, search(shape, lowering.vars.size())).first;
+            std::ofstream db(m_db_path, std::ios::app);
+            if (db.tellp() == 0) {
+                db << k_db_header << '\n';
+            }
+            db << key << '\t';
+            if (it->second.has_value()) {
+                for (size_t i = 0; i < it->second->size(); i++) {
+                    db << (i == 0 ? "" : ";") << it->second.value()[i];
+                }
+            } else {
+                db << "none";
+            }
+            db << '\n';
+        }
+        if (!it->second.has_value()) {
+            return {};
+        }
+        lowering.insns = it->second.value();
+        return lowering;
+    }
+
+private:
+    enum class Op { var, lit, add, sub, mul, neg };
+
+    struct Node {
+        Op op;
+        int lhs = -1;
+        int rhs = -1;
+        int64_t value = 0;   // variable index or literal
+    };
+
+    struct Shape {
+        std::vector<Node> nodes;   // children before parents, root last
+        size_t ops = 0;
+
+        std::string key(int index) const {
+            const Node& node = nodes[index];
+            switch (node.op) {
+            case Op::var: return "v" + std::to_string(node.value);
+            case Op::lit: return std::to_string(node.value);
+            case Op::add: return "add(" + key(node.lhs) + "," + key(node.rhs) + ")";
+            case Op::sub: return "sub(" + key(node.lhs) + "," + key(node.rhs) + ")";
+            case Op::mul: return "mul(" + key(node.lhs) + "," + key(node.rhs) + ")";
+            case Op::neg: return "neg(" + key(node.lhs) + ")";
+            }
+            return "";
+        }
+
+        template <typename T, typename Ops>
+        T eval(const std::array<T, 2>& vars, const Ops& ops) const {
+            std::vector<T> values(nodes.size());
+            for (size_t i = 0; i < nodes.size(); i++) {
+                const Node& node = nodes[i];
+                switch (node.op) {
+                case Op::var: values[i] = vars[node.value]; break;
+                case Op::lit: values[i] = ops.lit(node.value); break;
+                case Op::add: values[i] = ops.add(values[node.lhs], values[node.rhs]); break;
+                case Op::sub: values[i] = ops.sub(values[node.lhs], values[node.rhs]); break;
+                case Op::mul: values[i] = ops.mul(values[node.lhs], values[node.rhs]); break;
+                case Op::neg: values[i] = ops.sub(ops.lit(0), values[node.lhs]); break;
+                }
+            }
+            return values.back();
+        }
+    };
+
+    // Flatten a small arithmetic tree; returns the node index or -1
+    static int add_node(const NodeExpr* expr, Shape& shape, std::vector<std::string>& vars) {
+        if (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            return add_term(*term, shape, vars);
+        }
+        if (++shape.ops > k_max_ops) {
+            return -1;
+        }
+        const auto& bin_expr = std::get<NodeBinExpr*>(expr->var)->var;
+        Node node;
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+        if (const auto* add = std::get_if<NodeBinExprAdd*>(&bin_expr)) { node.op = Op::add; lhs = (*add)->lhs; rhs = (*add)->rhs; }
+        else if (const auto* sub = std::get_if<NodeBinExprSub*>(&bin_expr)) { node.op = Op::sub; lhs = (*sub)->lhs; rhs = (*sub)->rhs; }
+        else if (const auto* multi = std::get_if<NodeBinExprMulti*>(&bin_expr)) { node.op = Op::mul; lhs = (*multi)->lhs; rhs = (*multi)->rhs; }
+        else return -1;
+        node.lhs = add_node(lhs, shape, vars);
+        node.rhs = node.lhs < 0 ? -1 : add_node(rhs, shape, vars);
+        if (node.rhs < 0) {
+            return -1;
+        }
+        shape.nodes.push_back(node);
+        return static_cast<int>(shape.nodes.size()) - 1;
+    }
+
+    static int add_term(const NodeTerm* term, Shape& shape, std::vector<std::string>& vars) {
+        Node node;
+        if (const auto* lit = std::get_if<NodeTermIntLit*>(&term->var)) {
+            node.op = Op::lit;
+            node.value = std::stoll((*lit)->int_lit.value.value());
+        } else if (const auto* ident = std::get_if<NodeTermIdent*>(&term->var)) {
+            const std::string& name = (*ident)->ident.value.value();
+            auto it = std::find(vars.begin(), vars.end(), name);
+            if (it == vars.end()) {
+                if (vars.size() == 2) return -1;
+                it = vars.insert(vars.end(), name);
+            }
+            node.op = Op::var;
+            node.value = it - vars.begin();
+        } else if (const auto* paren = std::get_if<NodeTermParen*>(&term->var)) {
+            return add_node((*paren)->expr, shape, vars);
+        } else if (const auto* neg = std::get_if<NodeTermNeg*>(&term->var)) {
+            if (++shape.ops > k_max_ops) return -1;
+            node.op = Op::neg;
+            node.lhs = add_term((*neg)->term, shape, vars);
+            if (node.lhs < 0) return -1;
+        } else {
+            return -1;
+        }
+        shape.nodes.push_back(node);
+        return static_cast<int>(shape.nodes.size()) - 1;
+    }
+
+    static bool build_shape(const NodeExpr* expr, Shape& shape, std::vector<std::string>& vars) {
+        return add_node(expr, shape, vars) >= 0;
+    }
+
+    // Candidate instructions: dst = op(src, other/imm), over rax, rcx, rdx
+    enum class Kind { mov, mov_imm, add, add_imm, sub, sub_imm, imul, imul_imm, neg, lea, lea_scaled, shl };
+
+    struct Insn {
+        Kind kind;
+        int d;
+        int s = 0;
+        int t = 0;
+        int64_t imm = 0;
+
+        std::string text() const {
+            static const char* regs[] = {"rax", "rcx", "rdx"};
+            std::stringstream out;
+            switch (kind) {
+            case Kind::mov: out << "mov " << regs[d] << ", " << regs[s]; break;
+            case Kind::mov_imm: out << "mov " << regs[d] << ", " << imm; break;
+            case Kind::add: out << "add " << regs[d] << ", " << regs[s]; break;
+            case Kind::add_imm: out << "add " << regs[d] << ", " << imm; break;
+            case Kind::sub: out << "sub " << regs[d] << ", " << regs[s]; break;
+            case Kind::sub_imm: out << "sub " << regs[d] << ", " << imm; break;
+            case Kind::imul: out << "imul " << regs[d] << ", " << regs[s]; break;
+            case Kind::imul_imm: out << "imul " << regs[d] << ", " << regs[s] << ", " << imm; break;
+            case Kind::neg: out << "neg " << regs[d]; break;
+            case Kind::lea: out << "lea " << regs[d] << ", [" << regs[s] << " + " << regs[t] << "*" << imm << "]"; break;
+            case Kind::lea_scaled: out << "lea " << regs[d] << ", [" << regs[s] << "*" << imm << "]"; break;
+            case Kind::shl: out << "shl " << regs[d] << ", " << imm; break;
+            }
+            return out.str();
+        }
+
+        // Rough reciprocal throughput/latency weight used to rank sequences
+        int cost() const {
+            switch (kind) {
+            case Kind::imul:
+            case Kind::imul_imm: return 3;
+            case Kind::mov: return 1;
+            default: return 2;
+            }
+        }
+
+        template <typename T, typename Ops>
+        void apply(std::array<T, 3>& regs, const Ops& ops) const {
+            switch (kind) {
+            case Kind::mov: regs[d] = regs[s]; break;
+            case Kind::mov_imm: regs[d] = ops.lit(imm); break;
+            case Kind::add: regs[d] = ops.add(regs[d], regs[s]); break;
+            case Kind::add_imm: regs[d] = ops.add(regs[d], ops.lit(imm)); break;
+            case Kind::sub: regs[d] = ops.sub(regs[d], regs[s]); break;
+            case Kind::sub_imm: regs[d] = ops.sub(regs[d], ops.lit(imm)); break;
+            case Kind::imul: regs[d] = ops.mul(regs[d], regs[s]); break;
+            case Kind::imul_imm: regs[d] = ops.mul(regs[s], ops.lit(imm)); break;
+            case Kind::neg: regs[d] = ops.sub(ops.lit(0), regs[d]); break;
+            case Kind::lea: regs[d] = ops.add(regs[s], ops.mul(regs[t], ops.lit(imm))); break;
+            case Kind::lea_scaled: regs[d] = ops.mul(regs[s], ops.lit(imm)); break;
+            case Kind::shl: regs[d] = ops.mul(regs[d], ops.lit(int64_t {1} << imm)); break;
+            }
+        }
+    };
+
+    // Arithmetic modulo 2^bits
+    struct WordOps {
+        uint64_t mask;
+        uint64_t lit(int64_t v) const { return static_cast<uint64_t>(v) & mask; }
+        uint64_t add(uint64_t a, uint64_t b) const { return (a + b) & mask; }
+        uint64_t sub(uint64_t a, uint64_t b) const { return (a - b) & mask; }
+        uint64_t mul(uint64_t a, uint64_t b) const { return (a * b) & mask; }
+    };
+
+    // Polynomials over Z/2^64 in v0, v1 and the initial rdx, keyed by exponents
+    using Poly = std::map<std::array<uint8_t, 3>, uint64_t>;
+
+    struct PolyOps {
+        Poly lit(int64_t v) const {
+            Poly p;
+            if (v != 0) p[{0, 0, 0}] = static_cast<uint64_t>(v);
+            return p;
+        }
+        Poly add(const Poly& a, const Poly& b) const {
+            Poly r = a;
+            for (const auto& [exp, coef] : b) {
+                if ((r[exp] += coef) == 0) r.erase(exp);
+            }
+            return r;
+        }
+        Poly sub(const Poly& a, const Poly& b) const {
+            Poly r = a;
+            for (const auto& [exp, coef] : b) {
+                if ((r[exp] -= coef) == 0) r.erase(exp);
+            }
+            return r;
+        }
+        Poly mul(const Poly& a, const Poly& b) const {
+            Poly r;
+            for (const auto& [ea, ca] : a) {
+                for (const auto& [eb, cb] : b) {
+                    const std::array<uint8_t, 3> exp {
+                        static_cast<uint8_t>(ea[0] + eb[0]), static_cast<uint8_t>(ea[1] + eb[1]), static_cast<uint8_t>(ea[2] + eb[2])};
+                    if ((r[exp] += ca * cb) == 0) r.erase(exp);
+                }
+            }
+            return r;
+        }
+        static Poly var(uint8_t index) {
+            std::array<uint8_t, 3> exp {0, 0, 0};
+            exp[index] = 1;
+            return Poly {{exp, 1}};
+        }
+    };
+
+    std::vector<Insn> candidates(const Shape& shape) const {
+        std::vector<int64_t> imms;
+        for (const Node& node : shape.nodes) {
+            if (node.op == Op::lit && std::find(imms.begin(), imms.end(), node.value) == imms.end()) {
+                imms.push_back(node.value);
+            }
+        }
+        std::vector<Insn> insns;
+        for (int d = 0; d < 3; d++) {
+            insns.push_back({.kind = Kind::neg, .d = d});
+            for (int shift = 1; shift < 64; shift++) {
+                for (int64_t imm : imms) {
+                    if (imm == (int64_t {1} << shift) || imm == -(int64_t {1} << shift)) {
+                        insns.push_back({.kind = Kind::shl, .d = d, .imm = shift});
+                    }
+                }
+            }
+            for (int64_t imm : imms) {
+                insns.push_back({.kind = Kind::mov_imm, .d = d, .imm = imm});
+                if (imm >= INT32_MIN && imm <= INT32_MAX) {
+                    insns.push_back({.kind = Kind::add_imm, .d = d, .imm = imm});
+                    insns.push_back({.kind = Kind::sub_imm, .d = d, .imm = imm});
+                }
+            }
+            for (int s = 0; s < 3; s++) {
+                if (s != d) insns.push_back({.kind = Kind::mov, .d = d, .s = s});
+                insns.push_back({.kind = Kind::add, .d = d, .s = s});
+                insns.push_back({.kind = Kind::sub, .d = d, .s = s});
+                insns.push_back({.kind = Kind::imul, .d = d, .s = s});
+                for (int64_t imm : imms) {
+                    if (imm >= INT32_MIN && imm <= INT32_MAX) {
+                        insns.push_back({.kind = Kind::imul_imm, .d = d, .s = s, .imm = imm});
+                    }
+                }
+                for (int64_t scale : {2, 4, 8}) {
+                    insns.push_back({.kind = Kind::lea_scaled, .d = d, .s = s, .imm = scale});
+                }
+                for (int t = 0; t < 3; t++) {
+                    for (int64_t scale : {1, 2, 4, 8}) {
+                        insns.push_back({.kind = Kind::lea, .d = d, .s = s, .t = t, .imm = scale});
+                    }
+                }
+            }
+        }
+        return insns;
+    }
+
+    struct Search {
+        const Shape& shape;
+        const std::vector<Insn>& insns;
+        std::vector<std::array<uint64_t, 3>> inputs;
+        std::vector<uint64_t> expected;
+        std::vector<Insn> seq;
+        std::optional<std::vector<Insn>> best;
+        int best_cost = INT32_MAX;
+
+        // The empty sequence is tried too: it is the answer for identities
+        // such as `x * 1`, where the result is already in rax
+        void run(const std::vector<std::array<uint64_t, 3>>& states, int cost) {
+            if (cost < best_cost) {
+                bool match = true;
+                for (size_t i = 0; i < states.size() && match; i++) {
+                    match = states[i][0] == expected[i];
+                }
+                if (match && verify()) {
+                    best = seq;
+                    best_cost = cost;
+                }
+            }
+            if (seq.size() == k_max_length) {
+                return;
+            }
+            std::vector<std::array<uint64_t, 3>> next(states.size());
+            const WordOps ops {.mask = ~uint64_t {0}};
+            for (const Insn& insn : insns) {
+                if (cost + insn.cost() >= best_cost) {
+                    continue;
+                }
+                for (size_t i = 0; i < states.size(); i++) {
+                    next[i] = states[i];
+                    insn.apply(next[i], ops);
+                }
+                seq.push_back(insn);
+                run(next, cost + insn.cost());
+                seq.pop_back();
+            }
+        }
+
+        // Exhaustive check at 8 bits, then proof by polynomial normal form
+        bool verify() const {
+            const WordOps byte {.mask = 0xff};
+            for (uint64_t v0 = 0; v0 < 256; v0++) {
+                for (uint64_t v1 = 0; v1 < 256; v1++) {
+                    std::array<uint64_t, 3> regs {v0, v1, (v0 * 31 + v1 * 7 + 3) & 0xff};
+                    for (const Insn& insn : seq) insn.apply(regs, byte);
+                    if (regs[0] != shape.eval(std::array<uint64_t, 2> {v0, v1}, byte)) {
+                        return false;
+                    }
+                }
+            }
+            const PolyOps poly;
+            std::array<Poly, 3> regs {PolyOps::var(0), PolyOps::var(1), PolyOps::var(2)};
+            for (const Insn& insn : seq) insn.apply(regs, poly);
+            return regs[0] == shape.eval(std::array<Poly, 2> {PolyOps::var(0), PolyOps::var(1)}, poly);
+        }
+    };
+
+    std::optional<std::vector<std::string>> search(const Shape& shape, size_t num_vars) const {
+        const std::vector<Insn> insns = candidates(shape);
+        std::mt19937_64 rng(0x5eed);
+        Search search {.shape = shape, .insns = insns};
+        const WordOps ops {.mask = ~uint64_t {0}};
+        for (int i = 0; i < 8; i++) {
+            // Unused inputs hold garbage so sequences cannot depend on them
+            std::array<uint64_t, 3> regs {rng(), rng(), rng()};
+            search.inputs.push_back(regs);
+            search.expected.push_back(shape.eval(std::array<uint64_t, 2> {regs[0], num_vars > 1 ? regs[1] : 0}, ops));
+        }
+        search.run(search.inputs, 0);
+        if (!search.best.has_value()) {
+            return {};
+        }
+        std::vector<std::string> text;
+        for (const Insn& insn : search.best.value()) {
+            text.push_back(insn.text());
+        }
+        return text;
+    }
+
+    static constexpr size_t k_max_ops = 3;
+    static constexpr size_t k_max_length = 3;
+    static constexpr const char* k_db_header = "# hauss superoptimizer database v2: <shape>\\t<insn;insn;...> or none";
+
+    const std::string m_db_path;
+    std::unordered_map<std::string, std::optional<std::vector<std::string>>> m_db;
+};
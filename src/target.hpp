@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cpuid.h>
+#include <optional>
+#include <string>
+
+/**
+ * Instruction set extensions the generated code is allowed to use.
+ */
+struct TargetFeatures {
+    bool popcnt = false;
+    bool lzcnt = false;
+    bool bmi1 = false;
+    bool bmi2 = false;
+    bool adx = false;
+    bool movbe = false;
+    bool rdtscp = false;
+    bool avx = false;
+    bool avx2 = false;
+    bool avx512f = false;
+};
+
+/**
+ * The CPU the generated code is tuned for, selected with -march.
+ */
+struct Target {
+    std::string name = "x86-64";
+    TargetFeatures features;
+
+    /**
+     * Resolves a -march value: a psABI micro-architecture level or `native`.
+     */
+    static std::optional<Target> from_march(const std::string& march) {
+        Target target;
+        target.name = march;
+        if (march == "x86-64") {
+            return target;
+        }
+        if (march == "native") {
+            target.features = detect_host();
+            return target;
+        }
+        if (march == "x86-64-v2" || march == "x86-64-v3" || march == "x86-64-v4") {
+            const int level = march.back() - '0';
+            target.features.popcnt = true;
+            if (level >= 3) {
+                target.features.lzcnt = true;
+                target.features.bmi1 = true;
+                target.features.bmi2 = true;
+                target.features.movbe = true;
+                target.features.avx = true;
+                target.features.avx2 = true;
+            }
+            if (level >= 4) {
+                target.features.avx512f = true;
+            }
+            return target;
+        }
+        return {};
+    }
+
+    /**
+     * Queries CPUID of the machine running the compiler. Vector extensions
+     * are only reported when the OS also saves their register state.
+     */
+    static TargetFeatures detect_host() {
+        TargetFeatures features;
+        unsigned int eax, ebx, ecx, edx;
+        bool os_avx = false;
+        bool os_avx512 = false;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            features.popcnt = ecx & bit_POPCNT;
+            features.movbe = ecx & bit_MOVBE;
+            if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+                unsigned int xcr0_lo, xcr0_hi;
+                __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+                os_avx = (xcr0_lo & 0x6) == 0x6;
+                os_avx512 = os_avx && (xcr0_lo & 0xe0) == 0xe0;
+            }
+            features.avx = os_avx;
+        }
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            features.bmi1 = ebx & bit_BMI;
+            features.bmi2 = ebx & bit_BMI2;
+            features.adx = ebx & bit_ADX;
+            features.avx2 = os_avx && (ebx & bit_AVX2);
+            features.avx512f = os_avx512 && (ebx & bit_AVX512F);
+        }
+        if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+            features.lzcnt = ecx & bit_LZCNT;
+            features.rdtscp = edx & (1 << 27);  // RDTSCP, which cpuid.h does not name
+        }
+        return features;
+    }
+
+    /**
+     * Space separated list of enabled extensions, for the assembly header.
+     */
+    std::string describe() const {
+        std::string out;
+        const auto add = [&](bool enabled, const char* ext) {
+            if (enabled) {
+                out += " ";
+                out += ext;
+            }
+        };
+        add(features.popcnt, "popcnt");
+        add(features.lzcnt, "lzcnt");
+        add(features.bmi1, "bmi1");
+        add(features.bmi2, "bmi2");
+        add(features.adx, "adx");
+        add(features.movbe, "movbe");
+        add(features.rdtscp, "rdtscp");
+        add(features.avx, "avx");
+        add(features.avx2, "avx2");
+        add(features.avx512f, "avx512f");
+        return out.empty() ? " baseline" : out;
+    }
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <charconv>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <optional>
@@ -11,6 +13,7 @@
 enum class TokenType {
     exit, 
     int_lit,
+    float_lit,
     semi,
     open_paren,
     close_paren,
@@ -31,7 +34,43 @@ enum class TokenType {
     ge,        // >=
     eq_eq,     // ==
     lt,        // <
-    le         // <=
+    le,        // <=
+    read,
+    arg,
+    alloc,
+    open_bracket,
+    close_bracket,
+    for_,
+    parallel,
+    reduce,
+    colon,
+    comma,
+    f64,
+    i64,
+    percent,   // %
+    amp,       // &
+    pipe,      // |
+    caret,     // ^
+    tilde,     // ~
+    shl,       // <<
+    shr,       // >>
+    popcount,
+    clz,
+    ctz,
+    bswap,
+    rdtsc,
+    clock_ns,
+    cycles,
+    asm_,
+    asm_text,  // raw instructions between the braces of an asm statement
+    extern_,
+    fn,
+    struct_,
+    dot,       // .
+    pipe_gt,   // |>
+    fat_arrow, // =>
+    return_,
+    at         // @
 };
 
 /**
@@ -43,6 +82,12 @@ bool is_bin_op(TokenType type) {
         case TokenType::sub:
         case TokenType::plus:
         case TokenType::star:
+        case TokenType::percent:
+        case TokenType::amp:
+        case TokenType::pipe:
+        case TokenType::caret:
+        case TokenType::shl:
+        case TokenType::shr:
             return true;
         default:
             return false;
@@ -57,6 +102,7 @@ inline std::string to_string(const TokenType type)
     switch (type) {
     case TokenType::exit: return "`exit`";
     case TokenType::int_lit: return "int literal";
+    case TokenType::float_lit: return "float literal";
     case TokenType::semi: return "`;`";
     case TokenType::open_paren: return "`(`";
     case TokenType::close_paren: return "`)`";
@@ -78,26 +124,74 @@ inline std::string to_string(const TokenType type)
     case TokenType::eq_eq: return "`==`";
     case TokenType::lt: return "`<`";
     case TokenType::le: return "`<=`";
+    case TokenType::read: return "`read`";
+    case TokenType::arg: return "`arg`";
+    case TokenType::alloc: return "`alloc`";
+    case TokenType::open_bracket: return "`[`";
+    case TokenType::close_bracket: return "`]`";
+    case TokenType::for_: return "`for`";
+    case TokenType::parallel: return "`parallel`";
+    case TokenType::reduce: return "`reduce`";
+    case TokenType::colon: return "`:`";
+    case TokenType::comma: return "`,`";
+    case TokenType::f64: return "`f64`";
+    case TokenType::i64: return "`i64`";
+    case TokenType::percent: return "`%`";
+    case TokenType::amp: return "`&`";
+    case TokenType::pipe: return "`|`";
+    case TokenType::caret: return "`^`";
+    case TokenType::tilde: return "`~`";
+    case TokenType::shl: return "`<<`";
+    case TokenType::shr: return "`>>`";
+    case TokenType::popcount: return "`popcount`";
+    case TokenType::clz: return "`clz`";
+    case TokenType::ctz: return "`ctz`";
+    case TokenType::bswap: return "`bswap`";
+    case TokenType::rdtsc: return "`rdtsc`";
+    case TokenType::clock_ns: return "`clock_ns`";
+    case TokenType::cycles: return "`cycles`";
+    case TokenType::asm_: return "`asm`";
+    case TokenType::asm_text: return "`{` with instructions";
+    case TokenType::extern_: return "`extern`";
+    case TokenType::fn: return "`fn`";
+    case TokenType::struct_: return "`struct`";
+    case TokenType::dot: return "`.`";
+    case TokenType::pipe_gt: return "`|>`";
+    case TokenType::fat_arrow: return "`=>`";
+    case TokenType::return_: return "`return`";
+    case TokenType::at: return "`@`";
     }
     assert(false); // should never be reached
 }
 
 /**
- * Returns the precedence of a binary operator, if applicable.
+ * Returns the precedence of a binary operator, if applicable. Comparisons bind
+ * loosest, then |, ^ and &, shifts, + and -, and * / % tightest.
  */
 std::optional<int> bin_prec(TokenType type) {
     switch (type) {
-    case TokenType::sub:
-    case TokenType::plus:
     case TokenType::gt:
     case TokenType::ge:
     case TokenType::lt:
     case TokenType::le:
     case TokenType::eq_eq:
-        return 0; // lower precedence
+        return 0; // lowest precedence
+    case TokenType::pipe:
+        return 1;
+    case TokenType::caret:
+        return 2;
+    case TokenType::amp:
+        return 3;
+    case TokenType::shl:
+    case TokenType::shr:
+        return 4;
+    case TokenType::sub:
+    case TokenType::plus:
+        return 5;
     case TokenType::div:
     case TokenType::star:
-        return 1; // higher precedence
+    case TokenType::percent:
+        return 6; // highest precedence
     default:
         return {}; // not a binary operator
     }
@@ -131,12 +225,13 @@ public:
         std::vector<Token> tokens;
         std::string buf;
         int line_cnt = 1;
+        bool asm_header = false;   // between `asm` and the `{` of its body
 
         while (peek().has_value()) {
-            if (std::isalpha(peek().value())) {
+            if (std::isalpha(peek().value()) || peek().value() == '_') {
                 // Handle keywords and identifiers
                 buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value())) {
+                while (peek().has_value() && (std::isalnum(peek().value()) || peek().value() == '_')) {
                     buf.push_back(consume());
                 }
                 if (buf == "exit") tokens.push_back({TokenType::exit, line_cnt});
@@ -145,26 +240,41 @@ public:
                 else if (buf == "elif") tokens.push_back({TokenType::elif, line_cnt});
                 else if (buf == "else") tokens.push_back({TokenType::else_, line_cnt});
                 else if (buf == "print") tokens.push_back({TokenType::print, line_cnt});
+                else if (buf == "read") tokens.push_back({TokenType::read, line_cnt});
+                else if (buf == "arg") tokens.push_back({TokenType::arg, line_cnt});
+                else if (buf == "alloc") tokens.push_back({TokenType::alloc, line_cnt});
+                else if (buf == "for") tokens.push_back({TokenType::for_, line_cnt});
+                else if (buf == "parallel") tokens.push_back({TokenType::parallel, line_cnt});
+                else if (buf == "reduce") tokens.push_back({TokenType::reduce, line_cnt});
+                else if (buf == "f64") tokens.push_back({TokenType::f64, line_cnt});
+                else if (buf == "i64") tokens.push_back({TokenType::i64, line_cnt});
+                else if (buf == "popcount") tokens.push_back({TokenType::popcount, line_cnt});
+                else if (buf == "clz") tokens.push_back({TokenType::clz, line_cnt});
+                else if (buf == "ctz") tokens.push_back({TokenType::ctz, line_cnt});
+                else if (buf == "bswap") tokens.push_back({TokenType::bswap, line_cnt});
+                else if (buf == "rdtsc") tokens.push_back({TokenType::rdtsc, line_cnt});
+                else if (buf == "clock_ns") tokens.push_back({TokenType::clock_ns, line_cnt});
+                else if (buf == "cycles") tokens.push_back({TokenType::cycles, line_cnt});
+                else if (buf == "extern") tokens.push_back({TokenType::extern_, line_cnt});
+                else if (buf == "fn") tokens.push_back({TokenType::fn, line_cnt});
+                else if (buf == "return") tokens.push_back({TokenType::return_, line_cnt});
+                else if (buf == "struct") tokens.push_back({TokenType::struct_, line_cnt});
+                else if (buf == "asm") {
+                    tokens.push_back({TokenType::asm_, line_cnt});
+                    asm_header = true;
+                }
                 else tokens.push_back({TokenType::ident, line_cnt, buf});
                 buf.clear();
             }
             else if (peek().value() == '-' && peek(1).has_value() && std::isdigit(peek(1).value())) {
-                // Handle negative integer literals
-                consume();
-                buf.push_back('-');
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buf.push_back(consume());
-                }
-                tokens.push_back({TokenType::int_lit, line_cnt, buf});
+                // Handle negative numeric literals
+                buf.push_back(consume());
+                tokens.push_back({lex_number(buf, line_cnt), line_cnt, buf});
                 buf.clear();
             }
             else if (std::isdigit(peek().value())) {
-                // Handle positive integer literals
-                buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buf.push_back(consume());
-                }
-                tokens.push_back({TokenType::int_lit, line_cnt, buf});
+                // Handle positive numeric literals
+                tokens.push_back({lex_number(buf, line_cnt), line_cnt, buf});
                 buf.clear();
             }
             else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/') {
@@ -189,17 +299,53 @@ public:
             // Handle punctuation and operators
             else if (peek().value() == '(') { consume(); tokens.push_back({TokenType::open_paren, line_cnt}); }
             else if (peek().value() == ')') { consume(); tokens.push_back({TokenType::close_paren, line_cnt}); }
+            else if (peek().value() == '{' && asm_header) {
+                // The body of an asm statement is passed through verbatim, up
+                // to the matching brace
+                consume();
+                const int start_line = line_cnt;
+                int depth = 1;
+                while (peek().has_value()) {
+                    if (peek().value() == '{') depth++;
+                    if (peek().value() == '}' && --depth == 0) break;
+                    if (peek().value() == '\n') line_cnt++;
+                    buf.push_back(consume());
+                }
+                if (!peek().has_value()) {
+                    std::cerr << "Unterminated asm block on line " << start_line << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                consume();
+                tokens.push_back({TokenType::asm_text, start_line, buf});
+                buf.clear();
+                asm_header = false;
+            }
             else if (peek().value() == '{') { consume(); tokens.push_back({TokenType::open_curly, line_cnt}); }
             else if (peek().value() == '}') { consume(); tokens.push_back({TokenType::close_curly, line_cnt}); }
+            else if (peek().value() == '[') { consume(); tokens.push_back({TokenType::open_bracket, line_cnt}); }
+            else if (peek().value() == ']') { consume(); tokens.push_back({TokenType::close_bracket, line_cnt}); }
             else if (peek().value() == ';') { consume(); tokens.push_back({TokenType::semi, line_cnt}); }
+            else if (peek().value() == ':') { consume(); tokens.push_back({TokenType::colon, line_cnt}); }
+            else if (peek().value() == ',') { consume(); tokens.push_back({TokenType::comma, line_cnt}); }
+            else if (peek().value() == '.') { consume(); tokens.push_back({TokenType::dot, line_cnt}); }
+            else if (peek().value() == '@') { consume(); tokens.push_back({TokenType::at, line_cnt}); }
             else if (peek().value() == '+' ) { consume(); tokens.push_back({TokenType::plus, line_cnt}); }
             else if (peek().value() == '*' ) { consume(); tokens.push_back({TokenType::star, line_cnt}); }
             else if (peek().value() == '-' ) { consume(); tokens.push_back({TokenType::sub, line_cnt}); }
             else if (peek().value() == '/' ) { consume(); tokens.push_back({TokenType::div, line_cnt}); }
+            else if (peek().value() == '%' ) { consume(); tokens.push_back({TokenType::percent, line_cnt}); }
+            else if (peek().value() == '&' ) { consume(); tokens.push_back({TokenType::amp, line_cnt}); }
+            else if (peek().value() == '|' && peek(1).has_value() && peek(1).value() == '>') { consume(); consume(); tokens.push_back({TokenType::pipe_gt, line_cnt}); }
+            else if (peek().value() == '|' ) { consume(); tokens.push_back({TokenType::pipe, line_cnt}); }
+            else if (peek().value() == '^' ) { consume(); tokens.push_back({TokenType::caret, line_cnt}); }
+            else if (peek().value() == '~' ) { consume(); tokens.push_back({TokenType::tilde, line_cnt}); }
+            else if (peek().value() == '<' && peek(1).has_value() && peek(1).value() == '<') { consume(); consume(); tokens.push_back({TokenType::shl, line_cnt}); }
+            else if (peek().value() == '>' && peek(1).has_value() && peek(1).value() == '>') { consume(); consume(); tokens.push_back({TokenType::shr, line_cnt}); }
             else if (peek().value() == '>' && peek(1).has_value() && peek(1).value() == '=') { consume(); consume(); tokens.push_back({TokenType::ge, line_cnt}); }
             else if (peek().value() == '<' && peek(1).has_value() && peek(1).value() == '=') { consume(); consume(); tokens.push_back({TokenType::le, line_cnt}); }
             else if (peek().value() == '>' ) { consume(); tokens.push_back({TokenType::gt, line_cnt}); }
             else if (peek().value() == '<' ) { consume(); tokens.push_back({TokenType::lt, line_cnt}); }
+            else if (peek().value() == '=' && peek(1).has_value() && peek(1).value() == '>') { consume(); consume(); tokens.push_back({TokenType::fat_arrow, line_cnt}); }
             else if (peek().value() == '=' && peek(1).has_value() && peek(1).value() == '=') { consume(); consume(); tokens.push_back({TokenType::eq_eq, line_cnt}); }
             else if (peek().value() == '=' ) { consume(); tokens.push_back({TokenType::eq, line_cnt}); }
             else if (peek().value() == '\n') { consume(); line_cnt++; }
@@ -215,6 +361,44 @@ public:
     }
 
 private:
+    /**
+     * Appends the digits of a numeric literal to `buf`. A fraction (`1.5`) or
+     * an exponent (`2e-3`) makes it a float literal. Integer literals must fit
+     * in an i64.
+     */
+    inline TokenType lex_number(std::string& buf, const int line) {
+        TokenType type = TokenType::int_lit;
+        while (peek().has_value() && std::isdigit(peek().value())) {
+            buf.push_back(consume());
+        }
+        if (peek().has_value() && peek().value() == '.' && peek(1).has_value() && std::isdigit(peek(1).value())) {
+            type = TokenType::float_lit;
+            buf.push_back(consume());
+            while (peek().has_value() && std::isdigit(peek().value())) {
+                buf.push_back(consume());
+            }
+        }
+        if (peek().has_value() && (peek().value() == 'e' || peek().value() == 'E')) {
+            const int sign = peek(1).has_value() && (peek(1).value() == '+' || peek(1).value() == '-') ? 1 : 0;
+            if (peek(1 + sign).has_value() && std::isdigit(peek(1 + sign).value())) {
+                type = TokenType::float_lit;
+                for (int i = 0; i <= sign; i++) {
+                    buf.push_back(consume());
+                }
+                while (peek().has_value() && std::isdigit(peek().value())) {
+                    buf.push_back(consume());
+                }
+            }
+        }
+        int64_t value;
+        if (type == TokenType::int_lit
+            && std::from_chars(buf.data(), buf.data() + buf.size(), value).ec == std::errc::result_out_of_range) {
+            std::cerr << "Integer literal " << buf << " out of range on line " << line << "\n";
+            exit(EXIT_FAILURE);
+        }
+        return type;
+    }
+
     /**
      * Peeks at the character at the current index + offset.
      * Returns nullopt if out of bounds.
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./parser.hpp"
+#include "./var_stack.hpp"
+
+/**
+ * Infers the type of every expression and records it in NodeExpr::type.
+ *
+ * i64 and f64 never mix implicitly: both operands of an operator must have
+ * the same type, and a value only changes type through i64(...) or f64(...).
+ * Comparisons yield an i64 0/1. Conditions, exit codes, array elements and
+ * indices, read(), arg() and alloc() are i64, and so are the operands of %,
+ * the bitwise operators, shifts and bit builtins such as popcount().
+ * Calls take and return the types their fn or extern fn declaration states.
+ * An fn body only sees its parameters and its own variables, cannot call
+ * extern fns or contain a parallel for, and an @memo fn must be pure: no
+ * output, exit, input, clocks, asm, memory access or calls of impure fns.
+ * Struct fields are integers, and an array of structs is only used through
+ * its fields, as a[i].f. Range pipelines run over i64 values; the parameter
+ * of a map or filter is only visible in its own body. Inside a parallel for,
+ * a reduction variable is only updated as `s = s op e` with its reduction's
+ * operator and is not read otherwise: every chunk works on a private copy.
+ * An fn that calls a @memo fn, directly or through other fns, cannot be
+ * called inside a parallel for, whose threads would share the memo table.
+ */
+class TypeChecker {
+public:
+    /**
+     * Annotates the whole program, exiting with an error on the first mismatch.
+     */
+    void check(NodeProg& prog) {
+        for (NodeStmt* stmt : prog.stmts) {
+            check_stmt(stmt);
+        }
+    }
+
+private:
+    static void error(const std::string& msg) {
+        std::cerr << "[Type Error] " << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Reject a value whose type differs from the one its context needs
+    static void expect(Type actual, Type expected, const std::string& what) {
+        if (actual != expected) {
+            error(what + " must be " + to_string(expected) + ", found " + to_string(actual)
+                  + "; convert it with " + to_string(expected) + "(...)");
+        }
+    }
+
+    void check_stmt(NodeStmt* stmt) {
+        struct StmtVisitor {
+            TypeChecker& checker;
+            void operator()(NodeStmtExit* stmt_exit) const {
+                checker.impure("calls exit()");
+                expect(checker.check_expr(stmt_exit->expr), Type::i64, "exit code");
+            }
+            void operator()(NodeStmtLet* stmt_let) const {
+                if (stmt_let->record.has_value()) {
+                    checker.check_record_array(stmt_let);
+                    return;
+                }
+                const Type type = checker.check_expr(stmt_let->expr);
+                const std::string& name = stmt_let->ident.value.value();
+                if (stmt_let->type.has_value() && stmt_let->type.value() != type) {
+                    error("cannot initialize " + to_string(stmt_let->type.value()) + " variable " + name + " with an "
+                          + to_string(type) + " value on line " + std::to_string(stmt_let->ident.line));
+                }
+                checker.m_vars.push_back({.name = name, .type = type});
+            }
+            void operator()(NodeScope* scope) const { checker.check_scope(scope); }
+            void operator()(NodeStmtIf* stmt_if) const {
+                expect(checker.check_expr(stmt_if->expr), Type::i64, "if condition");
+                checker.check_scope(stmt_if->scope);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        expect(checker.check_expr((*elif)->expr), Type::i64, "elif condition");
+                        checker.check_scope((*elif)->scope);
+                        pred = (*elif)->pred;
+                    } else {
+                        checker.check_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        pred.reset();
+                    }
+                }
+            }
+            void operator()(NodeStmtAssign* stmt_assign) const {
+                const std::string& name = stmt_assign->ident.value.value();
+                const Type var_type = checker.find_var(name);
+                if (const auto reduction = checker.m_reductions.find(name); reduction != checker.m_reductions.end()) {
+                    checker.m_reduction_read = reduction_operand(stmt_assign->expr, name, reduction->second);
+                    if (checker.m_reduction_read == nullptr) {
+                        const std::string op = reduction->second == TokenType::plus ? " + " : " * ";
+                        error("reduction variable " + name + " can only be updated as " + name + " = " + name + op
+                              + "e on line " + std::to_string(stmt_assign->ident.line));
+                    }
+                }
+                const Type type = checker.check_expr(stmt_assign->expr);
+                checker.m_reduction_read = nullptr;
+                if (type != var_type) {
+                    error("cannot assign an " + to_string(type) + " value to " + to_string(var_type) + " variable "
+                          + name + " on line " + std::to_string(stmt_assign->ident.line));
+                }
+            }
+            void operator()(NodeStmtPrint* stmt_print) const {
+                checker.impure("prints");
+                checker.check_expr(stmt_print->expr);
+            }
+            void operator()(NodeStmtIndexAssign* stmt_assign) const {
+                checker.impure("writes an array");
+                expect(checker.find_var(stmt_assign->ident.value.value()), Type::i64, "array");
+                expect(checker.check_expr(stmt_assign->index), Type::i64, "array index");
+                expect(checker.check_expr(stmt_assign->expr), Type::i64, "array element");
+            }
+            void operator()(NodeStmtFor* stmt_for) const {
+                const size_t scope_start = checker.m_vars.size();
+                checker.check_stmt(stmt_for->init);
+                expect(checker.check_expr(stmt_for->cond), Type::i64, "for condition");
+                checker.check_stmt(stmt_for->step);
+                checker.check_scope(stmt_for->scope);
+                checker.m_vars.resize(scope_start);
+            }
+            void operator()(NodeStmtParallelFor* stmt_parallel) const {
+                if (checker.m_fn != nullptr) {
+                    error("fn " + checker.m_fn->ident.value.value() + " cannot contain a parallel for");
+                }
+                NodeStmtFor* loop = stmt_parallel->loop;
+                const size_t scope_start = checker.m_vars.size();
+                checker.check_stmt(loop->init);
+                expect(checker.check_expr(loop->cond), Type::i64, "for condition");
+                checker.check_stmt(loop->step);
+                for (const NodeReduction& reduction : stmt_parallel->reductions) {
+                    const std::string& name = reduction.ident.value.value();
+                    checker.find_var(name);
+                    if (!checker.m_reductions.emplace(name, reduction.op).second) {
+                        error(name + " is reduced twice on line " + std::to_string(reduction.ident.line));
+                    }
+                }
+                const bool outer_parallel = std::exchange(checker.m_parallel, true);
+                checker.check_scope(loop->scope);
+                checker.m_parallel = outer_parallel;
+                for (const NodeReduction& reduction : stmt_parallel->reductions) {
+                    checker.m_reductions.erase(reduction.ident.value.value());
+                }
+                checker.m_vars.resize(scope_start);
+            }
+            void operator()(NodeStmtExtern* stmt_extern) const {
+                const std::string& name = stmt_extern->ident.value.value();
+                if (checker.m_fns.contains(name) || !checker.m_functions.emplace(name, stmt_extern).second) {
+                    error("extern fn " + name + " is declared twice");
+                }
+                // Only register arguments are supported
+                const auto count = [&](Type type) { return std::count(stmt_extern->params.begin(), stmt_extern->params.end(), type); };
+                if (count(Type::i64) > 6 || count(Type::f64) > 8) {
+                    error("extern fn " + name + " takes more than 6 i64 or 8 f64 parameters");
+                }
+            }
+            void operator()(NodeStmtCall* stmt_call) const { checker.check_call(stmt_call->call); }
+            void operator()(NodeStmtStruct* stmt_struct) const { checker.layout_struct(stmt_struct); }
+            void operator()(NodeStmtFieldAssign* stmt_assign) const {
+                checker.impure("writes an array of structs");
+                checker.check_field(stmt_assign->target);
+                expect(checker.check_expr(stmt_assign->expr), Type::i64, "struct field");
+            }
+            // Registers are matched against the variable types by the Generator
+            void operator()(NodeStmtAsm* stmt_asm) const {
+                checker.impure("contains asm");
+                for (const auto* bindings : {&stmt_asm->inputs, &stmt_asm->outputs}) {
+                    for (const NodeAsmBinding& binding : *bindings) {
+                        checker.find_var(binding.ident.value.value());
+                        if (checker.m_reductions.contains(binding.ident.value.value())) {
+                            error("reduction variable " + binding.ident.value.value() + " cannot be bound by asm on line "
+                                  + std::to_string(binding.ident.line));
+                        }
+                    }
+                }
+            }
+            void operator()(NodeStmtFn* stmt_fn) const { checker.check_fn(stmt_fn); }
+            void operator()(NodeStmtReturn* stmt_return) const {
+                if (checker.m_fn == nullptr) {
+                    error("return outside of an fn on line " + std::to_string(stmt_return->line));
+                }
+                expect(checker.check_expr(stmt_return->expr), checker.m_fn->ret, "return value of " + checker.m_fn->ident.value.value());
+            }
+        };
+        std::visit(StmtVisitor {.checker = *this}, stmt->var);
+    }
+
+    // Check an fn body against its parameters alone, and work out whether
+    // it is pure. The fn is known inside its own body, so it may recurse.
+    void check_fn(NodeStmtFn* stmt_fn) {
+        const std::string& name = stmt_fn->ident.value.value();
+        if (m_fn != nullptr) {
+            error("fn " + name + " cannot be declared inside fn " + m_fn->ident.value.value());
+        }
+        if (m_functions.contains(name) || !m_fns.emplace(name, stmt_fn).second) {
+            error("function " + name + " is declared twice");
+        }
+        if (stmt_fn->memo_entries > k_max_memo_entries) {
+            error("@memo table of fn " + name + " cannot have more than " + std::to_string(k_max_memo_entries) + " entries");
+        }
+        VarStack<Var> outer_vars;
+        std::swap(outer_vars, m_vars);
+        for (size_t i = 0; i < stmt_fn->params.size(); i++) {
+            const std::string& param = stmt_fn->params[i].value.value();
+            if (m_vars.contains(param)) {
+                error("fn " + name + " has two parameters named " + param);
+            }
+            m_vars.push_back({.name = param, .type = stmt_fn->param_types[i]});
+            stmt_fn->clobbers_xmm = stmt_fn->clobbers_xmm || stmt_fn->param_types[i] == Type::f64;
+        }
+        std::unordered_map<std::string, TokenType> outer_reductions;
+        std::swap(outer_reductions, m_reductions);
+        const bool outer_parallel = std::exchange(m_parallel, false);
+        m_fn = stmt_fn;
+        m_impurity.reset();
+        check_scope(stmt_fn->scope);
+        m_parallel = outer_parallel;
+        std::swap(outer_reductions, m_reductions);
+        stmt_fn->pure = !m_impurity.has_value();
+        if (stmt_fn->memo && !stmt_fn->pure) {
+            error("@memo fn " + name + " is not pure: it " + m_impurity.value());
+        }
+        m_fn = nullptr;
+        std::swap(outer_vars, m_vars);
+    }
+
+    // Note an effect that makes the fn being checked impure; the first one
+    // is reported if the fn is @memo
+    void impure(const std::string& effect) {
+        if (m_fn != nullptr && !m_impurity.has_value()) {
+            m_impurity = effect;
+        }
+    }
+
+    void check_scope(NodeScope* scope) {
+        const size_t scope_start = m_vars.size();
+        for (NodeStmt* stmt : scope->stmts) {
+            check_stmt(stmt);
+        }
+        m_vars.resize(scope_start);
+    }
+
+    // Type an expression and everything below it
+    Type check_expr(NodeExpr* expr) {
+        if (auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            expr->type = check_term(*term);
+            note_type(expr->type);
+            return expr->type;
+        }
+        struct BinExprVisitor {
+            TypeChecker& checker;
+            Type operator()(NodeBinExprAdd* add) const { return arith(add->lhs, add->rhs, "+"); }
+            Type operator()(NodeBinExprSub* sub) const { return arith(sub->lhs, sub->rhs, "-"); }
+            Type operator()(NodeBinExprMulti* multi) const { return arith(multi->lhs, multi->rhs, "*"); }
+            Type operator()(NodeBinExprDiv* div) const { return arith(div->lhs, div->rhs, "/"); }
+            Type operator()(NodeBinExprGt* gt) const { return compare(gt->lhs, gt->rhs, ">"); }
+            Type operator()(NodeBinExprGe* ge) const { return compare(ge->lhs, ge->rhs, ">="); }
+            Type operator()(NodeBinExprLt* lt) const { return compare(lt->lhs, lt->rhs, "<"); }
+            Type operator()(NodeBinExprLe* le) const { return compare(le->lhs, le->rhs, "<="); }
+            Type operator()(NodeBinExprEqEq* eq_eq) const { return compare(eq_eq->lhs, eq_eq->rhs, "=="); }
+            Type operator()(NodeBinExprMod* mod) const { return integer(mod->lhs, mod->rhs, "%"); }
+            Type operator()(NodeBinExprBitAnd* bit_and) const { return integer(bit_and->lhs, bit_and->rhs, "&"); }
+            Type operator()(NodeBinExprBitOr* bit_or) const { return integer(bit_or->lhs, bit_or->rhs, "|"); }
+            Type operator()(NodeBinExprBitXor* bit_xor) const { return integer(bit_xor->lhs, bit_xor->rhs, "^"); }
+            Type operator()(NodeBinExprShl* shl) const { return integer(shl->lhs, shl->rhs, "<<"); }
+            Type operator()(NodeBinExprShr* shr) const { return integer(shr->lhs, shr->rhs, ">>"); }
+            Type arith(NodeExpr* lhs_expr, NodeExpr* rhs_expr, const char* op) const {
+                const Type lhs = checker.check_expr(lhs_expr);
+                const Type rhs = checker.check_expr(rhs_expr);
+                if (lhs != rhs) {
+                    error(std::string("operands of `") + op + "` have types " + to_string(lhs) + " and " + to_string(rhs)
+                          + "; convert one of them with i64(...) or f64(...)");
+                }
+                return lhs;
+            }
+            Type compare(NodeExpr* lhs, NodeExpr* rhs, const char* op) const {
+                arith(lhs, rhs, op);
+                return Type::i64;
+            }
+            Type integer(NodeExpr* lhs, NodeExpr* rhs, const char* op) const {
+                expect(checker.check_expr(lhs), Type::i64, std::string("operand of `") + op + "`");
+                expect(checker.check_expr(rhs), Type::i64, std::string("operand of `") + op + "`");
+                return Type::i64;
+            }
+        };
+        expr->type = std::visit(BinExprVisitor {.checker = *this}, std::get<NodeBinExpr*>(expr->var)->var);
+        note_type(expr->type);
+        return expr->type;
+    }
+
+    // f64 values live in xmm0-xmm3, which callers of the fn must then save
+    void note_type(Type type) {
+        if (m_fn != nullptr && type == Type::f64) {
+            m_fn->clobbers_xmm = true;
+        }
+    }
+
+    Type check_term(NodeTerm* term) {
+        struct TermVisitor {
+            TypeChecker& checker;
+            Type operator()(NodeTermIntLit*) const { return Type::i64; }
+            Type operator()(NodeTermFloatLit*) const { return Type::f64; }
+            Type operator()(NodeTermIdent* term_ident) const {
+                const std::string& name = term_ident->ident.value.value();
+                if (checker.m_reductions.contains(name) && term_ident != checker.m_reduction_read) {
+                    error("reduction variable " + name + " cannot be read inside its parallel for on line "
+                          + std::to_string(term_ident->ident.line) + "; each thread only has a partial result");
+                }
+                return checker.find_var(name);
+            }
+            Type operator()(NodeTermNeg* term_neg) const { return checker.check_term(term_neg->term); }
+            Type operator()(NodeTermBitNot* term_bit_not) const {
+                expect(checker.check_term(term_bit_not->term), Type::i64, "operand of `~`");
+                return Type::i64;
+            }
+            Type operator()(NodeTermParen* term_paren) const { return checker.check_expr(term_paren->expr); }
+            Type operator()(NodeTermRead*) const {
+                checker.impure("reads input");
+                return Type::i64;
+            }
+            Type operator()(NodeTermArg* term_arg) const {
+                checker.impure("reads the command line");
+                expect(checker.check_expr(term_arg->index), Type::i64, "arg() index");
+                return Type::i64;
+            }
+            Type operator()(NodeTermAlloc* term_alloc) const {
+                checker.impure("allocates memory");
+                expect(checker.check_expr(term_alloc->count), Type::i64, "alloc() count");
+                return Type::i64;
+            }
+            Type operator()(NodeTermIndex* term_index) const {
+                checker.impure("reads an array");
+                expect(checker.find_var(term_index->ident.value.value()), Type::i64, "array");
+                expect(checker.check_expr(term_index->index), Type::i64, "array index");
+                return Type::i64;
+            }
+            Type operator()(NodeTermIntrinsic* term_intrinsic) const {
+                if (!intrinsic_takes_arg(term_intrinsic->op)) {
+                    checker.impure("reads a clock");
+                }
+                if (term_intrinsic->arg != nullptr) {
+                    expect(checker.check_expr(term_intrinsic->arg), Type::i64, "builtin argument");
+                }
+                return Type::i64;
+            }
+            Type operator()(NodeTermCall* term_call) const { return checker.check_call(term_call); }
+            Type operator()(NodeTermField* term_field) const {
+                checker.impure("reads an array of structs");
+                checker.check_field(term_field);
+                return Type::i64;
+            }
+            Type operator()(NodeTermPipeline* pipeline) const {
+                expect(checker.check_expr(pipeline->begin), Type::i64, "range start");
+                expect(checker.check_expr(pipeline->end), Type::i64, "range end");
+                for (const NodePipeStage& stage : pipeline->stages) {
+                    checker.m_vars.push_back({.name = stage.param.value.value(), .type = Type::i64});
+                    expect(checker.check_expr(stage.body), Type::i64, stage.filter ? "filter condition" : "map result");
+                    checker.m_vars.pop_back();
+                }
+                return Type::i64;
+            }
+            Type operator()(NodeTermConvert* term_convert) const {
+                checker.check_expr(term_convert->expr);
+                return term_convert->type;
+            }
+        };
+        return std::visit(TermVisitor {.checker = *this}, term->var);
+    }
+
+    // The operand `name` of `expr` when it is a chain of the reduction operator
+    // with `name` as one of its terms (`s + e`, `e + s`, `s + a - b`), so the
+    // update is `name = name op rest`; nullptr otherwise
+    static const NodeTermIdent* reduction_operand(const NodeExpr* expr, const std::string& name, TokenType op) {
+        if (const auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (const auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                return reduction_operand((*paren)->expr, name, op);
+            }
+            const auto* ident = std::get_if<NodeTermIdent*>(&(*term)->var);
+            return ident != nullptr && (*ident)->ident.value.value() == name ? *ident : nullptr;
+        }
+        const auto& bin_expr = std::get<NodeBinExpr*>(expr->var)->var;
+        std::vector<const NodeExpr*> operands;
+        if (const auto* add = std::get_if<NodeBinExprAdd*>(&bin_expr); add && op == TokenType::plus) {
+            operands = {(*add)->lhs, (*add)->rhs};
+        } else if (const auto* sub = std::get_if<NodeBinExprSub*>(&bin_expr); sub && op == TokenType::plus) {
+            operands = {(*sub)->lhs};
+        } else if (const auto* multi = std::get_if<NodeBinExprMulti*>(&bin_expr); multi && op == TokenType::star) {
+            operands = {(*multi)->lhs, (*multi)->rhs};
+        }
+        for (const NodeExpr* operand : operands) {
+            if (const NodeTermIdent* ident = reduction_operand(operand, name, op)) {
+                return ident;
+            }
+        }
+        return nullptr;
+    }
+
+    // Check the arguments of a call against the declaration and return its result type
+    Type check_call(NodeTermCall* call) {
+        const std::string& name = call->ident.value.value();
+        const std::vector<Type>* param_types = nullptr;
+        Type ret;
+        if (const auto fn = m_fns.find(name); fn != m_fns.end()) {
+            call->fn = fn->second;
+            param_types = &fn->second->param_types;
+            ret = fn->second->ret;
+            // A recursive call is as pure as the rest of the body
+            if (fn->second != m_fn && !fn->second->pure) {
+                impure("calls " + name + ", which is not pure");
+            }
+            if (m_fn != nullptr && fn->second->clobbers_xmm) {
+                m_fn->clobbers_xmm = true;
+            }
+            // Direct calls of a @memo fn are checked by the Generator, which
+            // knows whether the call reads a read-only precomputed table
+            const NodeStmtFn* memo_callee = fn->second->memo ? fn->second : fn->second->memo_callee;
+            if (m_fn != nullptr && fn->second != m_fn && m_fn->memo_callee == nullptr) {
+                m_fn->memo_callee = memo_callee;
+            }
+            if (m_parallel && !fn->second->memo && fn->second->memo_callee != nullptr) {
+                error("fn " + name + " cannot be called inside a parallel for on line " + std::to_string(call->ident.line)
+                      + ": it calls @memo fn " + fn->second->memo_callee->ident.value.value() + ", whose table is shared");
+            }
+        } else if (const auto function = m_functions.find(name); function != m_functions.end()) {
+            if (m_fn != nullptr) {
+                error("fn " + m_fn->ident.value.value() + " cannot call extern fn " + name + " on line "
+                      + std::to_string(call->ident.line) + "; C code needs an aligned stack");
+            }
+            param_types = &function->second->params;
+            ret = function->second->ret;
+        } else {
+            error("call to undeclared function " + name + " on line " + std::to_string(call->ident.line)
+                  + "; declare it with fn or extern fn");
+        }
+        const std::vector<Type>& params = *param_types;
+        if (call->args.size() != params.size()) {
+            error(name + " takes " + std::to_string(params.size()) + " arguments, found " + std::to_string(call->args.size())
+                  + " on line " + std::to_string(call->ident.line));
+        }
+        for (size_t i = 0; i < params.size(); i++) {
+            expect(check_expr(call->args[i]), params[i], "argument " + std::to_string(i + 1) + " of " + name);
+        }
+        return ret;
+    }
+
+    // Compute the field offsets of a struct. Fields of an array of structs
+    // are naturally aligned, and the element is padded to its largest field.
+    // A struct of arrays keeps one array per field, widest first, so every
+    // array starts aligned when the allocation is.
+    void layout_struct(NodeStmtStruct* stmt_struct) {
+        const std::string& name = stmt_struct->ident.value.value();
+        if (!m_structs.emplace(name, stmt_struct).second) {
+            error("struct " + name + " is declared twice");
+        }
+        std::vector<NodeStructField>& fields = stmt_struct->fields;
+        for (size_t i = 0; i < fields.size(); i++) {
+            for (size_t j = 0; j < i; j++) {
+                if (fields[j].ident.value.value() == fields[i].ident.value.value()) {
+                    error("struct " + name + " has two fields named " + fields[i].ident.value.value());
+                }
+            }
+            stmt_struct->align = std::max(stmt_struct->align, fields[i].size);
+            stmt_struct->size = (stmt_struct->size + fields[i].size - 1) / fields[i].size * fields[i].size;
+            fields[i].offset = stmt_struct->size;
+            stmt_struct->size += fields[i].size;
+        }
+        stmt_struct->size = (stmt_struct->size + stmt_struct->align - 1) / stmt_struct->align * stmt_struct->align;
+        for (const int size : {8, 4, 2, 1}) {
+            for (NodeStructField& field : fields) {
+                if (field.size == size) {
+                    field.soa_offset = stmt_struct->packed_size;
+                    stmt_struct->packed_size += size;
+                }
+            }
+        }
+    }
+
+    // `let a: Name[] = alloc(n);`
+    void check_record_array(NodeStmtLet* stmt_let) {
+        const std::string& name = stmt_let->ident.value.value();
+        const std::string& record = stmt_let->record.value().value.value();
+        const auto it = m_structs.find(record);
+        if (it == m_structs.end()) {
+            error("unknown struct " + record + " on line " + std::to_string(stmt_let->ident.line));
+        }
+        const auto* term = std::get_if<NodeTerm*>(&stmt_let->expr->var);
+        const auto* term_alloc = term != nullptr ? std::get_if<NodeTermAlloc*>(&(*term)->var) : nullptr;
+        if (term_alloc == nullptr) {
+            error("array of structs " + name + " must be initialized with alloc(n) on line "
+                  + std::to_string(stmt_let->ident.line));
+        }
+        impure("allocates memory");
+        expect(check_expr((*term_alloc)->count), Type::i64, "alloc() count");
+        stmt_let->expr->type = Type::i64;
+        stmt_let->record_type = it->second;
+        m_vars.push_back({.name = name, .type = Type::i64, .array = stmt_let});
+    }
+
+    // Resolve the array and field of a[i].f
+    void check_field(NodeTermField* term_field) {
+        const std::string& name = term_field->ident.value.value();
+        const Var& var = lookup(name);
+        if (var.array == nullptr) {
+            error(name + " is not an array of structs on line " + std::to_string(term_field->ident.line));
+        }
+        expect(check_expr(term_field->index), Type::i64, "array index");
+        const std::vector<NodeStructField>& fields = var.array->record_type->fields;
+        const std::string& field = term_field->field.value.value();
+        const auto it = std::find_if(fields.begin(), fields.end(), [&](const NodeStructField& f) { return f.ident.value.value() == field; });
+        if (it == fields.end()) {
+            error("struct " + var.array->record_type->ident.value.value() + " has no field " + field + " on line "
+                  + std::to_string(term_field->field.line));
+        }
+        term_field->array = var.array;
+        term_field->field_index = it - fields.begin();
+    }
+
+    // Type of the innermost declaration of a variable used as a plain value
+    Type find_var(const std::string& name) const {
+        const Var& var = lookup(name);
+        if (var.array != nullptr) {
+            error("array of structs " + name + " can only be used as " + name + "[i].field");
+        }
+        return var.type;
+    }
+
+    struct Var;
+    const Var& lookup(const std::string& name) const {
+        if (const Var* var = m_vars.find(name)) {
+            return *var;
+        }
+        std::cerr << "Undeclared identifier: " << name << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    struct Var {
+        std::string name;
+        Type type;
+        const NodeStmtLet* array = nullptr;   // declaration of an array of structs
+    };
+
+    // Largest @memo(entries): the table is zero-filled .bss
+    static constexpr int64_t k_max_memo_entries = 1 << 24;
+
+    VarStack<Var> m_vars;
+    std::unordered_map<std::string, const NodeStmtExtern*> m_functions;
+    std::unordered_map<std::string, NodeStmtFn*> m_fns;
+    NodeStmtFn* m_fn = nullptr;                 // fn whose body is being checked
+    std::unordered_map<std::string, TokenType> m_reductions;   // reduction variables of the enclosing parallel for
+    const NodeTermIdent* m_reduction_read = nullptr;            // the `s` of the `s = s op e` being checked
+    bool m_parallel = false;                    // checking the body of a parallel for
+    std::optional<std::string> m_impurity;      // first effect found in it
+    std::unordered_map<std::string, const NodeStmtStruct*> m_structs;
+};
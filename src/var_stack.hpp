@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * The variables in scope, innermost declaration last, as kept by the
+ * TypeChecker and the Generator. Every name maps to the positions it is
+ * declared at, so looking a variable up does not scan everything in scope
+ * and programs with many variables compile in linear time.
+ *
+ * `Var` needs a `name` member, which must not change after push_back().
+ */
+template <typename Var>
+class VarStack {
+public:
+    void push_back(Var var)
+    {
+        m_positions[var.name].push_back(m_vars.size());
+        m_vars.push_back(std::move(var));
+    }
+
+    void pop_back()
+    {
+        const auto it = m_positions.find(m_vars.back().name);
+        it->second.pop_back();
+        if (it->second.empty()) {
+            m_positions.erase(it);
+        }
+        m_vars.pop_back();
+    }
+
+    // Drop the variables declared after the first `size`
+    void resize(const size_t size)
+    {
+        while (m_vars.size() > size) {
+            pop_back();
+        }
+    }
+
+    // Innermost declaration of `name`, or nullptr if there is none
+    [[nodiscard]] Var* find(const std::string& name)
+    {
+        const auto it = m_positions.find(name);
+        return it == m_positions.end() ? nullptr : &m_vars[it->second.back()];
+    }
+
+    [[nodiscard]] const Var* find(const std::string& name) const
+    {
+        const auto it = m_positions.find(name);
+        return it == m_positions.end() ? nullptr : &m_vars[it->second.back()];
+    }
+
+    // Outermost declaration of `name`, or nullptr if there is none
+    [[nodiscard]] Var* find_outermost(const std::string& name)
+    {
+        const auto it = m_positions.find(name);
+        return it == m_positions.end() ? nullptr : &m_vars[it->second.front()];
+    }
+
+    // Position of a variable held by this stack
+    [[nodiscard]] size_t index_of(const Var& var) const
+    {
+        return static_cast<size_t>(&var - m_vars.data());
+    }
+
+    // Every declaration of `name`, outermost first
+    template <typename F>
+    void for_each_named(const std::string& name, F f)
+    {
+        if (const auto it = m_positions.find(name); it != m_positions.end()) {
+            for (const size_t position : it->second) {
+                f(m_vars[position]);
+            }
+        }
+    }
+
+    [[nodiscard]] bool contains(const std::string& name) const
+    {
+        return m_positions.contains(name);
+    }
+
+    [[nodiscard]] size_t size() const { return m_vars.size(); }
+    [[nodiscard]] Var& back() { return m_vars.back(); }
+    [[nodiscard]] Var& operator[](const size_t i) { return m_vars[i]; }
+    [[nodiscard]] const Var& operator[](const size_t i) const { return m_vars[i]; }
+    [[nodiscard]] auto begin() { return m_vars.begin(); }
+    [[nodiscard]] auto end() { return m_vars.end(); }
+    [[nodiscard]] auto begin() const { return m_vars.begin(); }
+    [[nodiscard]] auto end() const { return m_vars.end(); }
+
+private:
+    std::vector<Var> m_vars;
+    std::unordered_map<std::string, std::vector<size_t>> m_positions;
+};
@@ -0,0 +1,15 @@
+// flags: -lc
+// A call that stores to an array is not reordered with reads of that array,
+// even when the reads need more registers
+extern fn memset(p, c, n);
+let a = alloc(4);
+a[0] = 1;
+a[1] = 2;
+a[2] = 3;
+a[3] = 4;
+print((memset(a, 0, 32) & 0) + (a[0] * (a[1] + a[2] * (a[3] - a[1]))));
+a[0] = 1;
+a[1] = 2;
+print((a[0] * (a[1] + a[0] * (a[1] - a[0]))) + (memset(a, 0, 32) & 0));
+print(a[0] + a[1]);
+exit(0);
@@ -0,0 +1,5 @@
+// C code in a parallel for would share the main thread's TLS (errno, stdio)
+extern fn abs(x);
+let s = 0;
+parallel for (let i = 0; i < 100; i = i + 1) reduce(+: s) { s = s + abs(i - 50); }
+print(s);
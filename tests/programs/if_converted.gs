@@ -0,0 +1,27 @@
+// Conditional assignments lowered to cmov: one arm or both, several targets,
+// constants, computed values and f64 values
+let a = read();
+let b = read();
+let m = 0;
+if (a < b) { m = a; } else { m = b; }
+print(m);
+let lo = 0;
+let hi = 0;
+if (a > b) { lo = b; hi = a; } else { lo = a; hi = b; }
+print(lo);
+print(hi);
+let c = 5;
+if (a == 3) { c = 7; }
+print(c);
+if (b == 3) { c = a * 2 + 1; } else { c = b - 1; }
+print(c);
+let d = 1;
+if (a) { d = 0; } else { d = 2; }
+print(d);
+let x: f64 = 1.5;
+if (a > 0) { x = 2.5; }
+print(x);
+let y: f64 = x * 2.0;
+if (b < a) { y = x; }
+print(y);
+exit(m);
@@ -0,0 +1,5 @@
+// An integer literal that does not fit in an i64 is a compile error
+print(9223372036854775807);
+print(-9223372036854775808);
+print(9223372036854775808);
+exit(0);
@@ -0,0 +1,33 @@
+// @memo fns through precomputed tables and through the runtime hash table
+@memo fn fib(n) {
+    if (n < 2) { return n; }
+    return fib(n - 1) + fib(n - 2);
+}
+@memo fn mix(a, b) { return a * 1000 + b * b; }
+@memo fn third(x): f64 { return f64(x) / 3.0; }
+@memo(64) fn collatz(n) {
+    if (n == 1) { return 0; }
+    if (n % 2 == 0) { return 1 + collatz(n / 2); }
+    return 1 + collatz(3 * n + 1);
+}
+
+// Table path: one value folds to the result, ranges index a table
+let k = 90;
+print(fib(k));
+let s = 0;
+for (let i = 0; i < 200; i = i + 1) { s = s + fib(i & 63) + mix(3, i % 8) + mix(i & 3, 7 - (i & 7)); }
+print(s);
+print(mix(-2, 5));
+
+// Hash path: arguments from stdin, recursion and f64 results
+let n = read();
+print(fib(n));
+print(fib(n - 10));
+let m = read();
+print(third(m));
+print(third(m) + third(m + 1));
+let steps = 0;
+for (let i = 1; i <= m; i = i + 1) { steps = steps + collatz(i); }
+print(steps);
+print(collatz(m));
+exit(fib(10));
@@ -0,0 +1,7 @@
+// A parallel for cannot reach a @memo fn's shared table through another fn
+@memo fn f(x) { return x * 2; }
+fn g(x) { return f(x); }
+fn h(x) { return g(x) + 1; }
+let s = 0;
+parallel for (let i = 0; i < 100; i = i + 1) reduce(+: s) { s = s + h(i); }
+print(s);
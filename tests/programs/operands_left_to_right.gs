@@ -0,0 +1,4 @@
+// Operands with side effects are evaluated left to right
+print(read() - read());
+print(read() < read());
+exit(0);
@@ -0,0 +1,53 @@
+// Parallel for loops with both schedules, every reduction kind, strides, <=
+// bounds and ranges that are empty; the bounds come from stdin
+let n = read();
+let lo = read();
+let hi = read();
+
+let s = 0;
+parallel for (let i = 0; i < n; i = i + 1) reduce(+: s) { s = s + i * i; }
+print(s);
+let t = 0;
+parallel(static) for (let i = 0; i < n; i = i + 1) reduce(+: t) { t = t + i * i; }
+print(t);
+
+// Element i of a is written by exactly one iteration
+let a = alloc(n);
+parallel(static) for (let i = 0; i < n; i = i + 1) { a[i] = 3 * i + 1; }
+let ok = 0;
+for (let i = 0; i < n; i = i + 1) { if (a[i] == 3 * i + 1) { ok = ok + 1; } }
+print(ok);
+
+let p = 1;
+parallel for (let i = 1; i <= 20; i = i + 1) reduce(*: p) { p = p * i; }
+print(p);
+let q = 1;
+parallel(static) for (let i = 0; i < 61; i = i + 1) reduce(*: q) { q = q * (1 + i % 2); }
+print(q);
+
+let f = 0.0;
+parallel for (let i = 0; i < n; i = i + 1) reduce(+: f) { f = f + 0.5; }
+print(f);
+let g = 1.0;
+parallel(static) for (let i = 0; i < 10; i = i + 1) reduce(*: g) { g = g * 2.0; }
+print(g);
+
+// Strides that do not divide the range, with < and <= bounds
+let u = 0;
+parallel for (let i = 3; i < n; i = i + 7) reduce(+: u) { u = u + i; }
+print(u);
+let v = 0;
+parallel(static) for (let i = lo; i <= hi; i = i + 5) reduce(+: v) { v = v + i; }
+print(v);
+
+// Empty ranges leave the reductions at their initial values
+let e = 11;
+parallel for (let i = hi; i < lo; i = i + 1) reduce(+: e) { e = e + 1; }
+print(e);
+let e2 = 13;
+parallel(static) for (let i = n; i < n; i = i + 1) reduce(*: e2) { e2 = e2 * 0; }
+print(e2);
+let e3 = 2.5;
+parallel for (let i = hi + 1; i <= hi; i = i + 3) reduce(+: e3) { e3 = e3 + 1.0; }
+print(e3);
+exit(0);
@@ -0,0 +1,24 @@
+// flags: -march=x86-64-v3
+// The AVX2 pipeline loop agrees with the scalar loop on negative and large
+// values and stops when the range ends near INT64_MAX
+let a = read();
+let b = read();
+print(sum(range(a, b) |> map(x => x + 1)));
+print(count(range(a, b) |> filter(x => x % 2 == 0)));
+let c = read();
+let d = read();
+print(sum(range(c, d) |> map(x => x * 3 - 7)));
+print(sum(range(c, d) |> filter(x => x < 0 - 5) |> map(x => x * x)));
+let n = 0;
+let m = 0;
+let s = 0;
+for (let i = c; i < d; i = i + 1) {
+    s = s + i * 3 - 7;
+    if (i < 0 - 5) { m = m + i * i; }
+    n = n + 1;
+}
+print(s);
+print(m);
+print(n);
+print(sum(range(d, c) |> map(x => x)));
+exit(0);
@@ -0,0 +1,10 @@
+// Floats are printed in a form that reads back as the same value
+print(0.1);
+print(1500.0);
+print(1.25e-7);
+print(-2.5);
+print(0.0);
+print(6.02e23);
+print(1e23);
+print(7.0925e20);
+exit(0);
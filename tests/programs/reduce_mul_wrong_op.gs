@@ -0,0 +1,5 @@
+// `p = p + 1` under reduce(*: p) mixes operators
+let p = 3;
+parallel for (let i = 0; i < 4; i = i + 1) reduce(*: p) { p = p + 1; }
+print(p);
+exit(0);
@@ -0,0 +1,8 @@
+// Reading a reduction variable in the body would see one chunk's partial value
+let s = 0;
+parallel for (let i = 0; i < 4; i = i + 1) reduce(+: s) {
+    let z = s;
+    s = s + z;
+}
+print(s);
+exit(0);
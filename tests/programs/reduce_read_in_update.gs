@@ -0,0 +1,5 @@
+// The added value cannot read the reduction variable either
+let s = 0;
+parallel for (let i = 0; i < 4; i = i + 1) reduce(+: s) { s = s - s * i; }
+print(s);
+exit(0);
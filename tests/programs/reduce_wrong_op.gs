@@ -0,0 +1,6 @@
+// A reduction variable is only updated with its own operator: each chunk
+// starts from the identity, so `s = s * 2` would drop the initial value
+let s = 1;
+parallel for (let i = 0; i < 10; i = i + 1) reduce(+: s) { s = s * 2; }
+print(s);
+exit(0);
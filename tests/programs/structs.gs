@@ -0,0 +1,47 @@
+// Arrays of structs in both layouts: narrow fields sign-extend on loads and
+// truncate on stores, and padded element sizes need not be powers of two
+struct Small { a: i8, b: i16, c: i32 }
+struct Wide { x, tag: i8 }
+struct Odd { p: i16, q: i16, r: i8 }    // 5 bytes padded to 6
+struct Trio { u: i32, v: i32, w: i8 }   // 9 bytes padded to 12
+
+let n = read();
+let aos: Small[] = alloc(n);
+let soa: Small[] layout(soa) = alloc(n);
+let wide: Wide[] = alloc(n);
+let odd: Odd[] = alloc(n);
+let odd_soa: Odd[] layout(soa) = alloc(n);
+let trio: Trio[] = alloc(n);
+
+for (let i = 0; i < n; i = i + 1) {
+    // Values outside each field's range keep only their low bits
+    aos[i].a = 100 + i * 10;
+    aos[i].b = 32700 + i * 10;
+    aos[i].c = 2147483600 + i * 10;
+    soa[i].a = 100 + i * 10;
+    soa[i].b = 32700 + i * 10;
+    soa[i].c = 2147483600 + i * 10;
+    wide[i].x = -i * 1000000000000;
+    wide[i].tag = 0 - i;
+    odd[i].p = i - 3;
+    odd[i].q = 65536 + i;
+    odd[i].r = -128 - i;
+    odd_soa[i].p = i - 3;
+    odd_soa[i].q = 65536 + i;
+    odd_soa[i].r = -128 - i;
+    trio[i].u = i * 3;
+    trio[i].v = -i * 5;
+    trio[i].w = 256 - i;
+}
+
+for (let i = 0; i < n; i = i + 1) {
+    print(aos[i].a);
+    print(aos[i].b);
+    print(aos[i].c);
+    print(soa[i].a + soa[i].b + soa[i].c - aos[i].a - aos[i].b - aos[i].c);
+    print(wide[i].x + wide[i].tag);
+    print(odd[i].p * 1000000 + odd[i].q * 1000 + odd[i].r);
+    print(odd_soa[i].p - odd[i].p + odd_soa[i].q - odd[i].q + odd_soa[i].r - odd[i].r);
+    print(trio[i].u + trio[i].v * 10 + trio[i].w * 100);
+}
+exit(0);
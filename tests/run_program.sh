@@ -0,0 +1,28 @@
+#!/bin/sh
+# usage: run_program.sh <hauss> <test.gs>
+#
+# Compiles and runs one test program and compares its output, followed by
+# `exit=<code>`, with <test>.expected. Flags for hauss are taken from a
+# `// flags:` line and stdin from <test>.in when it exists. An expected file
+# starting with `error:` holds the compile error the program must produce
+# instead.
+hauss=$(realpath "$1")
+test=$(realpath "$2")
+name=${test%.gs}
+flags=$(sed -n 's|^// flags: *||p' "$test")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+if grep -q '^error:' "$name.expected"; then
+    # shellcheck disable=SC2086
+    "$hauss" -S "$test" $flags > /dev/null 2> stderr && { echo "compiled without an error"; exit 1; }
+    sed 's/^/error: /' stderr > actual
+else
+    command -v nasm > /dev/null || { echo "nasm not found"; exit 77; }
+    # shellcheck disable=SC2086
+    "$hauss" "$test" $flags > /dev/null || exit 1
+    if [ -f "$name.in" ]; then ./out < "$name.in" > actual; else ./out < /dev/null > actual; fi
+    echo "exit=$?" >> actual
+fi
+diff -u "$name.expected" actual
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Compiles families of programs of doubling size with `hauss -S` and fails
+when the compile time or peak memory of a family grows faster than n log n.
+
+usage: scaling.py <hauss> [family...]
+
+The growth of each family is the slope of log(cost) over log(n), fitted by
+least squares. n log n has a slope of about 1.1 over the sizes used here; a
+quadratic phase shows up as a slope near 2.
+"""
+
+import math
+import os
+import resource
+import sys
+import tempfile
+import time
+
+SIZES = [1000, 2000, 4000, 8000]
+REPEATS = 2
+MAX_SLOPE = 1.35
+
+
+def many_vars(n):
+    return (''.join(f'let v{i} = {i};\n' for i in range(n))
+            + ''.join(f'v{i} = v{i} + v{(i * 7) % n};\n' for i in range(n)) + 'exit(v0);\n')
+
+
+def many_scopes(n):
+    return 'let a = 0;\n' + '{ let b = a + 1; a = b; }\n' * n + 'exit(a);\n'
+
+
+def nested_scopes(n):
+    return 'let a = 0;\n' + ''.join(f'{{ let b{i} = a;\n' for i in range(n)) + 'a = 1;\n' + '}\n' * n + 'exit(a);\n'
+
+
+def nested_ifs(n):
+    return 'let a = read();\n' + 'if (a > 0) {\n' * n + 'a = 1;\n' + '}\n' * n + 'exit(a);\n'
+
+
+def elif_chain(n):
+    return ('let a = read();\nlet r = 0;\nif (a == 0) { r = 1; }\n'
+            + ''.join(f'elif (a == {i}) {{ r = {i}; }}\n' for i in range(1, n)) + 'exit(r);\n')
+
+
+def long_expr(n):
+    return 'let a = read();\nexit(' + ' + '.join(f'a * {i}' for i in range(n)) + ');\n'
+
+
+def nested_expr(n):
+    return ('let a = read();\nlet b = read();\nexit(' + '(' * n + 'a'
+            + ''.join(f' - b) * {i % 5 + 1}' for i in range(n)) + ');\n')
+
+
+def vars_then_ifs(n):
+    return (''.join(f'let v{i} = read();\n' for i in range(n))
+            + ''.join(f'if (v{i} > 3) {{ print(v{i}); }} elif (v{i} < 0) {{ v{i} = 0; }} else {{ v{i} = 1; }}\n' for i in range(n))
+            + 'exit(v0);\n')
+
+
+def vars_then_fors(n):
+    return (''.join(f'let v{i} = {i};\n' for i in range(n))
+            + ''.join(f'for (let k{i} = 0; k{i} < 3; k{i} = k{i} + 1) {{ v{i} = v{i} + 1; }}\n' for i in range(n))
+            + 'exit(v0);\n')
+
+
+def vars_then_parallel_fors(n):
+    return (''.join(f'let v{i} = {i};\n' for i in range(n))
+            + ''.join(f'parallel for (let k{i} = 0; k{i} < 64; k{i} = k{i} + 1) reduce(+: v{i}) {{ v{i} = v{i} + k{i}; }}\n'
+                      for i in range(n))
+            + 'exit(v0);\n')
+
+
+def many_fns(n):
+    return (''.join(f'fn g{i}(x) {{ return x + {i}; }}\n' for i in range(n))
+            + 'let s = 0;\n' + ''.join(f's = s + g{i}(s);\n' for i in range(n)) + 'exit(s);\n')
+
+
+FAMILIES = {f.__name__: f for f in [
+    many_vars, many_scopes, nested_scopes, nested_ifs, elif_chain, long_expr, nested_expr,
+    vars_then_ifs, vars_then_fors, vars_then_parallel_fors, many_fns,
+]}
+
+
+def raise_stack_limit():
+    # The parser and code generator recurse once per nesting level
+    _, hard = resource.getrlimit(resource.RLIMIT_STACK)
+    resource.setrlimit(resource.RLIMIT_STACK, (hard, hard))
+
+
+def compile_once(hauss, path):
+    """Seconds and max RSS in KB of one `hauss -S` run."""
+    start = time.perf_counter()
+    pid = os.fork()
+    if pid == 0:
+        try:
+            raise_stack_limit()
+            devnull = os.open(os.devnull, os.O_WRONLY)
+            os.dup2(devnull, 1)
+            os.execv(hauss, [hauss, '-S', path])
+        finally:
+            os._exit(127)
+    _, status, usage = os.wait4(pid, 0)
+    seconds = time.perf_counter() - start
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+        raise RuntimeError(f'hauss -S {path} failed with status {status}')
+    return seconds, usage.ru_maxrss
+
+
+def slope(sizes, costs):
+    xs = [math.log(n) for n in sizes]
+    ys = [math.log(max(c, 1e-9)) for c in costs]
+    mx = sum(xs) / len(xs)
+    my = sum(ys) / len(ys)
+    return sum((x - mx) * (y - my) for x, y in zip(xs, ys)) / sum((x - mx) ** 2 for x in xs)
+
+
+def main():
+    hauss = os.path.abspath(sys.argv[1])
+    names = sys.argv[2:] or list(FAMILIES)
+    failed = []
+    with tempfile.TemporaryDirectory() as work:
+        os.chdir(work)
+        for name in names:
+            times = []
+            rss = []
+            for n in SIZES:
+                path = os.path.join(work, f'{name}_{n}.gs')
+                with open(path, 'w') as f:
+                    f.write(FAMILIES[name](n))
+                runs = [compile_once(hauss, path) for _ in range(REPEATS)]
+                times.append(min(seconds for seconds, _ in runs))
+                rss.append(min(kb for _, kb in runs))
+            time_slope = slope(SIZES, times)
+            rss_slope = slope(SIZES, rss)
+            row = '  '.join(f'{n}: {t * 1000:.0f} ms {kb} KB' for n, t, kb in zip(SIZES, times, rss))
+            ok = time_slope <= MAX_SLOPE and rss_slope <= MAX_SLOPE
+            print(f'{"ok  " if ok else "FAIL"} {name:24} time ~n^{time_slope:.2f}  memory ~n^{rss_slope:.2f}  ({row})', flush=True)
+            if not ok:
+                failed.append(name)
+    if failed:
+        print(f'grow faster than n log n: {", ".join(failed)}')
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())